@@ -25,14 +25,22 @@
 
 #include <libkern/libkern.h>
 #include <libkern/OSKextLib.h>
+#include <mach/kmod.h>                 // v0.23 (for kmod_info_t, used by latebloom_stop())
 #include <kern/debug.h>
 #include <IOKit/IOTypes.h>
+#include <libkern/OSAtomic.h>          // v0.23 (for the hook's thread table and counters)
+#include <kern/thread.h>               // v0.23 (for current_thread())
+#include <kern/clock.h>                // v0.23 (for clock_interval_to_deadline())
+#include <kern/thread_call.h>          // v0.23 (for lb_ABPoll())
+#include <IOKit/IOLocks.h>             // v0.23 (for the Phase 2 latch)
 #include <sys/conf.h>                  // 8sep21 v0.22 (for cdevsw_add())
 #include <miscfs/devfs/devfs.h>        // 8sep21 v0.22 (for devfs_make_node())
 // #include <IOKit/pwr_mgt/IOPMLib.h>  // For some strange reason, this won't ever #include properly
 extern void IOSleep(unsigned int);     // Manually prototype IOSleep() here, since IOPMLib.h is problematic
 
 #include "klookup.h"                   // Our kernel symbol lookup definitions
+#include "kpatch.h"                    // v0.23 - Our kernel text patching definitions
+#include "lbcore.h"                    // v0.23 - The hook's kernel-independent logic
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -46,6 +54,64 @@ extern void IOSleep(unsigned int);     // Manually prototype IOSleep() here, sin
 //          (Initial public release of source code)
 // v0.22    Added creation of /dev/latebloom pseudo-device when hook is
 //          successfully placed (allows confirmation that latebloom worked).
+// v0.23    Hook is now placed through a writable alias of the target's
+//          physical pages, in an order that's safe for other CPUs.  It can
+//          be disarmed at any time, but only re-armed later if it jumps
+//          through an island (whose 5-byte jump replaces one instruction).
+//          (CR0.WP toggling is only a fallback, while latebloom_start() is
+//          still single-threaded.)
+//          Patches are recorded in a journal (original/new bytes, checksum),
+//          verified after writing, and rolled back before unloading.
+//          /dev/latebloom can now be read to get latebloom's status.
+//          IOPCIBridge::probeBus is looked up in IOPCIFamily's symbol table
+//          (via the boot kernel collection), with the fake call as fallback.
+//          Addresses in /dev/latebloom and the IORegistry are shown with
+//          the symbol they belong to.
+//          Symbol lookups search the exported (LC_DYSYMTAB) symbols first.
+//          Hook logic moved from assembly language into C
+//          (latebloom_hook_body()), using current_thread() instead of
+//          %gs:0x10.  Each thread through the hook gets an ordinal, loop
+//          count and first/last TSC, and the start of Phase 2 is recorded.
+//          Added "lb_stagger=" (Phase 2 threads delay once, staggered by
+//          ordinal, instead of randomly on every loop).
+//          Added "lb_sequence=" (Phase 2 probeBus() calls run one at a time,
+//          in arrival order, with a timeout), tracking when each call
+//          returns through a return trampoline (latebloom_ret).
+//          Added "lb_rate=" (token bucket on hook entries, instead of a
+//          fixed delay on every loop).
+//          Added "lb_conc=" (Phase 2 delay scales with the number of
+//          probeBus() calls in progress;  none when a probe runs alone).
+//          Added "lb_backoff=" (Phase 2 loops wait in doubling slices, only
+//          while other probeBus() calls are in progress).
+//          Added "lb_window=" (Phase 2 delays only within a time window after
+//          Phase 2 starts).
+//          Added "lb_latch=" and "lb_latchname=" (Phase 2 waits until a given
+//          IOService is published, with a timeout).
+//          Added "lb_arm0=" to "lb_arm3=" and "lb_abgoal=" (A/B mode:  each
+//          boot picks one set of delays by Thompson sampling over earlier
+//          boots' outcomes, kept in NVRAM).
+//          Counters the hook updates are kept on cache lines of their own
+//          (lb_Counters), as are the settings it reads (lb_Settings), and
+//          the thread table comes out of a static arena (lb_ArenaAlloc()),
+//          sized with "lb_threads=".
+//          The symbol lookup tables are freed once the hook is armed, and
+//          /dev/latebloom shows how much memory they (and the arena) use.
+//          Symbol lookup tables are built exactly once, even with lookups
+//          coming from several threads at once.
+//          Each stage of latebloom_start() is timed (TSC), and the times
+//          are shown in /dev/latebloom.
+//          The 14-byte long jump goes in an island (unused space at the end
+//          of IOPCIFamily's code segment) when one is within rel32 range,
+//          so the hook site only needs a 5-byte jmp (8 bytes displaced).
+//          Pattern search prefilters 8 bytes at a time for the patterns'
+//          first bytes;  "lb_scan=1" also surveys all of IOPCIFamily's
+//          __text, and /dev/latebloom shows the matches and scan rate.
+//          poll()/select()/kqueue on /dev/latebloom wait until PCI
+//          enumeration has quiesced (no loops for "lb_quiet=" ms).
+//          "lb_selftest=N" times IOSleep()/IODelay() at load, and the hook's
+//          sleeps are corrected for the oversleep it measured.
+//          GET_SYMBOL() takes a KERNEL_SYMBOL() handle (name, length and
+//          hash computed at compile time) instead of a string.
 //
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -72,15 +138,12 @@ extern void IOSleep(unsigned int);     // Manually prototype IOSleep() here, sin
 // The latebloom kext is only active during PCIe bus enumeration, which
 // appears to only happen once, during the early boot process.  After that,
 // the kext is dormant, taking up a small amount of memory and never executing
-// any code.  At present, no unloading mechanism is in place, so unloading
-// the latebloom kext contains an element of risk - if latebloom is unloaded,
-// the patched IOPCIFamily.kext code will point to memory that has been freed
-// (and possibly reused), which would be a problem if the PCIe bus enumeration
-// code ever executed again.  Fortunately, it appears that the code in question
-// only executes during early boot, so while unloading latebloom produces an
-// unclean result, the actual risk of a kernel panic or other disastrous
-// outcome is extremely small.  If it ever becomes desirable or necessary to
-// unload the latebloom kext, some cleanup code will need to be added.
+// any code.  Originally, no unloading mechanism was in place, so unloading
+// left the patched IOPCIFamily.kext code pointing to memory that had been
+// freed (and possibly reused).  As of v0.23, latebloom_stop() (our MODULE_STOP
+// routine) rolls the hook back using the patch journal (see kpatch.c), waits
+// for any threads still inside the hook to leave, and refuses to unload if
+// either of those can't be done safely.
 //
 // The code in this file contains various known inefficiencies.  It began its
 // existence as a quick and dirty hack, and those origins still show.  Because
@@ -98,12 +161,55 @@ extern void IOSleep(unsigned int);     // Manually prototype IOSleep() here, sin
 
 #define MILLISECONDS_PER_SECOND  1000
 #define LB_DEBUGMSG_PREFIX       "_____[ !!! *** latebloom *** !!! ]: " // all debug messages use this prefix
-#define GET_SYMBOL(a,v) if ((v = SymbolLookup(a)) == NULL) { printf(LB_DEBUGMSG_PREFIX "failed to locate '%s', aborting\n", a); IOSleep(5 * MILLISECONDS_PER_SECOND); return; }
+// v0.23 - GET_SYMBOL() takes a KernelSymbol handle (see klookup.h), not a string
+#define GET_SYMBOL(a,v) if ((v = SymbolLookupRef(&(a))) == NULL) { printf(LB_DEBUGMSG_PREFIX "failed to locate '%s', aborting\n", (a).Name); IOSleep(5 * MILLISECONDS_PER_SECOND); return; }
 #define HOOK_WINDOW_SIZE         3144  // Maximum # bytes to search for hook placement
+#define LONG_JUMP_SIZE           14    // Size of our "jmp *0(%rip)" + imm64 hook patch
+#define SHORT_JUMP_SIZE          5     // v0.23 - Size of a "jmp rel32" (to the island, see lb_PlaceIsland())
+#define ISLAND_ALIGN             16    // v0.23 - Alignment of the island
+#define LB_SCAN_SITES            8     // v0.23 - Pattern matches lb_scan=1 remembers (see lb_ScanText())
+#define IOPCIFAMILY_BUNDLE_ID    "com.apple.iokit.IOPCIFamily"
+#define PROBEBUS_SYMBOL          "__ZN11IOPCIBridge8probeBusEP9IOServiceh"   // IOPCIBridge::probeBus(IOService *, UInt8)
 #define MAX_ARG_DIGITS           4     // Maximum number of digits in an boot-arg (xxx=NNNN)
 #define DEFAULT_SLEEP            60    // Default sleep (milliseconds) if "latebloom=" is not specified
+#define LB_MAX_THREADS           32    // v0.23 - Default number of threads the hook keeps track of individually (see lb_Threads)
+#define LB_ARENA_SIZE            (16 * 1024)  // v0.23 - Size of our static memory arena (see lb_ArenaAlloc())
+#define LB_KERNEL_SPACE          0xffffff8000000000ULL   // v0.23 - Lowest kernel address (for sanity-checking return addresses)
+#define LB_TSC_CALIBRATE_US      10000 // v0.23 - How long (us) to measure the TSC for, if we can't find tscFreq
+#define LB_SELFTEST_MAX          8     // v0.23 - Most calibration rounds lb_selftest= asks for
+#define LB_SLEEP_TOPUP_US        2000  // v0.23 - Longest busy-wait lb_Sleep() uses to make up a short sleep
+
+// v0.23 - Phase 2 delay policies (lb_Settings.Phase2Mode)
+#define LB_P2_DELAY              0     // Random delay on every loop (lb_delay2=, lb_range2=), as always
+#define LB_P2_STAGGER            1     // One delay per thread, staggered by ordinal (lb_stagger=)
+#define LB_P2_SEQUENCE           2     // No delay;  probeBus() calls take turns, in arrival order (lb_sequence=)
+#define LB_P2_CONCURRENCY        3     // Delay depends on how many other probeBus() calls are in progress (lb_conc=)
+#define LB_P2_BACKOFF            4     // Wait (in growing slices) only while other probeBus() calls are in progress (lb_backoff=)
+#define LB_P2_LATCH              5     // Wait until a given IOService has been published (lb_latch=, lb_latchname=)
+#define LB_LATCH_NAME_SIZE       64    // v0.23 - Longest class/device name lb_latch=/lb_latchname= accepts (including NUL)
+#define LB_LATCH_TIMEOUT         2000  // v0.23 - Default latch timeout (ms)
+#define LB_QUIET_MS              3000  // v0.23 - Default time (ms) without loops before enumeration counts as done (lb_quiet=)
+#define LB_MAX_CONC_EXPONENT     3     // v0.23 - Largest exponent lb_conc= accepts
+#define LB_BACKOFF_FIRST_SLICE   1     // v0.23 - Default first backoff slice (ms)
+#define LB_AB_VARIABLE           "latebloom-ab"  // v0.23 - NVRAM variable holding the A/B record
+#define LB_AB_POLL_MS            50    // v0.23 - How often (ms) lb_ABPoll() looks for NVRAM
+// v0.23 - A/B mode progress (lb_ABStage)
+#define LB_AB_WAITING            0     // Waiting for NVRAM (no arm yet, latebloom= etc. are in effect)
+#define LB_AB_CHOSEN             1     // Arm picked, but not yet recorded in NVRAM as "pending"
+#define LB_AB_MARKED             2     // Recorded in NVRAM as "pending"
+#define LB_AB_DONE               3     // Boot completed, outcome recorded
+#define LB_AB_MISSED             4     // Enumeration was over before NVRAM came up (no arm this boot)
 // 8sep21 v0.22 - for creating /dev/latebloom
 #define STARTING_DEVSW_SLOT      -24   // per bsd/kern/bsd_stubs.c, -24 is a safe starting point (not -1)
+// v0.23 - for latebloom_address() (these must match latebloom.hpp)
+#define LB_ADDRESS_PROBEBUS      0
+#define LB_ADDRESS_HOOK_SITE     1
+#define LB_ADDRESS_HOOK_RETURN   2
+#define UNLOAD_DRAIN_TRIES       50    // v0.23 - How many times latebloom_stop() checks for threads still in the hook
+#define UNLOAD_DRAIN_SLEEP       100   // v0.23 - How long (ms) latebloom_stop() waits between those checks
+// v0.23 - for building the /dev/latebloom status text
+#define DESCRIBE_BUFFER_SIZE     256   // v0.23 - Size of a buffer for latebloom_describe()
+#define STATUS_PRINTF(...)       { if (Length < Size) { Length += snprintf(&Buffer[Length], Size - Length, __VA_ARGS__); } }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -123,6 +229,10 @@ extern void IOSleep(unsigned int);     // Manually prototype IOSleep() here, sin
 // neutral or register-relative, with no absolute or linker-supplied offsets.
 // This way, we can simply append the original code to our hook code, and
 // not worry about keeping track of which pattern was used at runtime.
+// v0.23 - If we can place an island (see lb_PlaceIsland()), the hook site
+// only needs room for a 5-byte jmp rel32, so only the first ShortSize bytes
+// of the pattern (ending on an instruction boundary) are displaced;  the
+// whole pattern is still what we search for.
 //
 static const unsigned char BytePattern113[] = {       // 11.3 to somewhere below 11.5b2
    0x48, 0xc7, 0x45, 0xd0, 0x00, 0x00, 0x00, 0x00,    // movq    $0x0, -0x30(%rbp)
@@ -143,34 +253,72 @@ static const unsigned char BytePattern12b3[] = {      // 12.0b3+
 // (Patterns for alternate (top of loop) hook removed in v0.21)
 // (All code related to alternate hook also removed in v0.21)
 
-static struct
+static const lb_PatternInfo BytePatterns[] =
 {
-   const unsigned char *Pattern;
-   const unsigned long size;
-} BytePatterns[] =
-{
-   { BytePattern113,    sizeof(BytePattern113)     },
-   { BytePattern115b2,  sizeof(BytePattern115b2)   },
-   { BytePattern12b3,   sizeof(BytePattern12b3)    },
-   { NULL,              0                          }, // Mark the end of the list
+   { BytePattern113,    sizeof(BytePattern113),    8  },
+   { BytePattern115b2,  sizeof(BytePattern115b2),  8  },
+   { BytePattern12b3,   sizeof(BytePattern12b3),   8  },
+   { NULL,              0,                         0  }, // Mark the end of the list
 };
 
 // Per-loop debug message (format string for printf())
-static const char          HookMessage[] = LB_DEBUGMSG_PREFIX "PCI LOOP # %2ld %s delay %4ld ms (%08lx) *_*_*_*_*_*_*_*_*_*_*_*_*_*_*_*_*_*_*_*_*_*_*_\n";
+// (v0.23 - now includes the thread's ordinal (see lb_Threads) after "ONBOARD"/"EXTERNAL")
+static const char          HookMessage[] = LB_DEBUGMSG_PREFIX "PCI LOOP # %2ld %s-%u delay %4ld ms (%08lx) *_*_*_*_*_*_*_*_*_*_*_*_*_*_*_*_*_*_*_*_*_*_*_\n";
 // Variations for internal/external PCI buses (the displayed names are somewhat arbitrary)
 static const char          HookMessagePhase1[] = "ONBOARD";
 static const char          HookMessagePhase2[] = "EXTERNAL";
 // 8sep21 v0.22 - the name of our pseudo-device (in /dev/)
 static const char          lbDeviceName[] = "latebloom";
 
+static const KernelSymbol  PEBootArgsSymbol = KERNEL_SYMBOL("_PE_boot_args");   // v0.23 - for GET_SYMBOL()
+static const KernelSymbol  TSCFreqSymbol = KERNEL_SYMBOL("_tscFreq");            // v0.23 - the kernel's TSC frequency (Hz)
+static const KernelSymbol  NVRAMReadSymbol = KERNEL_SYMBOL("_PEReadNVRAMProperty");    // v0.23 - for the A/B record
+static const KernelSymbol  NVRAMWriteSymbol = KERNEL_SYMBOL("_PEWriteNVRAMProperty");  // v0.23 - for the A/B record
+static const KernelSymbol  NVRAMOptionsSymbol = KERNEL_SYMBOL("_gIOOptionsEntry");     // v0.23 - is NVRAM up yet?
+
 static char                *BootArgs;                 // Our pointer to boot-args
-static unsigned long long  lb_jump_address = 0;       // Address of the code we're hooking
+static unsigned long long  lb_HookSite = 0;           // Address of the code we're hooking
+static unsigned long long  lb_jump_address = 0;       // Address our hook returns to (just past the patched bytes)
+static int                 lb_HookArmed = 0;          // v0.23 - Non-zero while the jump to our hook is in place
+static int                 lb_HookJournal = -1;       // v0.23 - Patch journal entry for the hook (see kpatch.c)
+static unsigned long long  lb_Island = 0;             // v0.23 - Address of the long jump island (0 if none, see lb_PlaceIsland())
+static int                 lb_IslandJournal = -1;     // v0.23 - Patch journal entry for the island
+static unsigned long       lb_HookSize = 0;           // v0.23 - Number of bytes the hook displaces at lb_HookSite
+//
+// v0.23 - With "lb_scan=1", latebloom_start() also scans all of IOPCIFamily's __TEXT,__text for
+// the BytePatterns (not just the HOOK_WINDOW_SIZE bytes of probeBus() it hooks), and /dev/latebloom
+// shows where they turned up, and how fast the scan went.  The hook itself still goes in probeBus().
+//
+static long                lb_ScanAll = 0;            // v0.23 - Non-zero to scan all of __text (lb_scan=)
+static unsigned long long  lb_ScanBase = 0;           // v0.23 - Start of __text
+static unsigned long long  lb_ScanBytes = 0;          // v0.23 - Size of __text (0 if it wasn't scanned)
+static UInt32              lb_ScanCandidates = 0;     // v0.23 - Offsets the prefilter passed on to be compared
+static UInt32              lb_ScanMatches = 0;        // v0.23 - Pattern matches found
+static UInt64              lb_ScanTicks = 0;          // v0.23 - How long the scan took (TSC ticks)
+static unsigned long long  lb_ScanSites[LB_SCAN_SITES];      // v0.23 - The first LB_SCAN_SITES matches
+static unsigned long       lb_ScanPatterns[LB_SCAN_SITES];   // v0.23 - ... and which BytePattern each one is
 static unsigned long       WhichPattern = 0;          // Which BytePattern is in use
-static unsigned long       lb_PCI_counter = 0;        // IOPCIBridge::probeBus hook loop counter (for display only)
 static unsigned long long  ProbeAddress = 0;          // Address of IOPCIBridge::probeBus
-static unsigned long       SleepValue = 0;            // How long each loop should sleep (milliseconds)
-static long                lb_DebugLevel = 0;         // Non-zero means display additional debug info
-static long                lb_RandRange = 0;          // Range of random variations (+/-)
+//
+// v0.23 - The settings (mostly from boot-args) that the hook reads on every loop.  They're
+// only written by latebloom_start() (and, in A/B mode, once more when the arm is picked),
+// so they're kept together, on cache lines of their own, apart from lb_Counters (which
+// every CPU writes in Phase 2) and from the other statics, which the hook never needs.
+// The comments further down describe how each mode uses its settings.
+//
+lb_SettingsInfo            lb_Settings =
+{
+   .AltSleepValue        = -1,
+   .AltRandRange         = -1,
+   .Phase2Mode           = LB_P2_DELAY,
+   .ConcurrencyExponent  = 1,
+   .BackoffSlice         = LB_BACKOFF_FIRST_SLICE,
+   .LatchTimeout         = LB_LATCH_TIMEOUT,
+   .QuietMs              = LB_QUIET_MS,
+   .WindowEndTSC         = ~0ULL,
+   .RateBurst            = 1,
+   .MaxThreads           = LB_MAX_THREADS
+};
 //
 // It appears that the PCI probe loop first runs through PCI bus 0 (motherboard devices) using
 // a single thread, then it goes multithreaded for the remaining buses/devices (PCIe cards and
@@ -190,9 +338,202 @@ static long                lb_RandRange = 0;          // Range of random variati
 // if delay2 is not specified - meaning there's no lb_delay2= boot-arg, or lbloom= does not contain
 // anything past the debug parameter (no trailing comma after the debug parameter, if present).
 //
-static char                *CurrentThread = 0;        // Address of current thread
-static long                lb_AltSleepValue = -1;     // "Phase 2" (EXTERNAL) sleep value. "-1" means "No P2 sleep specified" (this allows for 0)
-static long                lb_AltRandRange = -1;      // "Phase 2" (EXTERNAL) random range - same default as lb_RandRange (no variation)
+// v0.23 - "Stagger" mode for Phase 2 (lb_stagger=NNNN):  random delays don't guarantee
+// that concurrent Phase 2 threads actually separate (two threads can draw similar delays
+// and collide anyway), and every thread pays the full mean delay on every loop.  In
+// stagger mode, the Nth Phase 2 thread (counting from 0) sleeps N * lb_Settings.StaggerStep ms
+// once, on its first time through the hook, and never again.  That spaces the threads'
+// starts at least lb_Settings.StaggerStep ms apart, for a fraction of the total sleep.  When
+// lb_Settings.StaggerStep is non-zero, it replaces lb_Settings.AltSleepValue/lb_Settings.AltRandRange.
+//
+// v0.23 - "Sequence" mode for Phase 2 (lb_sequence=NNNN):  if the hang is an ordering race
+// between bridges, random delays only make it less likely.  In sequence mode, each Phase 2
+// probeBus() call takes a ticket when it first reaches the hook, and doesn't continue until
+// the call holding the previous ticket has returned - so the probes run one at a time, in
+// the order they arrived, with no blanket sleep.  (A probeBus() call made from inside
+// another one is part of its caller's turn, and shares its ticket.)  A probe that waits more than NNNN ms for
+// its turn goes ahead anyway (and is counted in lb_Counters.SequenceTimeouts), so a stuck probe can't
+// deadlock the boot.  (Bus numbers would be a nicer order, but the bus number is long gone
+// from the registers by the time probeBus() gets to our hook.)
+//
+// v0.23 - Concurrency mode for Phase 2 (lb_conc=step,exponent,cap):  lb_delay2 is the same
+// whether one bridge is being probed or eight are being probed at once.  In concurrency
+// mode, each Phase 2 loop sleeps
+//    step * (number of other probeBus() calls in progress) ^ exponent
+// ms (but no more than <cap> ms, if <cap> isn't 0), so a probe running on its own costs
+// nothing at all.  The calls in progress are counted in lb_Counters.InRegion (see lb_EnterRegion()).
+//
+// v0.23 - Backoff mode for Phase 2 (lb_backoff=cap,slice):  IOSleep() for a fixed time
+// leaves the CPU idle even when nothing is racing.  In backoff mode, a Phase 2 loop only
+// waits while some other probeBus() call is in progress, and then in short slices (starting
+// at <slice> ms, doubling each time), checking again after each one;  as soon as it's
+// alone, it goes ahead.  The total wait per loop is limited to <cap> ms.
+//
+// v0.23 - Latch mode for Phase 2 (lb_latch=class,timeout or lb_latchname=name,timeout):
+// a timed delay is really just a stand-in for "wait until the other thing is ready".  In
+// latch mode, Phase 2 loops wait on a latch instead, which is released when an IOService
+// of the given class (or with the given name) is published;  AAA_LoadEarly_latebloom::start()
+// asks IOKit to tell us when that happens (see latebloom_latch_release()).  If it hasn't
+// happened within <timeout> ms of the first Phase 2 loop, we release the latch ourselves,
+// so a missing device can't hang the boot.  (Phase 1 never waits on the latch;  the
+// service it'd be waiting for might well need Phase 1 to finish first.)
+//
+static char                lb_LatchMatch[LB_LATCH_NAME_SIZE]; // v0.23 - Class (or device name) to wait for ("" = latch mode off)
+static int                 lb_LatchByName = 0;        // v0.23 - Non-zero if lb_LatchMatch is a device name, not a class
+//
+// v0.23 - PCI enumeration is considered done ("quiesced") once nobody is in the hook, and no loop
+// has come through it for lb_Settings.QuietMs.  poll()/select() on /dev/latebloom wait for that (see
+// AAA_LoadEarly_latebloom::LatebloomSelect()), so boot health agents don't have to keep polling.
+//
+static volatile UInt32     lb_Quiesced = 0;           // v0.23 - Non-zero once enumeration has quiesced
+static IOLock              *lb_LatchLock = NULL;      // v0.23 - Protects the latch (for IOLockSleepDeadline())
+static volatile SInt32     lb_LatchOpen = 0;          // v0.23 - Non-zero once the latch is released
+static volatile UInt64     lb_LatchDeadline = 0;      // v0.23 - When we give up waiting (absolute time), 0 = not set yet
+static int                 lb_LatchTimedOut = 0;      // v0.23 - Non-zero if we gave up waiting (rather than being released)
+//
+// v0.23 - Phase 2 time window (lb_window=start,end):  if the race only happens early on in
+// the multithreaded part of the PCI probe, there's no point in slowing down every Phase 2
+// loop after that (including hot-plugged devices).  With lb_window=, Phase 2 loops outside
+// of [start, end) ms after the first Phase 2 thread arrived (lb_Phase2StartTSC) go straight
+// through.  An <end> of 0 means there's no end.  The window is converted to TSC ticks once,
+// when the hook is armed, so the check itself costs one compare per loop.
+//
+static long                lb_WindowStart = 0;        // v0.23 - Start of the window (ms after Phase 2 starts)
+static long                lb_WindowEnd = 0;          // v0.23 - End of the window (ms after Phase 2 starts), 0 = none
+//
+// v0.23 - A/B mode (lb_arm0=delay,range,delay2,range2 ... lb_arm3=..., lb_abgoal=ms):  the
+// right delays differ from one Mac to the next, and finding them by hand takes a lot of
+// reboots.  In A/B mode, each boot uses one of up to LB_MAX_ARMS sets of delays ("arms"),
+// picked by Thompson sampling:  each arm's chance of success is modelled as a Beta
+// distribution over its past wins and losses, we draw one sample from each, and the
+// highest sample wins.  Arms that work get picked more and more often, but an arm with
+// little history still gets tried now and then.
+//
+// A boot "wins" if it completes (the first open of /dev/latebloom, see
+// latebloom_ab_complete()) and, if lb_abgoal= is given, the PCI probe took no longer than
+// <goal> ms.  A boot that never completes can't record anything, of course, so the arm is
+// recorded as "pending" in NVRAM while the boot is in progress;  if the next boot still
+// finds it pending, it counts as a loss.
+//
+// The record lives in the NVRAM variable LB_AB_VARIABLE (see lb_StoreRead()), and the arm
+// is only ever picked from a record that was actually read.  NVRAM usually isn't up yet when
+// the PCI probe starts, so the arm can't be picked then:  lb_ABPoll() (a thread call, off the
+// hook's path) looks for NVRAM every LB_AB_POLL_MS ms from latebloom_start() on, and picks
+// the arm, puts its delays into effect, and marks it pending as soon as the record can be
+// read.  Until then, the usual settings (latebloom=, lb_range=, lb_delay2=, lb_range2=) are
+// in effect.  If enumeration is over before NVRAM comes up, there's no arm this boot.
+// Changing the arms starts the experiment over.
+//
+typedef struct
+{
+   int               Set;                             // Non-zero if lb_armN= was given
+   long              Delay;                           // Phase 1 delay (ms) (lb_delay)
+   long              Range;                           // Phase 1 random range (ms) (lb_range)
+   long              Delay2;                          // Phase 2 delay (ms) (lb_delay2), -1 = same as Delay
+   long              Range2;                          // Phase 2 random range (ms) (lb_range2), -1 = same as Range
+} lb_ArmInfo;
+// (The record itself, lb_ABRecord, is in lbcore.h)
+
+typedef int (*lb_NVRAMReadFunc)(const char *Name, void *Value, unsigned int *Length);         // PEReadNVRAMProperty()
+typedef int (*lb_NVRAMWriteFunc)(const char *Name, const void *Value, const unsigned int Length); // PEWriteNVRAMProperty()
+
+static lb_ArmInfo          lb_Arms[LB_MAX_ARMS];
+static long                lb_ABGoal = 0;             // v0.23 - Longest PCI probe (ms) that counts as a win, 0 = any
+static UInt32              lb_ABConfig = 0x811c9dc5;  // v0.23 - Hash of the arms (FNV-1a, see latebloom_start())
+static int                 lb_ABArm = -1;             // v0.23 - The arm this boot is using (-1 = none yet)
+static volatile UInt32     lb_ABStage = LB_AB_WAITING;  // v0.23 - How far along this boot's experiment is (LB_AB_*)
+static volatile UInt32     lb_ABBusy = 0;             // v0.23 - Non-zero while somebody is updating the NVRAM record
+static unsigned long       lb_ABPickLoop = 0;         // v0.23 - Loops before the arm was picked (latebloom= etc. were in effect)
+static long                lb_ABProbeMs = -1;         // v0.23 - This boot's PCI probe time (ms), once recorded
+static lb_ABRecord         lb_ABLast;                 // v0.23 - The last A/B record we read or wrote (for the status)
+static thread_call_t       lb_ABCall = NULL;          // v0.23 - Runs lb_ABPoll()
+static volatile int        lb_ABClosing = 0;          // v0.23 - Non-zero once latebloom_stop() is taking lb_ABCall down
+static lb_NVRAMReadFunc    lb_NVRAMRead = NULL;       // v0.23 - PEReadNVRAMProperty()
+static lb_NVRAMWriteFunc   lb_NVRAMWrite = NULL;      // v0.23 - PEWriteNVRAMProperty()
+static void * volatile     *lb_NVRAMOptions = NULL;   // v0.23 - gIOOptionsEntry (the NVRAM driver, NULL until it's up)
+//
+// v0.23 - Rate mode (lb_rate=rate,burst):  a fixed sleep on every loop makes the total
+// delay proportional to the number of devices, so a Mac Pro with full slots and a couple
+// of Thunderbolt docks pays far more than a bare iMac for the same protection.  In rate
+// mode, hook entries (from any thread, in either phase) go straight through as long as
+// they stay under <rate> per second, allowing bursts of up to <burst>, and only sleep
+// when they'd exceed that.  (In Phase 2, the other Phase 2 modes (LB_P2_*) still take
+// precedence.)
+//
+// This is the "generic cell rate algorithm" form of a token bucket:  rather than a token
+// count that has to be refilled, we keep the theoretical arrival time (TAT) of the next
+// entry, in TSC ticks.  Each entry moves the TAT forward by one interval with a single
+// compare-and-swap, and sleeps if the TAT is more than <burst> intervals ahead of now.
+//
+// v0.23 - IOSleep() is only as good as the kernel's timers, and early in boot (especially with
+// timer coalescing on older machines) it can oversleep by a lot.  With "lb_selftest=N",
+// latebloom_start() times N rounds of IOSleep() and IODelay() at each of the values below
+// (lb_Calibrate()), and from then on lb_Sleep() asks for less (making up any shortfall with
+// a short IODelay()) so the delays come out as long as they were meant to be.
+//
+static const UInt32        lb_CalSleepMs[] = { 1, 2, 5, 10, 50 };       // v0.23 - IOSleep() values we time
+static const UInt32        lb_CalDelayUs[] = { 10, 100, 1000, 2000 };   // v0.23 - IODelay() values we time
+#define LB_CAL_SLEEPS            (sizeof(lb_CalSleepMs) / sizeof(lb_CalSleepMs[0]))
+#define LB_CAL_DELAYS            (sizeof(lb_CalDelayUs) / sizeof(lb_CalDelayUs[0]))
+static long                lb_SelfTest = 0;           // v0.23 - Calibration rounds (lb_selftest=), 0 = don't calibrate
+static int                 lb_Calibrated = 0;         // v0.23 - Non-zero once the tables below are filled in
+static UInt32              lb_SleepUs[LB_CAL_SLEEPS]; // v0.23 - How long (us, on average) each IOSleep() took
+static UInt32              lb_SleepWorstUs[LB_CAL_SLEEPS];  // v0.23 - ... and the longest one
+static UInt32              lb_DelayUs[LB_CAL_DELAYS]; // v0.23 - How long (us, on average) each IODelay() took
+//
+// v0.23 - The thread table (see lbcore.h)
+//
+
+lb_ThreadInfo              *lb_Threads = NULL;        // v0.23 - lb_Settings.MaxThreads entries, from the arena (see latebloom_start())
+volatile lb_CounterInfo    lb_Counters;              // v0.23 - The counters the hook updates (see lbcore.h)
+//
+// v0.23 - Tables (like lb_Threads) come out of this arena, rather than kernel allocations:
+// it's reserved in the kext image, so there's nothing to fail (or to free) at run time, and
+// nothing on the hook's path ever allocates.  lb_ArenaAlloc() hands out cache-line-aligned
+// pieces of it, and is only called from latebloom_start().
+//
+static UInt8               lb_Arena[LB_ARENA_SIZE] __attribute__((aligned(LB_CACHE_LINE)));
+static size_t              lb_ArenaUsed = 0;          // v0.23 - How much of lb_Arena has been handed out
+//
+// v0.23 - The symbol lookup tables (see klookup.c) are only needed to find the hook site;
+// once the hook is armed (or has failed to be), latebloom_start() frees them (lb_ReleaseLookup()).  The handful of
+// addresses the status and the IORegistry describe are looked up just before that, and
+// kept here (the names themselves are in the kernel's and kexts' string tables, which
+// stay put), so describing them later doesn't build the tables all over again.
+//
+#define LB_DESCRIBED             4     // v0.23 - Entries in lb_Described
+static struct
+{
+   unsigned long long   Address;
+   const char           *Name;                        // NULL if there's no symbol for it
+   const char           *Image;
+   uint64_t             Offset;
+} lb_Described[LB_DESCRIBED];
+//
+// v0.23 - How long each stage of latebloom_start() took.  lb_StartTSC[n] is the TSC at the
+// end of stage n (LB_STAGE_ENTRY is the start of the whole thing), 0 if it never got there.
+// /dev/latebloom shows them in microseconds, along with lb_Settings.TSCFrequency.
+//
+#define LB_STAGE_ENTRY           0     // latebloom_start() called
+#define LB_STAGE_VERSION         1     // Version check
+#define LB_STAGE_BOOTARGS_SYMBOL 2     // _PE_boot_args resolved (and called)
+#define LB_STAGE_BOOTARGS_PARSE  3     // Boot-args parsed, defaults and modes set up
+#define LB_STAGE_SELFTEST        4     // IOSleep()/IODelay() calibration (lb_selftest=, see lb_Calibrate())
+#define LB_STAGE_PROBEBUS        5     // IOPCIBridge::probeBus found
+#define LB_STAGE_SCAN            6     // Byte pattern scan
+#define LB_STAGE_PATCH           7     // Hook exit written, hook armed, lookup tables freed
+#define LB_STAGE_CDEVSW          8     // cdevsw_add() (and the first devfs_make_node())
+#define LB_STAGE_COUNT           9
+static const char          *lb_StageNames[LB_STAGE_COUNT] =
+{
+   "entry", "version check", "_PE_boot_args", "boot-args", "self-test", "probeBus", "pattern scan", "patch", "cdevsw"
+};
+static UInt64              lb_StartTSC[LB_STAGE_COUNT];
+#define LB_STAGE(n)              { lb_StartTSC[n] = lb_ReadTSC(); }
+static size_t              lb_LookupPeak = 0;         // v0.23 - Memory (bytes) the lookup tables held before they were freed
+static int                 lb_LookupReleased = 0;     // v0.23 - Non-zero once the lookup tables have been freed
+volatile UInt64            lb_Phase2StartTSC = 0;     // v0.23 - TSC when the first Phase 2 thread arrived (0 = not yet)
+unsigned long              lb_Phase2StartLoop = 0;    // v0.23 - Loop counter (lb_Counters.Loops) at that point
 //
 // 8sep21 v0.22 - we now create a dummy device (/dev/latebloom) if the hook is
 // set successfully.  Below are the data elements we use for creating the
@@ -202,189 +543,1416 @@ static long                lb_AltRandRange = -1;      // "Phase 2" (EXTERNAL) ra
 //
 extern struct cdevsw devsw;                           // Character device function vector table (see latebloom.hpp)
 dev_t  fBaseDev;                                      // Our base device
-int    MajorDev;                                      // Major device number
+int    MajorDev = -1;                                 // Major device number
 void   *fDeviceNode;                                  // Character device devfs node
 
 
+// v0.23 - Removes the latch's IOService notification (implemented in latebloom.cpp)
+extern void LatchUnregister(void);
+// v0.23 - Set up/tear down poll()/select() support for /dev/latebloom (implemented in latebloom.cpp)
+extern int SelectSetup(void);
+extern void SelectTeardown(void);
+
+// Local symbols defined in the assembly language below (invisible to the C compiler without extern declarations):
+extern unsigned long long latebloom_hook;             // The address of our hook code
+extern unsigned long long lb_hook_exit;               // The address of our hook exit code
+
+extern unsigned long long latebloom_ret;              // v0.23 - The address of our probeBus() return trampoline
+
+// v0.23 - Called from the hook code below (so they can't be static, or the compiler would drop them)
+void latebloom_hook_body(UInt64 Frame);
+UInt64 latebloom_region_exit(void);
+// v0.23 - Latch mode interface for latebloom.cpp
+void latebloom_latch_release(void);
+const char *latebloom_latch_match(int *ByName);
+// v0.23 - A/B mode interface for latebloom.cpp
+void latebloom_ab_complete(void);
+// v0.23 - Quiescence interface for latebloom.cpp
+long latebloom_quiet_remaining(void);
+
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Code
 //
 ////////////////////////////////////////////////////////////////////////////////
 
-///////////////////////////////////////////////
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Read the TimeStamp Counter
+//
+/////////////////////////////////////////////////////////
+static inline UInt64 lb_ReadTSC(void)
+{
+   UInt32 Low, High;
+
+   asm volatile ("rdtsc" : "=a" (Low), "=d" (High));
+   return ((UInt64)High << 32) | Low;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Find out how fast the TSC runs (lb_Settings.TSCFrequency).
+//
+// The kernel already knows (tscFreq), but that's not part of
+// any KPI, so if we can't find it, we measure the TSC across
+// a busy-wait instead.  That's only good to a percent or so,
+// but we don't need any better than that.
+//
+/////////////////////////////////////////////////////////
+static void lb_FindTSCFrequency(void)
+{
+   UInt64   *TSCFreq;
+   UInt64   Start;
+
+   if (lb_Settings.TSCFrequency != 0)
+   {
+      return;
+   }
+   if ((TSCFreq = (UInt64 *)SymbolLookupRef(&TSCFreqSymbol)) != NULL && *TSCFreq != 0)
+   {
+      lb_Settings.TSCFrequency = *TSCFreq;
+   }
+   else
+   {
+      Start = lb_ReadTSC();
+      IODelay(LB_TSC_CALIBRATE_US);
+      lb_Settings.TSCFrequency = (lb_ReadTSC() - Start) * (1000000 / LB_TSC_CALIBRATE_US);
+   }
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Convert between milliseconds and TSC ticks
+//
+/////////////////////////////////////////////////////////
+static inline UInt64 lb_MsToTSC(UInt64 Ms)
+{
+   return Ms * (lb_Settings.TSCFrequency / MILLISECONDS_PER_SECOND);
+}
+
+static inline unsigned long long lb_TSCToUs(UInt64 Ticks)
+{
+   return (lb_Settings.TSCFrequency < 1000000) ? 0 : Ticks / (lb_Settings.TSCFrequency / 1000000);
+}
+
+static inline long lb_TSCToMs(UInt64 Ticks)
+{
+   UInt64 PerMs = lb_Settings.TSCFrequency / MILLISECONDS_PER_SECOND;
+
+   // (Rounded up, so that a sleep is never shorter than it needs to be)
+   return (PerMs == 0) ? 0 : (long)((Ticks + PerMs - 1) / PerMs);
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Time lb_SelfTest rounds of IOSleep() and IODelay()
+// at each of lb_CalSleepMs[] and lb_CalDelayUs[].
+//
+/////////////////////////////////////////////////////////
+static void lb_Calibrate(void)
+{
+   UInt64   SleepTotal[LB_CAL_SLEEPS] = { 0 };
+   UInt64   DelayTotal[LB_CAL_DELAYS] = { 0 };
+   UInt64   Start, Us;
+   long     Round;
+   unsigned int i;
+
+   if (lb_SelfTest > LB_SELFTEST_MAX)
+   {
+      lb_SelfTest = LB_SELFTEST_MAX;
+   }
+   lb_FindTSCFrequency();
+   for (Round = 0; Round < lb_SelfTest; ++Round)
+   {
+      for (i = 0; i < LB_CAL_SLEEPS; ++i)
+      {
+         Start = lb_ReadTSC();
+         IOSleep(lb_CalSleepMs[i]);
+         Us = lb_TSCToUs(lb_ReadTSC() - Start);
+         SleepTotal[i] += Us;
+         if (Us > lb_SleepWorstUs[i])
+         {
+            lb_SleepWorstUs[i] = (UInt32)Us;
+         }
+      }
+      for (i = 0; i < LB_CAL_DELAYS; ++i)
+      {
+         Start = lb_ReadTSC();
+         IODelay(lb_CalDelayUs[i]);
+         DelayTotal[i] += lb_TSCToUs(lb_ReadTSC() - Start);
+      }
+   }
+   for (i = 0; i < LB_CAL_SLEEPS; ++i)
+   {
+      lb_SleepUs[i] = (UInt32)(SleepTotal[i] / lb_SelfTest);
+      printf(LB_DEBUGMSG_PREFIX "Self-test:  IOSleep(%u) took %u us (worst %u us)\n", lb_CalSleepMs[i], lb_SleepUs[i], lb_SleepWorstUs[i]);
+   }
+   for (i = 0; i < LB_CAL_DELAYS; ++i)
+   {
+      lb_DelayUs[i] = (UInt32)(DelayTotal[i] / lb_SelfTest);
+      printf(LB_DEBUGMSG_PREFIX "Self-test:  IODelay(%u) took %u us\n", lb_CalDelayUs[i], lb_DelayUs[i]);
+   }
+   lb_Calibrated = 1;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - How much longer (us) than <Us> a call asking for
+// <Us> is expected to take, interpolating (linearly) between
+// the calibration points <Asked> (scaled by <Scale> to us)
+// and what they actually took, <Got>.
+//
+/////////////////////////////////////////////////////////
+static UInt64 lb_Overshoot(const UInt32 *Asked, UInt32 Scale, const UInt32 *Got, unsigned int Count, UInt64 Us)
+{
+   SInt64         Lower, Upper;
+   unsigned int   i;
+
+   for (i = 1; i < Count - 1 && Us > (UInt64)Asked[i] * Scale; ++i)
+      ;
+   Lower = (SInt64)Got[i - 1] - (SInt64)Asked[i - 1] * Scale;
+   Upper = (SInt64)Got[i] - (SInt64)Asked[i] * Scale;
+   if (Us <= (UInt64)Asked[i - 1] * Scale)
+   {
+      Upper = Lower;
+   }
+   else if (Us < (UInt64)Asked[i] * Scale)
+   {
+      Upper = Lower + (Upper - Lower) * (SInt64)(Us - (UInt64)Asked[i - 1] * Scale) / (SInt64)((Asked[i] - Asked[i - 1]) * Scale);
+   }
+   return (Upper > 0) ? (UInt64)Upper : 0;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Sleep for <Ms> milliseconds.
+//
+// Until lb_Calibrate() has run, that's just IOSleep().  After
+// that, we ask IOSleep() for less, by however much it's been
+// oversleeping, and busy-wait (IODelay()) the rest if we come
+// up a little short.  Sleeps too short to take the expected
+// oversleep out of are just IOSleep(Ms).  Either way we always
+// sleep first, so the busy-wait only makes up a shortfall: never
+// more than LB_SLEEP_TOPUP_US, nor half the request (the polling
+// and backoff loops ask for 1 ms at a time, and must not spin).
+//
+/////////////////////////////////////////////////////////
+void lb_Sleep(unsigned int Ms)
+{
+   UInt64   Target = (UInt64)Ms * 1000;
+   UInt64   Overshoot, Start, Elapsed, Short;
+
+   if (!lb_Calibrated)
+   {
+      IOSleep(Ms);
+      return;
+   }
+   Overshoot = lb_Overshoot(lb_CalSleepMs, 1000, lb_SleepUs, LB_CAL_SLEEPS, Target);
+   Start = lb_ReadTSC();
+   if (Target >= Overshoot + 1000)
+   {
+      IOSleep((unsigned int)((Target - Overshoot) / 1000));
+   }
+   else
+   {
+      IOSleep(Ms);         // (the best we can do)
+   }
+   Elapsed = lb_TSCToUs(lb_ReadTSC() - Start);
+   if (Elapsed < Target && Target - Elapsed <= LB_SLEEP_TOPUP_US && Target - Elapsed <= Target / 2)
+   {
+      Short = Target - Elapsed;
+      Overshoot = lb_Overshoot(lb_CalDelayUs, 1, lb_DelayUs, LB_CAL_DELAYS, Short);
+      if (Short > Overshoot)
+      {
+         IODelay((unsigned int)(Short - Overshoot));
+      }
+      Elapsed = lb_TSCToUs(lb_ReadTSC() - Start);
+   }
+   OSAddAtomic64((SInt64)Target, (volatile SInt64 *)&lb_Counters.SleepAskedUs);
+   OSAddAtomic64((SInt64)Elapsed, (volatile SInt64 *)&lb_Counters.SleepGotUs);
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - A random offset in [-Range, +Range).
+//
+// We don't need strong randomization here, no particular
+// distribution, just something that's reasonably
+// unpredictable.  We can do that cheaply with the TSC (a
+// count of clock cycles since the CPU was last reset);  for
+// our purposes, its low 32 bits are more than random enough.
+//
+/////////////////////////////////////////////////////////
+static long lb_RandomOffset(long Range)
+{
+   long Offset;
+
+   if (Range <= 0)
+   {
+      return 0;
+   }
+   Offset = (long)((UInt32)lb_ReadTSC() % (UInt32)Range);
+   // Randomly add or subtract the range-bound random offset
+   return (lb_ReadTSC() & 0x01) ? -Offset : Offset;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Allocate <Size> bytes from the arena (cache line
+// aligned, zeroed).  Returns NULL if there's not enough left.
+//
+/////////////////////////////////////////////////////////
+static void *lb_ArenaAlloc(size_t Size)
+{
+   void     *Block;
+
+   Size = (Size + LB_CACHE_LINE - 1) & ~(size_t)(LB_CACHE_LINE - 1);
+   if (Size > LB_ARENA_SIZE - lb_ArenaUsed)
+   {
+      return NULL;
+   }
+   Block = &lb_Arena[lb_ArenaUsed];
+   lb_ArenaUsed += Size;
+   return Block;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Rate mode:  reserve the next slot in the token
+// bucket (see lb_Settings.Rate), and return how long (ms) we need to
+// sleep before using it (0 if we're under the rate).
+//
+/////////////////////////////////////////////////////////
+static long lb_RateDelay(UInt64 Now)
+{
+   UInt64   TAT;
+   UInt64   Allowed;
+   UInt64   Tolerance = (UInt64)(lb_Settings.RateBurst - 1) * lb_Settings.RateInterval;
+
+   do
+   {
+      TAT = lb_Counters.RateTAT;
+      Allowed = (TAT > Now) ? TAT : Now;
+   } while (!OSCompareAndSwap64(TAT, Allowed + lb_Settings.RateInterval, &lb_Counters.RateTAT));
+
+   if (Allowed - Now <= Tolerance)
+   {
+      return 0;
+   }
+   OSIncrementAtomic(&lb_Counters.RateThrottled);
+   return lb_TSCToMs(Allowed - Now - Tolerance);
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Latch mode:  wait for the latch to be released
+// (see lb_LatchMatch), or for lb_Settings.LatchTimeout to run out.
+//
+// Returns how long (ms) we waited.
+//
+/////////////////////////////////////////////////////////
+static long lb_LatchWait(UInt64 Now)
+{
+   UInt64   Deadline;
+
+   if (lb_LatchOpen || lb_LatchLock == NULL)
+   {
+      return 0;
+   }
+   // The timeout starts with the first Phase 2 loop to get here
+   if (lb_LatchDeadline == 0)
+   {
+      clock_interval_to_deadline((UInt32)lb_Settings.LatchTimeout, kMillisecondScale, &Deadline);
+      OSCompareAndSwap64(0, Deadline, &lb_LatchDeadline);
+   }
+   IOLockLock(lb_LatchLock);
+   while (!lb_LatchOpen)
+   {
+      if (IOLockSleepDeadline(lb_LatchLock, (void *)&lb_LatchOpen, lb_LatchDeadline, THREAD_UNINT) == THREAD_TIMED_OUT && !lb_LatchOpen)
+      {
+         // Nobody came;  let everybody go
+         lb_LatchTimedOut = 1;
+         lb_LatchOpen = 1;
+         IOLockWakeup(lb_LatchLock, (void *)&lb_LatchOpen, false);
+      }
+   }
+   IOLockUnlock(lb_LatchLock);
+   return lb_TSCToMs(lb_ReadTSC() - Now);
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Latch mode:  the service we were waiting for has
+// been published (called from AAA_LoadEarly_latebloom's
+// IOService notification handler).
+//
+/////////////////////////////////////////////////////////
+void latebloom_latch_release(void)
+{
+   if (lb_LatchLock == NULL)
+   {
+      lb_LatchOpen = 1;
+      return;
+   }
+   IOLockLock(lb_LatchLock);
+   lb_LatchOpen = 1;
+   IOLockWakeup(lb_LatchLock, (void *)&lb_LatchOpen, false);
+   IOLockUnlock(lb_LatchLock);
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Latch mode:  what the latch is waiting for (for
+// AAA_LoadEarly_latebloom::start()).
+//
+// Returns the class (or, if *ByName is set, device) name,
+// or NULL if latch mode is off.
+//
+/////////////////////////////////////////////////////////
+const char *latebloom_latch_match(int *ByName)
+{
+   if (lb_Settings.Phase2Mode != LB_P2_LATCH)
+   {
+      return NULL;
+   }
+   *ByName = lb_LatchByName;
+   return lb_LatchMatch;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - A/B mode:  read/write the A/B record in NVRAM.
+//
+// This is the only place that knows where the record is
+// kept.  PEReadNVRAMProperty() and PEWriteNVRAMProperty()
+// aren't KPI, so (like _PE_boot_args) latebloom_start()
+// looks them up.  Both fail harmlessly until IOKit's NVRAM
+// driver is up, and a failed read looks the same whether
+// NVRAM isn't up or the variable isn't there, so we also
+// look at gIOOptionsEntry, which they both check first.
+// (If we can't find it, a failed read is LB_STORE_DOWN;
+// latebloom_ab_complete() sorts that out.)
+//
+// lb_StoreRead() returns LB_STORE_*;  lb_StoreWrite()
+// returns non-zero on success.
+//
+/////////////////////////////////////////////////////////
+int lb_StoreRead(lb_ABRecord *Record)
+{
+   unsigned int      Length = sizeof(*Record);
+
+   if (lb_NVRAMRead == NULL || (lb_NVRAMOptions != NULL && *lb_NVRAMOptions == NULL))
+   {
+      return LB_STORE_DOWN;
+   }
+   if (lb_NVRAMRead(LB_AB_VARIABLE, Record, &Length))
+   {
+      return (Length == sizeof(*Record)) ? LB_STORE_OK : LB_STORE_MISSING;
+   }
+   return (lb_NVRAMOptions != NULL) ? LB_STORE_MISSING : LB_STORE_DOWN;
+}
+
+int lb_StoreWrite(const lb_ABRecord *Record)
+{
+   if (lb_NVRAMWrite == NULL || !lb_NVRAMWrite(LB_AB_VARIABLE, Record, sizeof(*Record)))
+   {
+      return 0;
+   }
+   lb_ABLast = *Record;
+   return 1;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - A/B mode:  an earlier boot left an arm pending
+// (see lb_ABResolvePending()).
+//
+/////////////////////////////////////////////////////////
+static void lb_ABResolve(lb_ABRecord *Record)
+{
+   int Arm;
+
+   if ((Arm = lb_ABResolvePending(Record)) >= 0)
+   {
+      printf(LB_DEBUGMSG_PREFIX "A/B: previous boot (arm %d) did not complete\n", Arm);
+   }
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - A/B mode:  pick this boot's arm from <Record>
+// (Thompson sampling), and put its delays into effect.
+//
+// The hook reads the delays without any locking, so a loop
+// that's working out its sleep just as they change may mix
+// the old and new values, once.  (Each arm's range is no
+// bigger than its delay, but a mix may not be;  a negative
+// sleep is taken as 0.)
+//
+/////////////////////////////////////////////////////////
+static void lb_ABChoose(const lb_ABRecord *Record)
+{
+   lb_ABArm = lb_ABPick(Record);
+   lb_ABPickLoop = lb_Counters.Loops;
+   lb_Settings.SleepValue = (unsigned long)lb_Arms[lb_ABArm].Delay;
+   lb_Settings.RandRange = lb_Arms[lb_ABArm].Range;
+   lb_Settings.AltSleepValue = lb_Arms[lb_ABArm].Delay2;
+   lb_Settings.AltRandRange = lb_Arms[lb_ABArm].Range2;
+   printf(LB_DEBUGMSG_PREFIX "A/B: using arm %d (%ld,%ld,%ld,%ld) from loop %lu on\n", lb_ABArm, lb_Arms[lb_ABArm].Delay,
+          lb_Arms[lb_ABArm].Range, lb_Arms[lb_ABArm].Delay2, lb_Arms[lb_ABArm].Range2, lb_ABPickLoop);
+   OSMemoryBarrier();
+   lb_ABStage = LB_AB_CHOSEN;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - A/B mode:  wait for NVRAM (lb_ABCall, every
+// LB_AB_POLL_MS ms from latebloom_start() on).
+//
+// Once the record can be read, pick the arm, and record it
+// as pending (if that write fails, we try it again next
+// time).  If enumeration is over before NVRAM is up, it's
+// too late for an arm to make any difference this boot.
+// If somebody else is busy with the record, we just try
+// again next time.
+//
+/////////////////////////////////////////////////////////
+static void lb_ABPoll(thread_call_param_t Param0, thread_call_param_t Param1)
+{
+   lb_ABRecord Record;
+   UInt64      Deadline;
+   int         Status;
+
+   if ((lb_ABStage == LB_AB_WAITING || lb_ABStage == LB_AB_CHOSEN) && OSCompareAndSwap(0, 1, &lb_ABBusy))
+   {
+      if ((Status = lb_ABLoad(&Record, lb_ABConfig, lb_Settings.ABArms)) != LB_STORE_DOWN)
+      {
+         if (Status == LB_STORE_OK)
+         {
+            lb_ABLast = Record;
+         }
+         lb_ABResolve(&Record);
+         if (lb_ABStage == LB_AB_WAITING)
+         {
+            lb_ABChoose(&Record);
+         }
+         Record.Pending = (UInt8)(lb_ABArm + 1);
+         if (lb_StoreWrite(&Record))
+         {
+            lb_ABStage = LB_AB_MARKED;
+         }
+      }
+      else if (latebloom_quiet_remaining() == 0)
+      {
+         printf(LB_DEBUGMSG_PREFIX "A/B: NVRAM wasn't up before enumeration was over, no arm this boot\n");
+         lb_ABStage = LB_AB_MISSED;
+      }
+      OSMemoryBarrier();
+      lb_ABBusy = 0;
+   }
+   if ((lb_ABStage == LB_AB_WAITING || lb_ABStage == LB_AB_CHOSEN) && !lb_ABClosing)
+   {
+      clock_interval_to_deadline(LB_AB_POLL_MS, kMillisecondScale, &Deadline);
+      thread_call_enter_delayed(lb_ABCall, Deadline);
+   }
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - A/B mode:  the boot completed (called from
+// AAA_LoadEarly_latebloom::LatebloomOpen()), so record this
+// boot's outcome.  Only the first open that gets the
+// record written counts.
+//
+// By now NVRAM has to be up, so a record we can't read
+// isn't there.  If no arm was picked this boot, we still
+// write the record (with any earlier pending arm counted),
+// so that the next boot finds one.
+//
+/////////////////////////////////////////////////////////
+void latebloom_ab_complete(void)
+{
+   lb_ABRecord Record;
+   long        ProbeMs = -1;
+   int         Win = 0;
+   UInt64      LastLoop;
+
+   if (lb_Settings.ABArms == 0 || lb_ABStage == LB_AB_DONE || !OSCompareAndSwap(0, 1, &lb_ABBusy))
+   {
+      return;
+   }
+   if (lb_ABStage != LB_AB_DONE)
+   {
+      lb_ABLoad(&Record, lb_ABConfig, lb_Settings.ABArms);
+      // Our own pending mark doesn't count against us;  anything else left pending does
+      if (lb_ABStage == LB_AB_MARKED && Record.Pending == lb_ABArm + 1)
+      {
+         Record.Pending = 0;
+      }
+      lb_ABResolve(&Record);
+      if (lb_ABStage == LB_AB_CHOSEN || lb_ABStage == LB_AB_MARKED)
+      {
+         // PCI probing ran from the first thread's first loop to the most recent loop of any thread
+         // (LastLoopTSC is updated on every loop, including those that go straight through)
+         LastLoop = lb_Counters.LastLoopTSC;
+         ProbeMs = (LastLoop > lb_Threads[0].FirstTSC) ? lb_TSCToMs(LastLoop - lb_Threads[0].FirstTSC) : 0;
+         Win = (lb_ABGoal == 0 || ProbeMs <= lb_ABGoal);
+         lb_ABCount(&Record.Arm[lb_ABArm], Win, ProbeMs);
+      }
+      if (lb_StoreWrite(&Record))
+      {
+         lb_ABProbeMs = ProbeMs;
+         if (lb_ABArm >= 0)
+         {
+            printf(LB_DEBUGMSG_PREFIX "A/B: arm %d %s (PCI probe took %ld ms)\n", lb_ABArm, Win ? "won" : "lost", ProbeMs);
+         }
+         OSMemoryBarrier();
+         lb_ABStage = LB_AB_DONE;
+      }
+   }
+   OSMemoryBarrier();
+   lb_ABBusy = 0;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Has PCI enumeration quiesced?  (For poll()/select()
+// on /dev/latebloom, see latebloom.cpp.)
+//
+// Returns 0 if it has, otherwise how much longer (ms) it has
+// to stay quiet before it will have - or lb_Settings.QuietMs, if it
+// hasn't started yet, or somebody's still in the hook.
+//
+/////////////////////////////////////////////////////////
+long latebloom_quiet_remaining(void)
+{
+   UInt64   Now;
+   long     Quiet;
+
+   if (lb_Quiesced)
+   {
+      return 0;
+   }
+   if (lb_Counters.Loops == 0 || lb_Counters.InHook != 0 || lb_Counters.InRegion != 0)
+   {
+      return lb_Settings.QuietMs;
+   }
+   lb_FindTSCFrequency();
+   Now = lb_ReadTSC();
+   Quiet = (Now > lb_Counters.LastLoopTSC) ? lb_TSCToMs(Now - lb_Counters.LastLoopTSC) : 0;
+   if (Quiet < lb_Settings.QuietMs)
+   {
+      return lb_Settings.QuietMs - Quiet;
+   }
+   lb_Quiesced = 1;
+   return 0;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Note that the thread has (possibly) entered a new
+// region, i.e. a probeBus() call whose frame pointer is
+// <Frame>.
+//
+// The hook runs once per probeBus() loop, so we've usually
+// seen this call before;  in that case, or if we can't track
+// it (too deeply nested, or the frame doesn't look right),
+// we return NULL.  Otherwise we take over the call's return
+// address (see latebloom_ret), and return the new region
+// (see lb_PushRegion()).
+//
+/////////////////////////////////////////////////////////
+static lb_RegionInfo *lb_EnterRegion(lb_ThreadInfo *Info, UInt64 Frame)
+{
+   lb_RegionInfo  *Region;
+   UInt64         *ReturnSlot = (UInt64 *)(Frame + 8);
+
+   if (Info->Depth != 0 && Info->Regions[Info->Depth - 1].Frame == Frame)
+   {
+      return NULL;      // Same call as last time
+   }
+   if (Frame < LB_KERNEL_SPACE || (Frame & 7) != 0 || *ReturnSlot < LB_KERNEL_SPACE)
+   {
+      return NULL;
+   }
+   if ((Region = lb_PushRegion(Info, Frame, *ReturnSlot)) == NULL)
+   {
+      return NULL;
+   }
+   *ReturnSlot = (UInt64)&latebloom_ret;
+   return Region;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Called from latebloom_ret, when a probeBus() call
+// we took over (see lb_EnterRegion()) returns.
+//
+// Returns the address probeBus() was originally going to
+// return to.
+//
+/////////////////////////////////////////////////////////
+UInt64 latebloom_region_exit(void)
+{
+   lb_ThreadInfo  *Info = lb_LookupThread(current_thread());
+   lb_RegionInfo  *Region;
+
+   if (Info == NULL || (Region = lb_PopRegion(Info)) == NULL)
+   {
+      // We have no idea where to go, so there's nothing sensible left to do
+      panic("latebloom: probeBus() returned through latebloom_ret, but we have no record of it");
+   }
+   return Region->ReturnAddress;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - The body of the hook (called from the assembly
+// language hook code below, once per probeBus() loop).
+//
+// Phase 1 handles almost all of the onboard PCI devices.  It
+// runs single-threaded, so it's all done by the first thread
+// we see (ordinal 0);  that constitutes Phase 1, and the
+// delay/range are specified by lb_Settings.SleepValue/lb_Settings.RandRange.
+// Phase 2 handles all external PCI devices, as well as the
+// Ethernet and FireWire controllers.  It runs multi-threaded,
+// so each of its threads gets a new ordinal;  those use
+// lb_Settings.AltSleepValue/lb_Settings.AltRandRange (which might match
+// lb_Settings.SleepValue/lb_Settings.RandRange, or they might be 0 - in the zero
+// case, we just return instead of calling IOSleep(0)).
+//
+// (Up through v0.22, this was all assembly language, and
+// read current_thread() directly from %gs:0x10.  That offset
+// could change in some future MacOS version;  calling
+// current_thread() (which is KPI) can't be broken that way.)
+//
+// <Frame> is probeBus()'s frame pointer (%rbp), which tells
+// us which probeBus() call we're in (see lb_EnterRegion()).
+//
+/////////////////////////////////////////////////////////
+void latebloom_hook_body(UInt64 Frame)
+{
+   thread_t       Thread = current_thread();
+   UInt64         Now = lb_ReadTSC();
+   lb_ThreadInfo  *Info;
+   lb_RegionInfo  *Region = NULL;
+   UInt32         Ordinal;
+   UInt32         Phase;
+   long           Sleep;
+   unsigned long  Loop;
+
+   Info = lb_FindThread(Thread, Now, &Ordinal);
+   Phase = (Ordinal == 0) ? 1 : 2;
+   if (Info != NULL)
+   {
+      Info->Iterations++;
+      Info->LastTSC = Now;
+   }
+   // v0.23 - Every loop counts (for quiescence and the A/B outcome), including the ones
+   // that return early below without sleeping.  Phase 2 is multithreaded, so the loop
+   // counter is now incremented atomically.
+   lb_Counters.LastLoopTSC = Now;
+   Loop = (unsigned long)OSIncrementAtomic64((volatile SInt64 *)&lb_Counters.Loops) + 1;
+
+   if (Phase == 2)
+   {
+      //
+      // 8sep21 v0.22 - once we're in Phase 2, try to create the /dev/latebloom node.
+      // Logically, we'd do this when the hook is placed.  However, at that point in the
+      // boot process, <devfs> has not yet been initialized, and calls to devfs_make_node()
+      // always fail.  Once MacOS is multi-threaded (Phase 2), <devfs> will get set up,
+      // and (hopefully) we'll succeed in creating /dev/latebloom during one of the
+      // "external" (Phase 2) PCI bus probes.  Note that it's possible for the PCI bus
+      // probes to finish quickly, or for <devfs> to initialize slowly, creating the
+      // possibility that /dev/latebloom will not be created.  There's really not much we
+      // can do about that, without jumping through a lot more hoops.
+      //
+      if (fDeviceNode == NULL)
+      {
+         fDeviceNode = devfs_make_node(fBaseDev, DEVFS_CHAR, UID_ROOT, GID_WHEEL, 0400, lbDeviceName);
+      }
+      // v0.23 - Outside of the lb_window= window, Phase 2 loops go straight through
+      // (a thread that read the TSC just before the first Phase 2 thread did counts as time 0)
+      if (lb_Settings.WindowSet)
+      {
+         UInt64 Elapsed = ((SInt64)(Now - lb_Phase2StartTSC) > 0) ? Now - lb_Phase2StartTSC : 0;
+
+         if (Elapsed < lb_Settings.WindowStartTSC || Elapsed >= lb_Settings.WindowEndTSC)
+         {
+            OSIncrementAtomic(&lb_Counters.WindowSkipped);
+            return;
+         }
+      }
+      if (Info != NULL && (lb_Settings.Phase2Mode == LB_P2_SEQUENCE || lb_Settings.Phase2Mode == LB_P2_CONCURRENCY || lb_Settings.Phase2Mode == LB_P2_BACKOFF))
+      {
+         Region = lb_EnterRegion(Info, Frame);
+      }
+      if (lb_Settings.Phase2Mode == LB_P2_SEQUENCE)
+      {
+         // v0.23 - Sequence mode:  wait (once per probeBus() call) for the previous call to finish
+         if (Region == NULL)
+         {
+            return;
+         }
+         Sleep = lb_SequencerWait(Info, Region);
+         goto Slept;
+      }
+      else if (lb_Settings.Phase2Mode == LB_P2_CONCURRENCY)
+      {
+         // v0.23 - Concurrency mode (don't count our own probeBus() call, if it's being counted)
+         Sleep = lb_ConcurrencyDelay(lb_Counters.InRegion - ((Info != NULL && Info->Depth != 0) ? 1 : 0));
+      }
+      else if (lb_Settings.Phase2Mode == LB_P2_LATCH)
+      {
+         // v0.23 - Latch mode (once the latch is released, this costs nothing)
+         Sleep = lb_LatchWait(Now);
+         goto Slept;
+      }
+      else if (lb_Settings.Phase2Mode == LB_P2_BACKOFF)
+      {
+         // v0.23 - Backoff mode (the waiting is done in slices, so skip the IOSleep() below)
+         Sleep = lb_BackoffWait((Info != NULL && Info->Depth != 0) ? 1 : 0);
+         goto Slept;
+      }
+      else if (lb_Settings.Phase2Mode == LB_P2_STAGGER)
+      {
+         // v0.23 - Stagger mode:  one delay of (Phase 2 ordinal) * lb_Settings.StaggerStep, on the first loop only
+         if ((Sleep = lb_StaggerDelay(Info, Ordinal)) == 0)
+         {
+            return;
+         }
+      }
+      else if (lb_Settings.Rate != 0)
+      {
+         Sleep = lb_RateDelay(Now);    // v0.23 - Rate mode
+      }
+      else if (lb_Settings.AltSleepValue == 0)
+      {
+         return;     // if lb_Settings.AltSleepValue == 0, do nothing in Phase 2
+      }
+      else
+      {
+         Sleep = lb_Settings.AltSleepValue + lb_RandomOffset(lb_Settings.AltRandRange);
+      }
+   }
+   else if (lb_Settings.Rate != 0)
+   {
+      Sleep = lb_RateDelay(Now);       // v0.23 - Rate mode
+   }
+   else
+   {
+      Sleep = (long)lb_Settings.SleepValue + lb_RandomOffset(lb_Settings.RandRange);
+   }
+   if (Sleep < 0)
+   {
+      Sleep = 0;
+   }
+
+   if (Sleep != 0)                  // (v0.23 - no point in calling IOSleep(0))
+   {
+      lb_Sleep((unsigned int)Sleep);   // Take a nap (v0.23 - corrected for oversleeping, with lb_selftest=)
+   }
+
+Slept:
+   lb_Counters.LastLoopTSC = lb_ReadTSC();     // v0.23 - (quiet time counts from the end of the sleep)
+   if (lb_Settings.DebugLevel & 1)
+   {
+      // Mask off current_thread() (avoid redacted "<ptr>" output)
+      printf(HookMessage, Loop, (Phase == 1) ? HookMessagePhase1 : HookMessagePhase2, Ordinal, Sleep,
+             (unsigned long)((unsigned long long)Thread & 0xffffffff));
+   }
+}
+
+///////////////////////////////////////////////
+//
+// The hook code (outside of any C routine)
+//
+///////////////////////////////////////////////
+asm (
+   // The "_latebloom_fake: / callq ... / _latebloom_hook:" lines below allow us to calculate
+   // the absolute address of IOPCIBridge::probeBus, since its symbol->address mapping
+   // may not be readily available to us.  (v0.23 - KextSymbolLookup() can usually find it
+   // in IOPCIFamily's symbol table;  this is now the fallback.)
+   // Modifying those three lines will break the kext.  Just leave them alone.
+   "_latebloom_fake:                         \n"
+   "  callq    __ZN11IOPCIBridge8probeBusEP9IOServiceh   \n"   // IOPCIBridge::probeBus(IOService *provider, UInt8 busNum), with C++ mangling
+   "_latebloom_hook:                         \n"
+   "  lock                                   \n"   // v0.23 - keep track of how many threads are in here, so that
+   "  incl     _lb_Counters(%rip)            \n"   // latebloom_stop() knows when it's safe to unload
+   "  pushq    %rdi                          \n"   // Save all the registers.  We could probably prune this list a little bit,
+   "  pushq    %rsi                          \n"   // but since we're *trying* to introduce delays, a few extra clock
+   "  pushq    %rcx                          \n"   // cycles isn't going to hurt anything, and it gives us the freedom to
+   "  pushq    %rbx                          \n"   // use whatever registers we might need inside the hook code.
+   "  pushq    %rdx                          \n"
+   "  pushq    %rax                          \n"
+   "  pushq    %r15                          \n"
+   "  pushq    %r14                          \n"
+   "  pushq    %r13                          \n"
+   "  pushq    %r12                          \n"
+   "  pushq    %r11                          \n"
+   "  pushq    %r10                          \n"
+   "  pushq    %r9                           \n"
+   "  pushq    %r8                           \n"
+   //
+   // v0.23 - Everything the hook does is now in latebloom_hook_body() (above).  We can't
+   // be sure what the stack alignment is in the middle of probeBus(), so we align it to 16
+   // bytes for the call (and undo that afterward, using %rbx, which the C code preserves).
+   //
+   "  movq     %rsp,%rbx                     \n"
+   "  andq     $-16,%rsp                     \n"
+   "  movq     %rbp,%rdi                     \n"   // Argument 0: probeBus()'s frame pointer
+   "  callq    _latebloom_hook_body          \n"
+   "  movq     %rbx,%rsp                     \n"
+   "  popq     %r8                           \n"   // We're done - pop all the registers we pushed
+   "  popq     %r9                           \n"
+   "  popq     %r10                          \n"
+   "  popq     %r11                          \n"
+   "  popq     %r12                          \n"
+   "  popq     %r13                          \n"
+   "  popq     %r14                          \n"
+   "  popq     %r15                          \n"
+   "  popq     %rax                          \n"
+   "  popq     %rdx                          \n"
+   "  popq     %rbx                          \n"
+   "  popq     %rcx                          \n"
+   "  popq     %rsi                          \n"
+   "  popq     %rdi                          \n"
+   "  lock                                   \n"   // v0.23 - leaving the hook (the exit stub below is only a few
+   "  decl     _lb_Counters(%rip)            \n"   // instructions, see latebloom_stop())
+   // Reproduce the original code before jumping back in (kernel version-dependent)
+   "_lb_hook_exit:                           \n"
+   "  .byte 0x90, 0x90, 0x90, 0x90           \n"   // Here we need enough NOPs to exceed the size of our largest BytePattern.
+   "  .byte 0x90, 0x90, 0x90, 0x90           \n"   // (We will copy the original code bytes into this NOP section
+   "  .byte 0x90, 0x90, 0x90, 0x90           \n"   // so that the actions of the original code path are preserved.)
+   "  .byte 0x90, 0x90, 0x90, 0x90           \n"   // NEED A MINIMUM OF 14 NOPS HERE;  more allows us flexibility
+   "  .byte 0x90, 0x90, 0x90, 0x90           \n"   // (to be forgetful about counting) when adding new patterns.
+   "  jmpq     *_lb_jump_address(%rip)       \n"   // Jump into the original code, just past our "jump to hook" patch
+);
+
+///////////////////////////////////////////////
+//
+// v0.23 - probeBus() return trampoline.
+//
+// lb_EnterRegion() points the return address of a
+// probeBus() call at latebloom_ret, so this is where
+// that call "returns" to.  latebloom_region_exit() does
+// the bookkeeping and hands back the real return
+// address, which we put in the slot we reserved on the
+// stack, then return through it.  probeBus()'s return
+// value (%rax/%rdx) and the callee-saved registers are
+// preserved;  we save the rest too, just to be safe.
+//
+///////////////////////////////////////////////
+asm (
+   "_latebloom_ret:                          \n"
+   "  pushq    $0                            \n"   // Reserve a slot for the real return address
+   "  lock                                   \n"   // We're in our own code again (see latebloom_stop())
+   "  incl     _lb_Counters(%rip)            \n"
+   "  pushq    %rbx                          \n"
+   "  pushq    %rax                          \n"
+   "  pushq    %rdx                          \n"
+   "  pushq    %rcx                          \n"
+   "  pushq    %rsi                          \n"
+   "  pushq    %rdi                          \n"
+   "  pushq    %r8                           \n"
+   "  pushq    %r9                           \n"
+   "  pushq    %r10                          \n"
+   "  pushq    %r11                          \n"
+   "  movq     %rsp,%rbx                     \n"   // Align the stack for the call (as in the hook code)
+   "  andq     $-16,%rsp                     \n"
+   "  callq    _latebloom_region_exit        \n"
+   "  movq     %rbx,%rsp                     \n"
+   "  movq     %rax,80(%rsp)                 \n"   // Fill in the slot we reserved (10 registers up)
+   "  popq     %r11                          \n"
+   "  popq     %r10                          \n"
+   "  popq     %r9                           \n"
+   "  popq     %r8                           \n"
+   "  popq     %rdi                          \n"
+   "  popq     %rsi                          \n"
+   "  popq     %rcx                          \n"
+   "  popq     %rdx                          \n"
+   "  popq     %rax                          \n"
+   "  popq     %rbx                          \n"
+   "  lock                                   \n"
+   "  decl     _lb_Counters(%rip)            \n"
+   "  retq                                   \n"   // Return to probeBus()'s caller
+);
+
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Build a 64-bit long jump to <Target> in <Bytes>
+// (LONG_JUMP_SIZE bytes).
+//
+// Note that we can't rely on the IOPCIFamily.kext being within +/- 2GB of our kext, so
+// we need to do a 64-bit long jump.  Since we don't control the registers at that point,
+// we can't load a register with our address and do an indirect jump without trashing the
+// register;  alternatively, pushing a register, loading it with an Imm64 address, then
+// jumping indirectly through it takes a minimum of 15 bytes.
+// Instead, we can leverage the RIP-relative mechanism and jump indirectly through a
+// 64-bit memory location;  by using an offset of 0 and immediately following that with
+// our 64-bit target address, we can always jump anywhere in exactly 14 bytes - and not
+// modify any registers (other than RIP) in the process.
+//
+/////////////////////////////////////////////////////////
+static void lb_LongJump(unsigned char *Bytes, unsigned long long Target)
+{
+   Bytes[0] = 0xff;                                         // <ff 25 00 00 00 00> is "jmp *(%rip)"
+   Bytes[1] = 0x25;
+   memset(&Bytes[2], 0, 4);
+   memcpy(&Bytes[6], &Target, sizeof(Target));              // followed by our 64-bit target address
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Place a long jump island near lb_HookSite.
+//
+// The 14-byte long jump is what forces the hook site to
+// be 14 bytes of relocatable code.  If we can find some
+// unused space in IOPCIFamily's own code segment (see
+// KextCodeCave()), within reach of a 5-byte jmp rel32
+// from the hook site, we put the long jump there instead,
+// and the hook site only needs a short jump to it.
+//
+// Nothing jumps to the island until latebloom_arm() points
+// the hook site at it, so it's simply left in place until
+// latebloom_stop() rolls back the whole journal.
+//
+// Returns non-zero if the island is in place (lb_Island).
+//
+/////////////////////////////////////////////////////////
+static int lb_PlaceIsland(void)
+{
+   unsigned char        JumpBytes[LONG_JUMP_SIZE];
+   unsigned long long   Island;
+   long long            Distance;
+   int                  result;
+
+   if (lb_Island != 0)
+   {
+      return 1;
+   }
+   if ((Island = KextCodeCave(lb_HookSite, LONG_JUMP_SIZE, ISLAND_ALIGN)) == 0)
+   {
+      return 0;
+   }
+   Distance = (long long)Island - (long long)(lb_HookSite + SHORT_JUMP_SIZE);
+   if (Distance != (int32_t)Distance)                       // out of rel32 range
+   {
+      return 0;
+   }
+   lb_LongJump(JumpBytes, (unsigned long long)&latebloom_hook);
+   if ((result = JournalPatch((void *)Island, JumpBytes, LONG_JUMP_SIZE, &lb_IslandJournal)) != KPATCH_OK)
+   {
+      printf(LB_DEBUGMSG_PREFIX "Unable to write island at 0x%llx (error %d), using a long jump\n", Island, result);
+      return 0;
+   }
+   lb_Island = Island;
+   return 1;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Place the jump to our hook at lb_HookSite.
+//
+// The hook site must already have been found (and the exit
+// stub filled in) by latebloom_start().  TextPoke() publishes
+// the jump in a cross-CPU-safe order, but that only helps a
+// CPU that is about to execute the patched bytes, not one
+// stopped in the middle of them:  the 14-byte long jump covers
+// three of the pattern's instructions, so a thread preempted
+// at HookSite+8 or +11 would resume inside the jump's target
+// address.  So the long jump is only ever armed the first
+// time, while latebloom_start() is still single-threaded;
+// re-arming later is only allowed through the island, whose
+// 5-byte jump replaces a single instruction.
+//
+// Returns KPATCH_OK if the hook is (now) armed, or one of
+// the KPATCH_* error codes (KPATCH_UNSAFE if this would
+// re-arm the long jump).
+//
+/////////////////////////////////////////////////////////
+int latebloom_arm(void)
+{
+   unsigned char        JumpBytes[LONG_JUMP_SIZE];
+   long long            Offset;
+   int                  result;
+
+   if (lb_HookSite == 0)
+   {
+      return KPATCH_BAD_ARGS;
+   }
+   if (lb_HookArmed)
+   {
+      return KPATCH_OK;
+   }
+   if (lb_Island == 0 && lb_HookJournal >= 0)
+   {
+      return KPATCH_UNSAFE;
+   }
+   // v0.23 - Convert the Phase 2 window (if any) to TSC ticks, so the hook doesn't have to
+   if (lb_Settings.WindowSet)
+   {
+      lb_FindTSCFrequency();
+      lb_Settings.WindowStartTSC = lb_MsToTSC(lb_WindowStart);
+      lb_Settings.WindowEndTSC = (lb_WindowEnd != 0) ? lb_MsToTSC(lb_WindowEnd) : ~0ULL;
+   }
+   if (lb_Island != 0)
+   {
+      // v0.23 - a short jump to the island, which takes it from there
+      Offset = (long long)lb_Island - (long long)(lb_HookSite + SHORT_JUMP_SIZE);
+      JumpBytes[0] = 0xe9;                                  // <e9 xx xx xx xx> is "jmp rel32"
+      memcpy(&JumpBytes[1], &Offset, 4);                    // (little-endian, so the low 4 bytes)
+      result = JournalPatch((void *)lb_HookSite, JumpBytes, SHORT_JUMP_SIZE, &lb_HookJournal);
+   }
+   else
+   {
+      lb_LongJump(JumpBytes, (unsigned long long)&latebloom_hook);
+      result = JournalPatch((void *)lb_HookSite, JumpBytes, LONG_JUMP_SIZE, &lb_HookJournal);
+   }
+   if (result == KPATCH_OK)
+   {
+      lb_HookArmed = 1;
+   }
+   return result;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Put the original code back at lb_HookSite
+// (using the bytes recorded in the patch journal, not the
+// BytePattern we searched for).
+//
+// Threads that are already inside our hook will still
+// finish normally (the exit stub and lb_jump_address are
+// left intact), and nothing can be stopped inside the jump
+// (only at its first byte), so unlike latebloom_arm() this
+// can be called at any time.  latebloom_stop() uses it to
+// cut off new entries before it waits for the hook to drain.
+//
+// Returns KPATCH_OK if the hook is (now) disarmed, or one
+// of the KPATCH_* error codes.
+//
+/////////////////////////////////////////////////////////
+int latebloom_disarm(void)
+{
+   int result;
+
+   if (!lb_HookArmed)
+   {
+      return KPATCH_OK;
+   }
+   result = JournalRollback(lb_HookJournal);
+   if (result == KPATCH_OK)
+   {
+      lb_HookArmed = 0;
+   }
+   return result;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Describe an address as text, with the symbol it
+// belongs to (if we can find one), e.g.
+//    0xffffff7f8a2c41d3 (com.apple.iokit.IOPCIFamily`__ZN11IOPCIBridge8probeBusEP9IOServiceh+0x1a3)
+//
+/////////////////////////////////////////////////////////
+void latebloom_describe(unsigned long long Address, char *Buffer, size_t Size)
+{
+   const char  *Name = NULL;
+   const char  *Image = NULL;
+   uint64_t    Offset = 0;
+
+   int         i;
+
+   // (the addresses we described before freeing the lookup tables don't need them)
+   for (i = 0; i < LB_DESCRIBED; ++i)
+   {
+      if (Address != 0 && lb_Described[i].Address == Address)
+      {
+         Name = lb_Described[i].Name;
+         Image = lb_Described[i].Image;
+         Offset = lb_Described[i].Offset;
+         break;
+      }
+   }
+   if (Address != 0 && i == LB_DESCRIBED)
+   {
+      Name = SymbolForAddress((void *)Address, &Offset, &Image);
+   }
+   if (Name != NULL)
+   {
+      snprintf(Buffer, Size, "0x%016llx (%s`%s+0x%llx)", Address, (Image != NULL) ? Image : "?", Name, Offset);
+   }
+   else
+   {
+      snprintf(Buffer, Size, "0x%016llx", Address);
+   }
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Return one of the addresses we care about (for
+// AAA_LoadEarly_latebloom::start(), which can't see our
+// static variables).
+//
+/////////////////////////////////////////////////////////
+unsigned long long latebloom_address(int Which)
+{
+   switch (Which)
+   {
+      case LB_ADDRESS_PROBEBUS:     return ProbeAddress;
+      case LB_ADDRESS_HOOK_SITE:    return lb_HookSite;
+      case LB_ADDRESS_HOOK_RETURN:  return lb_jump_address;
+   }
+   return 0;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Format latebloom's status (for /dev/latebloom).
+//
+// Returns the number of characters placed in <Buffer> (not
+// counting the terminating NUL).
+//
+/////////////////////////////////////////////////////////
+int latebloom_status(char *Buffer, size_t Size)
+{
+   size_t   Length = 0;
+   char     Description[DESCRIBE_BUFFER_SIZE];
+   int      i;
+
+   if (Size == 0)
+   {
+      return 0;
+   }
+   Buffer[0] = '\0';
+   STATUS_PRINTF("latebloom v0.23\n")
+   STATUS_PRINTF("hook: %s, pattern %lu\n", lb_HookArmed ? "armed" : "disarmed", WhichPattern)
+   latebloom_describe(ProbeAddress, Description, sizeof(Description));
+   STATUS_PRINTF("   probeBus: %s\n", Description)
+   latebloom_describe(lb_HookSite, Description, sizeof(Description));
+   STATUS_PRINTF("   site:     %s\n", Description)
+   latebloom_describe(lb_jump_address, Description, sizeof(Description));
+   STATUS_PRINTF("   return:   %s\n", Description)
+   if (lb_Island != 0)
+   {
+      latebloom_describe(lb_Island, Description, sizeof(Description));
+      STATUS_PRINTF("   island:   %s (%lu bytes displaced)\n", Description, lb_HookSize)
+   }
+   STATUS_PRINTF("config: delay %lu range %ld debug %ld delay2 %ld range2 %ld stagger %ld sequence %ld conc %ld,%ld,%ld backoff %ld,%ld\n",
+                 lb_Settings.SleepValue, lb_Settings.RandRange, lb_Settings.DebugLevel, lb_Settings.AltSleepValue, lb_Settings.AltRandRange, lb_Settings.StaggerStep, lb_Settings.SequenceTimeout,
+                 lb_Settings.ConcurrencyStep, lb_Settings.ConcurrencyExponent, lb_Settings.ConcurrencyCap, lb_Settings.BackoffCap, lb_Settings.BackoffSlice)
+   STATUS_PRINTF("loops: %lu, threads in hook: %d, in probeBus(): %d\n", lb_Counters.Loops, lb_Counters.InHook, (int)lb_Counters.InRegion)
+   if (latebloom_quiet_remaining() == 0)
+   {
+      STATUS_PRINTF("enumeration: quiesced (no loops for %ld ms), last loop %llu ms after latebloom started\n", lb_Settings.QuietMs,
+                    lb_TSCToUs(lb_Counters.LastLoopTSC - lb_StartTSC[LB_STAGE_ENTRY]) / 1000)
+   }
+   else
+   {
+      STATUS_PRINTF("enumeration: in progress (quiesces after %ld ms without loops)\n", lb_Settings.QuietMs)
+   }
+   if (lb_Settings.Phase2Mode == LB_P2_LATCH)
+   {
+      STATUS_PRINTF("latch: %s '%s', timeout %ld ms, %s\n", lb_LatchByName ? "device" : "class", lb_LatchMatch, lb_Settings.LatchTimeout,
+                    !lb_LatchOpen ? "closed" : lb_LatchTimedOut ? "timed out" : "released")
+   }
+   if (lb_Settings.ABArms != 0)
+   {
+      if (lb_ABArm >= 0)
+      {
+         STATUS_PRINTF("a/b: arm %d of %d, goal %ld ms, picked after %lu loops, %s", lb_ABArm, lb_Settings.ABArms, lb_ABGoal, lb_ABPickLoop,
+                       (lb_ABStage == LB_AB_DONE) ? "outcome recorded" : (lb_ABStage == LB_AB_MARKED) ? "pending" : "not recorded")
+      }
+      else
+      {
+         STATUS_PRINTF("a/b: no arm of %d, goal %ld ms, %s", lb_Settings.ABArms, lb_ABGoal,
+                       (lb_ABStage == LB_AB_WAITING) ? "waiting for NVRAM" : "none this boot (NVRAM came up too late)")
+      }
+      if (lb_ABProbeMs >= 0)
+      {
+         STATUS_PRINTF(" (PCI probe %ld ms)", lb_ABProbeMs)
+      }
+      STATUS_PRINTF("\n")
+      for (i = 0; i < lb_Settings.ABArms; ++i)
+      {
+         STATUS_PRINTF("   arm %d: %ld,%ld,%ld,%ld  wins %u  losses %u  average %u ms\n", i, lb_Arms[i].Delay, lb_Arms[i].Range,
+                       lb_Arms[i].Delay2, lb_Arms[i].Range2, lb_ABLast.Arm[i].Wins, lb_ABLast.Arm[i].Losses,
+                       (lb_ABLast.Arm[i].Boots != 0) ? lb_ABLast.Arm[i].TotalMs / lb_ABLast.Arm[i].Boots : 0)
+      }
+   }
+   if (lb_Settings.WindowSet)
+   {
+      STATUS_PRINTF("window: %ld-%ld ms after Phase 2 starts, %d loops outside\n", lb_WindowStart, lb_WindowEnd, (int)lb_Counters.WindowSkipped)
+   }
+   if (lb_Settings.Rate != 0)
+   {
+      STATUS_PRINTF("rate: %ld/s, burst %ld, interval %llu TSC, throttled %d\n",
+                    lb_Settings.Rate, lb_Settings.RateBurst, lb_Settings.RateInterval, (int)lb_Counters.RateThrottled)
+   }
+   if (lb_Settings.Phase2Mode == LB_P2_SEQUENCE)
+   {
+      STATUS_PRINTF("sequencer: timeout %ld ms, next ticket %u, now serving %u, timeouts %d\n",
+                    lb_Settings.SequenceTimeout, lb_Counters.NextTicket, lb_Counters.NowServing, (int)lb_Counters.SequenceTimeouts)
+   }
+   // v0.23 - latebloom_start()'s own cost, stage by stage
+   if (lb_ScanBytes != 0)
+   {
+      unsigned long long Us = lb_TSCToUs(lb_ScanTicks);
+
+      STATUS_PRINTF("scan: %llu bytes of __text in %llu us (%llu MB/s), %u candidates, %u matches\n", lb_ScanBytes, Us,
+                    (Us != 0) ? lb_ScanBytes / Us : 0, lb_ScanCandidates, lb_ScanMatches)
+      for (i = 0; i < (int)lb_ScanMatches && i < LB_SCAN_SITES; ++i)
+      {
+         STATUS_PRINTF("   __text+0x%llx: pattern %lu%s\n", lb_ScanSites[i] - lb_ScanBase, lb_ScanPatterns[i],
+                       (lb_ScanSites[i] == lb_HookSite) ? " (hook site)" : "")
+      }
+   }
+   if (lb_Calibrated)
+   {
+      STATUS_PRINTF("self-test: %ld rounds;  IOSleep", lb_SelfTest)
+      for (i = 0; i < (int)LB_CAL_SLEEPS; ++i)
+      {
+         STATUS_PRINTF("%s %u ms %u us (worst %u)", i ? "," : "", lb_CalSleepMs[i], lb_SleepUs[i], lb_SleepWorstUs[i])
+      }
+      STATUS_PRINTF(";  IODelay")
+      for (i = 0; i < (int)LB_CAL_DELAYS; ++i)
+      {
+         STATUS_PRINTF("%s %u us %u us", i ? "," : "", lb_CalDelayUs[i], lb_DelayUs[i])
+      }
+      STATUS_PRINTF("\n   corrected sleeps:  asked for %llu ms, slept %llu ms\n", lb_Counters.SleepAskedUs / 1000, lb_Counters.SleepGotUs / 1000)
+   }
+   STATUS_PRINTF("start: TSC %llu Hz;", lb_Settings.TSCFrequency)
+   for (i = 1; i < LB_STAGE_COUNT && lb_StartTSC[i] != 0; ++i)
+   {
+      STATUS_PRINTF("%s %s %llu us", (i > 1) ? "," : "", lb_StageNames[i], lb_TSCToUs(lb_StartTSC[i] - lb_StartTSC[i - 1]))
+   }
+   if (i > 1)
+   {
+      STATUS_PRINTF(";  total %llu us", lb_TSCToUs(lb_StartTSC[i - 1] - lb_StartTSC[LB_STAGE_ENTRY]))
+   }
+   STATUS_PRINTF("\n")
+   STATUS_PRINTF("memory: lookup tables %lu bytes at start, %lu now%s;  arena %lu of %u bytes used\n",
+                 (unsigned long)(lb_LookupReleased ? lb_LookupPeak : KLookupFootprint()), (unsigned long)KLookupFootprint(),
+                 lb_LookupReleased ? " (freed after start)" : "", (unsigned long)lb_ArenaUsed, LB_ARENA_SIZE)
+   STATUS_PRINTF("threads: %d seen (table %u)", (int)lb_Counters.ThreadCount, lb_Settings.MaxThreads)
+   if (lb_Phase2StartTSC != 0)
+   {
+      STATUS_PRINTF(", Phase 2 started at loop %lu (TSC %llu)\n", lb_Phase2StartLoop, lb_Phase2StartTSC)
+   }
+   else
+   {
+      STATUS_PRINTF(", Phase 2 not started\n")
+   }
+   for (i = 0; i < lb_Counters.ThreadCount && i < lb_Settings.MaxThreads; ++i)
+   {
+      if (lb_Threads[i].Thread != NULL)
+      {
+         STATUS_PRINTF("   #%-2u phase %u  loops %-4u  first TSC %llu  last TSC %llu\n", lb_Threads[i].Ordinal,
+                       lb_Threads[i].Phase, lb_Threads[i].Iterations, lb_Threads[i].FirstTSC, lb_Threads[i].LastTSC)
+      }
+   }
+   if (Length < Size)
+   {
+      Length += JournalFormat(&Buffer[Length], Size - Length);
+   }
+   return (int)((Length < Size) ? Length : Size - 1);
+}
+
+/////////////////////////////////////////////////////////
 //
-// The hook code (outside of any C routine)
+// v0.23 - This is called when latebloom is unloaded.
 //
-///////////////////////////////////////////////
-asm (
-   // The "_latebloom_fake: / callq ... / _latebloom_hook:" lines below allow us to calculate
-   // the absolute address of IOPCIBridge::probeBus, since its symbol->address mapping
-   // may not be readily available to us.
-   // Modifying those three lines will break the kext.  Just leave them alone.
-   "_latebloom_fake:                         \n"
-   "  callq    __ZN11IOPCIBridge8probeBusEP9IOServiceh   \n"   // IOPCIBridge::probeBus(IOService *provider, UInt8 busNum), with C++ mangling
-   "_latebloom_hook:                         \n"
-   "  pushq    %rdi                          \n"   // Save all the registers.  We could probably prune this list a little bit,
-   "  pushq    %rsi                          \n"   // but since we're *trying* to introduce delays, a few extra clock
-   "  pushq    %rcx                          \n"   // cycles isn't going to hurt anything, and it gives us the freedom to
-   "  pushq    %rbx                          \n"   // use whatever registers we might need inside the hook code.
-   "  pushq    %rdx                          \n"
-   "  pushq    %rax                          \n"
-   "  pushq    %r15                          \n"
-   "  pushq    %r14                          \n"
-   "  pushq    %r13                          \n"
-   "  pushq    %r12                          \n"
-   "  pushq    %r11                          \n"
-   "  pushq    %r10                          \n"
-   "  pushq    %r9                           \n"
-   "  pushq    %r8                           \n"
-   //
-   // See if we're in Phase 1 or Phase 2.
-   // Phase 1 handles almost all of the onboard PCI devices.  It runs single-threaded,
-   // meaning that current_thread() doesn't change from loop to loop.
-   // Phase 2 handles all external PCI devices, as well as the Ethernet controllers and
-   // FireWire controller.  It runs multi-threaded, so each of those threads will
-   // have a different current_thread() value.
-   // The first time through, our copy of CurrentThread is 0, so we just save current_thread()
-   // to it.  From there, every iteration compares its current_thread() to CurrentThread.  The
-   // first 55ish loops should match;  that constitutes Phase 1, and the delay/range are
-   // specified by the original SleepValue/lb_RandRange.
-   // If current_thread() doesn't match CurrentThread, we're in Phase 2, and we start using
-   // lb_AltSleepValue/lb_AltRandRange (which might match SleepValue/lb_RandRange, or they
-   // might be 0 - in the zero case, we just exit the loop instead of calling IOSleep(0).)
-   //
-   // (Note: We *could* do a symbol lookup on _current_thread() and call it each time through
-   // the loop, but for simplicity, we just directly access it at %gs:0x10.  The obvious
-   // downside to this is that the direct offset could change in some future MacOS version,
-   // breaking latebloom in the process.  The upside to this is that we can load/compare
-   // %gs:0x10 to any register we want, not having to dance around %rax (the return register
-   // from _current_thread()).  Since the _current_thread() offset seems to be relatively
-   // stable, we'll take our chances with it.)
-   //
-   // See if we've set CurrentThread yet
-   "  movq     _CurrentThread(%rip),%rax     \n"
-   "  testq    %rax,%rax                     \n"
-   "  jnz      CTloaded                      \n"
-   "  movq     %gs:0x10,%rax                 \n"
-   "  movq     %rax,_CurrentThread(%rip)     \n"
-   "CTloaded:                                \n"
-   // At this point, %rax contains our copy of CurrentThread.
-   "  cmpq     %gs:0x10,%rax                 \n"   // Have we gone multithreaded (entered Phase 2) yet?
-   "  jz       LB_Phase1                     \n"   // current_thread() == CurrentThread, so we're in Phase 1
-   // Phase 2 (external buses)
-   //
-   // 8sep21 v0.22 - once we're in Phase 2, try to create the /dev/latebloom node.
-   // Logically, we'd do this when the hook is placed.  However, at that point in the
-   // boot process, <devfs> has not yet been initialized, and calls to devfs_make_node()
-   // always fail.  Once MacOS is multi-threaded (Phase 2), <devfs> will get set up,
-   // and (hopefully) we'll succeed in creating /dev/latebloom during one of the
-   // "external" (Phase 2) PCI bus probes.  Note that it's possible for the PCI bus
-   // probes to finish quickly, or for <devfs> to initialize slowly, creating the
-   // possibility that /dev/latebloom will not be created.  There's really not much we
-   // can do about that, without jumping through a lot more hoops.
-   //
-   "  cmpq     $0,_fDeviceNode(%rip)         \n"   // if node is non-NULL, stop trying to create it
-   "  jnz      LB_DeviceNodeMade             \n"
-   "  xorl     %eax,%eax                     \n"
-   "  movl     _fBaseDev(%rip),%edi          \n"   // arg1: Device ID
-   "  movl     %eax,%esi                     \n"   // arg2: DEVFS_CHAR (::= 0)
-   "  movl     %eax,%edx                     \n"   // arg3: UID_ROOT (::= 0)
-   "  movl     %eax,%ecx                     \n"   // arg4: GID_WHEEL (::= 0)
-   "  movl     $0x100,%r8d                   \n"   // arg5: Permissions (::= 0400)
-   "  leaq     _lbDeviceName(%rip),%r9       \n"   // arg6: DeviceName (::= "latebloom")
-   "  callq    _devfs_make_node              \n"   // devfs_make_node(fBaseDev, DEVFS_CHAR, UID_ROOT, GID_WHEEL, 0400, "latebloom")
-   "  movq     %rax,_fDeviceNode(%rip)       \n"   // save the result (NULL if it failed)
-   "LB_DeviceNodeMade:                       \n"
-   // end 8sep21 v0.22
-   "  movl     _lb_AltSleepValue(%rip),%edi  \n"   // Calculate Phase 2 sleep value
-   "  testl    %edi,%edi                     \n"
-   "  jz       NoDebugOutput                 \n"   // if lb_AltSleepValue == 0, do nothing in Phase 2
-   // If "lb_range2=" was not set, just use lb_AltSleepValue
-   "  cmpl     $0,_lb_AltRandRange(%rip)     \n"
-   "  jz       LB_DoSleep                    \n"
-   //
-   // We don't need strong randomization here, no particular distribution, just something
-   // that's reasonably unpredictable.  We can do that cheaply using the RDTSC instruction.
-   // RDTSC reads the TimeStamp Counter, which is a count of clock cycles since the CPU was
-   // last reset.  For our purposes, it's more than random enough.  All we need to do is
-   // constrain the values to our needs.
-   // RDTSC reads the TSC into EDX:EAX.  For our purposes here, we only care about the low
-   // 32 bits of that result (the most rapidly-changing part), which is in EAX.
-   //
-   "  rdtsc                                  \n"   // Result is in EDX:EAX
-   "  xorl     %edx,%edx                     \n"   // We only care about the low 32 bits
-   "  divl     _lb_AltRandRange(%rip)        \n"   // Result: EDX contains (random# % lb_AltRandRange)
-   "  jmp      CTcontinue                    \n"   // Jump back to the common Phase1/Phase2 code
-   // Calculate Phase 1 (Onboard bus) sleep value
-   "LB_Phase1:                               \n"
-   "  movl     _SleepValue(%rip),%edi        \n"   // Calculate the Phase 1 sleep value
-   // If "lb_range=" was set, choose a random interval within the range
-   "  cmpl     $0,_lb_RandRange(%rip)        \n"
-   "  jz       LB_DoSleep                    \n"   // If effective range was 0, just sleep
-   "  rdtsc                                  \n"   // Result is in EDX:EAX
-   "  xorl     %edx,%edx                     \n"   // We only care about the low 32 bits
-   "  divl     _lb_RandRange(%rip)           \n"   // Result: EDX contains (random# % lb_RandRange)
-   // Phase 1 and Phase 2 code converges here
-   "CTcontinue:                              \n"
-   "  movl     %edx,%ebx                     \n"   // Preserve our (random# % RandRange) value (RDTSC modifies EDX)
-   // %ebx now contains (rand() % lb_RandRange)
-   "  rdtsc                                  \n"   // EAX contains low 32 bits of pseudo-random number
-   "  movl     %ebx,%edx                     \n"   // Create the negative version of our value in EDX
-   "  negl     %edx                          \n"
-   "  testl    $0x01,%eax                    \n"   // Randomly add or subtract the range-bound random offset
-   "  cmovnel  %edx,%ebx                     \n"
-   "  addl     %ebx,%edi                     \n"
-   // Back to common code
-   "LB_DoSleep:                              \n"
-   "  pushq    %rdi                          \n"   // Save our sleep value for later display
-   "  callq    _IOSleep                      \n"   // Take a nap
+// Take the jump out of the hook site (verifying that the
+// original bytes are back in place), then wait for any threads
+// still executing our hook code to leave.  Only once they have
+// do we roll back the island and the rest of the journal, and
+// stop listening for the latch.  If the hook can't be disarmed,
+// or doesn't drain, refuse to unload;  freeing our code while
+// IOPCIBridge::probeBus() can still reach it would be fatal.
+// (After a failed drain the hook is re-armed if it safely can
+// be (see latebloom_arm()), so a refused unload doesn't quietly
+// leave latebloom loaded but doing nothing.)
+//
+/////////////////////////////////////////////////////////
+kern_return_t latebloom_stop(kmod_info_t *ki, void *d)
+{
+   int result;
+   int i;
+
+   if ((result = latebloom_disarm()) != KPATCH_OK)
+   {
+      printf(LB_DEBUGMSG_PREFIX "Unable to roll back hook (error %d), refusing to unload.\n", result);
+      return KERN_FAILURE;
+   }
+   // v0.23 - Don't leave anybody waiting on the latch while we drain
+   latebloom_latch_release();
    //
-   // Note that if the loop counter were mission-critical, we'd need to use a lock, or
-   // call OSAddAtomic, or otherwise protect against races during Phase 2 (multithreaded).
-   // Since this counter is only used for display purposes, we don't really care if it's
-   // perfectly accurate - at least, we don't care enough to bother enforcing atomicity.
-   // Similarly, lb_LastSleep would also require some attention if accuracy was essential.
+   // v0.23 - Threads inside a probeBus() call whose return address we took over (lb_Counters.InRegion)
+   // will come back through latebloom_ret, so they count as being in our code, too.
    //
-   "  incl     _lb_PCI_counter(%rip)         \n"   // Increment the loop counter
-   "  testl    $1,_lb_DebugLevel(%rip)       \n"   // If debug is enabled, print the updated counter
-   "  popq     %rcx                          \n"   // Argument 3: value of this loop's sleep (align stack before possible jump)
-   "  jz       NoDebugOutput                 \n"
-   // The SysV ABI passes the first six arguments in RDI, RSI, RDX, RCX, R8, and R9.
-   "  leaq     _HookMessage(%rip),%rdi       \n"   // Argument 0: the printf() format string
-   "  leaq     _HookMessagePhase2(%rip),%rsi \n"   // Argument 2: either "ONBOARD" or "EXTERNAL"
-   "  leaq     _HookMessagePhase1(%rip),%rdx \n"
-   "  movq     %gs:0x10,%r8                  \n"   // Argument 5: current_thread()
-   "  cmpq     _CurrentThread(%rip),%r8      \n"
-   "  cmovne   %rsi,%rdx                     \n"   // If current_thread() != starting thread, use "EXTERNAL"
-   "  andl     $0xffffffff,%r8d              \n"   // Mask off current_thread() (avoid redacted "<ptr>" output)
-   "  movl     _lb_PCI_counter(%rip),%esi    \n"   // Argument 1: loop counter
-   "  callq    _printf                       \n"
-   "NoDebugOutput:                           \n"
-   "  popq     %r8                           \n"   // We're done - pop all the registers we pushed
-   "  popq     %r9                           \n"
-   "  popq     %r10                          \n"
-   "  popq     %r11                          \n"
-   "  popq     %r12                          \n"
-   "  popq     %r13                          \n"
-   "  popq     %r14                          \n"
-   "  popq     %r15                          \n"
-   "  popq     %rax                          \n"
-   "  popq     %rdx                          \n"
-   "  popq     %rbx                          \n"
-   "  popq     %rcx                          \n"
-   "  popq     %rsi                          \n"
-   "  popq     %rdi                          \n"
-   // Reproduce the original code before jumping back in (kernel version-dependent)
-   "_lb_hook_exit:                           \n"
-   "  .byte 0x90, 0x90, 0x90, 0x90           \n"   // Here we need enough NOPs to exceed the size of our largest BytePattern.
-   "  .byte 0x90, 0x90, 0x90, 0x90           \n"   // (We will copy the original code bytes into this NOP section
-   "  .byte 0x90, 0x90, 0x90, 0x90           \n"   // so that the actions of the original code path are preserved.)
-   "  .byte 0x90, 0x90, 0x90, 0x90           \n"   // NEED A MINIMUM OF 14 NOPS HERE;  more allows us flexibility
-   "  .byte 0x90, 0x90, 0x90, 0x90           \n"   // (to be forgetful about counting) when adding new patterns.
-   "  jmpq     *_lb_jump_address(%rip)       \n"   // Jump into the original code, just past our "jump to hook" patch
-);
+   for (i = 0; i < UNLOAD_DRAIN_TRIES && (lb_Counters.InHook != 0 || lb_Counters.InRegion != 0); ++i)
+   {
+      IOSleep(UNLOAD_DRAIN_SLEEP);
+   }
+   if (lb_Counters.InHook != 0 || lb_Counters.InRegion != 0)
+   {
+      printf(LB_DEBUGMSG_PREFIX "%d thread(s) still in hook (%d in probeBus()), refusing to unload.\n", lb_Counters.InHook, (int)lb_Counters.InRegion);
+      if ((result = latebloom_arm()) == KPATCH_OK)
+      {
+         printf(LB_DEBUGMSG_PREFIX "Hook re-armed (the latch, if any, stays open).\n");
+      }
+      else
+      {
+         printf(LB_DEBUGMSG_PREFIX "Unable to re-arm hook (error %d), latebloom stays loaded but DISARMED.\n", result);
+      }
+      return KERN_FAILURE;
+   }
+   // lb_Counters.InHook is decremented just before the exit stub, so give any straggler time to get out of it
+   IOSleep(UNLOAD_DRAIN_SLEEP);
+   // Nothing can reach the island (or anything else we patched) any more
+   if ((result = JournalRollbackAll()) != KPATCH_OK)
+   {
+      printf(LB_DEBUGMSG_PREFIX "Unable to roll back patches (error %d), refusing to unload.\n", result);
+      return KERN_FAILURE;
+   }
+   // v0.23 - Don't let IOKit call us about the latch later
+   LatchUnregister();
+   // v0.23 - Nor lb_ABPoll().  (A call that was already running when lb_ABClosing was set may have
+   // scheduled itself again;  the second cancel takes care of that.)
+   if (lb_ABCall != NULL)
+   {
+      lb_ABClosing = 1;
+      OSMemoryBarrier();
+      thread_call_cancel_wait(lb_ABCall);
+      thread_call_cancel_wait(lb_ABCall);
+      thread_call_free(lb_ABCall);
+      lb_ABCall = NULL;
+   }
 
+   if (lb_LatchLock != NULL)
+   {
+      IOLockFree(lb_LatchLock);
+      lb_LatchLock = NULL;
+   }
+
+   // Take down /dev/latebloom
+   if (fDeviceNode != NULL)
+   {
+      devfs_remove(fDeviceNode);
+      fDeviceNode = NULL;
+   }
+   if (MajorDev >= 0)
+   {
+      cdevsw_remove(MajorDev, &devsw);
+      MajorDev = -1;
+   }
+   SelectTeardown();    // v0.23 - (wakes up anybody still waiting)
+   printf(LB_DEBUGMSG_PREFIX "Hook removed, unloading.\n");
+   return KERN_SUCCESS;
+}
 
 //
 // Worker function for boot-args parsing
@@ -403,6 +1971,17 @@ static long ExtractArgValue(char *StartPos)
    return lbval;
 }
 
+//
+// v0.23 - Give the lookup tables' memory back once latebloom_start() is done with them,
+// whether or not the hook was placed (remembering how much they held, for status).
+//
+static void lb_ReleaseLookup(void)
+{
+   lb_LookupPeak = KLookupFootprint();
+   KLookupRelease();
+   lb_LookupReleased = 1;
+}
+
 /////////////////////////////////////////////////////////
 //
 // This is called when latebloom is initialized by the kernel.
@@ -411,11 +1990,10 @@ static long ExtractArgValue(char *StartPos)
 void latebloom_start(void)
 {
    int i, j;
+   int result;
    unsigned char *ptr;
-   // Local symbols defined in the assembly language above (invisible to the C compiler without extern declarations):
-   extern unsigned long long latebloom_hook; // The address of our hook code
-   extern unsigned long long lb_hook_exit;   // The address of our hook exit code
 
+   LB_STAGE(LB_STAGE_ENTRY)
    //
    // Before anything, see if we're running Big Sur or later.  If not, just bail.
    // (Don't bother with the minor version, the BytePattern mismatch will take care of it.)
@@ -426,31 +2004,21 @@ void latebloom_start(void)
       IOSleep(4 * MILLISECONDS_PER_SECOND);  // Delay long enough to read the message
       return;
    }
+   LB_STAGE(LB_STAGE_VERSION)
 
    printf(LB_DEBUGMSG_PREFIX "Starting.\n");
-   // Some variables are only actually used in the assembly code.  The compiler creates
-   // assembly code, which the assembler then handles;  because of this, symbol definitions
-   // and usage in the C source are visible to the inline assembly code, but definitions
-   // and usage in the inline assembly code are not visible in the C portion, so the
-   // compiler/assembler gets confused.
-   // If the following bogus assignments aren't present, the compiler drops the "unused" variables,
-   // which then causes "undefined symbol" errors at load time.
-   // It's nice that they allow inline assembly;  I just wish it was a more robust implementation.
-   CurrentThread = 0;
-   ptr = (unsigned char *)HookMessage;
-   ptr = (unsigned char *)HookMessagePhase1;
-   ptr = (unsigned char *)HookMessagePhase2;
-   ptr = (unsigned char *)lbDeviceName;            // 8sep21 v0.22
-   // End bogus assignments to keep the compiler happy
-
-   if (SleepValue == 0)    // Either it's the first time through or the user set it to 0
+   // (v0.23 - The "bogus assignments" that used to be here, to keep the compiler from
+   // dropping variables only the assembly code used, aren't needed any more;  the hook's
+   // logic is in C now.)
+
+   if (lb_Settings.SleepValue == 0)    // Either it's the first time through or the user set it to 0
    {
       // First, get the address of the _PE_boot_args() function.
       // _PE_boot_args() returns a pointer to the boot-args string.
       // We re-purpose the <BootArgs> variable here, using it first as a pointer
       // to the _PE_boot_args() function, then as a pointer to the boot-args
       // string itself.
-      GET_SYMBOL("_PE_boot_args", BootArgs)        // Get the address of _PE_boot_args()
+      GET_SYMBOL(PEBootArgsSymbol, BootArgs)       // Get the address of _PE_boot_args()
 
       // Get pointer to actual boot args by calling _PE_boot_args() and re-purposing the BootArgs variable
       asm (
@@ -458,6 +2026,7 @@ void latebloom_start(void)
          "callq   *%rax                      \n"   // Call PE_boot_args()
          "movq    %rax,_BootArgs(%rip)       \n"   // Save the address of boot-args in the same variable
          );                                        // BootArgs now points to the boot-args string
+      LB_STAGE(LB_STAGE_BOOTARGS_SYMBOL)
 
       printf(LB_DEBUGMSG_PREFIX "boot-args = %s\n", BootArgs);
 
@@ -495,43 +2064,206 @@ void latebloom_start(void)
                IOSleep(4 * MILLISECONDS_PER_SECOND);  // delay long enough to read the message
                return;
             }
-            SleepValue = lbval;
+            lb_Settings.SleepValue = lbval;
          }
          else if (BOOTARG_MATCH("lb_debug="))
          {
-            lb_DebugLevel = ExtractArgValue(&BootArgs[i + arglen]);
-            printf(LB_DEBUGMSG_PREFIX "lb_debug set to %ld\n", lb_DebugLevel);
+            lb_Settings.DebugLevel = ExtractArgValue(&BootArgs[i + arglen]);
+            printf(LB_DEBUGMSG_PREFIX "lb_debug set to %ld\n", lb_Settings.DebugLevel);
          }
          else if (BOOTARG_MATCH("lb_range="))
          {
-            lb_RandRange = ExtractArgValue(&BootArgs[i + arglen]);
-            printf(LB_DEBUGMSG_PREFIX "lb_range set to %ld\n", lb_RandRange);
+            lb_Settings.RandRange = ExtractArgValue(&BootArgs[i + arglen]);
+            printf(LB_DEBUGMSG_PREFIX "lb_range set to %ld\n", lb_Settings.RandRange);
          }
          // v0.21 - added Phase 1/Phase 2 differentiation
          else if (BOOTARG_MATCH("lb_delay2="))
          {
-            lb_AltSleepValue = ExtractArgValue(&BootArgs[i + arglen]);
-            printf(LB_DEBUGMSG_PREFIX "lb_delay2 set to %ld\n", lb_AltSleepValue);
+            lb_Settings.AltSleepValue = ExtractArgValue(&BootArgs[i + arglen]);
+            printf(LB_DEBUGMSG_PREFIX "lb_delay2 set to %ld\n", lb_Settings.AltSleepValue);
          }
          // v0.21 - added Phase 1/Phase 2 differentiation
          else if (BOOTARG_MATCH("lb_range2="))
          {
-            lb_AltRandRange = ExtractArgValue(&BootArgs[i + arglen]);
-            printf(LB_DEBUGMSG_PREFIX "lb_range2 set to %ld\n", lb_AltRandRange);
+            lb_Settings.AltRandRange = ExtractArgValue(&BootArgs[i + arglen]);
+            printf(LB_DEBUGMSG_PREFIX "lb_range2 set to %ld\n", lb_Settings.AltRandRange);
+         }
+         // v0.23 - added Phase 2 stagger mode
+         else if (BOOTARG_MATCH("lb_stagger="))
+         {
+            lb_Settings.StaggerStep = ExtractArgValue(&BootArgs[i + arglen]);
+            printf(LB_DEBUGMSG_PREFIX "lb_stagger set to %ld\n", lb_Settings.StaggerStep);
+         }
+         // v0.23 - added rate mode ("lb_rate=rate,burst")
+         else if (BOOTARG_MATCH("lb_rate="))
+         {
+            long lbval = 0;
+
+            ptr = (unsigned char *)&BootArgs[i + arglen];
+            j = -1;
+            EXTRACT_LBLOOM_VALUE           // (starts at ptr[j + 1])
+            lb_Settings.Rate = lbval;
+            if (ptr[j] == ',')
+            {
+               EXTRACT_LBLOOM_VALUE
+               lb_Settings.RateBurst = lbval;
+            }
+            printf(LB_DEBUGMSG_PREFIX "lb_rate set to %ld/s, burst %ld\n", lb_Settings.Rate, lb_Settings.RateBurst);
+         }
+         // v0.23 - added Phase 2 concurrency mode ("lb_conc=step,exponent,cap")
+         else if (BOOTARG_MATCH("lb_conc="))
+         {
+            long lbval = 0;
+
+            ptr = (unsigned char *)&BootArgs[i + arglen];
+            j = -1;
+            EXTRACT_LBLOOM_VALUE
+            lb_Settings.ConcurrencyStep = lbval;
+            if (ptr[j] == ',')
+            {
+               EXTRACT_LBLOOM_VALUE
+               lb_Settings.ConcurrencyExponent = lbval;
+            }
+            if (ptr[j] == ',')
+            {
+               EXTRACT_LBLOOM_VALUE
+               lb_Settings.ConcurrencyCap = lbval;
+            }
+            printf(LB_DEBUGMSG_PREFIX "lb_conc set to %ld,%ld,%ld\n", lb_Settings.ConcurrencyStep, lb_Settings.ConcurrencyExponent, lb_Settings.ConcurrencyCap);
+         }
+         // v0.23 - added Phase 2 backoff mode ("lb_backoff=cap,slice")
+         else if (BOOTARG_MATCH("lb_backoff="))
+         {
+            long lbval = 0;
+
+            ptr = (unsigned char *)&BootArgs[i + arglen];
+            j = -1;
+            EXTRACT_LBLOOM_VALUE
+            lb_Settings.BackoffCap = lbval;
+            if (ptr[j] == ',')
+            {
+               EXTRACT_LBLOOM_VALUE
+               lb_Settings.BackoffSlice = lbval;
+            }
+            printf(LB_DEBUGMSG_PREFIX "lb_backoff set to %ld,%ld\n", lb_Settings.BackoffCap, lb_Settings.BackoffSlice);
+         }
+         // v0.23 - added Phase 2 latch mode ("lb_latch=class,timeout" or "lb_latchname=name,timeout")
+         else if (BOOTARG_MATCH("lb_latch=") || BOOTARG_MATCH("lb_latchname="))
+         {
+            long lbval = 0;
+
+            lb_LatchByName = (BootArgs[i + arglen - 2] == 'e');  // "...name=" vs. "...latch="
+            ptr = (unsigned char *)&BootArgs[i + arglen];
+            for (j = 0; j < LB_LATCH_NAME_SIZE - 1 && ptr[j] != '\0' && ptr[j] != ',' && ptr[j] != ' '; ++j)
+            {
+               lb_LatchMatch[j] = ptr[j];
+            }
+            lb_LatchMatch[j] = '\0';
+            if (ptr[j] == ',')
+            {
+               EXTRACT_LBLOOM_VALUE
+               lb_Settings.LatchTimeout = lbval;
+            }
+            printf(LB_DEBUGMSG_PREFIX "%s set to %s,%ld\n", lb_LatchByName ? "lb_latchname" : "lb_latch", lb_LatchMatch, lb_Settings.LatchTimeout);
+         }
+         // v0.23 - added Phase 2 time window ("lb_window=start,end")
+         else if (BOOTARG_MATCH("lb_window="))
+         {
+            long lbval = 0;
+
+            ptr = (unsigned char *)&BootArgs[i + arglen];
+            j = -1;
+            EXTRACT_LBLOOM_VALUE
+            lb_WindowStart = lbval;
+            if (ptr[j] == ',')
+            {
+               EXTRACT_LBLOOM_VALUE
+               lb_WindowEnd = lbval;
+            }
+            lb_Settings.WindowSet = 1;
+            printf(LB_DEBUGMSG_PREFIX "lb_window set to %ld,%ld\n", lb_WindowStart, lb_WindowEnd);
+         }
+         // v0.23 - added A/B mode arms ("lb_armN=delay,range,delay2,range2", N = 0 to LB_MAX_ARMS - 1)
+         else if (BOOTARG_MATCH("lb_arm") && BootArgs[i + arglen] >= '0' && BootArgs[i + arglen] < '0' + LB_MAX_ARMS &&
+                  BootArgs[i + arglen + 1] == '=')
+         {
+            lb_ArmInfo  *Arm = &lb_Arms[BootArgs[i + arglen] - '0'];
+            long        lbval = 0;
+
+            ptr = (unsigned char *)&BootArgs[i + arglen + 2];
+            j = -1;
+            Arm->Range = 0;
+            Arm->Delay2 = -1;
+            Arm->Range2 = -1;
+            EXTRACT_LBLOOM_VALUE
+            Arm->Delay = lbval;
+            if (ptr[j] == ',')
+            {
+               EXTRACT_LBLOOM_VALUE
+               Arm->Range = lbval;
+            }
+            if (ptr[j] == ',')
+            {
+               EXTRACT_LBLOOM_VALUE
+               Arm->Delay2 = (j == 0) ? -1 : lbval;   // (omitted means "same as delay", like lbloom=)
+            }
+            if (ptr[j] == ',')
+            {
+               EXTRACT_LBLOOM_VALUE
+               Arm->Range2 = (j == 0) ? -1 : lbval;
+            }
+            Arm->Set = 1;
+            printf(LB_DEBUGMSG_PREFIX "lb_arm%c set to %ld,%ld,%ld,%ld\n", BootArgs[i + arglen], Arm->Delay, Arm->Range, Arm->Delay2, Arm->Range2);
+         }
+         // v0.23 - added IOSleep()/IODelay() self-test
+         else if (BOOTARG_MATCH("lb_selftest="))
+         {
+            lb_SelfTest = ExtractArgValue(&BootArgs[i + arglen]);
+            printf(LB_DEBUGMSG_PREFIX "lb_selftest set to %ld\n", lb_SelfTest);
+         }
+         // v0.23 - added enumeration quiescence time
+         else if (BOOTARG_MATCH("lb_quiet="))
+         {
+            lb_Settings.QuietMs = ExtractArgValue(&BootArgs[i + arglen]);
+            printf(LB_DEBUGMSG_PREFIX "lb_quiet set to %ld\n", lb_Settings.QuietMs);
+         }
+         // v0.23 - added whole-__text pattern survey
+         else if (BOOTARG_MATCH("lb_scan="))
+         {
+            lb_ScanAll = ExtractArgValue(&BootArgs[i + arglen]);
+            printf(LB_DEBUGMSG_PREFIX "lb_scan set to %ld\n", lb_ScanAll);
+         }
+         // v0.23 - added thread table size
+         else if (BOOTARG_MATCH("lb_threads="))
+         {
+            lb_Settings.MaxThreads = (UInt32)ExtractArgValue(&BootArgs[i + arglen]);
+            printf(LB_DEBUGMSG_PREFIX "lb_threads set to %u\n", lb_Settings.MaxThreads);
+         }
+         // v0.23 - added A/B mode goal
+         else if (BOOTARG_MATCH("lb_abgoal="))
+         {
+            lb_ABGoal = ExtractArgValue(&BootArgs[i + arglen]);
+            printf(LB_DEBUGMSG_PREFIX "lb_abgoal set to %ld\n", lb_ABGoal);
+         }
+         // v0.23 - added Phase 2 sequence mode
+         else if (BOOTARG_MATCH("lb_sequence="))
+         {
+            lb_Settings.SequenceTimeout = ExtractArgValue(&BootArgs[i + arglen]);
+            printf(LB_DEBUGMSG_PREFIX "lb_sequence set to %ld\n", lb_Settings.SequenceTimeout);
          }
          // v0.20 - added "lbloom=" condensed boot-arg
          else if (BOOTARG_MATCH("lbloom="))  // condensed latebloom parameters
          {
             // Format is: lbloom=delay,range,debug,delay2,range2
-            // (SleepValue, lb_RandRange, lb_DebugLevel, lb_AltSleepValue, lb_AltRandRange)
+            // (lb_Settings.SleepValue, lb_Settings.RandRange, lb_Settings.DebugLevel, lb_Settings.AltSleepValue, lb_Settings.AltRandRange)
             // Args can be omitted, e.g. "lbloom=90,,1" or "lbloom=110" or "lbloom=,,1" or "lbloom="90,20"
             // Omitted args are always treated as 0
             // Values > 4 digits cause all subsequent values to be 0 (e.g. "lbloom=12345,90,1" effectively becomes "1234,0,0")
             long lbval = 0;
             ptr = (unsigned char *)&BootArgs[i + arglen];
-            SleepValue = 0;
-            lb_RandRange = 0;
-            lb_DebugLevel = 0;
+            lb_Settings.SleepValue = 0;
+            lb_Settings.RandRange = 0;
+            lb_Settings.DebugLevel = 0;
             // First, get the delay value (if any)
             for (j = 0; j < MAX_ARG_DIGITS && ptr[j] >= '0' && ptr[j] <= '9'; ++j)
             {
@@ -543,31 +2275,31 @@ void latebloom_start(void)
                IOSleep(4 * MILLISECONDS_PER_SECOND);  // delay long enough to read the message
                return;
             }
-            SleepValue = lbval;
+            lb_Settings.SleepValue = lbval;
             if (ptr[j] == ',')   // are there more arguments to follow?
             {
                // Next is lb_range
                EXTRACT_LBLOOM_VALUE
-               lb_RandRange = lbval;
+               lb_Settings.RandRange = lbval;
             }
             if (ptr[j] == ',')   // are there more arguments to follow?
             {
                // Next is lb_debug
                EXTRACT_LBLOOM_VALUE
-               lb_DebugLevel = lbval;
+               lb_Settings.DebugLevel = lbval;
             }
             if (ptr[j] == ',')   // are there more arguments to follow?
             {
                // Next is lb_delay2
                EXTRACT_LBLOOM_VALUE
-               // if argument is omitted (not explicitly zero), use SleepValue instead
-               lb_AltSleepValue = (j == 0) ? SleepValue : lbval;
+               // if argument is omitted (not explicitly zero), use lb_Settings.SleepValue instead
+               lb_Settings.AltSleepValue = (j == 0) ? lb_Settings.SleepValue : lbval;
             }
             if (ptr[j] == ',')   // are there more arguments to follow?
             {
                // Next is lb_range2
                EXTRACT_LBLOOM_VALUE
-               lb_AltRandRange = lbval;
+               lb_Settings.AltRandRange = lbval;
             }
             // Assuming they're all comma-separated, additional arguments can appear here
             // (just use the "if (ptr[j] == ',') { ... }" above as a template)
@@ -579,60 +2311,191 @@ void latebloom_start(void)
       //
       // Before we do anything else, deal with any defaults that need to be set.
       //
-      if (SleepValue == 0)    // latebloom= value not specified, so use default
+      if (lb_Settings.SleepValue == 0)    // latebloom= value not specified, so use default
       {
-         SleepValue = DEFAULT_SLEEP;
-         printf(LB_DEBUGMSG_PREFIX "latebloom boot-arg not set, Phase 1 using %lu ms default.\n", SleepValue);
+         lb_Settings.SleepValue = DEFAULT_SLEEP;
+         printf(LB_DEBUGMSG_PREFIX "latebloom boot-arg not set, Phase 1 using %lu ms default.\n", lb_Settings.SleepValue);
       }
       else
       {
-         printf(LB_DEBUGMSG_PREFIX "based on boot-args, Phase 1 using delay of %lu ms.\n", SleepValue);
+         printf(LB_DEBUGMSG_PREFIX "based on boot-args, Phase 1 using delay of %lu ms.\n", lb_Settings.SleepValue);
       }
-      if (lb_AltSleepValue != -1)
+      if (lb_Settings.AltSleepValue != -1)
       {
-         printf(LB_DEBUGMSG_PREFIX "based on boot-args, Phase 2 using delay of %lu ms.\n", lb_AltSleepValue);
+         printf(LB_DEBUGMSG_PREFIX "based on boot-args, Phase 2 using delay of %lu ms.\n", lb_Settings.AltSleepValue);
       }
       else
       {
-         lb_AltSleepValue = SleepValue;
-         printf(LB_DEBUGMSG_PREFIX "No Phase 2 delay specified, using Phase 1 delay of %lu ms.\n", lb_AltSleepValue);
+         lb_Settings.AltSleepValue = lb_Settings.SleepValue;
+         printf(LB_DEBUGMSG_PREFIX "No Phase 2 delay specified, using Phase 1 delay of %lu ms.\n", lb_Settings.AltSleepValue);
       }
-      if (lb_RandRange != 0)
+      if (lb_Settings.RandRange != 0)
       {
-         if (lb_RandRange > SleepValue)
+         if (lb_Settings.RandRange > lb_Settings.SleepValue)
          {
-            lb_RandRange = SleepValue;
-            printf(LB_DEBUGMSG_PREFIX "lb_range larger than lb_sleep, truncating to %ld\n", lb_RandRange);
+            lb_Settings.RandRange = lb_Settings.SleepValue;
+            printf(LB_DEBUGMSG_PREFIX "lb_range larger than lb_sleep, truncating to %ld\n", lb_Settings.RandRange);
          }
          printf(LB_DEBUGMSG_PREFIX "Phase 1 delays will be random, between %lu and %lu ms.\n",
-                SleepValue - lb_RandRange, SleepValue + lb_RandRange);
+                lb_Settings.SleepValue - lb_Settings.RandRange, lb_Settings.SleepValue + lb_Settings.RandRange);
       }
-      if (lb_AltRandRange != 0)
+      if (lb_Settings.AltRandRange != 0)
       {
-         if (lb_AltRandRange == -1)
+         if (lb_Settings.AltRandRange == -1)
          {
-            lb_AltRandRange = lb_RandRange;
+            lb_Settings.AltRandRange = lb_Settings.RandRange;
          }
-         if (lb_AltRandRange > lb_AltSleepValue)
+         if (lb_Settings.AltRandRange > lb_Settings.AltSleepValue)
          {
-            lb_AltRandRange = lb_AltSleepValue;
-            printf(LB_DEBUGMSG_PREFIX "lb_range2 larger than lb_delay2, truncating to %ld\n", lb_AltRandRange);
+            lb_Settings.AltRandRange = lb_Settings.AltSleepValue;
+            printf(LB_DEBUGMSG_PREFIX "lb_range2 larger than lb_delay2, truncating to %ld\n", lb_Settings.AltRandRange);
          }
-         if (lb_AltRandRange != 0)
+         if (lb_Settings.AltRandRange != 0)
          {
             printf(LB_DEBUGMSG_PREFIX "Phase 2 delays will be random, between %lu and %lu ms.\n",
-                   lb_AltSleepValue - lb_AltRandRange, lb_AltSleepValue + lb_AltRandRange);
+                   lb_Settings.AltSleepValue - lb_Settings.AltRandRange, lb_Settings.AltSleepValue + lb_Settings.AltRandRange);
+         }
+      }
+      // v0.23 - set up rate mode
+      if (lb_Settings.Rate != 0)
+      {
+         if (lb_Settings.RateBurst < 1)
+         {
+            lb_Settings.RateBurst = 1;
+         }
+         lb_FindTSCFrequency();
+         lb_Settings.RateInterval = lb_Settings.TSCFrequency / lb_Settings.Rate;
+         printf(LB_DEBUGMSG_PREFIX "Hook entries limited to %ld per second (bursts of %ld), TSC %llu Hz.\n",
+                lb_Settings.Rate, lb_Settings.RateBurst, lb_Settings.TSCFrequency);
+      }
+      if (lb_Settings.WindowSet)
+      {
+         if (lb_WindowEnd != 0 && lb_WindowEnd <= lb_WindowStart)
+         {
+            printf(LB_DEBUGMSG_PREFIX "lb_window end (%ld) not after start (%ld), ignoring end\n", lb_WindowEnd, lb_WindowStart);
+            lb_WindowEnd = 0;
+         }
+         printf(LB_DEBUGMSG_PREFIX "Phase 2 delays only from %ld to %ld ms after Phase 2 starts (0 = no end).\n",
+                lb_WindowStart, lb_WindowEnd);
+      }
+      // v0.23 - the thread table has to fit in the arena (with room to spare for anything else)
+      if (lb_Settings.MaxThreads < 1 || lb_Settings.MaxThreads > LB_ARENA_SIZE / 2 / sizeof(lb_ThreadInfo))
+      {
+         lb_Settings.MaxThreads = (lb_Settings.MaxThreads < 1) ? 1 : (UInt32)(LB_ARENA_SIZE / 2 / sizeof(lb_ThreadInfo));
+         printf(LB_DEBUGMSG_PREFIX "lb_threads out of range, using %u\n", lb_Settings.MaxThreads);
+      }
+      // v0.23 - set up A/B mode (the arms have to be numbered from 0, without gaps)
+      for (lb_Settings.ABArms = 0; lb_Settings.ABArms < LB_MAX_ARMS && lb_Arms[lb_Settings.ABArms].Set; ++lb_Settings.ABArms)
+      {
+         lb_ArmInfo *Arm = &lb_Arms[lb_Settings.ABArms];
+
+         if (Arm->Delay2 == -1)
+         {
+            Arm->Delay2 = Arm->Delay;
+         }
+         if (Arm->Range2 == -1)
+         {
+            Arm->Range2 = Arm->Range;
+         }
+         if (Arm->Range > Arm->Delay)
+         {
+            Arm->Range = Arm->Delay;
+         }
+         if (Arm->Range2 > Arm->Delay2)
+         {
+            Arm->Range2 = Arm->Delay2;
+         }
+         // (FNV-1a, so that changing any arm starts the experiment over)
+         lb_ABConfig = (lb_ABConfig ^ (UInt32)Arm->Delay) * 0x01000193;
+         lb_ABConfig = (lb_ABConfig ^ (UInt32)Arm->Range) * 0x01000193;
+         lb_ABConfig = (lb_ABConfig ^ (UInt32)Arm->Delay2) * 0x01000193;
+         lb_ABConfig = (lb_ABConfig ^ (UInt32)Arm->Range2) * 0x01000193;
+      }
+      for (i = lb_Settings.ABArms; i < LB_MAX_ARMS; ++i)
+      {
+         if (lb_Arms[i].Set)
+         {
+            printf(LB_DEBUGMSG_PREFIX "lb_arm%d ignored (lb_arm%d not set)\n", i, lb_Settings.ABArms);
+         }
+      }
+      if (lb_Settings.ABArms != 0)
+      {
+         lb_FindTSCFrequency();
+         lb_RandomSeed(lb_ReadTSC());
+         // (looked up now, while the lookup tables are still around;  lb_ABPoll() runs after they're freed)
+         lb_NVRAMRead = (lb_NVRAMReadFunc)SymbolLookupRef(&NVRAMReadSymbol);
+         lb_NVRAMWrite = (lb_NVRAMWriteFunc)SymbolLookupRef(&NVRAMWriteSymbol);
+         lb_NVRAMOptions = (void * volatile *)SymbolLookupRef(&NVRAMOptionsSymbol);
+         printf(LB_DEBUGMSG_PREFIX "A/B mode:  %d arms, goal %ld ms (0 = any completed boot), record in NVRAM '%s'.\n",
+                lb_Settings.ABArms, lb_ABGoal, LB_AB_VARIABLE);
+         printf(LB_DEBUGMSG_PREFIX "A/B mode:  latebloom=, lb_range=, lb_delay2= and lb_range2= apply until NVRAM is up and an arm is picked.\n");
+      }
+      // v0.23 - pick the Phase 2 policy (sequence mode wins if more than one was asked for)
+      if (lb_Settings.SequenceTimeout != 0)
+      {
+         lb_Settings.Phase2Mode = LB_P2_SEQUENCE;
+         printf(LB_DEBUGMSG_PREFIX "Phase 2 probes will run one at a time, in order (waiting up to %ld ms each).\n", lb_Settings.SequenceTimeout);
+      }
+      else if (lb_Settings.StaggerStep != 0)
+      {
+         lb_Settings.Phase2Mode = LB_P2_STAGGER;
+         printf(LB_DEBUGMSG_PREFIX "Phase 2 threads will be staggered %ld ms apart (first loop only).\n", lb_Settings.StaggerStep);
+      }
+      else if (lb_Settings.ConcurrencyStep != 0)
+      {
+         if (lb_Settings.ConcurrencyExponent > LB_MAX_CONC_EXPONENT)
+         {
+            lb_Settings.ConcurrencyExponent = LB_MAX_CONC_EXPONENT;
+            printf(LB_DEBUGMSG_PREFIX "lb_conc exponent too large, truncating to %ld\n", lb_Settings.ConcurrencyExponent);
+         }
+         lb_Settings.Phase2Mode = LB_P2_CONCURRENCY;
+         printf(LB_DEBUGMSG_PREFIX "Phase 2 delays will be %ld ms * (other probes)^%ld (cap %ld ms).\n",
+                lb_Settings.ConcurrencyStep, lb_Settings.ConcurrencyExponent, lb_Settings.ConcurrencyCap);
+      }
+      else if (lb_LatchMatch[0] != '\0')
+      {
+         if ((lb_LatchLock = IOLockAlloc()) == NULL)
+         {
+            printf(LB_DEBUGMSG_PREFIX "Unable to allocate latch lock, ignoring %s\n", lb_LatchByName ? "lb_latchname" : "lb_latch");
          }
+         else
+         {
+            lb_Settings.Phase2Mode = LB_P2_LATCH;
+            printf(LB_DEBUGMSG_PREFIX "Phase 2 loops will wait (up to %ld ms) until %s '%s' is published.\n",
+                   lb_Settings.LatchTimeout, lb_LatchByName ? "device" : "class", lb_LatchMatch);
+         }
+      }
+      else if (lb_Settings.BackoffCap != 0)
+      {
+         if (lb_Settings.BackoffSlice < 1)
+         {
+            lb_Settings.BackoffSlice = LB_BACKOFF_FIRST_SLICE;
+         }
+         lb_Settings.Phase2Mode = LB_P2_BACKOFF;
+         printf(LB_DEBUGMSG_PREFIX "Phase 2 loops will back off (from %ld ms, up to %ld ms) while other probes are running.\n",
+                lb_Settings.BackoffSlice, lb_Settings.BackoffCap);
       }
-   }  // end if (SleepValue == 0)
+      LB_STAGE(LB_STAGE_BOOTARGS_PARSE)
+   }  // end if (lb_Settings.SleepValue == 0)
+
+   // v0.23 - With lb_selftest=N, find out how long IOSleep() and IODelay() really take (for lb_Sleep())
+   if (lb_SelfTest > 0 && !lb_Calibrated)
+   {
+      lb_Calibrate();
+   }
+   LB_STAGE(LB_STAGE_SELFTEST)
 
    //
    // Find our insertion point and place the hook
    //
-   if (lb_jump_address == 0)  // We haven't yet calculated the hook address, so the hook is not yet set
+   if (lb_HookSite == 0)      // We haven't yet calculated the hook address, so the hook is not yet set
    {
       printf(LB_DEBUGMSG_PREFIX "Start - First time through, trying to place hook...\n");
-      // Find the symbol (which isn't part of the kernel symbol table)
+      // v0.23 - Look up IOPCIBridge::probeBus in IOPCIFamily's own symbol table
+      ProbeAddress = (unsigned long long)KextSymbolLookup(IOPCIFAMILY_BUNDLE_ID, PROBEBUS_SYMBOL);
+      if (ProbeAddress == 0)
+      {
+      // If that didn't work, recover the symbol (which isn't part of the kernel symbol table) from our fake call
       asm (
          "  pushq %rdi                             \n"   // Save the registers we'll use (don't confuse the compiler)
          "  pushq %rax                             \n"
@@ -644,81 +2507,131 @@ void latebloom_start(void)
          "  popq  %rax                             \n"   // Restore the registers we used
          "  popq  %rdi                             \n"
          );
+      }
+      LB_STAGE(LB_STAGE_PROBEBUS)
+      if (lb_Settings.DebugLevel & 1)
+      {
+         printf(LB_DEBUGMSG_PREFIX "IOPCIBridge::probeBus is at 0x%llx\n", ProbeAddress);
+      }
       //
-      // Search IOPCIBridge::probeBus() for a byte pattern that we recognize.
-      // (This could be made significantly more efficient, but we only do it once,
-      // and the window is relatively small, so "simple but inefficient" is fine.)
+      // v0.23 - With lb_scan=1, survey all of IOPCIFamily's __text for our byte patterns first.
       //
-      ptr = (unsigned char *)ProbeAddress;
-      for (i = 0; i < HOOK_WINDOW_SIZE && lb_jump_address == 0; ++i, ++ptr)
+      if (lb_ScanAll)
       {
-         for (WhichPattern = 0; BytePatterns[WhichPattern].Pattern != NULL; ++WhichPattern)
+         uint64_t TextStart, TextSize;
+
+         if (KextSectionRange(IOPCIFAMILY_BUNDLE_ID, "__TEXT", "__text", &TextStart, &TextSize))
          {
-            if (!memcmp(ptr, BytePatterns[WhichPattern].Pattern, BytePatterns[WhichPattern].size))
-            {
-               lb_jump_address = (unsigned long long)ptr;
-               break;
-            }
+            UInt64 ScanStart = lb_ReadTSC();
+
+            lb_ScanMatches = lb_ScanText(BytePatterns, (const unsigned char *)TextStart, TextSize, lb_ScanSites, lb_ScanPatterns, LB_SCAN_SITES, &lb_ScanCandidates);
+            lb_ScanTicks = lb_ReadTSC() - ScanStart;
+            lb_ScanBase = TextStart;
+            lb_ScanBytes = TextSize;
+            printf(LB_DEBUGMSG_PREFIX "Scanned %llu bytes of __text:  %u candidates, %u matches\n", lb_ScanBytes, lb_ScanCandidates, lb_ScanMatches);
+         }
+         else
+         {
+            printf(LB_DEBUGMSG_PREFIX "Unable to locate IOPCIFamily's __text, not scanned\n");
          }
-      }  // end for (i = 0; i < HOOK_WINDOW_SIZE; ++i)
+      }
+      //
+      // Search IOPCIBridge::probeBus() for a byte pattern that we recognize.
+      // (v0.23 - A match may start anywhere in the first HOOK_WINDOW_SIZE bytes, and the
+      // patterns are LONG_JUMP_SIZE bytes long, so that's how far past the window we look.)
+      //
+      if (lb_ScanText(BytePatterns, (const unsigned char *)ProbeAddress, HOOK_WINDOW_SIZE + LONG_JUMP_SIZE - 1, &lb_HookSite, &WhichPattern, 1, NULL) == 0)
+      {
+         lb_HookSite = 0;
+      }
+      LB_STAGE(LB_STAGE_SCAN)
 
       // Did we find a byte pattern that we can use?
-      if (lb_jump_address == 0)
+      if (lb_HookSite == 0)
       {
          printf("\n\n" LB_DEBUGMSG_PREFIX "Hook byte pattern not found, HOOK NOT PLACED. ...---...\n\n");
+         lb_ReleaseLookup();
          IOSleep(4 * MILLISECONDS_PER_SECOND);  // delay long enough to read the message
          return;
       }
 
       // We found a place to set our hook.
-      asm (
-         // Turn off interrupts, make codespace writable
-         "  cli                                    \n"   // Interrupts off
-         "  movq  %cr0,%rax                        \n"   // Get current CR0
-         "  pushq %rax                             \n"   // Save original CR0 for later restoration
-         "  pushq %rbx                             \n"   // Save RBX (don't confuse the compiler)
-         "  movq  $0xfffffffffffeffff,%rbx         \n"   // Mask to enable write to codespace
-         "  andq  %rbx,%rax                        \n"   // Mask CR0 to make codespace writable
-         "  movq  %rax,%cr0                        \n"   // Update CR0 (make codespace writable)
-         // Write the hook.
-         // Note that we can't rely on the IOPCIFamily.kext being within +/- 2GB of our kext, so
-         // we need to do a 64-bit long jump.  Since we don't control the registers at that point,
-         // we can't load a register with our address and do an indirect jump without trashing the
-         // register;  alternatively, pushing a register, loading it with an Imm64 address, then
-         // jumping indirectly through it takes a minimum of 15 bytes.
-         // Instead, we can leverage the RIP-relative mechanism and jump indirectly through a
-         // 64-bit memory location;  by using an offset of 0 and immediately following that with
-         // our 64-bit target address, we can always jump anywhere in exactly 14 bytes - and not
-         // modify any registers (other than RIP) in the process.
-         "  movq  _lb_jump_address(%rip),%rbx      \n"   // Where the hook is going to be placed
-         "  movl  $0x25ff,%eax                     \n"   // <ff 25 00 00 00 00> is "jmp *(%rip)"
-         "  movq  %rax,(%rbx)                      \n"   // Write eight bytes, although we only need the first six
-         "  leaq  _latebloom_hook(%rip),%rax       \n"   // 64-bit address of our hook code
-         "  addq  $6,%rbx                          \n"   // Point past the "jmp *(%rip)"
-         "  movq  %rax,(%rbx)                      \n"   // Save our 64-bit target address
-         "  addq  $8,%rbx                          \n"   // Point past the long jump
-         "  movq  %rbx,_lb_jump_address(%rip)      \n"   // Save this address as the return point from our hook
-         "  popq  %rbx                             \n"   // Restore RBX
-         );
-      // Copy the selected byte pattern to the end of our hook code (overwriting the NOPs we put there for this purpose)
-      ptr = (unsigned char *)&lb_hook_exit;
-      memcpy(ptr, BytePatterns[WhichPattern].Pattern, BytePatterns[WhichPattern].size);
-      // Make codespace read-only again, turn interrupts back on
-      asm (
-         "  popq  %rax                             \n"   // Retrieve original CR0
-         "  movq  %rax,%cr0                        \n"   // Restore original CR0 (make codespace read-only again)
-         "  sti                                    \n"   // Interrupts back on
-         );
+      // v0.23 - Until the hook is armed, we're still single-threaded, so kpatch.c may fall back
+      // to clearing CR0.WP if it can't make a writable alias of the target.
+      TextAllowCR0(1);
+      // v0.23 - If we can put a long jump island within reach, the hook site only needs a short jump,
+      // which displaces fewer of the pattern's bytes.
+      lb_HookSize = lb_PlaceIsland() ? BytePatterns[WhichPattern].ShortSize : BytePatterns[WhichPattern].size;
+      if (lb_Settings.DebugLevel & 1)
+      {
+         printf(LB_DEBUGMSG_PREFIX "Hook displaces %lu bytes (%s)\n", lb_HookSize, lb_Island ? "short jump to island" : "long jump");
+      }
+      // Copy the displaced bytes of the selected pattern to the end of our hook code (overwriting the NOPs we put
+      // there for this purpose), and point the exit stub just past the bytes it reproduces.  Nothing is executing
+      // the hook yet, so a plain write (through a writable alias of our own code) is good enough here.
+      lb_jump_address = lb_HookSite + lb_HookSize;
+      if ((result = TextWrite(&lb_hook_exit, BytePatterns[WhichPattern].Pattern, lb_HookSize)) != KPATCH_OK)
+      {
+         printf("\n\n" LB_DEBUGMSG_PREFIX "Unable to write hook exit code (error %d), HOOK NOT PLACED. ...---...\n\n", result);
+         TextAllowCR0(0);
+         lb_HookSite = 0;
+         lb_ReleaseLookup();
+         IOSleep(4 * MILLISECONDS_PER_SECOND);  // delay long enough to read the message
+         return;
+      }
+      // v0.23 - The hook needs its thread table before it can run
+      if (lb_Threads == NULL && (lb_Threads = (lb_ThreadInfo *)lb_ArenaAlloc(lb_Settings.MaxThreads * sizeof(lb_ThreadInfo))) == NULL)
+      {
+         printf("\n\n" LB_DEBUGMSG_PREFIX "Unable to allocate thread table, HOOK NOT PLACED. ...---...\n\n");
+         TextAllowCR0(0);
+         lb_HookSite = 0;
+         lb_ReleaseLookup();
+         IOSleep(4 * MILLISECONDS_PER_SECOND);  // delay long enough to read the message
+         return;
+      }
+      // Now publish the jump into our hook
+      result = latebloom_arm();
+      TextAllowCR0(0);
+      if (result != KPATCH_OK)
+      {
+         printf("\n\n" LB_DEBUGMSG_PREFIX "Unable to write hook (error %d), HOOK NOT PLACED. ...---...\n\n", result);
+         lb_HookSite = 0;
+         lb_ReleaseLookup();
+         IOSleep(4 * MILLISECONDS_PER_SECOND);  // delay long enough to read the message
+         return;
+      }
+      //
+      // v0.23 - That's all we needed the lookup tables for;  describe the addresses we'll be asked
+      // about later, then give the tables' memory back (latebloom stays loaded until shutdown).
+      //
+      lb_Described[0].Address = ProbeAddress;
+      lb_Described[1].Address = lb_HookSite;
+      lb_Described[2].Address = lb_jump_address;
+      lb_Described[3].Address = lb_Island;
+      for (i = 0; i < LB_DESCRIBED; ++i)
+      {
+         lb_Described[i].Name = SymbolForAddress((void *)lb_Described[i].Address, &lb_Described[i].Offset, &lb_Described[i].Image);
+      }
+      lb_ReleaseLookup();
+      LB_STAGE(LB_STAGE_PATCH)
+      printf(LB_DEBUGMSG_PREFIX "Lookup tables freed (%lu bytes), %lu bytes of arena in use.\n", (unsigned long)lb_LookupPeak, (unsigned long)lb_ArenaUsed);
       // Verbosely log our success
-      printf(LB_DEBUGMSG_PREFIX "Hook placed successfully.  Count = %d :: %d,%d,%d,%d,%d\n", (int)lb_PCI_counter, (int)SleepValue, (int)lb_RandRange, (int)lb_DebugLevel, (int)lb_AltSleepValue, (int)lb_AltRandRange);
+      printf(LB_DEBUGMSG_PREFIX "Hook placed successfully (via %s).  Count = %d :: %d,%d,%d,%d,%d\n", TextMethodName(), (int)lb_Counters.Loops, (int)lb_Settings.SleepValue, (int)lb_Settings.RandRange, (int)lb_Settings.DebugLevel, (int)lb_Settings.AltSleepValue, (int)lb_Settings.AltRandRange);
       //
       // 8sep21 v0.22 - if we successfully set the hook, also create /dev/latebloom as
       // an indicator.
       //
       // Add the device to the system cdevsw table
+      // (v0.23 - poll()/select() need a lock and a timer first;  without them, /dev/latebloom is always readable)
+      if (!SelectSetup())
+      {
+         printf(LB_DEBUGMSG_PREFIX "Unable to set up poll() support for /dev/latebloom\n");
+      }
       MajorDev = cdevsw_add(STARTING_DEVSW_SLOT, &devsw);
       if (MajorDev >= 0)   // Successfully added cdevsw?
       {
+         // v0.23 - let kqueue use our d_select, too (EVFILT_READ)
+         cdevsw_setkqueueok(MajorDev, &devsw, CDEVSW_SELECT_KQUEUE);
          // Build the device ID using our major # and a minor # of 0
          fBaseDev = makedev(MajorDev, 0);
          // Create /dev/latebloom visibly in the filesystem
@@ -736,7 +2649,23 @@ void latebloom_start(void)
                                        0400,                   // Permissions
                                        (char *)"latebloom");   // Device name
       }
-   }  // end if (lb_jump_address == 0)
+      LB_STAGE(LB_STAGE_CDEVSW)
+      // v0.23 - (after the last timestamp, since it may have to measure the TSC)
+      lb_FindTSCFrequency();
+      // v0.23 - A/B mode:  start waiting for NVRAM (see lb_ABPoll())
+      if (lb_Settings.ABArms != 0)
+      {
+         if ((lb_ABCall = thread_call_allocate(lb_ABPoll, NULL)) != NULL)
+         {
+            thread_call_enter(lb_ABCall);
+         }
+         else
+         {
+            printf(LB_DEBUGMSG_PREFIX "A/B: unable to set up NVRAM polling, no arm this boot\n");
+            lb_ABStage = LB_AB_MISSED;
+         }
+      }
+   }  // end if (lb_HookSite == 0)
 
    // All done
    return;
@@ -23,44 +23,663 @@
 
 #include "klookup.h"
 #include <IOKit/IOLib.h>
+#include <libkern/OSAtomic.h>          // v0.23 (for OnceBegin()/OnceDone())
 #include <mach-o/nlist.h>
 
 #define KERNEL_BASE           0xffffff8000200000   // Base address of the kernel, per the Mach-O file on disk
 #define LB_SEG_PRELINK_TEXT   "__PRELINK_TEXT"     // Segment name for PRELINK_TEXT (used by Big Sur and later)
 
+//
+// v0.23 - Everything we know about one image's symbol table
+//
+typedef struct
+{
+   struct nlist_64   *NameList;        // The symbols
+   char              *StringTable;     // Their names
+   uint32_t          nsyms;            // How many symbols in NameList
+   uint32_t          strsize;          // Size of StringTable
+   uint32_t          *ByAddress;       // Indexes of the defined symbols in NameList, sorted by address (built lazily)
+   uint32_t          nByAddress;       // How many entries in ByAddress
+   uint32_t          iExtDef;          // First external definition (from LC_DYSYMTAB)
+   uint32_t          nExtDef;          // Number of external definitions (0 if there's no LC_DYSYMTAB)
+   int               ExtDefSorted;     // Non-zero if the external definitions are sorted by name
+   volatile UInt32   AddressOnce;      // v0.23 - ByAddress's OnceBegin() state
+} SymbolTableInfo;
+
+// For effiency, we keep the kernel's symbol table info across invocations
+static SymbolTableInfo  KernelSymbols;
+
+//////////////////////////////////////////////////////////////////////
+//
+// v0.23 - One-time initialization.
+//
+// Up through v0.22, there was only ever one caller (early in boot),
+// so "if (KernelSymbols.StringTable == NULL) build it" was good
+// enough.  Now lookups can come from several threads at once (the
+// hook, /dev/latebloom, IOKit's start()), and two of them could both
+// see NULL and both build the same table, or one could see a table
+// that's only half built.  So each table built on demand has a state
+// that goes ONCE_NEW -> ONCE_BUSY -> ONCE_DONE:  the caller that
+// moves it from ONCE_NEW to ONCE_BUSY (with a compare-and-swap) builds
+// the table, and everybody else waits until it's ONCE_DONE.  The
+// memory barriers make sure that everything the builder wrote is
+// visible before ONCE_DONE is, and that whoever sees ONCE_DONE also
+// sees everything that was written before it.  Once a table is
+// built, all it costs is reading the state.
+//
+// A table that couldn't be built is still "done";  whatever the
+// builder left behind (a NULL pointer, an error code) says so.
+//
+//////////////////////////////////////////////////////////////////////
+#define ONCE_NEW              0        // Nobody has started
+#define ONCE_BUSY             1        // Somebody is building it right now
+#define ONCE_DONE             2        // Built (or found to be unbuildable)
+#define ONCE_WAIT_US          10       // How long (us) to wait between checks on somebody else's build
+
+//
+// Returns non-zero if the caller is to build the table (and then call OnceDone()),
+// or 0 once somebody else has.
+//
+static int OnceBegin(volatile UInt32 *State)
+{
+   while (*State != ONCE_DONE)
+   {
+      if (OSCompareAndSwap(ONCE_NEW, ONCE_BUSY, State))
+      {
+         return 1;
+      }
+      IODelay(ONCE_WAIT_US);
+   }
+   OSMemoryBarrier();      // (acquire)
+   return 0;
+}
+
+static void OnceDone(volatile UInt32 *State)
+{
+   OSMemoryBarrier();      // (release)
+   *State = ONCE_DONE;
+}
+
+//
+// v0.23 - Everything klookup allocates goes through LookupAlloc()/LookupFree(), so we
+// know how much memory the lookup tables are holding (KLookupFootprint()), and
+// KLookupRelease() can give it all back once latebloom no longer needs it.
+//
+static size_t           LookupBytes = 0;
+
+static void *LookupAlloc(size_t Size)
+{
+   void *Block;
+
+   if ((Block = IOMalloc(Size)) != NULL)
+   {
+      LookupBytes += Size;
+   }
+   return Block;
+}
+
+static void LookupFree(void *Block, size_t Size)
+{
+   IOFree(Block, Size);
+   LookupBytes -= Size;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// v0.23 - Mach-O load command index.
+//
+// Up through v0.22, every FindSegment64() call (and the LC_SYMTAB
+// search) walked the load commands from the top, trusting every
+// cmdsize along the way.  Now we walk them exactly once per image,
+// checking each command against the bounds of the load command area
+// (and each __LINKEDIT reference against the __LINKEDIT segment) as
+// we go, and keep pointers to everything we'll want later.  After
+// that, finding a segment or the symbol table is just a table lookup.
+//
+//////////////////////////////////////////////////////////////////////
+#define MACHO_MAX_SEGMENTS    16       // More than any kernel or kext image has
+
+// ParseMachO() return values
+#define MACHO_OK              0
+#define MACHO_BAD_MAGIC       1        // Not a 64-bit Mach-O header
+#define MACHO_BAD_COMMAND     2        // A load command is malformed, or runs past the end of the load commands
+#define MACHO_BAD_LINKEDIT    3        // Something points outside of __LINKEDIT
+#define MACHO_TOO_MANY        4        // More than MACHO_MAX_SEGMENTS segments
+
+typedef struct
+{
+   struct mach_header_64         *Header;
+   struct segment_command_64     *Segments[MACHO_MAX_SEGMENTS];
+   uint32_t                      nSegments;
+   struct segment_command_64     *LinkEdit;        // __LINKEDIT (also in Segments[])
+   struct symtab_command         *Symtab;          // LC_SYMTAB
+   struct dysymtab_command       *Dysymtab;        // LC_DYSYMTAB
+   struct uuid_command           *UUID;            // LC_UUID
+   struct linkedit_data_command  *FunctionStarts;  // LC_FUNCTION_STARTS
+   uint32_t                      nFilesetEntries;  // Number of LC_FILESET_ENTRY commands
+   uint64_t                      Start;            // Lowest vmaddr of any segment but __LINKEDIT
+   uint64_t                      End;              // Highest vmaddr + vmsize of any segment but __LINKEDIT
+} MachOIndex;
+
+//
+// Is [Offset, Offset + Size) inside the file range of __LINKEDIT?
+//
+static int InLinkEdit(const struct segment_command_64 *LinkEdit, uint64_t Offset, uint64_t Size)
+{
+   return LinkEdit != NULL && Offset >= LinkEdit->fileoff && Size <= LinkEdit->filesize &&
+          Offset - LinkEdit->fileoff <= LinkEdit->filesize - Size;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Parse (and validate) the load commands of a 64-bit Mach-O image
+//
+// Returns MACHO_OK, or one of the MACHO_* error codes (in which case
+// the contents of <Index> should not be used).
+//
+//////////////////////////////////////////////////////////////////////
+static int ParseMachO(struct mach_header_64 *MachHeader, MachOIndex *Index)
+{
+   struct   load_command            *LoadCommands;
+   struct   segment_command_64      *Segment;
+   struct   fileset_entry_command   *Entry;
+   uint64_t                         Offset;
+   uint64_t                         CommandsEnd;
+   uint32_t                         i;
+
+   memset(Index, 0, sizeof(*Index));
+   Index->Header = MachHeader;
+   Index->Start = ~0ULL;
+   if (MachHeader->magic != MH_MAGIC_64)
+   {
+      return MACHO_BAD_MAGIC;
+   }
+
+   // The load commands immediately follow the header
+   CommandsEnd = sizeof(struct mach_header_64) + (uint64_t)MachHeader->sizeofcmds;
+   for (i = 0, Offset = sizeof(struct mach_header_64); i < MachHeader->ncmds; ++i, Offset += LoadCommands->cmdsize)
+   {
+      LoadCommands = (struct load_command *)((uint64_t)MachHeader + Offset);
+      if (Offset + sizeof(struct load_command) > CommandsEnd ||
+          LoadCommands->cmdsize < sizeof(struct load_command) || (LoadCommands->cmdsize & 7) != 0 ||
+          Offset + LoadCommands->cmdsize > CommandsEnd)
+      {
+         return MACHO_BAD_COMMAND;
+      }
+      switch (LoadCommands->cmd)
+      {
+         case LC_SEGMENT_64:
+            Segment = (struct segment_command_64 *)LoadCommands;
+            if (LoadCommands->cmdsize < sizeof(struct segment_command_64) ||
+                (LoadCommands->cmdsize - sizeof(struct segment_command_64)) / sizeof(struct section_64) < Segment->nsects ||
+                Segment->vmaddr + Segment->vmsize < Segment->vmaddr || Segment->fileoff + Segment->filesize < Segment->fileoff)
+            {
+               return MACHO_BAD_COMMAND;
+            }
+            if (Index->nSegments == MACHO_MAX_SEGMENTS)
+            {
+               return MACHO_TOO_MANY;
+            }
+            Index->Segments[Index->nSegments++] = Segment;
+            if (!strncmp(Segment->segname, SEG_LINKEDIT, sizeof(Segment->segname)))
+            {
+               Index->LinkEdit = Segment;
+            }
+            else if (Segment->vmsize != 0)
+            {
+               if (Segment->vmaddr < Index->Start)
+               {
+                  Index->Start = Segment->vmaddr;
+               }
+               if (Segment->vmaddr + Segment->vmsize > Index->End)
+               {
+                  Index->End = Segment->vmaddr + Segment->vmsize;
+               }
+            }
+            break;
+         case LC_SYMTAB:
+            if (LoadCommands->cmdsize < sizeof(struct symtab_command))
+            {
+               return MACHO_BAD_COMMAND;
+            }
+            Index->Symtab = (struct symtab_command *)LoadCommands;
+            break;
+         case LC_DYSYMTAB:
+            if (LoadCommands->cmdsize < sizeof(struct dysymtab_command))
+            {
+               return MACHO_BAD_COMMAND;
+            }
+            Index->Dysymtab = (struct dysymtab_command *)LoadCommands;
+            break;
+         case LC_UUID:
+            if (LoadCommands->cmdsize < sizeof(struct uuid_command))
+            {
+               return MACHO_BAD_COMMAND;
+            }
+            Index->UUID = (struct uuid_command *)LoadCommands;
+            break;
+         case LC_FUNCTION_STARTS:
+            if (LoadCommands->cmdsize < sizeof(struct linkedit_data_command))
+            {
+               return MACHO_BAD_COMMAND;
+            }
+            Index->FunctionStarts = (struct linkedit_data_command *)LoadCommands;
+            break;
+         case LC_FILESET_ENTRY:
+            // The entry's name must start, and end (with a NUL), inside the command
+            Entry = (struct fileset_entry_command *)LoadCommands;
+            if (LoadCommands->cmdsize <= sizeof(struct fileset_entry_command) ||
+                Entry->entry_id.offset < sizeof(struct fileset_entry_command) || Entry->entry_id.offset >= LoadCommands->cmdsize ||
+                ((const char *)Entry)[LoadCommands->cmdsize - 1] != '\0')
+            {
+               return MACHO_BAD_COMMAND;
+            }
+            ++Index->nFilesetEntries;
+            break;
+      }
+   }
+
+   // Now that we know where __LINKEDIT is, make sure everything that points into it stays inside it
+   if (Index->Symtab != NULL &&
+       (!InLinkEdit(Index->LinkEdit, Index->Symtab->symoff, (uint64_t)Index->Symtab->nsyms * sizeof(struct nlist_64)) ||
+        !InLinkEdit(Index->LinkEdit, Index->Symtab->stroff, Index->Symtab->strsize)))
+   {
+      return MACHO_BAD_LINKEDIT;
+   }
+   if (Index->Dysymtab != NULL && Index->Symtab != NULL &&
+       ((uint64_t)Index->Dysymtab->iextdefsym + Index->Dysymtab->nextdefsym > Index->Symtab->nsyms ||
+        (uint64_t)Index->Dysymtab->ilocalsym + Index->Dysymtab->nlocalsym > Index->Symtab->nsyms))
+   {
+      return MACHO_BAD_LINKEDIT;
+   }
+   if (Index->FunctionStarts != NULL &&
+       !InLinkEdit(Index->LinkEdit, Index->FunctionStarts->dataoff, Index->FunctionStarts->datasize))
+   {
+      return MACHO_BAD_LINKEDIT;
+   }
+   return MACHO_OK;
+}
+
 //////////////////////////////////////////////////////////////////////
 //
 // Find a 64-bit segment by name
 //
 //////////////////////////////////////////////////////////////////////
-static struct segment_command_64 *FindSegment64(struct mach_header_64 *MachHeader, const char *SegmentName)
+static struct segment_command_64 *FindSegment64(const MachOIndex *Index, const char *SegmentName)
+{
+   uint32_t i;
+
+   for (i = 0; i < Index->nSegments; ++i)
+   {
+      if (!strncmp(Index->Segments[i]->segname, SegmentName, sizeof(Index->Segments[i]->segname)))
+      {
+         return Index->Segments[i];
+      }
+   }
+   return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// v0.23 - Find a section by segment and section name
+//
+//////////////////////////////////////////////////////////////////////
+static struct section_64 *FindSection64(const MachOIndex *Index, const char *SegmentName, const char *SectionName)
+{
+   struct segment_command_64  *Segment;
+   struct section_64          *Section;
+   uint32_t                   i;
+
+   if ((Segment = FindSegment64(Index, SegmentName)) == NULL)
+   {
+      return NULL;
+   }
+   for (i = 0, Section = (struct section_64 *)(Segment + 1); i < Segment->nsects; ++i, ++Section)
+   {
+      if (!strncmp(Section->sectname, SectionName, sizeof(Section->sectname)))
+      {
+         return Section;
+      }
+   }
+   return NULL;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+//
+// v0.23 - Find the symbol table of a Mach-O image.
+//
+// Fills in <Symbols> (except for the address index), and returns 0 on
+// success, or one of the KLOOKUP_NO_* codes if the image has no
+// __LINKEDIT segment or no LC_SYMTAB.
+//
+//////////////////////////////////////////////////////////////////////
+#define KLOOKUP_NO_LINKEDIT   1
+#define KLOOKUP_NO_SYMTAB     2
+
+static int FindSymbolTable(const MachOIndex *Index, SymbolTableInfo *Symbols)
 {
-   struct   load_command         *LoadCommands;
-   struct   segment_command_64   *Segment = NULL;
-   struct   segment_command_64   *tmpSegment;
+   struct   segment_command_64   *LinkEdit = Index->LinkEdit;
+   struct   symtab_command       *SymbolTable = Index->Symtab;
+
+   if (LinkEdit == NULL)
+   {
+      return KLOOKUP_NO_LINKEDIT;
+   }
+   if (SymbolTable == NULL)
+   {
+      return KLOOKUP_NO_SYMTAB;
+   }
+
+   // Get the address of the string table
+   Symbols->StringTable = (char *)((int64_t)(LinkEdit->vmaddr - LinkEdit->fileoff) + SymbolTable->stroff);
+   // Get the address of the name list
+   Symbols->NameList = (struct nlist_64 *)((int64_t)(LinkEdit->vmaddr - LinkEdit->fileoff) + SymbolTable->symoff);
+   Symbols->nsyms = SymbolTable->nsyms;
+   Symbols->strsize = SymbolTable->strsize;
 
-   // Get the address of the list of load commands
-   LoadCommands = (struct load_command *)((uint64_t)MachHeader + sizeof(struct mach_header_64));
-   while ((uint64_t)LoadCommands < (uint64_t)MachHeader + (uint64_t)MachHeader->sizeofcmds)
+   //
+   // The great majority of the kernel's symbols are locals (and STABs) that we'll never
+   // ask for.  LC_DYSYMTAB tells us where the external definitions - which is what we're
+   // almost always after - sit in the name list.  The static linker sorts that range by
+   // name, but we check rather than assume, since it's cheap and only done once.
+   //
+   Symbols->iExtDef = Symbols->nExtDef = 0;
+   Symbols->ExtDefSorted = 0;
+   if (Index->Dysymtab != NULL && Index->Dysymtab->nextdefsym != 0)
    {
-      if (LoadCommands->cmd == LC_SEGMENT_64)
+      struct nlist_64   *ExtDef;
+      uint32_t          i;
+
+      Symbols->iExtDef = Index->Dysymtab->iextdefsym;
+      Symbols->nExtDef = Index->Dysymtab->nextdefsym;
+      ExtDef = Symbols->NameList + Symbols->iExtDef;
+      for (i = 1; i < Symbols->nExtDef; ++i)
       {
-         // evaluate segment
-         tmpSegment = (struct segment_command_64 *)LoadCommands;
-         if (!strcmp(tmpSegment->segname, SegmentName))
+         if (strcmp(Symbols->StringTable + ExtDef[i - 1].n_un.n_strx, Symbols->StringTable + ExtDef[i].n_un.n_strx) > 0)
          {
-            Segment = tmpSegment;
             break;
          }
       }
-        
-      // next load command
-      LoadCommands = (struct load_command *)((uint64_t)LoadCommands + (uint64_t)LoadCommands->cmdsize);
+      Symbols->ExtDefSorted = (i >= Symbols->nExtDef);
    }
 
-   return Segment;
+   return 0;
 }
 
+//
+// v0.23 - Does the string table entry at <Offset> match <Symbol> (whose length is <Length>)?
+//
+// The string table is one contiguous block of NUL-terminated names, so once we know
+// Offset + Length is inside it, we can check the entry's first character and the
+// terminating NUL where <Symbol>'s would be before bothering with a full compare.
+//
+static inline int NameMatches(SymbolTableInfo *Symbols, uint32_t Offset, const char *Symbol, uint32_t Length)
+{
+   const char *str;
+
+   if ((uint64_t)Offset + Length >= Symbols->strsize)
+   {
+      return 0;
+   }
+   str = Symbols->StringTable + Offset;
+   return str[Length] == '\0' && str[0] == Symbol[0] && !memcmp(str, Symbol, Length);
+}
+
+//
+// v0.23 - The run-time version of KSYM_HASH() (see klookup.h)
+//
+static uint32_t SymbolHash(const char *Name, uint32_t *Length)
+{
+   uint32_t Hash = 0;
+   uint32_t i;
+   int      Ended = 0;
+
+   for (i = 0; i < KSYM_HASH_CHARS; ++i)
+   {
+      if (!Ended && Name[i] == '\0')
+      {
+         Ended = 1;
+      }
+      Hash = Hash * KSYM_HASH_MULTIPLIER + (Ended ? 0 : (unsigned char)Name[i]);
+   }
+   *Length = (uint32_t)strlen(Name);
+   return Hash;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// v0.23 - Search a name list for <Symbol>.
+//
+// We try the external definitions first (binary search if they're
+// sorted, which they normally are), and only fall back to scanning
+// the rest of the name list (locals, etc.) if that misses.
+//
+// In the scan, the (known) length of <Symbol> lets us reject almost
+// every entry by looking at two bytes, without a full compare.
+//
+// Returns the symbol's associated address (and, if <Found> isn't NULL,
+// the string table's copy of its name), or NULL if not found.
+//
+//////////////////////////////////////////////////////////////////////
+static void *FindInNameList(SymbolTableInfo *Symbols, const char *Symbol, uint32_t Length, const char **Found)
+{
+   struct   nlist_64 *tmpNameList;
+   uint64_t i;
+   uint32_t Low, High, Middle;
+   int      Compare;
+
+   if (Symbols->nExtDef != 0)
+   {
+      tmpNameList = Symbols->NameList + Symbols->iExtDef;
+      if (Symbols->ExtDefSorted)
+      {
+         for (Low = 0, High = Symbols->nExtDef; Low < High; )
+         {
+            Middle = Low + (High - Low) / 2;
+            Compare = strcmp(Symbols->StringTable + tmpNameList[Middle].n_un.n_strx, Symbol);
+            if (Compare == 0)
+            {
+               tmpNameList += Middle;
+               goto Matched;
+            }
+            if (Compare < 0)
+            {
+               Low = Middle + 1;
+            }
+            else
+            {
+               High = Middle;
+            }
+         }
+      }
+      else
+      {
+         for (i = 0; i < Symbols->nExtDef; ++i)
+         {
+            if (NameMatches(Symbols, tmpNameList[i].n_un.n_strx, Symbol, Length))
+            {
+               tmpNameList += i;
+               goto Matched;
+            }
+         }
+      }
+   }
+
+   // Not an external definition - search everything else
+   for (i = 0, tmpNameList = Symbols->NameList; i < Symbols->nsyms; ++i, ++tmpNameList)
+   {
+      if (i == Symbols->iExtDef && Symbols->nExtDef != 0)
+      {
+         // Already searched these
+         i += Symbols->nExtDef - 1;
+         tmpNameList += Symbols->nExtDef - 1;
+         continue;
+      }
+      if (NameMatches(Symbols, tmpNameList->n_un.n_strx, Symbol, Length))
+      {
+         goto Matched;
+      }
+   }
+   return NULL;
+
+Matched:
+   // Found it - return its associated value (address)
+   if (Found != NULL)
+   {
+      *Found = Symbols->StringTable + tmpNameList->n_un.n_strx;
+   }
+   return (void *)tmpNameList->n_value;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// v0.23 - Find and index the kernel's Mach-O header(s).
+//
+// KernelFileIndex is the kernel's own header (as linked);  KernelIndex
+// is the header we get the kernel's symbol table from, which on Big
+// Sur and later is the one __PRELINK_TEXT points at (see below).  They
+// may be the same header.
+//
+// Also calculates the kernel slide (KernelSlide), which we need
+// again later for the kext images.
+//
+// Returns MACHO_OK, or one of the MACHO_* error codes.
+//
+//////////////////////////////////////////////////////////////////////
+static int64_t    KernelSlide = 0;
+static MachOIndex KernelFileIndex;
+static MachOIndex KernelIndex;
+
+static int IndexKernel(void)
+{
+   vm_offset_t                      SlideAddress = 0;
+   struct      mach_header_64       *MachHeader;
+   struct      segment_command_64   *PrelinkText;
+   int                              result;
+
+   //
+   // Calculate the kernel slide (ASLR):
+   //
+   // Get the un-slid address of the printf function
+   //
+   vm_kernel_unslide_or_perm_external((unsigned long long)(void *)printf, &SlideAddress);
+   //
+   // Now calculate the difference between that and the slid address of printf
+   //
+   KernelSlide = (long long)(void *)printf - SlideAddress;
+   //
+   // Now that we know the slide, we can figure out where the kernel's Mach-O structure is.
+   //
+   MachHeader = (struct mach_header_64 *)(KernelSlide + KERNEL_BASE);
+
+   // Check for a valid MACH-O header (and valid load commands)
+   if ((result = ParseMachO(MachHeader, &KernelFileIndex)) != MACHO_OK)
+   {
+      return result;
+   }
+
+   //
+   // If there's a __PRELINK_TEXT segment and it contains a vmaddr, we use that as the
+   // starting point to search for the __LINKEDIT segment.  (This appears to be a Big Sur
+   // addition, copying modified segments (such as __LINKEDIT) into a normally-empty
+   // __PRELINK_TEXT segment in memory;  the __PRELINK_TEXT segment is present in the
+   // Mach-O kernel file, but it's empty on disk.)
+   //
+   // Since __PRELINK_TEXT is apparently present in Catalina (and earlier?), but seems to
+   // be bogus (creates page faults) in those versions, we check for OS versions >= Big Sur.
+   //
+   if (version_major >= BIGSUR_XNU_MAJOR_VERSION)        // Only look at __PRELINK_TEXT on BS or later (Darwin version 20+)
+   {
+      // Find __PRELINK_TEXT
+      if ((PrelinkText = FindSegment64(&KernelFileIndex, LB_SEG_PRELINK_TEXT)) != NULL)
+      {
+         // If we found it, use its vmaddr as our Mach-O header
+         return ParseMachO((struct mach_header_64 *)(PrelinkText->vmaddr), &KernelIndex);
+      }
+      // If we didn't find __PRELINK_TEXT, just use the original Mach-O header.
+   }
+   KernelIndex = KernelFileIndex;
+
+   return MACHO_OK;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// v0.23 - Resolved symbol cache.
+//
+// Symbols are resolved into a small direct-mapped cache indexed by
+// their (precomputed) hash, so asking for the same symbol again -
+// from anywhere - costs a hash/length compare rather than a search.
+//
+// Two threads can want the same entry for different symbols, so
+// each entry has a sequence number, which is odd while somebody is
+// writing the entry.  A reader only trusts what it read if the
+// sequence number was even, and the same, before and after;  a
+// writer that finds the entry busy just doesn't cache its result.
+//
+//////////////////////////////////////////////////////////////////////
+#define SYMBOL_CACHE_SIZE     32       // Must be a power of 2
+
+typedef struct
+{
+   volatile UInt32   Sequence;         // v0.23 - Odd while the entry is being written
+   const char        *Name;
+   uint32_t          Length;
+   uint32_t          Hash;
+   void              *Address;
+} SymbolCacheEntry;
+
+static SymbolCacheEntry SymbolCache[SYMBOL_CACHE_SIZE];
+
+// v0.23 - Setting up KernelSymbols (see OnceBegin())
+static volatile UInt32  KernelOnce = ONCE_NEW;
+static int              KernelIndexed = 0;   // Non-zero if the kernel's load commands could be indexed
+static int              KernelReady = 0;     // Non-zero if KernelSymbols could be set up
+
+//
+// v0.23 - Find the kernel's Mach-O header and symbol table (once).
+// Returns non-zero if they're usable.
+//
+static int SetupKernelSymbols(void)
+{
+   int result;
+
+   if (!OnceBegin(&KernelOnce))
+   {
+      return KernelReady;
+   }
+   if ((result = IndexKernel()) == MACHO_BAD_MAGIC)
+   {
+      printf("\n\n****** ********* ********* Latebloom KLOOKUP: BAD MAGIC HEADER\n\n");
+      IOLog("latebloom: Bad Mach-O Magic Header\n");
+   }
+   else if (result != MACHO_OK)
+   {
+      printf("\n\n****** ********* ********* Latebloom KLOOKUP: BAD MACH-O LOAD COMMANDS (%d)\n\n", result);
+      IOLog("latebloom: Bad Mach-O load commands (%d)\n", result);
+   }
+   else
+   {
+      KernelIndexed = 1;
+      switch (FindSymbolTable(&KernelIndex, &KernelSymbols))
+      {
+         case KLOOKUP_NO_LINKEDIT:
+            printf("\n\n****** ********* ********* Latebloom KLOOKUP: __LINKEDIT NOT FOUND\n\n");
+            IOLog("latebloom: __LINKEDIT not found\n");
+            break;
+         case KLOOKUP_NO_SYMTAB:
+            printf("\n\n****** ********* ********* Latebloom KLOOKUP: LC_SYMTAB NOT FOUND\n\n");
+            IOLog("latebloom: LC_SYMTAB not found\n");
+            break;
+         default:
+            KernelReady = 1;
+            break;
+      }
+   }
+   OnceDone(&KernelOnce);
+   return KernelReady;
+}
 
 //////////////////////////////////////////////////////////////////////
 //
@@ -72,132 +691,680 @@ static struct segment_command_64 *FindSegment64(struct mach_header_64 *MachHeade
 //////////////////////////////////////////////////////////////////////
 void *SymbolLookup(const char *Symbol)
 {
-   // For effiency, we keep SymbolTable, StringTable, and NameList across invocations
-   static struct  symtab_command    *SymbolTable = NULL;
-   static void                      *StringTable = NULL;
-   static struct  nlist_64          *NameList = NULL;
-   vm_offset_t                      SlideAddress = 0;
-   int64_t                          Slide;
-   struct      mach_header_64       *MachHeader;
-   struct      segment_command_64   *LinkEdit;
-   struct      load_command         *LoadCommands;
-   struct      nlist_64             *tmpNameList;
+   KernelSymbol   Request;
+
+   // v0.23 - Same as a KERNEL_SYMBOL() handle, but hashed at run time
+   Request.Name = Symbol;
+   Request.Hash = SymbolHash(Symbol, &Request.Length);
+   return SymbolLookupRef(&Request);
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// v0.23 - Find the address of a symbol by handle (see klookup.h).
+//
+// Returns the symbol's associated address, or
+//         NULL if <Symbol> was not found.
+//
+//////////////////////////////////////////////////////////////////////
+void *SymbolLookupRef(const KernelSymbol *Symbol)
+{
+   SymbolCacheEntry                 *Cached;
+   const char                       *Name;
    void                             *Address;
-   uint64_t                         i;
+   UInt32                           Sequence;
+
+   // Compare the hash and length first;  only a likely hit gets a full compare
+   Cached = &SymbolCache[Symbol->Hash & (SYMBOL_CACHE_SIZE - 1)];
+   if (!((Sequence = Cached->Sequence) & 1))
+   {
+      OSMemoryBarrier();
+      Address = Cached->Address;
+      if (Address != NULL && Cached->Hash == Symbol->Hash && Cached->Length == Symbol->Length &&
+          (Cached->Name == Symbol->Name || !memcmp(Cached->Name, Symbol->Name, Symbol->Length)))
+      {
+         OSMemoryBarrier();
+         if (Cached->Sequence == Sequence)   // (nobody rewrote the entry while we were reading it)
+         {
+            return Address;
+         }
+      }
+   }
 
    //
-   // First, see if we've already found the symbol table and name list.
+   // First, make sure we've found the symbol table and name list.
    // (For effiency, we only parse the kernel's Mach-O structure once.)
    //
-   if (SymbolTable == NULL || StringTable == NULL || NameList == NULL)
+   if (!SetupKernelSymbols())
+   {
+      return NULL;
+   }
+
+   //
+   // Now loop through the name list until we find a match for <Symbol>
+   //
+   Address = FindInNameList(&KernelSymbols, Symbol->Name, Symbol->Length, &Name);
+
+   // Did we find <Symbol> in the name list?
+   if (Address == NULL)
+   {
+      printf("\n\n****** ********* ********* Latebloom KLOOKUP: SYMBOL '%s' NOT FOUND\n\n", Symbol->Name);
+      IOLog("latebloom: Symbol '%s' not found\n", Symbol->Name);
+   }
+   else
    {
       //
-      // Calculate the kernel slide (ASLR):
-      //
-      // Get the un-slid address of the printf function
-      //
-      vm_kernel_unslide_or_perm_external((unsigned long long)(void *)printf, &SlideAddress);
-      //
-      // Now calculate the difference between that and the slid address of printf
-      //
-      Slide = (long long)(void *)printf - SlideAddress;
-      //
-      // Now that we know the slide, we can figure out where the kernel's Mach-O structure is.
+      // Remember it.  SymbolLookup() names belong to the caller (and may not outlive the
+      // cache entry), so we always cache the string table's copy of the name instead.
       //
-      MachHeader = (struct mach_header_64 *)(Slide + KERNEL_BASE);
+      if (!((Sequence = Cached->Sequence) & 1) && OSCompareAndSwap(Sequence, Sequence + 1, &Cached->Sequence))
+      {
+         OSMemoryBarrier();
+         Cached->Name = Name;
+         Cached->Length = Symbol->Length;
+         Cached->Hash = Symbol->Hash;
+         Cached->Address = Address;
+         OSMemoryBarrier();
+         Cached->Sequence = Sequence + 2;
+      }
+   }
+
+   // Return either <Symbol>'s associated address, or NULL if we didn't find it.
+   return Address;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// v0.23 - Kext symbol lookup.
+//
+// SymbolLookup() only sees the kernel's own symbol table.  Starting
+// with Big Sur, the kernel and the kexts it boots with are linked
+// into a single "boot kernel collection", an MH_FILESET Mach-O whose
+// LC_FILESET_ENTRY load commands each describe one member image (the
+// kernel, or a kext), named by its bundle identifier.  Each member
+// has its own Mach-O header, and its own LC_SYMTAB pointing into the
+// collection's shared __LINKEDIT.
+//
+// We list the members the first time we're asked for a kext symbol,
+// but only look up a member's symbol table the first time somebody
+// asks for a symbol in that particular kext.
+//
+// If the kernel wasn't booted from a collection (i.e. an old-style
+// prelinked kernel), we fall back to walking __PRELINK_TEXT, where
+// the prelinked kexts' Mach-O images sit back to back on page
+// boundaries.  Those images are anonymous (their names are only in
+// the XML plist in __PRELINK_INFO), so in that case the bundle
+// identifier is ignored and every image is searched.
+//
+//////////////////////////////////////////////////////////////////////
+#define KC_KIND_PRIMARY       1        // KCKindPrimary (kc_kind_t, for PE_get_kc_header())
+#define KEXT_PAGE_SIZE        4096     // Alignment of prelinked kext images in __PRELINK_TEXT
+
+typedef struct
+{
+   const char              *BundleID;     // The fileset entry's name (NULL for __PRELINK_TEXT images)
+   struct mach_header_64   *Header;       // The image's Mach-O header
+   uint64_t                Start;         // Extent of the image's segments (not counting __LINKEDIT)
+   uint64_t                End;
+   MachOIndex              *Index;        // Load command index (built on first use)
+   SymbolTableInfo         Symbols;       // Symbol table (filled in on first use)
+   int                     Indexed;       // 0: not yet, 1: symbol table found, -1: no symbol table
+   volatile UInt32         IndexOnce;     // OnceBegin() state for Index/Symbols/Indexed
+} KextImage;
+
+static KextImage        *KextImages = NULL;  // The list of images
+static int              KextCount = 0;       // How many entries in KextImages
+static volatile UInt32  KextListOnce = ONCE_NEW;   // OnceBegin() state for KextImages/KextCount
+
+static const KernelSymbol GetKCHeaderSymbol = KERNEL_SYMBOL("_PE_get_kc_header");
+
+//
+// Find the boot kernel collection's MH_FILESET header (NULL if there isn't one)
+//
+static struct mach_header_64 *FindFilesetHeader(struct mach_header_64 *KernelHeader)
+{
+   typedef struct mach_header_64 *(*GetKCHeaderFunc)(int);
+   GetKCHeaderFunc   GetKCHeader;
+   struct mach_header_64 *Header;
 
-      // Check for a valid MACH-O header
-      if (MachHeader->magic != MH_MAGIC_64)
+   // The kernel header we use for symbol lookup may itself be the collection header
+   if (KernelHeader->filetype == MH_FILESET)
+   {
+      return KernelHeader;
+   }
+   // Otherwise, ask the kernel (PE_get_kc_header() is Big Sur+, and not part of any KPI)
+   if (version_major >= BIGSUR_XNU_MAJOR_VERSION)
+   {
+      if ((GetKCHeader = (GetKCHeaderFunc)SymbolLookupRef(&GetKCHeaderSymbol)) != NULL)
       {
-         printf("\n\n****** ********* ********* Latebloom KLOOKUP: BAD MAGIC HEADER\n\n");
-         IOLog("latebloom: Bad Mach-O Magic Header\n");
-         return NULL;
+         Header = GetKCHeader(KC_KIND_PRIMARY);
+         if (Header != NULL && Header->magic == MH_MAGIC_64 && Header->filetype == MH_FILESET)
+         {
+            return Header;
+         }
       }
+   }
+   return NULL;
+}
 
-      //
-      // If there's a __PRELINK_TEXT segment and it contains a vmaddr, we use that as the
-      // starting point to search for the __LINKEDIT segment.  (This appears to be a Big Sur
-      // addition, copying modified segments (such as __LINKEDIT) into a normally-empty
-      // __PRELINK_TEXT segment in memory;  the __PRELINK_TEXT segment is present in the
-      // Mach-O kernel file, but it's empty on disk.)
-      //
-      // Since __PRELINK_TEXT is apparently present in Catalina (and earlier?), but seems to
-      // be bogus (creates page faults) in those versions, we check for OS versions >= Big Sur.
-      //
-      if (version_major >= BIGSUR_XNU_MAJOR_VERSION)        // Only look at __PRELINK_TEXT on BS or later (Darwin version 20+)
+//
+// Add one image to the list (or, if <Pass> is 0, just count it).  Images whose
+// load commands don't pass ParseMachO()'s checks are skipped.
+//
+static void AddKextImage(int Pass, struct mach_header_64 *Image, const char *BundleID)
+{
+   MachOIndex Index;
+
+   if (ParseMachO(Image, &Index) != MACHO_OK)
+   {
+      return;
+   }
+   if (Pass == 1)
+   {
+      KextImages[KextCount].BundleID = BundleID;
+      KextImages[KextCount].Header = Image;
+      KextImages[KextCount].Start = Index.Start;
+      KextImages[KextCount].End = Index.End;
+   }
+   ++KextCount;
+}
+
+//
+// Build the list of kext images (but not their symbol indexes), the first time anybody needs it
+//
+static void BuildKextList(void);
+
+static void ListKextImages(void)
+{
+   if (OnceBegin(&KextListOnce))
+   {
+      BuildKextList();
+      OnceDone(&KextListOnce);
+   }
+}
+
+static void BuildKextList(void)
+{
+   MachOIndex                    FilesetIndex;
+   struct mach_header_64         *Fileset;
+   struct segment_command_64     *PrelinkText = NULL;
+   struct load_command           *LoadCommands;
+   struct fileset_entry_command  *Entry;
+   uint64_t                      Address;
+   uint32_t                      i;
+   int                           Pass;
+
+   // (The kernel's header is indexed along with its symbol table)
+   SetupKernelSymbols();
+   if (!KernelIndexed)
+   {
+      return;
+   }
+   if ((Fileset = FindFilesetHeader(KernelIndex.Header)) != NULL && ParseMachO(Fileset, &FilesetIndex) != MACHO_OK)
+   {
+      Fileset = NULL;
+   }
+   // No collection?  Then we'll walk __PRELINK_TEXT (in the kernel's own header, not the one we get symbols from)
+   if (Fileset == NULL && ((PrelinkText = FindSegment64(&KernelFileIndex, LB_SEG_PRELINK_TEXT)) == NULL || PrelinkText->vmsize == 0))
+   {
+      return;
+   }
+
+   // Two passes over the same data: the first counts the images, the second records them
+   for (Pass = 0; Pass < 2; ++Pass)
+   {
+      KextCount = 0;
+      if (Fileset != NULL)
+      {
+         // ParseMachO() has already checked every command (including the entries' names)
+         LoadCommands = (struct load_command *)((uint64_t)Fileset + sizeof(struct mach_header_64));
+         for (i = 0; i < Fileset->ncmds; ++i)
+         {
+            if (LoadCommands->cmd == LC_FILESET_ENTRY)
+            {
+               Entry = (struct fileset_entry_command *)LoadCommands;
+               AddKextImage(Pass, (struct mach_header_64 *)Entry->vmaddr, (const char *)Entry + Entry->entry_id.offset);
+            }
+            LoadCommands = (struct load_command *)((uint64_t)LoadCommands + (uint64_t)LoadCommands->cmdsize);
+         }
+      }
+      else
+      {
+         for (Address = PrelinkText->vmaddr; Address + sizeof(struct mach_header_64) <= PrelinkText->vmaddr + PrelinkText->vmsize; Address += KEXT_PAGE_SIZE)
+         {
+            if (((struct mach_header_64 *)Address)->magic == MH_MAGIC_64 && ((struct mach_header_64 *)Address)->filetype == MH_KEXT_BUNDLE)
+            {
+               AddKextImage(Pass, (struct mach_header_64 *)Address, NULL);
+            }
+         }
+      }
+      if (Pass == 0)
       {
-         // Find __PRELINK_TEXT
-         if ((LinkEdit = FindSegment64(MachHeader, LB_SEG_PRELINK_TEXT)) != NULL)
+         if (KextCount == 0 || (KextImages = LookupAlloc(KextCount * sizeof(KextImage))) == NULL)
          {
-            // If we found it, use its vmaddr as our Mach-O header
-            MachHeader = (struct mach_header_64 *)(LinkEdit->vmaddr);
+            KextCount = 0;
+            return;
          }
-         // If we didn't find __PRELINK_TEXT, just use the original Mach-O header.
+         memset(KextImages, 0, KextCount * sizeof(KextImage));
       }
+   }
+}
 
-      // find the __LINKEDIT segment
-      if (!(LinkEdit = FindSegment64(MachHeader, SEG_LINKEDIT)))
+//
+// Index a kext's load commands and find its symbol table, the first time we need them
+//
+static int IndexKext(KextImage *Kext)
+{
+   if (OnceBegin(&Kext->IndexOnce))
+   {
+      Kext->Indexed = -1;
+      if ((Kext->Index = LookupAlloc(sizeof(MachOIndex))) != NULL)
       {
-         printf("\n\n****** ********* ********* Latebloom KLOOKUP: __LINKEDIT NOT FOUND\n\n");
-         IOLog("latebloom: __LINKEDIT not found\n");
-         return NULL;
+         if (ParseMachO(Kext->Header, Kext->Index) != MACHO_OK)
+         {
+            LookupFree(Kext->Index, sizeof(MachOIndex));
+            Kext->Index = NULL;
+         }
+         else if (FindSymbolTable(Kext->Index, &Kext->Symbols) == 0)
+         {
+            Kext->Indexed = 1;
+         }
       }
+      OnceDone(&Kext->IndexOnce);
+   }
+   return Kext->Indexed;
+}
 
-      //
-      // Find the symbol table (LC_SYMTAB command)
-      //
-      SymbolTable = NULL;              // assume failure
-      // Get the list of load commands
-      LoadCommands = (struct load_command *)((uint64_t)MachHeader + sizeof(struct mach_header_64));
-      // Loop through the list of load commands, looking for LC_SYMTAB
-      while ((uint64_t)LoadCommands < (uint64_t)MachHeader + (uint64_t)MachHeader->sizeofcmds)
+//////////////////////////////////////////////////////////////////////
+//
+// Find the address of a symbol in a kext by name.
+//
+// <BundleID> is the kext's bundle identifier (for example,
+// "com.apple.iokit.IOPCIFamily"), or NULL to search every kext.
+//
+// Returns the symbol's associated address, or
+//         NULL if <symbol> was not found.
+//
+// Unlike SymbolLookup(), a miss is not considered an error (callers
+// usually have a fallback), so it's only logged, not printed.
+//
+//////////////////////////////////////////////////////////////////////
+void *KextSymbolLookup(const char *BundleID, const char *Symbol)
+{
+   KextImage   *Kext;
+   void        *Address;
+   int         i;
+
+   ListKextImages();
+   for (i = 0, Kext = KextImages; i < KextCount; ++i, ++Kext)
+   {
+      if (BundleID != NULL && Kext->BundleID != NULL && strcmp(BundleID, Kext->BundleID))
+      {
+         continue;
+      }
+      // Index this kext's symbol table the first time we need it
+      if (IndexKext(Kext) < 0)
       {
-         if (LoadCommands->cmd == LC_SYMTAB)
+         continue;
+      }
+      if ((Address = FindInNameList(&Kext->Symbols, Symbol, (uint32_t)strlen(Symbol), NULL)) != NULL)
+      {
+         //
+         // Symbol values in a collection's __LINKEDIT may or may not have been slid along with
+         // the images' load commands.  If the value doesn't land inside the kext, but the slid
+         // value does, use the slid value.
+         //
+         if (((uint64_t)Address < Kext->Start || (uint64_t)Address >= Kext->End) &&
+             (uint64_t)Address + KernelSlide >= Kext->Start && (uint64_t)Address + KernelSlide < Kext->End)
          {
-            // Found the symbol table
-            SymbolTable = (struct symtab_command *)LoadCommands;
-            break;
+            Address = (void *)((uint64_t)Address + KernelSlide);
          }
-         // Jump to the next load command
-         LoadCommands = (struct load_command *)((uint64_t)LoadCommands + (uint64_t)LoadCommands->cmdsize);
+         return Address;
       }
+   }
+   IOLog("latebloom: Kext symbol '%s' not found in %s\n", Symbol, BundleID ? BundleID : "any kext");
+   return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// v0.23 - Find a section of a kext (e.g. __TEXT,__text).
+//
+// Sets *Address and *Size, and returns non-zero if the section was
+// found, or returns 0 if it wasn't (or the kext wasn't found).
+//
+//////////////////////////////////////////////////////////////////////
+int KextSectionRange(const char *BundleID, const char *SegmentName, const char *SectionName, uint64_t *Address, uint64_t *Size)
+{
+   KextImage         *Kext;
+   struct section_64 *Section;
+   int               i;
 
-      // Did we find the symbol table?
-      if (SymbolTable == NULL)
+   ListKextImages();
+   for (i = 0, Kext = KextImages; i < KextCount; ++i, ++Kext)
+   {
+      if (Kext->BundleID == NULL || strcmp(BundleID, Kext->BundleID))
+      {
+         continue;
+      }
+      // The load command index is built along with the symbol table (even if there's no symbol table)
+      IndexKext(Kext);
+      if (Kext->Index != NULL && (Section = FindSection64(Kext->Index, SegmentName, SectionName)) != NULL)
       {
-         printf("\n\n****** ********* ********* Latebloom KLOOKUP: LC_SYMTAB NOT FOUND\n\n");
-         IOLog("latebloom: LC_SYMTAB not found\n");
-         return NULL;
+         *Address = Section->addr;
+         *Size = Section->size;
+         return 1;
       }
+      break;
+   }
+   return 0;
+}
 
-      // Get the address of the string table
-      StringTable = (void *)((int64_t)(LinkEdit->vmaddr - LinkEdit->fileoff) + SymbolTable->stroff);
-      // Get the address of the name list
-      NameList = (struct nlist_64 *)((int64_t)(LinkEdit->vmaddr - LinkEdit->fileoff) + SymbolTable->symoff);
-   }  // End if (SymbolTable == NULL || StringTable == NULL || NameList == NULL)
+//////////////////////////////////////////////////////////////////////
+//
+// v0.23 - Find a "code cave":  <Size> bytes of unused space in the
+// same image as <Near>, in an executable segment.
+//
+// Segments are page-aligned, and the last section in a segment
+// rarely ends on a page boundary, so there's usually some padding
+// left between the end of the last section and the end of the
+// segment.  It's mapped (executable, in a code segment), but nothing
+// uses it.  We only take it if it's still filled with padding (0x00
+// or int3), in case somebody else got there first.
+//
+// Returns the address (a multiple of <Align>, a power of 2), or 0 if
+// no image contains <Near>, or there's no room.
+//
+//////////////////////////////////////////////////////////////////////
+uint64_t KextCodeCave(uint64_t Near, uint32_t Size, uint32_t Align)
+{
+   KextImage                  *Kext;
+   struct segment_command_64  *Segment;
+   struct section_64          *Section;
+   uint64_t                   Start;
+   uint64_t                   i;
+   uint32_t                   j, k;
+   int                        n;
 
-   //
-   // Now loop through the name list until we find a match for <Symbol>
-   //
-   for (i = 0, Address = NULL, tmpNameList = NameList; i < SymbolTable->nsyms; ++i, ++tmpNameList)
+   ListKextImages();
+   for (n = 0, Kext = KextImages; n < KextCount; ++n, ++Kext)
    {
-      char *str = (char *)(StringTable + tmpNameList->n_un.n_strx);
+      if (Near < Kext->Start || Near >= Kext->End)
+      {
+         continue;
+      }
+      IndexKext(Kext);
+      if (Kext->Index == NULL)
+      {
+         return 0;
+      }
+      for (j = 0; j < Kext->Index->nSegments; ++j)
+      {
+         Segment = Kext->Index->Segments[j];
+         if (!(Segment->initprot & VM_PROT_EXECUTE) || Segment->nsects == 0)
+         {
+            continue;
+         }
+         // The padding starts where the last section ends
+         Start = Segment->vmaddr;
+         for (k = 0, Section = (struct section_64 *)(Segment + 1); k < Segment->nsects; ++k, ++Section)
+         {
+            if (Section->addr + Section->size > Start)
+            {
+               Start = Section->addr + Section->size;
+            }
+         }
+         Start = (Start + Align - 1) & ~(uint64_t)(Align - 1);
+         if (Start + Size > Segment->vmaddr + Segment->vmsize)
+         {
+            continue;
+         }
+         for (i = 0; i < Size; ++i)
+         {
+            if (((uint8_t *)Start)[i] != 0x00 && ((uint8_t *)Start)[i] != 0xcc)
+            {
+               break;
+            }
+         }
+         if (i == Size)
+         {
+            return Start;
+         }
+      }
+      return 0;
+   }
+   return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// v0.23 - Address-to-symbol reverse lookup (for diagnostics).
+//
+// The first time we're asked about an address in a given image, we
+// build an index of that image's defined (N_SECT, non-debugging)
+// symbols, sorted by address.  After that, each lookup is a binary
+// search.  The index holds 32-bit indexes into the name list, so it
+// costs 4 bytes per symbol.
+//
+//////////////////////////////////////////////////////////////////////
+#define MAX_SYMBOL_OFFSET     0x100000    // Don't claim an address is "symbol+offset" beyond this
+
+//
+// Sort helper: restore the heap property below <Root>
+//
+static void SiftDown(SymbolTableInfo *Symbols, uint32_t Root, uint32_t Count)
+{
+   uint32_t *Index = Symbols->ByAddress;
+   uint32_t Child;
+   uint32_t tmp;
 
-      if (!strcmp(str, Symbol))
+   while ((Child = 2 * Root + 1) < Count)
+   {
+      if (Child + 1 < Count && Symbols->NameList[Index[Child + 1]].n_value > Symbols->NameList[Index[Child]].n_value)
       {
-         // Found it - save its associated value (address)
-         Address = (void *)tmpNameList->n_value;
-         break;
+         ++Child;
       }
+      if (Symbols->NameList[Index[Root]].n_value >= Symbols->NameList[Index[Child]].n_value)
+      {
+         return;
+      }
+      tmp = Index[Root];
+      Index[Root] = Index[Child];
+      Index[Child] = tmp;
+      Root = Child;
    }
+}
 
-   // Did we find <Symbol> in the name list?
-   if (Address == NULL)
+//
+// Build the address index for <Symbols> (a heapsort, so no recursion and no extra memory)
+//
+static int BuildAddressIndex(SymbolTableInfo *Symbols)
+{
+   uint32_t i;
+   uint32_t Count = 0;
+   uint32_t tmp;
+
+   for (i = 0; i < Symbols->nsyms; ++i)
+   {
+      if (!(Symbols->NameList[i].n_type & N_STAB) && (Symbols->NameList[i].n_type & N_TYPE) == N_SECT)
+      {
+         ++Count;
+      }
+   }
+   if (Count == 0 || (Symbols->ByAddress = LookupAlloc(Count * sizeof(uint32_t))) == NULL)
+   {
+      return 0;
+   }
+   for (i = 0, Count = 0; i < Symbols->nsyms; ++i)
+   {
+      if (!(Symbols->NameList[i].n_type & N_STAB) && (Symbols->NameList[i].n_type & N_TYPE) == N_SECT)
+      {
+         Symbols->ByAddress[Count++] = i;
+      }
+   }
+   for (i = Count / 2; i > 0; --i)
+   {
+      SiftDown(Symbols, i - 1, Count);
+   }
+   for (i = Count - 1; i > 0; --i)
    {
-      printf("\n\n****** ********* ********* Latebloom KLOOKUP: SYMBOL '%s' NOT FOUND\n\n", Symbol);
-      IOLog("latebloom: Symbol '%s' not found\n", Symbol);
+      tmp = Symbols->ByAddress[0];
+      Symbols->ByAddress[0] = Symbols->ByAddress[i];
+      Symbols->ByAddress[i] = tmp;
+      SiftDown(Symbols, 0, i);
    }
+   Symbols->nByAddress = Count;
+   return 1;
+}
 
-   // Return either <Symbol>'s associated address, or NULL if we didn't find it.
-   return Address;
+//
+// Find the closest symbol at or below <Address> in one image
+//
+static const char *FindByAddress(SymbolTableInfo *Symbols, uint64_t Address, uint64_t *Offset)
+{
+   uint32_t Low = 0;
+   uint32_t High;
+   uint32_t Mid;
+   struct nlist_64 *Found;
+
+   if (OnceBegin(&Symbols->AddressOnce))
+   {
+      BuildAddressIndex(Symbols);
+      OnceDone(&Symbols->AddressOnce);
+   }
+   if (Symbols->ByAddress == NULL)
+   {
+      return NULL;
+   }
+   // Find the last entry whose address is <= <Address>
+   High = Symbols->nByAddress;
+   while (Low < High)
+   {
+      Mid = Low + (High - Low) / 2;
+      if (Symbols->NameList[Symbols->ByAddress[Mid]].n_value <= Address)
+      {
+         Low = Mid + 1;
+      }
+      else
+      {
+         High = Mid;
+      }
+   }
+   if (Low == 0)
+   {
+      return NULL;
+   }
+   Found = &Symbols->NameList[Symbols->ByAddress[Low - 1]];
+   if (Address - Found->n_value > MAX_SYMBOL_OFFSET)
+   {
+      return NULL;
+   }
+   *Offset = Address - Found->n_value;
+   return Symbols->StringTable + Found->n_un.n_strx;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Find the symbol an address belongs to.
+//
+// Returns the name of the closest symbol at or below <Address>, and
+// sets *Offset to <Address>'s offset from it, and *Image (if not NULL)
+// to the bundle identifier of the kext it's in ("kernel" for the
+// kernel itself, NULL if unknown).
+// Returns NULL if <Address> couldn't be matched to a symbol.
+//
+//////////////////////////////////////////////////////////////////////
+const char *SymbolForAddress(void *Address, uint64_t *Offset, const char **Image)
+{
+   KextImage   *Kext;
+   const char  *Name;
+   int         i;
+
+   if (Image != NULL)
+   {
+      *Image = NULL;
+   }
+   // Does it belong to a kext?  (Only kexts whose image contains <Address> are indexed.)
+   ListKextImages();
+   for (i = 0, Kext = KextImages; i < KextCount; ++i, ++Kext)
+   {
+      if ((uint64_t)Address < Kext->Start || (uint64_t)Address >= Kext->End || IndexKext(Kext) < 0)
+      {
+         continue;
+      }
+      // (see KextSymbolLookup() about symbol values in a collection possibly being unslid)
+      if ((Name = FindByAddress(&Kext->Symbols, (uint64_t)Address, Offset)) != NULL ||
+          (Name = FindByAddress(&Kext->Symbols, (uint64_t)Address - KernelSlide, Offset)) != NULL)
+      {
+         if (Image != NULL)
+         {
+            *Image = Kext->BundleID;
+         }
+         return Name;
+      }
+   }
+   // Otherwise, try the kernel
+   if (SetupKernelSymbols() && (Name = FindByAddress(&KernelSymbols, (uint64_t)Address, Offset)) != NULL)
+   {
+      if (Image != NULL)
+      {
+         *Image = "kernel";
+      }
+      return Name;
+   }
+   return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// v0.23 - How much memory (bytes) the lookup tables are holding
+//
+//////////////////////////////////////////////////////////////////////
+size_t KLookupFootprint(void)
+{
+   return LookupBytes;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// v0.23 - Free the lookup tables (the kext list, the kexts' load
+// command indexes, and the address indexes).
+//
+// The kernel's own index and symbol table info point into the
+// kernel image, so they stay.  Anything freed here is rebuilt
+// if it's needed again, so a later lookup still works;  it just
+// costs the memory (and the time) all over again.  This must not
+// be called while a lookup might be in progress.
+//
+//////////////////////////////////////////////////////////////////////
+void KLookupRelease(void)
+{
+   KextImage   *Kext;
+   int         i;
+
+   for (i = 0, Kext = KextImages; i < KextCount; ++i, ++Kext)
+   {
+      if (Kext->Index != NULL)
+      {
+         LookupFree(Kext->Index, sizeof(MachOIndex));
+      }
+      if (Kext->Symbols.ByAddress != NULL)
+      {
+         LookupFree(Kext->Symbols.ByAddress, Kext->Symbols.nByAddress * sizeof(uint32_t));
+      }
+   }
+   if (KextImages != NULL)
+   {
+      LookupFree(KextImages, KextCount * sizeof(KextImage));
+      KextImages = NULL;
+   }
+   KextCount = 0;
+   KextListOnce = ONCE_NEW;
+   if (KernelSymbols.ByAddress != NULL)
+   {
+      LookupFree(KernelSymbols.ByAddress, KernelSymbols.nByAddress * sizeof(uint32_t));
+      KernelSymbols.ByAddress = NULL;
+      KernelSymbols.nByAddress = 0;
+   }
+   KernelSymbols.AddressOnce = ONCE_NEW;
 }
@@ -26,11 +26,54 @@
 #include <sys/sysctl.h>
 #include <libkern/version.h>
 
+//
+// v0.23 - Symbol handles.
+//
+// A KernelSymbol carries the symbol's name along with its length and
+// hash, both computed by the compiler when the handle is declared with
+// KERNEL_SYMBOL() (the name must be a string literal), e.g.
+//
+//    static const KernelSymbol PEBootArgsSymbol = KERNEL_SYMBOL("_PE_boot_args");
+//
+// The hash is a Horner-style polynomial over the first KSYM_HASH_CHARS
+// characters, zero-padded;  SymbolHash() in klookup.c computes the same
+// value at run time, and the two must be kept in step.
+//
+typedef struct
+{
+   const char  *Name;      // The symbol's name (including the leading '_')
+   uint32_t    Length;     // strlen(Name)
+   uint32_t    Hash;       // KSYM_HASH(Name)
+} KernelSymbol;
+
+#define KSYM_HASH_CHARS       64             // How many characters of the name are hashed
+#define KSYM_HASH_MULTIPLIER  0x01000193U    // (the 32-bit FNV prime)
+
+#define KSYM_CHAR(s,i)        ((uint32_t)(sizeof(s) > (i) + 1 ? (unsigned char)(s)[i] : 0))
+#define KSYM_HASH1(s,i,h)     ((h) * KSYM_HASH_MULTIPLIER + KSYM_CHAR(s,i))
+#define KSYM_HASH2(s,i,h)     KSYM_HASH1(s, (i) + 1, KSYM_HASH1(s, i, h))
+#define KSYM_HASH4(s,i,h)     KSYM_HASH2(s, (i) + 2, KSYM_HASH2(s, i, h))
+#define KSYM_HASH8(s,i,h)     KSYM_HASH4(s, (i) + 4, KSYM_HASH4(s, i, h))
+#define KSYM_HASH16(s,i,h)    KSYM_HASH8(s, (i) + 8, KSYM_HASH8(s, i, h))
+#define KSYM_HASH32(s,i,h)    KSYM_HASH16(s, (i) + 16, KSYM_HASH16(s, i, h))
+#define KSYM_HASH64(s,i,h)    KSYM_HASH32(s, (i) + 32, KSYM_HASH32(s, i, h))
+#define KSYM_HASH(s)          ((uint32_t)KSYM_HASH64(s, 0, 0U))
+
+#define KERNEL_SYMBOL(s)      { (s), (uint32_t)(sizeof(s) - 1), KSYM_HASH(s) }
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
     void *SymbolLookup(const char *symbol);
+    void *SymbolLookupRef(const KernelSymbol *Symbol);                  // v0.23
+    void *KextSymbolLookup(const char *BundleID, const char *Symbol);   // v0.23
+    const char *SymbolForAddress(void *Address, uint64_t *Offset, const char **Image);   // v0.23
+    int KextSectionRange(const char *BundleID, const char *SegmentName, const char *SectionName,
+                         uint64_t *Address, uint64_t *Size);                                 // v0.23
+    uint64_t KextCodeCave(uint64_t Near, uint32_t Size, uint32_t Align); // v0.23
+    size_t KLookupFootprint(void);                                      // v0.23
+    void KLookupRelease(void);                                          // v0.23
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,533 @@
+//
+// kpatch.c
+//
+// Kernel text patching functions
+//
+////////////////////////////////////////////////////////////////////////////////
+// License: 0BSD                                                              //
+//                                                                            //
+// Copyright (C) 2021 by Syncretic                                            //
+//                                                                            //
+// Permission to use, copy, modify, and/or distribute this software for any   //
+// purpose with or without fee is hereby granted.                             //
+//                                                                            //
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES   //
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF           //
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR    //
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES     //
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN      //
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR //
+// IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.                //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include "kpatch.h"
+#include "klookup.h"
+#include <IOKit/IOLib.h>
+#include <i386/proc_reg.h>
+
+//
+// Up through v0.22, latebloom placed its hook by turning off interrupts, clearing CR0.WP
+// on the current CPU, and writing the 14-byte long jump with two non-atomic movq's.  That
+// was good enough while the hook was only placed from latebloom_start() during single-threaded
+// early boot, but any other CPU executing the target while the bytes were changing could
+// see a torn instruction stream.
+//
+// The routines here write through a temporary writable alias of the target's physical page(s)
+// instead, and publish a live patch in an order that's safe for other CPUs:
+//
+//    1) Atomically replace the first two bytes with "jmp ." (eb fe).  Any CPU that arrives
+//       at the patch site from now on just spins in place.
+//    2) Write the body of the patch (everything past the first two bytes).
+//    3) Atomically replace the "jmp ." with the first two bytes of the patch.
+//
+// Every step is followed by a serializing instruction on every CPU, per the Intel SDM's
+// cross-modifying code guidelines.
+//
+// What this can't protect against is a CPU that is already *inside* the patched range (past
+// its first instruction) when step 2 happens.  For the sites latebloom patches (a handful of
+// simple movq's in the middle of a loop), that window is a few instructions wide, and it's
+// the same window every inline hooking technique has to live with.
+//
+// If the alias can't be created, and latebloom_start() has said it's still running single-
+// threaded (see TextAllowCR0()), we fall back to the v0.22 method:  interrupts off, CR0.WP
+// clear, write the bytes, put CR0 back.  Nothing else can be executing the target then, so
+// the guard sequence isn't needed.  JournalFormat() shows how many patches took each path.
+//
+#define JMP_SELF              0xfeeb      // "jmp ." (eb fe), stored little-endian
+#define CACHE_LINE_SIZE       64
+
+//
+// v0.23 - the patch journal.  Every patch we make through JournalPatch() is recorded
+// here, along with the bytes it replaced and a checksum of the entry itself, so that
+// we can verify the patch after writing it, and put the original bytes back later
+// (on disarm, or before unloading).  The journal is a small fixed-size table;  latebloom
+// only ever has a handful of patches in place.
+//
+static struct
+{
+   uint64_t       Address;                      // Where the patch was written
+   uint32_t       Length;                       // Number of bytes patched
+   uint32_t       State;                        // KPATCH_STATE_*
+   uint32_t       Method;                       // KPATCH_METHOD_* (how the last write to it was made)
+   unsigned char  Original[KPATCH_MAX_BYTES];   // The bytes we replaced
+   unsigned char  Patched[KPATCH_MAX_BYTES];    // The bytes we wrote
+   uint32_t       Checksum;                     // Covers everything above
+} Journal[KPATCH_JOURNAL_SIZE];
+
+static const char *JournalStateNames[] = { "empty", "applied", "reverted", "FAILED" };
+static const char *MethodNames[] = { "alias", "CR0.WP" };
+
+// How the most recent TextWrite()/TextPoke() got its bytes in, and how often each method was used
+static uint32_t         LastMethod = KPATCH_METHOD_ALIAS;
+static uint32_t         MethodCount[KPATCH_METHOD_COUNT];
+// Whether the CR0.WP fallback may be used (see TextAllowCR0())
+static int              CR0Allowed = 0;
+
+//
+// mp_rendezvous_no_intrs(), pmap_find_phys() and kernel_pmap aren't part of any KPI, so we look
+// them up the first time we need them.  (That's during latebloom_start(), before the lookup
+// tables are freed, so they're still around for rolling back the journal at unload time.)
+//
+typedef void (*RendezvousFunc)(void (*action)(void *), void *arg);
+typedef ppnum_t (*FindPhysFunc)(void *pmap, addr64_t va);
+static RendezvousFunc   Rendezvous = NULL;
+static FindPhysFunc     FindPhys = NULL;
+static void             **KernelPmap = NULL;
+static int              SymbolsLookedUp = 0;
+static const KernelSymbol RendezvousSymbol = KERNEL_SYMBOL("_mp_rendezvous_no_intrs");
+static const KernelSymbol FindPhysSymbol = KERNEL_SYMBOL("_pmap_find_phys");
+static const KernelSymbol KernelPmapSymbol = KERNEL_SYMBOL("_kernel_pmap");
+
+static void LookupSymbols(void)
+{
+   if (!SymbolsLookedUp)
+   {
+      Rendezvous = (RendezvousFunc)SymbolLookupRef(&RendezvousSymbol);
+      FindPhys = (FindPhysFunc)SymbolLookupRef(&FindPhysSymbol);
+      KernelPmap = (void **)SymbolLookupRef(&KernelPmapSymbol);
+      SymbolsLookedUp = 1;
+   }
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Execute a serializing instruction (CPUID) on the current CPU
+//
+//////////////////////////////////////////////////////////////////////
+static void SerializeCPU(void *Unused)
+{
+   unsigned int eax = 0, ebx, ecx = 0, edx;
+
+   (void)Unused;
+   asm volatile ("cpuid" : "+a" (eax), "=b" (ebx), "+c" (ecx), "=d" (edx) : : "memory");
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Execute a serializing instruction on every CPU
+//
+// If mp_rendezvous_no_intrs() isn't available (which should only
+// happen if some future kernel renames it), we can only serialize
+// the current CPU.  Other CPUs will still pick up the change the
+// next time they execute a serializing instruction (any interrupt
+// will do), but they aren't guaranteed to see it immediately.
+//
+//////////////////////////////////////////////////////////////////////
+static void SerializeAllCPUs(void)
+{
+   LookupSymbols();
+   if (Rendezvous != NULL)
+   {
+      Rendezvous(SerializeCPU, NULL);
+   }
+   else
+   {
+      SerializeCPU(NULL);
+   }
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Map the physical page(s) behind <Address> .. <Address + Length> a
+// second time, writable, and return the alias of <Address> (NULL if
+// that can't be done).  Kernel text is mapped read/execute only, and
+// its map entries can't be made writable, so we go by the physical
+// address instead of asking the VM layer for a writable view of the
+// existing mapping.  A range that spans two pages needs them to be
+// physically contiguous (they almost always are, for kernel text).
+//
+//////////////////////////////////////////////////////////////////////
+static unsigned char *AliasText(void *Address, size_t Length, void **Cookie)
+{
+   uint64_t Virtual = (uint64_t)Address;
+   uint64_t Last = Virtual + Length - 1;
+   ppnum_t  FirstPage, LastPage;
+
+   LookupSymbols();
+   if (FindPhys == NULL || KernelPmap == NULL || *KernelPmap == NULL)
+   {
+      return NULL;
+   }
+   if ((FirstPage = FindPhys(*KernelPmap, (addr64_t)Virtual)) == 0)
+   {
+      return NULL;
+   }
+   if ((Last >> PAGE_SHIFT) != (Virtual >> PAGE_SHIFT))
+   {
+      LastPage = FindPhys(*KernelPmap, (addr64_t)Last);
+      if (LastPage != FirstPage + 1)
+      {
+         return NULL;
+      }
+   }
+   return (unsigned char *)MapWritableAlias(((uint64_t)FirstPage << PAGE_SHIFT) | (Virtual & PAGE_MASK), Length, Cookie);
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// The v0.22 method:  write <Length> bytes at <Address> with interrupts
+// off and CR0.WP clear on this CPU.  Only safe while nothing else can
+// be executing (or about to execute) the target.
+//
+//////////////////////////////////////////////////////////////////////
+static void WriteWithCR0(void *Address, const void *Bytes, size_t Length)
+{
+   uintptr_t   CR0;
+   uint64_t    Flags;
+   size_t      i;
+
+   asm volatile ("pushfq; popq %0; cli" : "=r" (Flags) : : "memory");
+   CR0 = get_cr0();
+   set_cr0(CR0 & ~CR0_WP);
+   for (i = 0; i < Length; ++i)
+   {
+      ((volatile unsigned char *)Address)[i] = ((const unsigned char *)Bytes)[i];
+   }
+   set_cr0(CR0);
+   if (Flags & 0x200)               // (RFLAGS.IF)
+   {
+      asm volatile ("sti" : : : "memory");
+   }
+   SerializeAllCPUs();
+   LastMethod = KPATCH_METHOD_CR0;
+   ++MethodCount[KPATCH_METHOD_CR0];
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Allow (or stop allowing) the CR0.WP fallback.  latebloom_start()
+// allows it while it's placing the hook, and stops allowing it once
+// the hook is armed;  from then on, it's alias or nothing.
+//
+//////////////////////////////////////////////////////////////////////
+void TextAllowCR0(int Allowed)
+{
+   CR0Allowed = Allowed;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// How the most recent TextWrite()/TextPoke() was done (KPATCH_METHOD_*)
+//
+//////////////////////////////////////////////////////////////////////
+const char *TextMethodName(void)
+{
+   return MethodNames[LastMethod];
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Write <Length> bytes of kernel text that nothing is executing yet
+// (such as the exit stub of our own hook code).
+//
+// Returns KPATCH_OK, or one of the KPATCH_* error codes.
+//
+//////////////////////////////////////////////////////////////////////
+int TextWrite(void *Address, const void *Bytes, size_t Length)
+{
+   void  *Cookie;
+   unsigned char *Alias;
+
+   if (Address == NULL || Bytes == NULL || Length == 0)
+   {
+      return KPATCH_BAD_ARGS;
+   }
+   if ((Alias = AliasText(Address, Length, &Cookie)) == NULL)
+   {
+      if (!CR0Allowed)
+      {
+         return KPATCH_NO_ALIAS;
+      }
+      WriteWithCR0(Address, Bytes, Length);
+      return KPATCH_OK;
+   }
+   memcpy(Alias, Bytes, Length);
+   UnmapWritableAlias(Cookie);
+   SerializeAllCPUs();
+   LastMethod = KPATCH_METHOD_ALIAS;
+   ++MethodCount[KPATCH_METHOD_ALIAS];
+
+   return KPATCH_OK;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Patch <Length> bytes of live kernel text at <Address>, using the
+// guard/body/opcode sequence described above.
+//
+// Returns KPATCH_OK, or one of the KPATCH_* error codes.  If an
+// error is returned, the target has not been modified.
+//
+//////////////////////////////////////////////////////////////////////
+int TextPoke(void *Address, const void *Bytes, size_t Length)
+{
+   void              *Cookie;
+   unsigned char     *Alias;
+   const unsigned char *NewBytes = (const unsigned char *)Bytes;
+   volatile uint16_t *Head;
+   size_t            i;
+
+   if (Address == NULL || Bytes == NULL || Length < KPATCH_GUARD_SIZE || Length > KPATCH_MAX_BYTES)
+   {
+      return KPATCH_BAD_ARGS;
+   }
+   // A 16-bit store is only atomic (as seen by other CPUs' instruction fetch) if it doesn't straddle a cache line
+   if (((uint64_t)Address % CACHE_LINE_SIZE) == CACHE_LINE_SIZE - 1)
+   {
+      return KPATCH_SPLIT_LINE;
+   }
+   if ((Alias = AliasText(Address, Length, &Cookie)) == NULL)
+   {
+      if (!CR0Allowed)
+      {
+         return KPATCH_NO_ALIAS;
+      }
+      WriteWithCR0(Address, Bytes, Length);
+      return KPATCH_OK;
+   }
+   Head = (volatile uint16_t *)Alias;
+
+   // Step 1: park any newcomers on a "jmp ."
+   *Head = JMP_SELF;
+   SerializeAllCPUs();
+
+   // Step 2: the body
+   for (i = KPATCH_GUARD_SIZE; i < Length; ++i)
+   {
+      ((volatile unsigned char *)Alias)[i] = NewBytes[i];
+   }
+   SerializeAllCPUs();
+
+   // Step 3: release the guard by publishing the first two bytes
+   *Head = (uint16_t)(NewBytes[0] | (NewBytes[1] << 8));
+   SerializeAllCPUs();
+
+   UnmapWritableAlias(Cookie);
+   LastMethod = KPATCH_METHOD_ALIAS;
+   ++MethodCount[KPATCH_METHOD_ALIAS];
+
+   return KPATCH_OK;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Checksum a journal entry (FNV-1a over everything but the checksum)
+//
+//////////////////////////////////////////////////////////////////////
+static uint32_t JournalChecksum(int Entry)
+{
+   const unsigned char  *ptr = (const unsigned char *)&Journal[Entry];
+   size_t               i;
+   uint32_t             Hash = 2166136261u;
+
+   for (i = 0; i < __builtin_offsetof(__typeof__(Journal[0]), Checksum); ++i)
+   {
+      Hash = (Hash ^ ptr[i]) * 16777619u;
+   }
+   return Hash;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Patch live kernel text (via TextPoke()), recording the change in
+// the journal and verifying it byte-for-byte afterwards.  If the
+// verification fails, the original bytes are put back.
+//
+// On success, *Entry receives the journal entry number (for use
+// with JournalRollback()).
+//
+// Returns KPATCH_OK, or one of the KPATCH_* error codes.
+//
+//////////////////////////////////////////////////////////////////////
+int JournalPatch(void *Address, const void *Bytes, size_t Length, int *Entry)
+{
+   int i;
+   int result;
+
+   if (Address == NULL || Bytes == NULL || Length < KPATCH_GUARD_SIZE || Length > KPATCH_MAX_BYTES)
+   {
+      return KPATCH_BAD_ARGS;
+   }
+   // Find a free entry (reverted entries can be reused)
+   for (i = 0; i < KPATCH_JOURNAL_SIZE; ++i)
+   {
+      if (Journal[i].State == KPATCH_STATE_EMPTY || Journal[i].State == KPATCH_STATE_REVERTED)
+      {
+         break;
+      }
+   }
+   if (i == KPATCH_JOURNAL_SIZE)
+   {
+      return KPATCH_JOURNAL_FULL;
+   }
+
+   // Record the change before we make it
+   memset(&Journal[i], 0, sizeof(Journal[i]));
+   Journal[i].Address = (uint64_t)Address;
+   Journal[i].Length = (uint32_t)Length;
+   memcpy(Journal[i].Original, Address, Length);
+   memcpy(Journal[i].Patched, Bytes, Length);
+
+   if ((result = TextPoke(Address, Bytes, Length)) != KPATCH_OK)
+   {
+      return result;    // nothing was written, so leave the entry free
+   }
+   // Read it back through the original mapping
+   if (memcmp(Address, Bytes, Length))
+   {
+      Journal[i].Method = LastMethod;
+      TextPoke(Address, Journal[i].Original, Length);
+      Journal[i].State = KPATCH_STATE_FAILED;
+      Journal[i].Checksum = JournalChecksum(i);
+      return KPATCH_VERIFY_FAILED;
+   }
+   Journal[i].State = KPATCH_STATE_APPLIED;
+   Journal[i].Method = LastMethod;
+   Journal[i].Checksum = JournalChecksum(i);
+   if (Entry != NULL)
+   {
+      *Entry = i;
+   }
+   return KPATCH_OK;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Put back the original bytes for one journal entry.
+//
+// We refuse to touch the target if the entry itself looks corrupt,
+// or if the target no longer contains the bytes we wrote (someone
+// else has patched over us, and blindly restoring our copy of the
+// original bytes would clobber their patch).
+//
+// Returns KPATCH_OK, or one of the KPATCH_* error codes.
+//
+//////////////////////////////////////////////////////////////////////
+int JournalRollback(int Entry)
+{
+   int result;
+
+   if (Entry < 0 || Entry >= KPATCH_JOURNAL_SIZE || Journal[Entry].Checksum != JournalChecksum(Entry))
+   {
+      return KPATCH_BAD_ENTRY;
+   }
+   if (Journal[Entry].State != KPATCH_STATE_APPLIED)
+   {
+      return (Journal[Entry].State == KPATCH_STATE_REVERTED) ? KPATCH_OK : KPATCH_BAD_ENTRY;
+   }
+   if (memcmp((void *)Journal[Entry].Address, Journal[Entry].Patched, Journal[Entry].Length))
+   {
+      return KPATCH_MODIFIED;
+   }
+   if ((result = TextPoke((void *)Journal[Entry].Address, Journal[Entry].Original, Journal[Entry].Length)) != KPATCH_OK)
+   {
+      return result;
+   }
+   if (memcmp((void *)Journal[Entry].Address, Journal[Entry].Original, Journal[Entry].Length))
+   {
+      return KPATCH_VERIFY_FAILED;
+   }
+   Journal[Entry].State = KPATCH_STATE_REVERTED;
+   Journal[Entry].Method = LastMethod;
+   Journal[Entry].Checksum = JournalChecksum(Entry);
+
+   return KPATCH_OK;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Roll back every applied patch, newest first.
+//
+// Returns KPATCH_OK if everything was rolled back, otherwise the
+// first error encountered (we keep going, to undo as much as we can).
+//
+//////////////////////////////////////////////////////////////////////
+int JournalRollbackAll(void)
+{
+   int i;
+   int result;
+   int FirstError = KPATCH_OK;
+
+   for (i = KPATCH_JOURNAL_SIZE - 1; i >= 0; --i)
+   {
+      if (Journal[i].State == KPATCH_STATE_APPLIED)
+      {
+         if ((result = JournalRollback(i)) != KPATCH_OK && FirstError == KPATCH_OK)
+         {
+            FirstError = result;
+         }
+      }
+   }
+   return FirstError;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Format the journal as text (for /dev/latebloom).
+//
+// Returns the number of characters placed in <Buffer> (not counting
+// the terminating NUL).
+//
+//////////////////////////////////////////////////////////////////////
+int JournalFormat(char *Buffer, size_t Size)
+{
+   size_t   Length = 0;
+   int      i;
+   uint32_t j;
+
+   if (Size == 0)
+   {
+      return 0;
+   }
+   Buffer[0] = '\0';
+   Length += snprintf(Buffer, Size, "patching: %u via alias, %u via CR0.WP\n",
+                      MethodCount[KPATCH_METHOD_ALIAS], MethodCount[KPATCH_METHOD_CR0]);
+   for (i = 0; i < KPATCH_JOURNAL_SIZE && Length < Size; ++i)
+   {
+      if (Journal[i].State == KPATCH_STATE_EMPTY)
+      {
+         continue;
+      }
+      Length += snprintf(&Buffer[Length], Size - Length, "patch %d: %-8s (%s) @ 0x%016llx len %u csum %08x %s\n   orig:",
+                         i, JournalStateNames[Journal[i].State], MethodNames[Journal[i].Method], (unsigned long long)Journal[i].Address, Journal[i].Length, Journal[i].Checksum,
+                         (Journal[i].Checksum == JournalChecksum(i)) ? "ok" : "BAD");
+      for (j = 0; j < Journal[i].Length && Length < Size; ++j)
+      {
+         Length += snprintf(&Buffer[Length], Size - Length, " %02x", Journal[i].Original[j]);
+      }
+      if (Length < Size)
+      {
+         Length += snprintf(&Buffer[Length], Size - Length, "\n   new: ");
+      }
+      for (j = 0; j < Journal[i].Length && Length < Size; ++j)
+      {
+         Length += snprintf(&Buffer[Length], Size - Length, " %02x", Journal[i].Patched[j]);
+      }
+      if (Length < Size)
+      {
+         Length += snprintf(&Buffer[Length], Size - Length, "\n");
+      }
+   }
+   return (int)((Length < Size) ? Length : Size - 1);
+}
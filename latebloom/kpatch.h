@@ -0,0 +1,78 @@
+////////////////////////////////////////////////////////////////////////////////
+// License: 0BSD                                                              //
+//                                                                            //
+// Copyright (C) 2021 by Syncretic                                            //
+//                                                                            //
+// Permission to use, copy, modify, and/or distribute this software for any   //
+// purpose with or without fee is hereby granted.                             //
+//                                                                            //
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES   //
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF           //
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR    //
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES     //
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN      //
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR //
+// IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.                //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+#ifndef KPATCH_H
+#define KPATCH_H
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+
+#define KPATCH_MAX_BYTES      16    // Largest patch TextPoke() will write in one go
+#define KPATCH_GUARD_SIZE     2     // Size of the "jmp ." guard (eb fe) published first
+
+// TextPoke()/TextWrite() return values
+#define KPATCH_OK             0     // Bytes were written
+#define KPATCH_BAD_ARGS       1     // Bad address or length
+#define KPATCH_NO_ALIAS       2     // Couldn't create a writable alias of the target
+#define KPATCH_SPLIT_LINE     3     // Guard would straddle a cache line (can't be published atomically)
+#define KPATCH_VERIFY_FAILED  4     // Bytes read back after patching don't match what we wrote
+#define KPATCH_JOURNAL_FULL   5     // No free patch journal entries
+#define KPATCH_BAD_ENTRY      6     // Journal entry doesn't exist, or its checksum doesn't match
+#define KPATCH_MODIFIED       7     // Someone else changed the patched bytes since we wrote them
+#define KPATCH_UNSAFE         8     // Other CPUs may be stopped inside the bytes we'd replace (caller's check)
+
+#define KPATCH_JOURNAL_SIZE   8     // Maximum number of patches we keep track of
+
+// How a patch was written
+#define KPATCH_METHOD_ALIAS   0     // Through a writable alias of the target's physical page(s)
+#define KPATCH_METHOD_CR0     1     // With CR0.WP cleared (only while latebloom_start() is single-threaded)
+#define KPATCH_METHOD_COUNT   2
+
+// Patch journal entry states
+#define KPATCH_STATE_EMPTY    0     // Unused entry
+#define KPATCH_STATE_APPLIED  1     // Patch is in place (and was verified)
+#define KPATCH_STATE_REVERTED 2     // Original bytes were put back (and verified)
+#define KPATCH_STATE_FAILED   3     // Patch didn't verify, and was rolled back
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Patch live kernel text (code that other CPUs may be executing)
+    int  TextPoke(void *Address, const void *Bytes, size_t Length);
+    // Write kernel text that nothing is executing yet (no ordering guarantees)
+    int  TextWrite(void *Address, const void *Bytes, size_t Length);
+    // Allow the CR0.WP fallback (only while nothing else can run the target)
+    void TextAllowCR0(int Allowed);
+    // How the last TextPoke()/TextWrite() was done ("alias" or "CR0.WP")
+    const char *TextMethodName(void);
+
+    // Patch journal: patch/verify/rollback, with a record of what was changed
+    int  JournalPatch(void *Address, const void *Bytes, size_t Length, int *Entry);
+    int  JournalRollback(int Entry);
+    int  JournalRollbackAll(void);
+    int  JournalFormat(char *Buffer, size_t Size);
+
+    // Writable alias mappings of physical memory (implemented in latebloom.cpp, since they need IOMemoryDescriptor)
+    void *MapWritableAlias(uint64_t Physical, size_t Length, void **Cookie);
+    void UnmapWritableAlias(void *Cookie);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // KPATCH_H
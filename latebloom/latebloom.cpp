@@ -40,12 +40,16 @@ __BEGIN_DECLS
 #include <sys/fcntl.h>
 #include <sys/proc.h>
 #include <sys/errno.h>
+#include <sys/uio.h>
+#include <sys/select.h>
 #include <sys/dkstat.h>
 #include <sys/time.h>
 #include <sys/kernel.h>
 #include <miscfs/devfs/devfs.h>
 #include <i386/proc_reg.h>
 #include <kern/thread.h>
+#include <kern/thread_call.h>
+#include <kern/clock.h>
 #include <libkern/version.h>
 #include <IOKit/assert.h>
 #include <IOKit/system.h>
@@ -55,6 +59,7 @@ __BEGIN_DECLS
 #include <IOKit/IOInterruptEventSource.h>
 #include <IOKit/IOInterruptController.h>
 #include <IOKit/IOService.h>
+#include <IOKit/IOMemoryDescriptor.h>
 #include <IOKit/IOReturn.h>
 #include <IOKit/IOTypes.h>
 
@@ -62,6 +67,7 @@ __BEGIN_DECLS
 #pragma clang diagnostic pop
 
 #include "latebloom.hpp"
+#include "kpatch.h"
 __END_DECLS
 
 // This required macro defines the class's constructors, destructors,
@@ -71,18 +77,86 @@ OSDefineMetaClassAndStructors(AAA_LoadEarly_latebloom, IOService)
 // Define the driver's superclass.
 #define super IOService
 
+// v0.23 - the IOService notification that releases the Phase 2 latch (see cfuncs.c)
+static IONotifier *LatchNotifier = NULL;
+
+//
+// v0.23 - poll()/select() support for /dev/latebloom (see LatebloomSelect()).
+// struct selinfo is private to the kernel (and its size varies between releases),
+// so we just reserve more than enough zeroed space for it;  selrecord() sets it up
+// the first time it's used.
+//
+#define SELECT_INFO_SIZE   128
+static UInt64        SelectInfo[SELECT_INFO_SIZE / sizeof(UInt64)];
+static IOLock        *SelectLock = NULL;     // Protects the rest of these, and SelectInfo
+static thread_call_t SelectTimer = NULL;     // Checks for quiescence again when it might have happened
+static bool          SelectTimerPending = false;
+static bool          SelectClosing = false;  // Set by SelectTeardown(), so SelectTimer isn't scheduled again
+
+//
+// v0.23 - called by IOKit when the service the Phase 2 latch is waiting for is published
+// (or right away, from addMatchingNotification(), if it already has been)
+//
+static bool LatchPublished(void *Target, void *RefCon, IOService *NewService, IONotifier *Notifier)
+{
+   latebloom_latch_release();
+   return true;
+}
+
 /////////////////////////////////////////////////////////////////
 //
 // Because we specified MODULE_START as latebloom_start() in the project's target settings, that routine
 // will be called at load time.  IOKit's call to latebloom::start() won't happen until later.  Here, we
-// create a dummy IOKit start() routine, just to have a handy place to add some code if at some point we
-// decide that doing something at IOKit startup would be useful.
+// create an IOKit start() routine, just to have a handy place to add some code if at some point we
+// decide that doing something at IOKit startup would be useful.  (v0.23 - it now publishes some
+// information in the IORegistry.)
 //
 /////////////////////////////////////////////////////////////////
 bool AAA_LoadEarly_latebloom::start(IOService *provider)
 {
    bool result = super::start(provider);
 
+   // v0.23 - publish the addresses we hooked (with their symbols) in the IORegistry,
+   // so that "ioreg -c AAA_LoadEarly_latebloom" shows them in readable form
+   if (result)
+   {
+      static const struct { const char *Key; int Which; } Addresses[] =
+      {
+         { "ProbeBus",     LB_ADDRESS_PROBEBUS     },
+         { "HookSite",     LB_ADDRESS_HOOK_SITE    },
+         { "HookReturn",   LB_ADDRESS_HOOK_RETURN  },
+      };
+      char Description[LB_DESCRIBE_SIZE];
+
+      for (unsigned int i = 0; i < sizeof(Addresses) / sizeof(Addresses[0]); ++i)
+      {
+         latebloom_describe(latebloom_address(Addresses[i].Which), Description, sizeof(Description));
+         setProperty(Addresses[i].Key, Description);
+      }
+
+      // v0.23 - if Phase 2 is supposed to wait for some service, ask IOKit to tell us when it shows up
+      int         ByName;
+      const char  *Match = latebloom_latch_match(&ByName);
+
+      if (Match != NULL && LatchNotifier == NULL)
+      {
+         OSDictionary *Matching = ByName ? nameMatching(Match) : serviceMatching(Match);
+
+         if (Matching != NULL)
+         {
+            LatchNotifier = addMatchingNotification(gIOPublishNotification, Matching, LatchPublished, this, NULL, 0);
+            Matching->release();
+         }
+         if (LatchNotifier == NULL)
+         {
+            // We'll never hear about it, so don't make anybody wait for it
+            IOLog("latebloom: unable to watch for %s '%s', releasing latch\n", ByName ? "device" : "class", Match);
+            latebloom_latch_release();
+         }
+         setProperty("Latch", Match);
+      }
+   }
+
    return result; // true if successful, false if not
 }
 
@@ -90,32 +164,251 @@ bool AAA_LoadEarly_latebloom::start(IOService *provider)
 //
 // The reality is that at unload time, neither ->stop() nor
 // ->free() seem to get called reliably.  Because of that,
-// latebloom can't really be unloaded.  We can't do anything
-// about that here, anyway.  If ->stop() was called, we could
-// undo our hook and allow latebloom to be unloaded.  However,
-// since latebloom is quiescent by the time the desktop appears,
-// and it uses very little memory, there's not much point in
-// unloading it anyway.  Because it's seemingly never called,
 // we don't bother implementing an IOKit stop() method.
 //
-// NOTE that if someone does try to unload latebloom, and the
-// kernel obliges, IOPCIBridge::probeBus() will still contain a
-// jump into memory that has now been freed;  in the unlikely
-// event that the PCI bus was somehow probed again, this would
-// result in a kernel panic (or, conceivably, something worse).
+// v0.23 - unloading is now handled by latebloom_stop() (our
+// MODULE_STOP routine, in cfuncs.c), which is called reliably.
+// It rolls back the hook using the patch journal, waits for
+// any threads still inside the hook to leave, and refuses to
+// unload if either of those can't be done safely.
 //
 /////////////////////////////////////////////////////////////////
 
 //
 // 8sep21 v0.22 - we now create /dev/latebloom if the hook gets set successfully.
-// However, at present, we don't actually want to handle any I/O with the
-// device, we just need a convenient signal that latebloom worked.  Here we
-// implement the device::open() routine to simply fail, regardless of the type
-// of open that's requested.  If, in the future, we want to pass data in and
-// out of the device, we'll need to implement at least the open/read/write/close
-// methods, as well as possibly ioctl/stop/reset/getc/putc/type (or others).
+//
+// v0.23 - /dev/latebloom can now be opened (read-only) and read, to get
+// latebloom's status (hook state, settings, counters, and the patch journal)
+// as text, e.g. "cat /dev/latebloom".
+//
+// There's no per-open state:  every read() formats a fresh status (at most
+// LB_STATUS_BUFFER_SIZE bytes) and returns the part of it at the read's offset.
+// A reader that needs several read()s to get all of it (a small buffer) gets
+// pieces of different snapshots, and counters can change between them, so
+// anybody who wants a consistent snapshot should read it in one go, with a
+// buffer of at least LB_STATUS_BUFFER_SIZE bytes.
 //
 int AAA_LoadEarly_latebloom::LatebloomOpen(dev_t dev, int flags, int devetype, struct proc *p)
 {
-   return KERN_FAILURE;    // for now, always fail to open the device.
+   if (flags & FWRITE)
+   {
+      return EPERM;        // there's nothing to write (yet)
+   }
+   // v0.23 - if somebody can open /dev/latebloom, the boot completed (for A/B mode)
+   latebloom_ab_complete();
+   return 0;
+}
+
+int AAA_LoadEarly_latebloom::LatebloomClose(dev_t dev, int flags, int devetype, struct proc *p)
+{
+   return 0;
+}
+
+//
+// v0.23 - (re)schedule SelectTimer to go off in <Ms> milliseconds, unless it's already scheduled
+// (called with SelectLock held)
+//
+static void SelectSchedule(long Ms)
+{
+   uint64_t Deadline;
+
+   if (!SelectTimerPending && !SelectClosing)
+   {
+      clock_interval_to_deadline((uint32_t)Ms, kMillisecondScale, &Deadline);
+      thread_call_enter_delayed(SelectTimer, Deadline);
+      SelectTimerPending = true;
+   }
+}
+
+//
+// v0.23 - SelectTimer went off:  if enumeration has quiesced, wake up everybody waiting
+// in poll()/select(), otherwise check again when it might have
+//
+static void SelectTimerFired(thread_call_param_t Param0, thread_call_param_t Param1)
+{
+   long Remaining;
+
+   IOLockLock(SelectLock);
+   SelectTimerPending = false;
+   if ((Remaining = latebloom_quiet_remaining()) == 0)
+   {
+      selwakeup((struct selinfo *)SelectInfo);
+   }
+   else
+   {
+      SelectSchedule(Remaining);
+   }
+   IOLockUnlock(SelectLock);
+}
+
+//
+// v0.23 - /dev/latebloom becomes readable (for poll(), select() and kevent(EVFILT_READ))
+// once PCI enumeration has quiesced (see latebloom_quiet_remaining() in cfuncs.c), so
+// a boot health agent can wait for that, then read the final status, instead of
+// polling.  (Reading it never blocks, though;  it just shows the status so far.)
+//
+int AAA_LoadEarly_latebloom::LatebloomSelect(dev_t dev, int which, void *wql, struct proc *p)
+{
+   int   Ready = 0;
+
+   if (which != FREAD)
+   {
+      return 0;            // there's nothing to write (and no exceptions)
+   }
+   if (SelectLock == NULL)
+   {
+      return 1;            // (see SelectSetup()) - no way to wait, so don't
+   }
+   IOLockLock(SelectLock);
+   if (latebloom_quiet_remaining() == 0)
+   {
+      Ready = 1;
+   }
+   else
+   {
+      selrecord(p, (struct selinfo *)SelectInfo, wql);
+      SelectSchedule(latebloom_quiet_remaining());
+   }
+   IOLockUnlock(SelectLock);
+
+   return Ready;
+}
+
+int AAA_LoadEarly_latebloom::LatebloomRead(dev_t dev, struct uio *uio, int ioflag)
+{
+   char           *Buffer;
+   int            Length;
+   int            result = 0;
+   off_t          Offset = uio_offset(uio);
+   user_ssize_t   Count;
+
+   if ((Buffer = (char *)IOMalloc(LB_STATUS_BUFFER_SIZE)) == NULL)
+   {
+      return ENOMEM;
+   }
+   Length = latebloom_status(Buffer, LB_STATUS_BUFFER_SIZE);
+   if (Offset >= 0 && Offset < Length)
+   {
+      Count = Length - Offset;
+      if (Count > uio_resid(uio))
+      {
+         Count = uio_resid(uio);
+      }
+      result = uiomove(&Buffer[Offset], (int)Count, uio);
+   }
+   IOFree(Buffer, LB_STATUS_BUFFER_SIZE);
+
+   return result;
+}
+
+/////////////////////////////////////////////////////////////////
+//
+// v0.23 - remove the Phase 2 latch's IOService notification
+// (called from latebloom_stop(), since our IOKit stop() isn't
+// called reliably - see above)
+//
+/////////////////////////////////////////////////////////////////
+void LatchUnregister(void)
+{
+   if (LatchNotifier != NULL)
+   {
+      LatchNotifier->remove();
+      LatchNotifier = NULL;
+   }
+}
+
+/////////////////////////////////////////////////////////////////
+//
+// v0.23 - set up (called from latebloom_start(), before
+// /dev/latebloom is added) and tear down (from latebloom_stop(),
+// after it's removed) poll()/select() support.
+//
+// If SelectSetup() fails, LatebloomSelect() reports
+// /dev/latebloom as always readable.
+//
+/////////////////////////////////////////////////////////////////
+int SelectSetup(void)
+{
+   if (SelectLock != NULL)
+   {
+      return 1;
+   }
+   if ((SelectTimer = thread_call_allocate(SelectTimerFired, NULL)) == NULL)
+   {
+      return 0;
+   }
+   if ((SelectLock = IOLockAlloc()) == NULL)
+   {
+      thread_call_free(SelectTimer);
+      SelectTimer = NULL;
+      return 0;
+   }
+   return 1;
+}
+
+void SelectTeardown(void)
+{
+   if (SelectLock == NULL)
+   {
+      return;
+   }
+   IOLockLock(SelectLock);
+   SelectClosing = true;
+   IOLockUnlock(SelectLock);
+   // (Not holding SelectLock, which SelectTimerFired() may be waiting for)
+   thread_call_cancel_wait(SelectTimer);
+   thread_call_free(SelectTimer);
+   SelectTimer = NULL;
+
+   IOLockLock(SelectLock);
+   selwakeup((struct selinfo *)SelectInfo);
+   selthreadclear((struct selinfo *)SelectInfo);
+   IOLockUnlock(SelectLock);
+   IOLockFree(SelectLock);
+   SelectLock = NULL;
+}
+
+/////////////////////////////////////////////////////////////////
+//
+// v0.23 - writable alias mappings for kpatch.c
+//
+// Kernel text is mapped read/execute only.  Rather than clearing
+// CR0.WP (which only affects the current CPU, and affects
+// everything that CPU touches), kpatch.c finds the physical
+// page(s) behind the target range (with pmap_find_phys()), and we
+// map them a second time, read/write, somewhere else in the kernel
+// map.  Writes through the alias land in the same physical memory
+// the original (read-only) mapping points to.  (Kernel text is
+// wired for good, so there's nothing to prepare().)
+//
+// These need IOMemoryDescriptor, so they live here in C++ land,
+// with C linkage so that kpatch.c can call them.
+//
+/////////////////////////////////////////////////////////////////
+void *MapWritableAlias(uint64_t Physical, size_t Length, void **Cookie)
+{
+   uint64_t             Base = trunc_page(Physical);
+   uint64_t             Size = round_page(Physical + Length) - Base;
+   IOMemoryDescriptor   *Descriptor;
+   IOMemoryMap          *Map;
+
+   Descriptor = IOMemoryDescriptor::withPhysicalAddress((IOPhysicalAddress)Base, (IOByteCount)Size, kIODirectionInOut);
+   if (Descriptor == NULL)
+   {
+      return NULL;
+   }
+   Map = Descriptor->createMappingInTask(kernel_task, 0, kIOMapAnywhere | kIOMapDefaultCache);
+   Descriptor->release();     // the map keeps its own reference to the descriptor
+   if (Map == NULL)
+   {
+      return NULL;
+   }
+   *Cookie = Map;
+
+   return (void *)(Map->getVirtualAddress() + (Physical - Base));
+}
+
+void UnmapWritableAlias(void *Cookie)
+{
+   ((IOMemoryMap *)Cookie)->release();    // tear down the alias
 }
@@ -18,6 +18,31 @@
 #ifndef LATEBLOOM_HPP
 #define LATEBLOOM_HPP
 
+// v0.23 - hook control (see cfuncs.c)
+int latebloom_arm(void);
+int latebloom_disarm(void);
+// v0.23 - status text for /dev/latebloom (see cfuncs.c)
+int latebloom_status(char *Buffer, size_t Size);
+void latebloom_describe(unsigned long long Address, char *Buffer, size_t Size);
+// v0.23 - addresses of interest, for the IORegistry (see AAA_LoadEarly_latebloom::start())
+unsigned long long latebloom_address(int Which);
+#define LB_ADDRESS_PROBEBUS      0
+#define LB_ADDRESS_HOOK_SITE     1
+#define LB_ADDRESS_HOOK_RETURN   2
+// v0.23 - Phase 2 latch (see cfuncs.c)
+const char *latebloom_latch_match(int *ByName);
+void latebloom_latch_release(void);
+void LatchUnregister(void);
+// v0.23 - A/B mode (see cfuncs.c)
+void latebloom_ab_complete(void);
+// v0.23 - poll()/select() on /dev/latebloom (see cfuncs.c and latebloom.cpp)
+long latebloom_quiet_remaining(void);
+int SelectSetup(void);
+void SelectTeardown(void);
+
+#define LB_STATUS_BUFFER_SIZE    8192     // Size of the buffer /dev/latebloom reads are formatted into
+#define LB_DESCRIBE_SIZE         256      // Size of a buffer for latebloom_describe()
+
 class AAA_LoadEarly_latebloom : public IOService
 {
    OSDeclareDefaultStructors(AAA_LoadEarly_latebloom)
@@ -25,8 +50,12 @@ class AAA_LoadEarly_latebloom : public IOService
 public:
    // IOService overrides
    virtual bool start(IOService *provider) override;
-   // 8sep21 v0.22 - dummy open() routine for /dev/latebloom pseudo-device
+   // 8sep21 v0.22 - open() routine for /dev/latebloom pseudo-device
    static int LatebloomOpen(dev_t dev, int flags, int devetype, struct proc *p);
+   // v0.23 - close()/read() routines for /dev/latebloom
+   static int LatebloomClose(dev_t dev, int flags, int devetype, struct proc *p);
+   static int LatebloomRead(dev_t dev, struct uio *uio, int ioflag);
+   static int LatebloomSelect(dev_t dev, int which, void *wql, struct proc *p);
 
 protected:
 
@@ -37,9 +66,27 @@ private:
 // 8sep21 v0.22 - the function vectors for the /dev/latebloom pseudo-device
 //
 extern "C" struct cdevsw devsw; // avoid C++ name mangling
+//
+// v0.23 - now that open() can succeed, every entry we don't implement gets
+// an eno_* stub:  cdevsw_add() doesn't fill in defaults, so e.g. an ioctl()
+// on /dev/latebloom would otherwise call through a NULL d_ioctl.
+//
 struct cdevsw devsw =
 {
-   .d_open  = AAA_LoadEarly_latebloom::LatebloomOpen,
+   .d_open     = AAA_LoadEarly_latebloom::LatebloomOpen,
+   .d_close    = AAA_LoadEarly_latebloom::LatebloomClose,   // v0.23
+   .d_read     = AAA_LoadEarly_latebloom::LatebloomRead,    // v0.23
+   .d_write    = eno_rdwrt,                                 // v0.23
+   .d_ioctl    = eno_ioctl,                                 // v0.23
+   .d_stop     = eno_stop,                                  // v0.23
+   .d_reset    = eno_reset,                                 // v0.23
+   .d_ttys     = NULL,
+   .d_select   = AAA_LoadEarly_latebloom::LatebloomSelect,  // v0.23
+   .d_mmap     = eno_mmap,                                  // v0.23
+   .d_strategy = eno_strat,                                 // v0.23
+   .d_reserved_1 = eno_getc,                                // v0.23
+   .d_reserved_2 = eno_putc,                                // v0.23
+   .d_type     = 0,
 };
 
 #endif   // LATEBLOOM_HPP
@@ -0,0 +1,606 @@
+//
+// lbcore.c
+//
+// v0.23 - The parts of the hook's logic that don't need the kernel
+//
+////////////////////////////////////////////////////////////////////////////////
+// License: 0BSD                                                              //
+//                                                                            //
+// Copyright (C) 2021 by Syncretic                                            //
+//                                                                            //
+// Permission to use, copy, modify, and/or distribute this software for any   //
+// purpose with or without fee is hereby granted.                             //
+//                                                                            //
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES   //
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF           //
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR    //
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES     //
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN      //
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR //
+// IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.                //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include "lbcore.h"
+#include <libkern/OSAtomic.h>
+#include <sys/systm.h>                  // (for memcmp(), memcpy())
+
+//
+// Everything here works on lb_Settings, lb_Counters and the thread table alone (plus
+// atomics, lb_Sleep() to wait, and lb_StoreRead()/lb_StoreWrite() for the A/B record),
+// and is called from cfuncs.c:  the hook (latebloom_hook_body() and friends), the byte
+// pattern search (latebloom_start()), and A/B mode (lb_ABPoll(), latebloom_ab_complete()).
+// Keeping it apart from cfuncs.c's hook assembly and kernel calls means tools/lbcheck.c
+// can #include it, and check it on a host with threads.
+//
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Find the calling thread's entry in lb_Threads
+// (lb_LookupThread() only finds it, lb_FindThread() also
+// adds it if this is the thread's first time through).
+//
+// Returns the entry (or NULL if the table is full, in which
+// case *Ordinal is still set), and sets *Ordinal to the
+// thread's ordinal.
+//
+/////////////////////////////////////////////////////////
+lb_ThreadInfo *lb_LookupThread(thread_t Thread)
+{
+   SInt32         Count = lb_Counters.ThreadCount;
+   SInt32         i;
+
+   // Only this thread can publish its own entry, so if it's there, we'll see it
+   for (i = 0; i < Count && i < (SInt32)lb_Settings.MaxThreads; ++i)
+   {
+      if (lb_Threads[i].Thread == Thread)
+      {
+         return &lb_Threads[i];
+      }
+   }
+   return NULL;
+}
+
+lb_ThreadInfo *lb_FindThread(thread_t Thread, UInt64 Now, UInt32 *Ordinal)
+{
+   lb_ThreadInfo  *Info;
+   SInt32         Count = lb_Counters.ThreadCount;
+   SInt32         i;
+
+   if ((Info = lb_LookupThread(Thread)) != NULL)
+   {
+      *Ordinal = Info->Ordinal;
+      return Info;
+   }
+
+   // Table's full, so there's no telling whether we've seen this thread before
+   if (Count >= (SInt32)lb_Settings.MaxThreads)
+   {
+      *Ordinal = lb_Settings.MaxThreads;
+      return NULL;
+   }
+
+   // First time through for this thread:  take the next ordinal (and with it, the next slot)
+   i = OSIncrementAtomic(&lb_Counters.ThreadCount);
+   *Ordinal = (UInt32)i;
+   if (i == 1 && lb_Phase2StartTSC == 0)
+   {
+      // The first thread after the Phase 1 thread marks the start of Phase 2
+      lb_Phase2StartLoop = lb_Counters.Loops;
+      OSCompareAndSwap64(0, Now, &lb_Phase2StartTSC);
+   }
+   if (i >= (SInt32)lb_Settings.MaxThreads)
+   {
+      // (Another thread took the last slot after we looked)
+      OSDecrementAtomic(&lb_Counters.ThreadCount);
+      *Ordinal = lb_Settings.MaxThreads;
+      return NULL;
+   }
+   Info = &lb_Threads[i];
+   Info->Ordinal = (UInt32)i;
+   Info->Phase = (i == 0) ? 1 : 2;
+   Info->Iterations = 0;
+   Info->FirstTSC = Now;
+   Info->LastTSC = Now;
+   Info->Depth = 0;
+   OSMemoryBarrier();
+   Info->Thread = Thread;
+   return Info;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - <Info>'s thread has entered a new region, a
+// probeBus() call whose frame pointer is <Frame>, and which
+// will return to <ReturnAddress> (lb_EnterRegion() in
+// cfuncs.c has already made sure it's one we haven't seen).
+//
+// Each outermost region takes the next sequencer ticket.
+// A nested one (a probeBus() call made from inside another)
+// is part of its caller's turn, so it shares the caller's
+// ticket:  with a ticket of its own it'd queue behind every
+// call that arrived since its caller did, and since its
+// caller can't finish until it does, it would only ever go
+// ahead by timing out.
+//
+// Returns the new region, or NULL if the thread's stack of
+// them is full.
+//
+/////////////////////////////////////////////////////////
+lb_RegionInfo *lb_PushRegion(lb_ThreadInfo *Info, UInt64 Frame, UInt64 ReturnAddress)
+{
+   lb_RegionInfo  *Region;
+
+   if (Info->Depth == LB_MAX_REGIONS)
+   {
+      return NULL;
+   }
+   Region = &Info->Regions[Info->Depth];
+   Region->Frame = Frame;
+   Region->ReturnAddress = ReturnAddress;
+   if (Info->Depth != 0)
+   {
+      Region->Ticket = Info->Regions[0].Ticket;
+   }
+   else
+   {
+      Region->Ticket = (UInt32)OSIncrementAtomic((volatile SInt32 *)&lb_Counters.NextTicket);
+   }
+   Info->Depth++;
+   OSIncrementAtomic(&lb_Counters.InRegion);
+   return Region;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - <Info>'s innermost region has ended (its
+// probeBus() call returned).  When that was the outermost
+// one, its turn is over, so the next ticket can go ahead.
+//
+// Returns the region (its ReturnAddress is still good until
+// the thread enters another one), or NULL if there wasn't
+// one.
+//
+/////////////////////////////////////////////////////////
+lb_RegionInfo *lb_PopRegion(lb_ThreadInfo *Info)
+{
+   lb_RegionInfo  *Region;
+
+   if (Info->Depth == 0)
+   {
+      return NULL;
+   }
+   Region = &Info->Regions[--Info->Depth];
+   OSDecrementAtomic(&lb_Counters.InRegion);
+   if (Info->Depth == 0)
+   {
+      lb_SequencerDone(Region->Ticket);
+   }
+   return Region;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Wait until it's <Region>'s turn (or until we've
+// waited lb_Settings.SequenceTimeout ms).  A nested region's
+// turn came when its caller's did (see lb_PushRegion()),
+// so it doesn't wait at all, even if its caller timed out.
+//
+// Returns how long we waited (ms).
+//
+/////////////////////////////////////////////////////////
+long lb_SequencerWait(const lb_ThreadInfo *Info, const lb_RegionInfo *Region)
+{
+   UInt32   Ticket = Region->Ticket;
+   long     Waited = 0;
+
+   if (Region != &Info->Regions[0])
+   {
+      return 0;
+   }
+   // (Tickets are compared as differences, so they can wrap)
+   while ((SInt32)(lb_Counters.NowServing - Ticket) < 0)
+   {
+      if (Waited >= lb_Settings.SequenceTimeout)
+      {
+         OSIncrementAtomic(&lb_Counters.SequenceTimeouts);
+         break;
+      }
+      lb_Sleep(LB_SEQUENCE_POLL);
+      Waited += LB_SEQUENCE_POLL;
+   }
+   return Waited;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - <Ticket>'s turn is over, so let the next ticket
+// go ahead.
+//
+// If <Ticket> went ahead without waiting for its turn (or a
+// later ticket did), lb_Counters.NowServing may already be past it;
+// it only ever moves forward.
+//
+/////////////////////////////////////////////////////////
+void lb_SequencerDone(UInt32 Ticket)
+{
+   UInt32 Serving;
+
+   do
+   {
+      Serving = lb_Counters.NowServing;
+      if ((SInt32)(Serving - (Ticket + 1)) >= 0)
+      {
+         return;
+      }
+   } while (!OSCompareAndSwap(Serving, Ticket + 1, &lb_Counters.NowServing));
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Concurrency mode:  how long (ms) to sleep, given
+// how many other probeBus() calls are in progress (see
+// lb_Settings.ConcurrencyStep).
+//
+// That's step * Others^exponent, but no more than the cap
+// (if there is one) or LB_MAX_DELAY.  Each multiplication is
+// checked against that limit before it's done, so a large
+// exponent saturates instead of overflowing (and stops
+// multiplying as soon as it gets there).
+//
+/////////////////////////////////////////////////////////
+long lb_ConcurrencyDelay(SInt32 Others)
+{
+   long  Limit = LB_MAX_DELAY;
+   long  Delay = lb_Settings.ConcurrencyStep;
+   long  i;
+
+   if (Others <= 0)
+   {
+      return 0;
+   }
+   if (lb_Settings.ConcurrencyCap != 0 && lb_Settings.ConcurrencyCap < Limit)
+   {
+      Limit = lb_Settings.ConcurrencyCap;
+   }
+   // (Multiplying by 1 changes nothing, however often we do it)
+   for (i = 0; i < lb_Settings.ConcurrencyExponent && Others > 1; ++i)
+   {
+      if (Delay > Limit / Others)
+      {
+         return Limit;
+      }
+      Delay *= Others;
+   }
+   return (Delay < Limit) ? Delay : Limit;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Backoff mode:  wait while other probeBus() calls
+// are in progress (see lb_Settings.BackoffCap).  <Self> is how many
+// of lb_Counters.InRegion are our own.
+//
+// The slices start at lb_Settings.BackoffSlice and double,
+// and the last one is cut short to stay within the cap.
+// InRegion is checked again after every slice, so we go
+// ahead after the slice in which the other probes finished.
+//
+// Returns how long (ms) we waited.
+//
+/////////////////////////////////////////////////////////
+long lb_BackoffWait(SInt32 Self)
+{
+   long  Waited = 0;
+   long  Slice = lb_Settings.BackoffSlice;
+
+   while (lb_Counters.InRegion - Self > 0 && Waited < lb_Settings.BackoffCap)
+   {
+      if (Slice > lb_Settings.BackoffCap - Waited)
+      {
+         Slice = lb_Settings.BackoffCap - Waited;
+      }
+      lb_Sleep((unsigned int)Slice);
+      Waited += Slice;
+      Slice *= 2;
+   }
+   return Waited;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Stagger mode:  how long (ms) the thread with
+// <Ordinal> (and table entry <Info>) should sleep on this
+// loop (see lb_Settings.StaggerStep).
+//
+// The Nth Phase 2 thread (ordinal N + 1) sleeps N steps,
+// on its first loop only.  Threads we couldn't fit in
+// lb_Threads (Info == NULL) can't tell which loop is their
+// first, so they never wait.
+//
+/////////////////////////////////////////////////////////
+long lb_StaggerDelay(const lb_ThreadInfo *Info, UInt32 Ordinal)
+{
+   if (Info == NULL || Info->Iterations != 1 || Ordinal <= 1)
+   {
+      return 0;
+   }
+   return (long)(Ordinal - 1) * lb_Settings.StaggerStep;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - Search <Length> bytes at <Start> for the patterns
+// in <Table> (which ends with a NULL Pattern).
+//
+// Comparing every pattern at every offset is fine for the
+// few KB of probeBus(), but not for all of __text.  So we
+// look at 8 bytes at a time for the patterns' first bytes
+// ("anchors"), and only compare the patterns where one
+// turns up.  Kexts can't use SSE/AVX (the kernel doesn't
+// save FPU state for us), but plain 64-bit arithmetic can
+// test 8 bytes at once:  for w = Word ^ (Anchor * 0x01..01),
+// (w - 0x01..01) & ~w & 0x80..80 has the high bit set in
+// every byte of Word equal to Anchor.  (It can also flag a
+// byte just above a real match, because of the borrow, but
+// never misses one, and false alarms are weeded out by the
+// comparison anyway.)
+//
+// Only matches lying entirely within <Length> bytes count.
+// The first <MaxSites> matches (lowest address first) go in
+// <Sites> (and their index in <Table> in <Patterns>);
+// returns the total number of matches.  If <Candidates> isn't
+// NULL, the number of offsets compared is added to it.
+//
+/////////////////////////////////////////////////////////
+#define SWAR_ONES                0x0101010101010101ULL
+#define SWAR_HIGHS               0x8080808080808080ULL
+UInt32 lb_ScanText(const lb_PatternInfo *Table, const unsigned char *Start, unsigned long long Length,
+                   unsigned long long *Sites, unsigned long *Patterns, UInt32 MaxSites, UInt32 *Candidates)
+{
+   UInt64               Anchors[LB_SCAN_ANCHORS];
+   UInt64               Word, Mask, w;
+   unsigned long long   Offset, Position;
+   UInt32               Matches = 0;
+   UInt32               Compared = 0;
+   int                  AnchorCount = 0;
+   int                  a;
+   unsigned long        p;
+
+   // Collect the distinct first bytes (replicated into all 8 byte lanes)
+   for (p = 0; Table[p].Pattern != NULL; ++p)
+   {
+      w = Table[p].Pattern[0] * SWAR_ONES;
+      for (a = 0; a < AnchorCount && Anchors[a] != w; ++a)
+         ;
+      if (a == AnchorCount)
+      {
+         if (AnchorCount == LB_SCAN_ANCHORS)
+         {
+            AnchorCount = 0;     // Too many to prefilter for;  compare everywhere
+            break;
+         }
+         Anchors[AnchorCount++] = w;
+      }
+   }
+
+   for (Offset = 0; Offset < Length; Offset += 8)
+   {
+      if (AnchorCount == 0 || Offset + 8 > Length)
+      {
+         Mask = SWAR_HIGHS;      // No prefilter (or the last few bytes):  every offset is a candidate
+      }
+      else
+      {
+         memcpy(&Word, &Start[Offset], sizeof(Word));
+         for (Mask = 0, a = 0; a < AnchorCount; ++a)
+         {
+            w = Word ^ Anchors[a];
+            Mask |= (w - SWAR_ONES) & ~w & SWAR_HIGHS;
+         }
+      }
+      for (; Mask != 0; Mask &= Mask - 1)
+      {
+         Position = Offset + (__builtin_ctzll(Mask) >> 3);
+         if (Position >= Length)
+         {
+            break;
+         }
+         ++Compared;
+         for (p = 0; Table[p].Pattern != NULL; ++p)
+         {
+            if (Position + Table[p].size <= Length && !memcmp(&Start[Position], Table[p].Pattern, Table[p].size))
+            {
+               if (Matches < MaxSites)
+               {
+                  Sites[Matches] = (unsigned long long)&Start[Position];
+                  Patterns[Matches] = p;
+               }
+               ++Matches;
+               break;
+            }
+         }
+      }
+   }
+   if (Candidates != NULL)
+   {
+      *Candidates += Compared;
+   }
+   return Matches;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - A/B mode:  a 32-bit random number.
+//
+// lb_RandomOffset() (in cfuncs.c) gets away with reading
+// the TSC, but the Beta samples below need dozens of numbers
+// in a row, and back-to-back TSC reads are anything but
+// independent.  So we seed xorshift64* once (from the TSC,
+// see latebloom_start()), and use that.
+//
+/////////////////////////////////////////////////////////
+static UInt64              lb_RandomState = 1;
+
+void lb_RandomSeed(UInt64 Seed)
+{
+   lb_RandomState = Seed | 1;
+}
+
+UInt32 lb_Random32(void)
+{
+   lb_RandomState ^= lb_RandomState >> 12;
+   lb_RandomState ^= lb_RandomState << 25;
+   lb_RandomState ^= lb_RandomState >> 27;
+   return (UInt32)((lb_RandomState * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - A/B mode:  draw a sample from Beta(Wins + 1,
+// Losses + 1), scaled to 32 bits.
+//
+// No floating point in the kernel, so we use the fact that
+// for whole-number parameters (a, b), a Beta(a, b) sample is
+// the a'th smallest of (a + b - 1) uniform random numbers.
+// lb_ABCount() keeps Wins + Losses <= LB_AB_HISTORY, so that's
+// at most LB_AB_HISTORY + 1 numbers to sort.
+//
+/////////////////////////////////////////////////////////
+UInt32 lb_BetaSample(UInt32 Wins, UInt32 Losses)
+{
+   UInt32   Samples[LB_AB_HISTORY + 1];
+   UInt32   Count = Wins + Losses + 1;
+   UInt32   Value;
+   UInt32   i, j;
+
+   if (Count > LB_AB_HISTORY + 1)
+   {
+      return 0;      // (can't happen, see lb_ABCount())
+   }
+   // Insertion sort;  there aren't enough of them to bother with anything fancier
+   for (i = 0; i < Count; ++i)
+   {
+      Value = lb_Random32();
+      for (j = i; j > 0 && Samples[j - 1] > Value; --j)
+      {
+         Samples[j] = Samples[j - 1];
+      }
+      Samples[j] = Value;
+   }
+   return Samples[Wins];
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - A/B mode:  get the A/B record for <Arms> arms whose
+// hash is <Config>.  If there isn't one (or it's for a
+// different set of arms), start a new one.
+//
+// Returns LB_STORE_OK if the record was read, LB_STORE_MISSING
+// if *Record is a new, empty one (which still needs to be
+// written), or LB_STORE_DOWN if NVRAM isn't up yet (*Record
+// is a new, empty one, but there may well be a record that
+// we just can't read yet, so it mustn't be written).
+//
+/////////////////////////////////////////////////////////
+int lb_ABLoad(lb_ABRecord *Record, UInt32 Config, int Arms)
+{
+   int Status;
+
+   if ((Status = lb_StoreRead(Record)) == LB_STORE_OK &&
+       !(Record->Magic == LB_AB_MAGIC && Record->Config == Config && Record->Arms == Arms && Record->Pending <= Arms))
+   {
+      Status = LB_STORE_MISSING;
+   }
+   if (Status != LB_STORE_OK)
+   {
+      memset(Record, 0, sizeof(*Record));
+      Record->Magic = LB_AB_MAGIC;
+      Record->Config = Config;
+      Record->Arms = (UInt8)Arms;
+   }
+   return Status;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - A/B mode:  count one outcome for an arm.
+//
+// To keep up with changes (a new MacOS version, a new card)
+// and to keep lb_BetaSample() cheap, old outcomes fade out:
+// once an arm has more than LB_AB_HISTORY of them, its
+// counts are halved.
+//
+/////////////////////////////////////////////////////////
+void lb_ABCount(lb_ArmRecord *Arm, int Win, long ProbeMs)
+{
+   if (Win)
+   {
+      Arm->Wins++;
+   }
+   else
+   {
+      Arm->Losses++;
+   }
+   if (Arm->Wins + Arm->Losses > LB_AB_HISTORY)
+   {
+      Arm->Wins /= 2;
+      Arm->Losses /= 2;
+   }
+   if (ProbeMs >= 0)
+   {
+      if (Arm->Boots >= LB_AB_HISTORY)
+      {
+         Arm->Boots /= 2;
+         Arm->TotalMs /= 2;
+      }
+      Arm->Boots++;
+      Arm->TotalMs += (UInt32)ProbeMs;
+   }
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - A/B mode:  an arm left pending by an earlier boot
+// means that boot never completed;  count it as a loss.
+//
+// Returns the arm that was pending, or -1 if none was.
+//
+/////////////////////////////////////////////////////////
+int lb_ABResolvePending(lb_ABRecord *Record)
+{
+   int Arm = (int)Record->Pending - 1;
+
+   if (Arm >= 0)
+   {
+      lb_ABCount(&Record->Arm[Arm], 0, -1);
+      Record->Pending = 0;
+   }
+   return Arm;
+}
+
+/////////////////////////////////////////////////////////
+//
+// v0.23 - A/B mode:  pick an arm (Thompson sampling):  one
+// sample from each arm's Beta distribution, highest wins.
+//
+/////////////////////////////////////////////////////////
+int lb_ABPick(const lb_ABRecord *Record)
+{
+   UInt32   Sample;
+   UInt32   Best = 0;
+   int      Arm = 0;
+   int      i;
+
+   for (i = 0; i < Record->Arms; ++i)
+   {
+      Sample = lb_BetaSample(Record->Arm[i].Wins, Record->Arm[i].Losses);
+      if (i == 0 || Sample > Best)
+      {
+         Best = Sample;
+         Arm = i;
+      }
+   }
+   return Arm;
+}
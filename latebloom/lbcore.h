@@ -0,0 +1,220 @@
+////////////////////////////////////////////////////////////////////////////////
+// License: 0BSD                                                              //
+//                                                                            //
+// Copyright (C) 2021 by Syncretic                                            //
+//                                                                            //
+// Permission to use, copy, modify, and/or distribute this software for any   //
+// purpose with or without fee is hereby granted.                             //
+//                                                                            //
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES   //
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF           //
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR    //
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES     //
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN      //
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR //
+// IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.                //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+#ifndef LBCORE_H
+#define LBCORE_H
+
+//
+// v0.23 - What cfuncs.c and lbcore.c (the parts of the hook's logic that don't need the
+// kernel) share:  the settings the hook reads, the counters it updates, and the thread table
+// (and the byte patterns latebloom_start() searches for).
+//
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+
+#define LB_CACHE_LINE            64    // CPU cache line size (see lb_Counters)
+#define LB_MAX_REGIONS           4     // Nested probeBus() calls we can track per thread (see lb_PushRegion())
+#define LB_SEQUENCE_POLL         1     // How often (ms) a thread waiting for its turn checks the sequencer
+#define LB_MAX_DELAY             0x7fffffffL   // Longest delay (ms) a Phase 2 mode works out (lb_Sleep() takes an unsigned int)
+#define LB_SCAN_ANCHORS          4     // Distinct first bytes lb_ScanText() can prefilter for
+#define LB_MAX_ARMS              4     // Policy arms for A/B mode (lb_arm0= through lb_arm3=)
+#define LB_AB_HISTORY            32    // Outcomes per arm the bandit remembers (older ones fade out, see lb_ABCount())
+#define LB_AB_MAGIC              0x62614c42  // "LBab", marks a valid A/B record
+
+// lb_StoreRead() (and lb_ABLoad()) results
+#define LB_STORE_OK              0     // Read our record
+#define LB_STORE_MISSING         1     // NVRAM is up, but there's no record (or it isn't one of ours)
+#define LB_STORE_DOWN            2     // NVRAM isn't up yet (or we can't tell whether it is)
+
+//
+// v0.23 - The settings (mostly from boot-args) that the hook reads on every loop (see lb_Settings in cfuncs.c).
+//
+typedef struct
+{
+   unsigned long     SleepValue;                      // How long each loop should sleep (milliseconds)
+   long              DebugLevel;                      // Non-zero means display additional debug info
+   long              RandRange;                       // Range of random variations (+/-)
+   long              AltSleepValue;                   // "Phase 2" (EXTERNAL) sleep value. "-1" means "No P2 sleep specified" (this allows for 0)
+   long              AltRandRange;                    // "Phase 2" (EXTERNAL) random range - same default as RandRange (no variation)
+   int               Phase2Mode;                      // v0.23 - Which Phase 2 delay policy is in effect (LB_P2_*)
+   long              StaggerStep;                     // v0.23 - Phase 2 stagger step (ms), 0 = stagger mode off
+   long              SequenceTimeout;                 // v0.23 - How long (ms) to wait for our turn
+   long              ConcurrencyStep;                 // v0.23 - ms per other probe (0 = concurrency mode off)
+   long              ConcurrencyExponent;             // v0.23 - 0 (flat), 1 (linear), 2 (quadratic), ...
+   long              ConcurrencyCap;                  // v0.23 - Longest delay (ms), 0 = no limit
+   long              BackoffCap;                      // v0.23 - Longest total wait per loop (ms), 0 = backoff mode off
+   long              BackoffSlice;                    // v0.23 - First slice (ms)
+   long              LatchTimeout;                    // v0.23 - Longest wait (ms) for the latch
+   long              QuietMs;                         // v0.23 - lb_quiet=
+   int               WindowSet;                       // v0.23 - Non-zero if lb_window= was given
+   UInt64            WindowStartTSC;                  // v0.23 - Start of the lb_window= window, in TSC ticks
+   UInt64            WindowEndTSC;                    // v0.23 - End of the lb_window= window, in TSC ticks
+   long              Rate;                            // v0.23 - Hook entries per second (0 = rate mode off)
+   long              RateBurst;                       // v0.23 - How many entries can go through back to back
+   UInt64            RateInterval;                    // v0.23 - TSC ticks per entry (TSCFrequency / Rate)
+   UInt64            TSCFrequency;                    // v0.23 - TSC ticks per second
+   UInt32            MaxThreads;                      // v0.23 - Size of lb_Threads (lb_threads=)
+   int               ABArms;                          // v0.23 - Number of A/B arms (0 = A/B mode off)
+} __attribute__((aligned(LB_CACHE_LINE))) lb_SettingsInfo;
+
+//
+// v0.23 - The counters the hook updates, from every CPU at once in Phase 2.  They're kept
+// together, on cache lines of their own, so that updating them doesn't keep knocking the
+// read-mostly settings (lb_Settings) out of the other CPUs' caches.
+// (The hook's assembly code uses InHook as "_lb_Counters", so it has to stay first.)
+//
+typedef struct
+{
+   int               InHook;                          // Number of threads currently executing our hook code
+   SInt32            ThreadCount;                     // Number of distinct threads seen so far
+   SInt32            InRegion;                        // Number of regions in progress (threads inside probeBus())
+   unsigned long     Loops;                           // IOPCIBridge::probeBus hook loop counter (for display only)
+   UInt64            LastLoopTSC;                     // TSC when the most recent loop entered the hook (or, if it slept, left it)
+   UInt32            NextTicket;                      // Sequencer:  next ticket to hand out
+   UInt32            NowServing;                      // Sequencer:  lowest ticket allowed to proceed
+   SInt32            SequenceTimeouts;                // Sequencer:  how many times a probe gave up waiting
+   SInt32            RateThrottled;                   // Rate mode:  how many entries had to sleep
+   UInt64            RateTAT;                         // Rate mode:  theoretical arrival time of the next entry (TSC)
+   SInt32            WindowSkipped;                   // How many Phase 2 loops were outside lb_window=
+   UInt64            SleepAskedUs;                    // lb_Sleep():  total time asked for (us, once calibrated)
+   UInt64            SleepGotUs;                      // lb_Sleep():  total time actually slept (us)
+} __attribute__((aligned(LB_CACHE_LINE))) lb_CounterInfo;
+
+
+//
+// v0.23 - Up through v0.22, the hook remembered only the first thread it saw (in
+// CurrentThread, read directly from %gs:0x10), and lumped every other thread together
+// as "Phase 2".  Now we keep a small table of every thread that comes through the hook,
+// in the order they first arrived, so Phase 2 threads can be told apart (and treated
+// individually, if need be).  The thread with ordinal 0 is the Phase 1 thread.
+//
+// The table is append-only and lock-free:  a new thread takes the next ordinal with an
+// atomic increment, which also gives it exclusive use of that slot, fills the slot in, and
+// publishes it by storing its thread pointer last.  Only the owning thread ever updates
+// its slot after that.  (If more than lb_Settings.MaxThreads threads show up, the extras aren't
+// tracked individually;  they all share the ordinal lb_Settings.MaxThreads.)
+//
+// Note that a thread_t can be reused once its thread terminates, so in principle a new
+// thread could be mistaken for an old one.  The probeBus threads all run at the same time,
+// and live well past the end of the PCI probe, so in practice that doesn't happen.
+//
+// v0.23 - A "region" is one Phase 2 call of probeBus(), from the first time it reaches our
+// hook until it returns.  To find out when it returns, we swap its return address for
+// latebloom_ret (see cfuncs.c), which puts the original back.  A thread can be inside
+// more than one probeBus() call at once (if one ends up calling another), so each thread
+// has a small stack of them.
+//
+typedef struct
+{
+   UInt64            Frame;                           // probeBus()'s frame pointer (%rbp)
+   UInt64            ReturnAddress;                   // Where probeBus() was really going to return to
+   UInt32            Ticket;                          // Sequencer ticket (see lb_Settings.SequenceTimeout)
+} lb_RegionInfo;
+
+typedef struct
+{
+   thread_t          Thread;                          // The thread (NULL while the slot is being filled in)
+   UInt32            Ordinal;                         // Order in which the thread first entered the hook (0 = first)
+   UInt32            Phase;                           // 1 or 2
+   UInt32            Iterations;                      // How many times the thread has been through the hook
+   UInt64            FirstTSC;                        // TSC when the thread first entered the hook
+   UInt64            LastTSC;                         // TSC when the thread most recently entered the hook
+   UInt32            Depth;                           // v0.23 - How many entries in Regions are in use
+   lb_RegionInfo     Regions[LB_MAX_REGIONS];         // v0.23 - probeBus() calls in progress (innermost last)
+} __attribute__((aligned(LB_CACHE_LINE))) lb_ThreadInfo;   // (each thread's slot gets its own cache line(s))
+
+//
+// v0.23 - One of the byte patterns that mark the hook site (see BytePatterns in cfuncs.c).
+//
+typedef struct
+{
+   const unsigned char *Pattern;
+   const unsigned long size;
+   const unsigned long ShortSize;                     // v0.23 - Bytes displaced by a short jump (>= SHORT_JUMP_SIZE)
+} lb_PatternInfo;
+
+//
+// v0.23 - The A/B record (see A/B mode in cfuncs.c):  each arm's recent wins and losses, and
+// the arm of a boot that hasn't completed yet.
+//
+typedef struct
+{
+   UInt16            Wins;
+   UInt16            Losses;
+   UInt16            Boots;                           // Completed boots (for the average PCI probe time)
+   UInt16            Reserved;
+   UInt32            TotalMs;                         // Total PCI probe time (ms) of those boots
+} lb_ArmRecord;
+
+typedef struct
+{
+   UInt32            Magic;                           // LB_AB_MAGIC
+   UInt32            Config;                          // Hash of the arms (see lb_ABConfig in cfuncs.c)
+   UInt8             Arms;                            // Number of arms
+   UInt8             Pending;                         // Arm number + 1 of a boot that hasn't completed (0 = none)
+   UInt16            Reserved;
+   lb_ArmRecord      Arm[LB_MAX_ARMS];
+} lb_ABRecord;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Defined in cfuncs.c (or, for tools/lbcheck.c, by the checks themselves)
+    extern lb_SettingsInfo           lb_Settings;
+    extern volatile lb_CounterInfo   lb_Counters;
+    extern lb_ThreadInfo             *lb_Threads;
+    extern volatile UInt64           lb_Phase2StartTSC;
+    extern unsigned long             lb_Phase2StartLoop;
+    void lb_Sleep(unsigned int Ms);
+
+    // The thread table
+    lb_ThreadInfo *lb_LookupThread(thread_t Thread);
+    lb_ThreadInfo *lb_FindThread(thread_t Thread, UInt64 Now, UInt32 *Ordinal);
+
+    // Regions (probeBus() calls in progress) and the sequencer (lb_sequence=)
+    lb_RegionInfo *lb_PushRegion(lb_ThreadInfo *Info, UInt64 Frame, UInt64 ReturnAddress);
+    lb_RegionInfo *lb_PopRegion(lb_ThreadInfo *Info);
+    long lb_SequencerWait(const lb_ThreadInfo *Info, const lb_RegionInfo *Region);
+    void lb_SequencerDone(UInt32 Ticket);
+
+    // Phase 2 delay policies
+    long lb_ConcurrencyDelay(SInt32 Others);
+    long lb_BackoffWait(SInt32 Self);
+    long lb_StaggerDelay(const lb_ThreadInfo *Info, UInt32 Ordinal);
+
+    // A/B mode (where the record is kept is up to lb_StoreRead()/lb_StoreWrite(), in cfuncs.c)
+    int  lb_StoreRead(lb_ABRecord *Record);
+    int  lb_StoreWrite(const lb_ABRecord *Record);
+    void lb_RandomSeed(UInt64 Seed);
+    UInt32 lb_Random32(void);
+    UInt32 lb_BetaSample(UInt32 Wins, UInt32 Losses);
+    int  lb_ABLoad(lb_ABRecord *Record, UInt32 Config, int Arms);
+    void lb_ABCount(lb_ArmRecord *Arm, int Win, long ProbeMs);
+    int  lb_ABResolvePending(lb_ABRecord *Record);
+    int  lb_ABPick(const lb_ABRecord *Record);
+
+    // Searching kernel text for byte patterns
+    UInt32 lb_ScanText(const lb_PatternInfo *Table, const unsigned char *Start, unsigned long long Length,
+                       unsigned long long *Sites, unsigned long *Patterns, UInt32 MaxSites, UInt32 *Candidates);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LBCORE_H
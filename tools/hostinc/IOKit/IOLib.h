@@ -0,0 +1,14 @@
+//
+// Host stand-in for <IOKit/IOLib.h> (see tools/lbcheck.c)
+//
+#ifndef LBCHECK_IOLIB_H
+#define LBCHECK_IOLIB_H
+
+#include <mach/mach_types.h>
+
+void *IOMalloc(size_t Size);
+void IOFree(void *Address, size_t Size);
+void IOLog(const char *Format, ...);
+void IODelay(unsigned int Microseconds);
+
+#endif
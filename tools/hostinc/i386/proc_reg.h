@@ -0,0 +1,24 @@
+//
+// Host stand-in for <i386/proc_reg.h> (see tools/lbcheck.c).  lbcheck never
+// lets kpatch.c fall back to clearing CR0.WP, so these are never really used.
+//
+#ifndef LBCHECK_PROC_REG_H
+#define LBCHECK_PROC_REG_H
+
+#include <stdint.h>
+
+#define CR0_WP       0x00010000
+
+extern uintptr_t lbcheck_cr0;
+
+static inline uintptr_t get_cr0(void)
+{
+   return lbcheck_cr0;
+}
+
+static inline void set_cr0(uintptr_t Value)
+{
+   lbcheck_cr0 = Value;
+}
+
+#endif
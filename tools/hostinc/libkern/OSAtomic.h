@@ -0,0 +1,35 @@
+//
+// Host stand-in for <libkern/OSAtomic.h> (see tools/lbcheck.c)
+//
+#ifndef LBCHECK_OSATOMIC_H
+#define LBCHECK_OSATOMIC_H
+
+#include <mach/mach_types.h>
+
+static inline int OSCompareAndSwap(UInt32 Old, UInt32 New, volatile UInt32 *Address)
+{
+   return __sync_bool_compare_and_swap(Address, Old, New);
+}
+
+static inline int OSCompareAndSwap64(UInt64 Old, UInt64 New, volatile UInt64 *Address)
+{
+   return __sync_bool_compare_and_swap(Address, Old, New);
+}
+
+// (Like the kernel's, these return the value from before the change)
+static inline SInt32 OSIncrementAtomic(volatile SInt32 *Address)
+{
+   return __sync_fetch_and_add(Address, 1);
+}
+
+static inline SInt32 OSDecrementAtomic(volatile SInt32 *Address)
+{
+   return __sync_fetch_and_sub(Address, 1);
+}
+
+static inline void OSMemoryBarrier(void)
+{
+   __sync_synchronize();
+}
+
+#endif
@@ -0,0 +1,4 @@
+//
+// Host stand-in for <libkern/version.h> (see tools/lbcheck.c)
+//
+extern const int version_major;
@@ -0,0 +1,139 @@
+//
+// Host stand-in for <mach-o/loader.h> (see tools/lbcheck.c) - just what klookup.c uses,
+// laid out as in the real thing
+//
+#ifndef LBCHECK_LOADER_H
+#define LBCHECK_LOADER_H
+
+#include <stdint.h>
+
+struct mach_header_64
+{
+   uint32_t       magic;
+   int32_t        cputype;
+   int32_t        cpusubtype;
+   uint32_t       filetype;
+   uint32_t       ncmds;
+   uint32_t       sizeofcmds;
+   uint32_t       flags;
+   uint32_t       reserved;
+};
+
+#define MH_MAGIC_64           0xfeedfacf
+#define MH_EXECUTE            0x2
+#define MH_KEXT_BUNDLE        0xb
+#define MH_FILESET            0xc
+
+struct load_command
+{
+   uint32_t       cmd;
+   uint32_t       cmdsize;
+};
+
+#define LC_REQ_DYLD           0x80000000
+#define LC_SYMTAB             0x2
+#define LC_DYSYMTAB           0xb
+#define LC_SEGMENT_64         0x19
+#define LC_UUID               0x1b
+#define LC_FUNCTION_STARTS    0x26
+#define LC_FILESET_ENTRY      (0x35 | LC_REQ_DYLD)
+
+#define SEG_TEXT              "__TEXT"
+#define SEG_LINKEDIT          "__LINKEDIT"
+
+union lc_str
+{
+   uint32_t       offset;
+};
+
+struct segment_command_64
+{
+   uint32_t       cmd;
+   uint32_t       cmdsize;
+   char           segname[16];
+   uint64_t       vmaddr;
+   uint64_t       vmsize;
+   uint64_t       fileoff;
+   uint64_t       filesize;
+   int32_t        maxprot;
+   int32_t        initprot;
+   uint32_t       nsects;
+   uint32_t       flags;
+};
+
+struct section_64
+{
+   char           sectname[16];
+   char           segname[16];
+   uint64_t       addr;
+   uint64_t       size;
+   uint32_t       offset;
+   uint32_t       align;
+   uint32_t       reloff;
+   uint32_t       nreloc;
+   uint32_t       flags;
+   uint32_t       reserved1;
+   uint32_t       reserved2;
+   uint32_t       reserved3;
+};
+
+struct symtab_command
+{
+   uint32_t       cmd;
+   uint32_t       cmdsize;
+   uint32_t       symoff;
+   uint32_t       nsyms;
+   uint32_t       stroff;
+   uint32_t       strsize;
+};
+
+struct dysymtab_command
+{
+   uint32_t       cmd;
+   uint32_t       cmdsize;
+   uint32_t       ilocalsym;
+   uint32_t       nlocalsym;
+   uint32_t       iextdefsym;
+   uint32_t       nextdefsym;
+   uint32_t       iundefsym;
+   uint32_t       nundefsym;
+   uint32_t       tocoff;
+   uint32_t       ntoc;
+   uint32_t       modtaboff;
+   uint32_t       nmodtab;
+   uint32_t       extrefsymoff;
+   uint32_t       nextrefsyms;
+   uint32_t       indirectsymoff;
+   uint32_t       nindirectsyms;
+   uint32_t       extreloff;
+   uint32_t       nextrel;
+   uint32_t       locreloff;
+   uint32_t       nlocrel;
+};
+
+struct uuid_command
+{
+   uint32_t       cmd;
+   uint32_t       cmdsize;
+   uint8_t        uuid[16];
+};
+
+struct linkedit_data_command
+{
+   uint32_t       cmd;
+   uint32_t       cmdsize;
+   uint32_t       dataoff;
+   uint32_t       datasize;
+};
+
+struct fileset_entry_command
+{
+   uint32_t       cmd;
+   uint32_t       cmdsize;
+   uint64_t       vmaddr;
+   uint64_t       fileoff;
+   union lc_str   entry_id;
+   uint32_t       reserved;
+};
+
+#endif
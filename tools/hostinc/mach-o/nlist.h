@@ -0,0 +1,29 @@
+//
+// Host stand-in for <mach-o/nlist.h> (see tools/lbcheck.c) - just what klookup.c uses
+//
+#ifndef LBCHECK_NLIST_H
+#define LBCHECK_NLIST_H
+
+#include <stdint.h>
+
+struct nlist_64
+{
+   union
+   {
+      uint32_t    n_strx;
+   } n_un;
+   uint8_t        n_type;
+   uint8_t        n_sect;
+   uint16_t       n_desc;
+   uint64_t       n_value;
+};
+
+#define N_STAB       0xe0
+#define N_TYPE       0x0e
+#define N_EXT        0x01
+#define N_UNDF       0x00
+#define N_ABS        0x02
+#define N_SECT       0x0e
+#define N_FUN        0x24
+
+#endif
@@ -0,0 +1,32 @@
+//
+// Host stand-in for <mach/mach_types.h> (see tools/lbcheck.c)
+//
+#ifndef LBCHECK_MACH_TYPES_H
+#define LBCHECK_MACH_TYPES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef uint8_t      UInt8;
+typedef uint16_t     UInt16;
+typedef uint32_t     UInt32;
+typedef uint64_t     UInt64;
+typedef int32_t      SInt32;
+typedef int64_t      SInt64;
+typedef uint32_t     ppnum_t;
+typedef uint64_t     addr64_t;
+typedef uintptr_t    vm_offset_t;
+typedef int          kern_return_t;
+typedef struct thread *thread_t;
+
+#define PAGE_SHIFT   12
+#define PAGE_SIZE    (1UL << PAGE_SHIFT)
+#define PAGE_MASK    (PAGE_SIZE - 1)
+
+#define VM_PROT_READ    0x01
+#define VM_PROT_WRITE   0x02
+#define VM_PROT_EXECUTE 0x04
+
+#endif
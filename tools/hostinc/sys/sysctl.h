@@ -0,0 +1,3 @@
+//
+// Host stand-in for <sys/sysctl.h> (see tools/lbcheck.c) - nothing needed from it
+//
@@ -0,0 +1,5 @@
+//
+// Host stand-in for <sys/systm.h> (see tools/lbcheck.c)
+//
+#include <stdio.h>
+#include <string.h>
@@ -0,0 +1,6 @@
+//
+// Host stand-in for <vm/vm_kern.h> (see tools/lbcheck.c)
+//
+#include <mach/mach_types.h>
+
+void vm_kernel_unslide_or_perm_external(vm_offset_t Address, vm_offset_t *Unslid);
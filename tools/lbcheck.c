@@ -0,0 +1,1907 @@
+//
+// lbcheck.c
+//
+// v0.23 - Host-side checks for the parts of latebloom that are plain C.
+//
+// Usage:   cc -I hostinc -I ../latebloom -o lbcheck lbcheck.c -lpthread && ./lbcheck [-v]
+//
+// kpatch.c, klookup.c and lbcore.c are #included here, so their static functions
+// and tables can be checked directly.  The few kernel interfaces they use come from
+// the stand-in headers in hostinc/ and the stubs below:  "physical" pages are
+// numbered from the start of Text[] (so kpatch.c's writable aliases land back in
+// Text[]), the kernel image klookup.c finds is a Mach-O built in memory by
+// BuildImage(), holding the symbols kpatch.c looks up, and the settings, counters,
+// thread table and lb_Sleep() that lbcore.c shares with cfuncs.c are defined here
+// (lb_Sleep() really sleeps, so pthreads can stand in for probeBus() threads, unless
+// a check swaps in a simulated clock), and A/B mode's NVRAM record is kept in a file.
+// x86_64 only (kpatch.c serializes with CPUID).
+//
+// Exits 0 if every check passed;  -v also shows klookup.c's messages, and timings.
+//
+// cfuncs.c itself can't be built here:  its hook is top-level assembly that names
+// Mach-O symbols (_lb_Counters, _latebloom_ret, IOPCIFamily's mangled probeBus()),
+// and it uses some 30 kernel KPIs.  What the hook decides, though, lives in lbcore.c
+// (the thread table, regions, and the stagger, sequence, concurrency and backoff
+// modes), as does the search for the hook's byte patterns and A/B mode's bookkeeping
+// and arm choice, and all of those are checked here.
+//
+////////////////////////////////////////////////////////////////////////////////
+// License: 0BSD                                                              //
+//                                                                            //
+// Copyright (C) 2021 by Syncretic                                            //
+//                                                                            //
+// Permission to use, copy, modify, and/or distribute this software for any   //
+// purpose with or without fee is hereby granted.                             //
+//                                                                            //
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES   //
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF           //
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR    //
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES     //
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN      //
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR //
+// IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.                //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+// klookup.c's messages go through lbcheck_printf() (quiet unless -v)
+static int  Verbose = 0;
+static int  lbcheck_printf(const char *Format, ...);
+#define printf lbcheck_printf
+
+#include "kpatch.c"
+#include "klookup.c"
+#include "lbcore.c"
+
+#undef printf
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Kernel stand-ins
+//
+////////////////////////////////////////////////////////////////////////////////
+const int   version_major = BIGSUR_XNU_MAJOR_VERSION - 1;   // (no __PRELINK_TEXT detour, see IndexKernel())
+uintptr_t   lbcheck_cr0 = CR0_WP;
+
+static int lbcheck_printf(const char *Format, ...)
+{
+   va_list  Args;
+   int      Length = 0;
+
+   if (Verbose)
+   {
+      va_start(Args, Format);
+      Length = vprintf(Format, Args);
+      va_end(Args);
+   }
+   return Length;
+}
+
+void IOLog(const char *Format, ...)
+{
+   va_list  Args;
+
+   if (Verbose)
+   {
+      va_start(Args, Format);
+      vprintf(Format, Args);
+      va_end(Args);
+   }
+}
+
+void *IOMalloc(size_t Size)
+{
+   return malloc(Size);
+}
+
+void IOFree(void *Address, size_t Size)
+{
+   (void)Size;
+   free(Address);
+}
+
+void IODelay(unsigned int Microseconds)
+{
+   (void)Microseconds;
+}
+
+//
+// What lbcore.c shares with cfuncs.c
+//
+#define THREADS            8
+
+lb_SettingsInfo            lb_Settings = { .MaxThreads = THREADS };
+volatile lb_CounterInfo    lb_Counters;
+lb_ThreadInfo              *lb_Threads;
+volatile UInt64            lb_Phase2StartTSC;
+unsigned long              lb_Phase2StartLoop;
+static lb_ThreadInfo       Slots[THREADS];
+
+static void RealSleep(unsigned int Ms)
+{
+   usleep(Ms * 1000);
+}
+
+static void (*Sleeper)(unsigned int Ms) = RealSleep;
+
+void lb_Sleep(unsigned int Ms)
+{
+   Sleeper(Ms);
+}
+
+// Where lbcore.c's A/B mode keeps its record (NVRAM, in cfuncs.c):  a file, here.  Until
+// a check sets StorePath, and while StoreUp is 0, "NVRAM" isn't up.
+static const char          *StorePath;
+static int                 StoreUp = 0;
+
+int lb_StoreRead(lb_ABRecord *Record)
+{
+   FILE     *File;
+   size_t   Length;
+
+   if (StorePath == NULL || !StoreUp)
+   {
+      return LB_STORE_DOWN;
+   }
+   if ((File = fopen(StorePath, "rb")) == NULL)
+   {
+      return LB_STORE_MISSING;
+   }
+   Length = fread(Record, 1, sizeof(*Record), File);
+   fclose(File);
+   return (Length == sizeof(*Record)) ? LB_STORE_OK : LB_STORE_MISSING;
+}
+
+int lb_StoreWrite(const lb_ABRecord *Record)
+{
+   FILE     *File;
+   size_t   Length;
+
+   if (StorePath == NULL || !StoreUp || (File = fopen(StorePath, "wb")) == NULL)
+   {
+      return 0;
+   }
+   Length = fwrite(Record, 1, sizeof(*Record), File);
+   return (fclose(File) == 0 && Length == sizeof(*Record));
+}
+
+//
+// The code kpatch.c patches, and its "physical" pages (page n of Text[] is page n + 1)
+//
+#define TEXT_PAGES         3
+static unsigned char Text[TEXT_PAGES * PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+static int           AliasCount = 0;      // Aliases currently mapped
+
+static ppnum_t pmap_find_phys_stub(void *Pmap, addr64_t Virtual)
+{
+   (void)Pmap;
+   if (Virtual < (addr64_t)Text || Virtual >= (addr64_t)Text + sizeof(Text))
+   {
+      return 0;
+   }
+   return (ppnum_t)(((Virtual - (addr64_t)Text) >> PAGE_SHIFT) + 1);
+}
+
+void *MapWritableAlias(uint64_t Physical, size_t Length, void **Cookie)
+{
+   (void)Length;
+   ++AliasCount;
+   *Cookie = &AliasCount;
+   return Text + (Physical - PAGE_SIZE);
+}
+
+void UnmapWritableAlias(void *Cookie)
+{
+   if (Cookie == &AliasCount)
+   {
+      --AliasCount;
+   }
+}
+
+static int  RendezvousCount = 0;
+
+static void mp_rendezvous_no_intrs_stub(void (*Action)(void *), void *Arg)
+{
+   ++RendezvousCount;
+   Action(Arg);
+}
+
+static int  KernelPmapStore;
+static void *KernelPmapStub = &KernelPmapStore;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Mach-O fixtures
+//
+// BuildImage() lays out a header, __TEXT and __LINKEDIT segments, LC_SYMTAB and
+// LC_DYSYMTAB, then (at LINKEDIT_OFFSET) the name list - locals first, then the
+// external definitions, in the order given - and the string table.  __LINKEDIT's
+// vmaddr is where it really is in <Image>, so the symbol table can be read in
+// place, as it would be in the kernel.  (BuildSizedImage() does the same in a buffer
+// of any size, for symbol tables that don't fit in IMAGE_SIZE.)
+//
+////////////////////////////////////////////////////////////////////////////////
+#define IMAGE_SIZE         8192
+#define LINKEDIT_OFFSET    1024
+
+typedef struct
+{
+   const char  *Name;
+   uint8_t     Type;
+   uint64_t    Value;
+} FixtureSymbol;
+
+typedef struct
+{
+   struct mach_header_64      Header;
+   struct segment_command_64  Text;
+   struct segment_command_64  LinkEdit;
+   struct symtab_command      Symtab;
+   struct dysymtab_command    Dysymtab;
+} FixtureCommands;
+
+static void BuildSizedImage(unsigned char *Image, size_t Size, const FixtureSymbol *Locals, uint32_t nLocals,
+                            const FixtureSymbol *Externals, uint32_t nExternals)
+{
+   FixtureCommands   *Commands = (FixtureCommands *)Image;
+   struct nlist_64   *NameList = (struct nlist_64 *)(Image + LINKEDIT_OFFSET);
+   uint32_t          nSyms = nLocals + nExternals;
+   uint32_t          StringOffset = LINKEDIT_OFFSET + nSyms * sizeof(struct nlist_64);
+   uint32_t          StringSize = 1;         // (offset 0 is the empty string)
+   uint32_t          i;
+
+   memset(Image, 0, Size);
+   Commands->Header.magic = MH_MAGIC_64;
+   Commands->Header.filetype = MH_EXECUTE;
+   Commands->Header.ncmds = 4;
+   Commands->Header.sizeofcmds = sizeof(FixtureCommands) - sizeof(struct mach_header_64);
+
+   Commands->Text.cmd = LC_SEGMENT_64;
+   Commands->Text.cmdsize = sizeof(struct segment_command_64);
+   strcpy(Commands->Text.segname, SEG_TEXT);
+   Commands->Text.vmaddr = 0x100000;
+   Commands->Text.vmsize = 0x10000;
+
+   for (i = 0; i < nSyms; ++i)
+   {
+      const FixtureSymbol *Symbol = (i < nLocals) ? &Locals[i] : &Externals[i - nLocals];
+
+      NameList[i].n_un.n_strx = StringSize;
+      NameList[i].n_type = Symbol->Type;
+      NameList[i].n_sect = 1;
+      NameList[i].n_value = Symbol->Value;
+      strcpy((char *)Image + StringOffset + StringSize, Symbol->Name);
+      StringSize += (uint32_t)strlen(Symbol->Name) + 1;
+   }
+
+   Commands->LinkEdit.cmd = LC_SEGMENT_64;
+   Commands->LinkEdit.cmdsize = sizeof(struct segment_command_64);
+   strcpy(Commands->LinkEdit.segname, SEG_LINKEDIT);
+   Commands->LinkEdit.fileoff = LINKEDIT_OFFSET;
+   Commands->LinkEdit.filesize = Size - LINKEDIT_OFFSET;
+   Commands->LinkEdit.vmaddr = (uint64_t)Image + LINKEDIT_OFFSET;
+   Commands->LinkEdit.vmsize = Size - LINKEDIT_OFFSET;
+
+   Commands->Symtab.cmd = LC_SYMTAB;
+   Commands->Symtab.cmdsize = sizeof(struct symtab_command);
+   Commands->Symtab.symoff = LINKEDIT_OFFSET;
+   Commands->Symtab.nsyms = nSyms;
+   Commands->Symtab.stroff = StringOffset;
+   Commands->Symtab.strsize = StringSize;
+
+   Commands->Dysymtab.cmd = LC_DYSYMTAB;
+   Commands->Dysymtab.cmdsize = sizeof(struct dysymtab_command);
+   Commands->Dysymtab.ilocalsym = 0;
+   Commands->Dysymtab.nlocalsym = nLocals;
+   Commands->Dysymtab.iextdefsym = nLocals;
+   Commands->Dysymtab.nextdefsym = nExternals;
+}
+
+static void BuildImage(unsigned char *Image, const FixtureSymbol *Locals, uint32_t nLocals,
+                       const FixtureSymbol *Externals, uint32_t nExternals)
+{
+   BuildSizedImage(Image, IMAGE_SIZE, Locals, nLocals, Externals, nExternals);
+}
+
+//
+// Append an LC_FILESET_ENTRY for the image at <VMAddr>, named <Name>, to the load commands
+//
+static struct fileset_entry_command *AddFilesetEntry(unsigned char *Image, uint64_t VMAddr, const char *Name)
+{
+   struct mach_header_64         *Header = (struct mach_header_64 *)Image;
+   struct fileset_entry_command  *Entry = (struct fileset_entry_command *)(Image + sizeof(*Header) + Header->sizeofcmds);
+   uint32_t                      Size = (uint32_t)(sizeof(*Entry) + strlen(Name) + 1 + 7) & ~7U;
+
+   memset(Entry, 0, Size);
+   Entry->cmd = LC_FILESET_ENTRY;
+   Entry->cmdsize = Size;
+   Entry->vmaddr = VMAddr;
+   Entry->entry_id.offset = sizeof(*Entry);
+   strcpy((char *)(Entry + 1), Name);
+   ++Header->ncmds;
+   Header->sizeofcmds += Size;
+   return Entry;
+}
+
+//
+// The kernel klookup.c finds (see vm_kernel_unslide_or_perm_external()):  what kpatch.c
+// looks up, as sorted external definitions, plus a local symbol.  It's a boot kernel
+// collection (MH_FILESET), whose members are two kexts and an image that isn't Mach-O.
+//
+static unsigned char KernelImage[IMAGE_SIZE] __attribute__((aligned(8)));
+static unsigned char KextAlpha[IMAGE_SIZE] __attribute__((aligned(8)));
+static unsigned char KextBeta[IMAGE_SIZE] __attribute__((aligned(8)));
+static unsigned char KextBroken[IMAGE_SIZE] __attribute__((aligned(8)));
+
+static void BuildKernel(void)
+{
+   const FixtureSymbol Locals[] =
+   {
+      { "_lbcheck_local", N_SECT, 0x1234 },
+   };
+   const FixtureSymbol Externals[] =
+   {
+      { "_kernel_pmap",             N_SECT | N_EXT, (uint64_t)&KernelPmapStub },
+      { "_mp_rendezvous_no_intrs",  N_SECT | N_EXT, (uint64_t)mp_rendezvous_no_intrs_stub },
+      { "_pmap_find_phys",          N_SECT | N_EXT, (uint64_t)pmap_find_phys_stub },
+   };
+   const FixtureSymbol AlphaSymbols[] =
+   {
+      { "_alpha_start",    N_SECT | N_EXT, 0x100100 },
+      { "_shared",         N_SECT | N_EXT, 0x100200 },
+   };
+   const FixtureSymbol BetaSymbols[] =
+   {
+      { "_beta_start",     N_SECT | N_EXT, 0x100300 },
+      { "_shared",         N_SECT | N_EXT, 0x100400 },
+   };
+
+   BuildImage(KernelImage, Locals, 1, Externals, 3);
+   ((struct mach_header_64 *)KernelImage)->filetype = MH_FILESET;
+   BuildImage(KextAlpha, NULL, 0, AlphaSymbols, 2);
+   ((struct mach_header_64 *)KextAlpha)->filetype = MH_KEXT_BUNDLE;
+   BuildImage(KextBeta, NULL, 0, BetaSymbols, 2);
+   ((struct mach_header_64 *)KextBeta)->filetype = MH_KEXT_BUNDLE;
+   AddFilesetEntry(KernelImage, (uint64_t)KextAlpha, "com.example.alpha");
+   AddFilesetEntry(KernelImage, (uint64_t)KextBroken, "com.example.broken");
+   AddFilesetEntry(KernelImage, (uint64_t)KextBeta, "com.example.beta");
+}
+
+//
+// IndexKernel() takes the kernel's header to be at KERNEL_BASE + (printf's slid address -
+// its unslid one);  make that KernelImage
+//
+void vm_kernel_unslide_or_perm_external(vm_offset_t Address, vm_offset_t *Unslid)
+{
+   *Unslid = Address + KERNEL_BASE - (vm_offset_t)KernelImage;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Checks
+//
+////////////////////////////////////////////////////////////////////////////////
+static int  Checks = 0;
+static int  Failures = 0;
+
+#define CHECK(Condition) \
+   do { ++Checks; if (!(Condition)) { ++Failures; fprintf(stderr, "%s:%d: FAILED: %s\n", __FILE__, __LINE__, #Condition); } } while (0)
+
+// Repeatable pseudo-random numbers (xorshift), for fixtures
+static UInt32  Seed = 2463534242U;
+
+static UInt32 Random(void)
+{
+   Seed ^= Seed << 13;
+   Seed ^= Seed >> 17;
+   Seed ^= Seed << 5;
+   return Seed;
+}
+
+// Wall-clock time, for the timings -v shows
+static double Seconds(void)
+{
+   struct timespec   Now;
+
+   clock_gettime(CLOCK_MONOTONIC, &Now);
+   return (double)Now.tv_sec + (double)Now.tv_nsec / 1e9;
+}
+
+static int AllBytes(const unsigned char *Bytes, size_t Length, unsigned char Value)
+{
+   while (Length-- != 0)
+   {
+      if (*Bytes++ != Value)
+      {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+//
+// v0.23 - kpatch.c:  patching, the journal's verification and checksums, and rollback
+//
+static void CheckJournal(void)
+{
+   static const unsigned char LongJump[14] = { 0xff, 0x25, 0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8 };
+   unsigned char  *Site = Text + 0x100;
+   unsigned char  *Straddle = Text + PAGE_SIZE - 6;
+   char           Buffer[2048];
+   int            Entry, Other;
+   int            i;
+
+   memset(Text, 0x90, sizeof(Text));
+
+   // Bad arguments never touch anything
+   CHECK(JournalPatch(NULL, LongJump, sizeof(LongJump), &Entry) == KPATCH_BAD_ARGS);
+   CHECK(JournalPatch(Site, LongJump, 1, &Entry) == KPATCH_BAD_ARGS);
+   CHECK(JournalPatch(Site, LongJump, KPATCH_MAX_BYTES + 1, &Entry) == KPATCH_BAD_ARGS);
+   // The guard can't straddle a cache line
+   CHECK(TextPoke(Text + 63, LongJump, sizeof(LongJump)) == KPATCH_SPLIT_LINE);
+   CHECK(AllBytes(Text, sizeof(Text), 0x90));
+   // Outside Text[] there's no "physical" page, so no alias (and no CR0.WP fallback unless allowed)
+   CHECK(TextWrite(Buffer, LongJump, sizeof(LongJump)) == KPATCH_NO_ALIAS);
+
+   // Patch, verify, record
+   RendezvousCount = 0;
+   CHECK(JournalPatch(Site, LongJump, sizeof(LongJump), &Entry) == KPATCH_OK);
+   CHECK(!memcmp(Site, LongJump, sizeof(LongJump)));
+   CHECK(AllBytes(Site - 1, 1, 0x90) && AllBytes(Site + sizeof(LongJump), 1, 0x90));
+   CHECK(RendezvousCount == 3);              // guard, body, opcode
+   CHECK(AliasCount == 0);                   // alias unmapped again
+   CHECK(Journal[Entry].State == KPATCH_STATE_APPLIED);
+   CHECK(Journal[Entry].Method == KPATCH_METHOD_ALIAS);
+   CHECK(Journal[Entry].Checksum == JournalChecksum(Entry));
+   CHECK(AllBytes(Journal[Entry].Original, sizeof(LongJump), 0x90));
+   CHECK(!strcmp(TextMethodName(), "alias"));
+   JournalFormat(Buffer, sizeof(Buffer));
+   CHECK(strstr(Buffer, "applied  (alias)") != NULL && strstr(Buffer, " ok\n") != NULL);
+   CHECK(strstr(Buffer, "orig: 90 90") != NULL && strstr(Buffer, "new:  ff 25") != NULL);
+
+   // A patch across a page boundary needs both "physical" pages
+   CHECK(JournalPatch(Straddle, LongJump, 12, &Other) == KPATCH_OK);
+   CHECK(!memcmp(Straddle, LongJump, 12));
+
+   // A corrupt entry is left alone (and the formatted journal says so)
+   Journal[Entry].Original[3] ^= 0x01;
+   CHECK(JournalRollback(Entry) == KPATCH_BAD_ENTRY);
+   CHECK(!memcmp(Site, LongJump, sizeof(LongJump)));
+   JournalFormat(Buffer, sizeof(Buffer));
+   CHECK(strstr(Buffer, " BAD\n") != NULL);
+   Journal[Entry].Original[3] ^= 0x01;
+
+   // So is a patch somebody else has since written over
+   Site[7] ^= 0xff;
+   CHECK(JournalRollback(Entry) == KPATCH_MODIFIED);
+   Site[7] ^= 0xff;
+
+   // Rollback puts the original bytes back, and is idempotent
+   CHECK(JournalRollback(Entry) == KPATCH_OK);
+   CHECK(AllBytes(Site, sizeof(LongJump), 0x90));
+   CHECK(Journal[Entry].State == KPATCH_STATE_REVERTED);
+   CHECK(Journal[Entry].Checksum == JournalChecksum(Entry));
+   CHECK(JournalRollback(Entry) == KPATCH_OK);
+   CHECK(JournalRollback(-1) == KPATCH_BAD_ENTRY && JournalRollback(KPATCH_JOURNAL_SIZE) == KPATCH_BAD_ENTRY);
+
+   // Reverted entries are reused;  once every entry is applied, the journal is full
+   for (i = 0; i < KPATCH_JOURNAL_SIZE - 1; ++i)
+   {
+      CHECK(JournalPatch(Text + 2 * PAGE_SIZE + 64 * i, LongJump, sizeof(LongJump), NULL) == KPATCH_OK);
+   }
+   CHECK(JournalPatch(Text + 2 * PAGE_SIZE + 64 * i, LongJump, sizeof(LongJump), NULL) == KPATCH_JOURNAL_FULL);
+
+   // Roll everything back
+   CHECK(JournalRollbackAll() == KPATCH_OK);
+   CHECK(AllBytes(Text, sizeof(Text), 0x90));
+   for (i = 0; i < KPATCH_JOURNAL_SIZE; ++i)
+   {
+      CHECK(Journal[i].State == KPATCH_STATE_REVERTED && Journal[i].Checksum == JournalChecksum(i));
+   }
+   CHECK(AliasCount == 0);
+}
+
+//
+// v0.23 - klookup.c:  ParseMachO()'s bounds checks
+//
+static unsigned char Image[IMAGE_SIZE] __attribute__((aligned(8)));
+
+static void BuildFixture(void)
+{
+   const FixtureSymbol Locals[] =
+   {
+      { "_local_one", N_SECT, 0x101000 },
+      { "_local_two", N_SECT, 0x102000 },
+   };
+   const FixtureSymbol Externals[] =
+   {
+      { "_alpha",    N_SECT | N_EXT, 0x100100 },
+      { "_beta",     N_SECT | N_EXT, 0x100200 },
+      { "_gamma",    N_SECT | N_EXT, 0x100300 },
+   };
+
+   BuildImage(Image, Locals, 2, Externals, 3);
+}
+
+static int Parse(void)
+{
+   MachOIndex  Index;
+
+   return ParseMachO((struct mach_header_64 *)Image, &Index);
+}
+
+static void CheckParseMachO(void)
+{
+   FixtureCommands   *Commands = (FixtureCommands *)Image;
+   MachOIndex        Index;
+   uint32_t          i;
+
+   BuildFixture();
+   CHECK(ParseMachO((struct mach_header_64 *)Image, &Index) == MACHO_OK);
+   CHECK(Index.nSegments == 2 && Index.LinkEdit == &Commands->LinkEdit);
+   CHECK(Index.Symtab == &Commands->Symtab && Index.Dysymtab == &Commands->Dysymtab);
+   CHECK(Index.Start == 0x100000 && Index.End == 0x110000);
+   CHECK(FindSegment64(&Index, SEG_TEXT) == &Commands->Text && FindSegment64(&Index, "__DATA") == NULL);
+
+   Commands->Header.magic = MH_MAGIC_64 + 1;
+   CHECK(Parse() == MACHO_BAD_MAGIC);
+
+   // Load commands must be sane, and stay inside sizeofcmds
+   BuildFixture();
+   Commands->Text.cmdsize += 4;
+   CHECK(Parse() == MACHO_BAD_COMMAND);
+   BuildFixture();
+   Commands->Text.cmdsize = 0;
+   CHECK(Parse() == MACHO_BAD_COMMAND);
+   BuildFixture();
+   Commands->Dysymtab.cmdsize += 8;
+   CHECK(Parse() == MACHO_BAD_COMMAND);
+   BuildFixture();
+   Commands->Header.sizeofcmds -= 8;
+   CHECK(Parse() == MACHO_BAD_COMMAND);
+   BuildFixture();
+   Commands->Header.ncmds = 5;
+   CHECK(Parse() == MACHO_BAD_COMMAND);
+   BuildFixture();
+   Commands->Text.nsects = 1;
+   CHECK(Parse() == MACHO_BAD_COMMAND);
+   BuildFixture();
+   Commands->Text.vmsize = ~0ULL;
+   CHECK(Parse() == MACHO_BAD_COMMAND);
+   BuildFixture();
+   Commands->Symtab.cmdsize = sizeof(struct load_command);
+   CHECK(Parse() == MACHO_BAD_COMMAND);
+
+   // Everything LC_SYMTAB and LC_DYSYMTAB point at must be inside __LINKEDIT
+   BuildFixture();
+   Commands->Symtab.symoff = LINKEDIT_OFFSET - 8;
+   CHECK(Parse() == MACHO_BAD_LINKEDIT);
+   BuildFixture();
+   Commands->Symtab.nsyms = IMAGE_SIZE / sizeof(struct nlist_64);
+   CHECK(Parse() == MACHO_BAD_LINKEDIT);
+   BuildFixture();
+   Commands->Symtab.strsize = IMAGE_SIZE;
+   CHECK(Parse() == MACHO_BAD_LINKEDIT);
+   BuildFixture();
+   Commands->Symtab.stroff = ~0U;
+   CHECK(Parse() == MACHO_BAD_LINKEDIT);
+   BuildFixture();
+   Commands->Dysymtab.nextdefsym = 4;
+   CHECK(Parse() == MACHO_BAD_LINKEDIT);
+   BuildFixture();
+   Commands->Dysymtab.ilocalsym = ~0U;
+   CHECK(Parse() == MACHO_BAD_LINKEDIT);
+   BuildFixture();
+   memset(Commands->LinkEdit.segname, 0, sizeof(Commands->LinkEdit.segname));
+   CHECK(Parse() == MACHO_BAD_LINKEDIT);
+
+   // No more than MACHO_MAX_SEGMENTS segments
+   BuildFixture();
+   Commands->Header.ncmds = MACHO_MAX_SEGMENTS + 1;
+   Commands->Header.sizeofcmds = (MACHO_MAX_SEGMENTS + 1) * sizeof(struct segment_command_64);
+   for (i = 0; i <= MACHO_MAX_SEGMENTS; ++i)
+   {
+      struct segment_command_64  *Segment = &Commands->Text + i;
+
+      memset(Segment, 0, sizeof(*Segment));
+      Segment->cmd = LC_SEGMENT_64;
+      Segment->cmdsize = sizeof(*Segment);
+   }
+   CHECK(Parse() == MACHO_TOO_MANY);
+}
+
+//
+// v0.23 - klookup.c:  kext symbols, through the boot kernel collection's LC_FILESET_ENTRY commands
+//
+static void CheckFileset(void)
+{
+   struct fileset_entry_command  *Entry;
+   uint64_t                      Address, Size;
+
+   // Each entry's name must start, and end (with a NUL), inside the command
+   BuildFixture();
+   AddFilesetEntry(Image, 0, "com.example.entry");
+   CHECK(Parse() == MACHO_OK);
+   BuildFixture();
+   Entry = AddFilesetEntry(Image, 0, "com.example.entry");
+   Entry->entry_id.offset = Entry->cmdsize;
+   CHECK(Parse() == MACHO_BAD_COMMAND);
+   BuildFixture();
+   Entry = AddFilesetEntry(Image, 0, "com.example.entry");
+   Entry->entry_id.offset = 8;
+   CHECK(Parse() == MACHO_BAD_COMMAND);
+   BuildFixture();
+   Entry = AddFilesetEntry(Image, 0, "com.example.entry");      // (and no NUL in it)
+   memset((char *)(Entry + 1), 'x', Entry->cmdsize - sizeof(*Entry));
+   CHECK(Parse() == MACHO_BAD_COMMAND);
+   BuildFixture();
+   Entry = AddFilesetEntry(Image, 0, "");
+   Entry->cmdsize = sizeof(*Entry);
+   ((struct mach_header_64 *)Image)->sizeofcmds -= 8;
+   CHECK(Parse() == MACHO_BAD_COMMAND);
+
+   // The kernel fixture's members (the one that isn't Mach-O is skipped)
+   ListKextImages();
+   CHECK(KextCount == 2);
+   CHECK(KextCount == 2 && !strcmp(KextImages[0].BundleID, "com.example.alpha") && KextImages[0].Header == (void *)KextAlpha);
+   CHECK(KextCount == 2 && !strcmp(KextImages[1].BundleID, "com.example.beta") && KextImages[1].Header == (void *)KextBeta);
+   CHECK(KextSymbolLookup("com.example.alpha", "_alpha_start") == (void *)0x100100);
+   CHECK(KextSymbolLookup("com.example.beta", "_shared") == (void *)0x100400);
+   CHECK(KextSymbolLookup("com.example.alpha", "_shared") == (void *)0x100200);
+   CHECK(KextSymbolLookup("com.example.alpha", "_beta_start") == NULL);
+   CHECK(KextSymbolLookup(NULL, "_beta_start") == (void *)0x100300);
+   CHECK(KextSymbolLookup("com.example.missing", "_alpha_start") == NULL);
+   CHECK(KextSectionRange("com.example.alpha", SEG_TEXT, "__text", &Address, &Size) == 0);    // (no sections)
+   CHECK(KextImages[0].Indexed == 1 && KextImages[1].Indexed == 1);
+}
+
+//
+// v0.23 - klookup.c:  address-to-symbol lookups
+//
+static void CheckByAddress(void)
+{
+   const FixtureSymbol Locals[] =
+   {
+      { "_zeta",     N_SECT,  0x100900 },
+      { "_stab",     N_FUN,   0x100150 },    // (debugging symbols aren't indexed)
+      { "_absolute", N_ABS,   0x100160 },    // (nor is anything that isn't N_SECT)
+      { "_eta",      N_SECT,  0x100500 },
+   };
+   const FixtureSymbol Externals[] =
+   {
+      { "_alpha",    N_SECT | N_EXT, 0x100100 },
+      { "_beta",     N_SECT | N_EXT, 0x100200 },
+      { "_gamma",    N_SECT | N_EXT, 0x100300 },
+   };
+   MachOIndex        Index;
+   SymbolTableInfo   Symbols;
+   uint64_t          Offset;
+   const char        *Name;
+   const char        *Owner;
+   uint32_t          i;
+
+   BuildImage(Image, Locals, 4, Externals, 3);
+   memset(&Symbols, 0, sizeof(Symbols));
+   CHECK(ParseMachO((struct mach_header_64 *)Image, &Index) == MACHO_OK && FindSymbolTable(&Index, &Symbols) == 0);
+
+   Name = FindByAddress(&Symbols, 0x100100, &Offset);
+   CHECK(Name != NULL && !strcmp(Name, "_alpha") && Offset == 0);
+   Name = FindByAddress(&Symbols, 0x100158, &Offset);
+   CHECK(Name != NULL && !strcmp(Name, "_alpha") && Offset == 0x58);
+   Name = FindByAddress(&Symbols, 0x1004ff, &Offset);
+   CHECK(Name != NULL && !strcmp(Name, "_gamma") && Offset == 0x1ff);
+   Name = FindByAddress(&Symbols, 0x100904, &Offset);
+   CHECK(Name != NULL && !strcmp(Name, "_zeta") && Offset == 4);
+   CHECK(FindByAddress(&Symbols, 0x1000ff, &Offset) == NULL);
+   CHECK(FindByAddress(&Symbols, 0x100900 + MAX_SYMBOL_OFFSET + 1, &Offset) == NULL);
+   Name = FindByAddress(&Symbols, 0x100900 + MAX_SYMBOL_OFFSET, &Offset);
+   CHECK(Name != NULL && !strcmp(Name, "_zeta"));
+
+   // The index holds the N_SECT symbols, sorted by address
+   CHECK(Symbols.nByAddress == 5);
+   for (i = 1; i < Symbols.nByAddress; ++i)
+   {
+      CHECK(Symbols.NameList[Symbols.ByAddress[i - 1]].n_value <= Symbols.NameList[Symbols.ByAddress[i]].n_value);
+   }
+   LookupFree(Symbols.ByAddress, Symbols.nByAddress * sizeof(uint32_t));
+
+   // SymbolForAddress() tries the kexts whose images hold the address, then the kernel
+   Name = SymbolForAddress((void *)0x100210, &Offset, &Owner);
+   CHECK(Name != NULL && !strcmp(Name, "_shared") && Offset == 0x10 && Owner != NULL && !strcmp(Owner, "com.example.alpha"));
+   Name = SymbolForAddress((void *)0x100000, &Offset, &Owner);
+   CHECK(Name != NULL && !strcmp(Name, "_lbcheck_local") && Offset == 0x100000 - 0x1234 && Owner != NULL && !strcmp(Owner, "kernel"));
+   Name = SymbolForAddress((void *)((uint64_t)pmap_find_phys_stub + 1), &Offset, &Owner);
+   CHECK(Name != NULL && Offset <= 1 && Owner != NULL && !strcmp(Owner, "kernel"));
+   CHECK(SymbolForAddress((void *)0x100, &Offset, &Owner) == NULL && Owner == NULL);
+}
+
+//
+// v0.23 - A symbol table about the size of a kernel's, for timing the lookups:  BIG_LOCALS
+// locals (every 16th a debugging symbol, and the next an N_ABS one), then BIG_EXTERNALS
+// external definitions, sorted by name.  Names are of all lengths (a numbered stem, and a
+// random tail), and every symbol has its own address, 0x40 apart, in no particular order.
+//
+#define BIG_LOCALS         48000
+#define BIG_EXTERNALS      24000
+#define BIG_SYMBOLS        (BIG_LOCALS + BIG_EXTERNALS)
+#define BIG_BASE           0xffffff8000200000ULL
+#define BIG_NAME_SIZE      32
+#define BIG_LOOKUPS        500
+#define BIG_VALUE(i)       (BIG_BASE + (uint64_t)(((i) * 7919ULL) % BIG_SYMBOLS) * 0x40)
+
+static unsigned char    *BigImage;
+static SymbolTableInfo  BigSymbols;
+
+static void BuildBigImage(void)
+{
+   FixtureSymbol  *Symbols = malloc(BIG_SYMBOLS * sizeof(FixtureSymbol));
+   char           *Names = malloc(BIG_SYMBOLS * BIG_NAME_SIZE);
+   size_t         Size = LINKEDIT_OFFSET + BIG_SYMBOLS * (sizeof(struct nlist_64) + BIG_NAME_SIZE) + 1;
+   MachOIndex     Index;
+   uint32_t       i, Length, Tail;
+
+   for (i = 0; i < BIG_SYMBOLS; ++i)
+   {
+      char  *Name = &Names[i * BIG_NAME_SIZE];
+
+      Length = (uint32_t)sprintf(Name, (i < BIG_LOCALS) ? "_l%05u" : "_x%05u", i);
+      for (Tail = Random() % (BIG_NAME_SIZE - Length); Tail > 0; --Tail)
+      {
+         Name[Length++] = (char)('a' + Random() % 26);
+      }
+      Name[Length] = '\0';
+      Symbols[i].Name = Name;
+      Symbols[i].Type = (i >= BIG_LOCALS) ? (N_SECT | N_EXT) : (i % 16 == 0) ? N_FUN : (i % 16 == 1) ? N_ABS : N_SECT;
+      Symbols[i].Value = BIG_VALUE(i);
+   }
+   BigImage = malloc(Size);
+   BuildSizedImage(BigImage, Size, Symbols, BIG_LOCALS, &Symbols[BIG_LOCALS], BIG_EXTERNALS);
+   memset(&BigSymbols, 0, sizeof(BigSymbols));
+   CHECK(ParseMachO((struct mach_header_64 *)BigImage, &Index) == MACHO_OK && FindSymbolTable(&Index, &BigSymbols) == 0);
+   CHECK(BigSymbols.nsyms == BIG_SYMBOLS && BigSymbols.nExtDef == BIG_EXTERNALS && BigSymbols.ExtDefSorted);
+   free(Names);
+   free(Symbols);
+}
+
+// The obvious way:  look at every symbol
+static const char *NaiveByAddress(SymbolTableInfo *Symbols, uint64_t Address, uint64_t *Offset)
+{
+   struct nlist_64   *Found = NULL;
+   uint32_t          i;
+
+   for (i = 0; i < Symbols->nsyms; ++i)
+   {
+      struct nlist_64 *Symbol = &Symbols->NameList[i];
+
+      if (!(Symbol->n_type & N_STAB) && (Symbol->n_type & N_TYPE) == N_SECT && Symbol->n_value <= Address &&
+          (Found == NULL || Symbol->n_value > Found->n_value))
+      {
+         Found = Symbol;
+      }
+   }
+   if (Found == NULL || Address - Found->n_value > MAX_SYMBOL_OFFSET)
+   {
+      return NULL;
+   }
+   *Offset = Address - Found->n_value;
+   return Symbols->StringTable + Found->n_un.n_strx;
+}
+
+//
+// v0.23 - klookup.c:  address-to-symbol lookup in the big symbol table, against looking at
+// every symbol.  The first lookup builds the index;  SymbolForAddress() gets there with the
+// big table standing in for the kernel's.
+//
+static void CheckBigByAddress(void)
+{
+   static uint64_t   Addresses[BIG_LOOKUPS];
+   const char        *Names[BIG_LOOKUPS];
+   uint64_t          Offsets[BIG_LOOKUPS];
+   SymbolTableInfo   SavedKernel = KernelSymbols;
+   const char        *Name, *Owner;
+   uint64_t          Offset;
+   double            Build, Indexed, Naive, Reverse;
+   int               i, Wrong;
+
+   for (i = 0; i < BIG_LOOKUPS; ++i)
+   {
+      // (a few below the lowest symbol, and past the end of the highest one)
+      Addresses[i] = BIG_BASE - 0x100 + Random() % ((uint64_t)BIG_SYMBOLS * 0x40 + MAX_SYMBOL_OFFSET / 64);
+   }
+   Addresses[0] = BIG_BASE - 1;
+   Addresses[1] = BIG_VALUE(BIG_LOCALS);
+   Addresses[2] = BIG_BASE + (BIG_SYMBOLS - 1) * 0x40ULL + MAX_SYMBOL_OFFSET + 1;
+
+   Build = Seconds();
+   FindByAddress(&BigSymbols, BIG_BASE, &Offset);
+   Build = Seconds() - Build;
+   CHECK(BigSymbols.nByAddress == BIG_SYMBOLS - 2 * (BIG_LOCALS / 16));
+
+   Indexed = Seconds();
+   for (i = 0; i < BIG_LOOKUPS; ++i)
+   {
+      Offsets[i] = ~0ULL;
+      Names[i] = FindByAddress(&BigSymbols, Addresses[i], &Offsets[i]);
+   }
+   Indexed = Seconds() - Indexed;
+
+   Naive = Seconds();
+   for (i = 0, Wrong = 0; i < BIG_LOOKUPS; ++i)
+   {
+      Offset = ~0ULL;
+      Name = NaiveByAddress(&BigSymbols, Addresses[i], &Offset);
+      Wrong += (Name != Names[i] || (Name != NULL && Offset != Offsets[i]));
+   }
+   Naive = Seconds() - Naive;
+   CHECK(Wrong == 0);
+   CHECK(Names[0] == NULL && Names[1] == BigSymbols.StringTable + BigSymbols.NameList[BIG_LOCALS].n_un.n_strx && Offsets[1] == 0 && Names[2] == NULL);
+
+   // The same lookups through SymbolForAddress() (past the kexts, to the "kernel")
+   KernelSymbols = BigSymbols;
+   Reverse = Seconds();
+   for (i = 0, Wrong = 0; i < BIG_LOOKUPS; ++i)
+   {
+      Offset = ~0ULL;
+      Name = SymbolForAddress((void *)Addresses[i], &Offset, &Owner);
+      Wrong += (Name != Names[i] || (Name != NULL && (Offset != Offsets[i] || strcmp(Owner, "kernel"))));
+   }
+   Reverse = Seconds() - Reverse;
+   KernelSymbols = SavedKernel;
+   CHECK(Wrong == 0);
+   LookupFree(BigSymbols.ByAddress, BigSymbols.nByAddress * sizeof(uint32_t));
+   BigSymbols.ByAddress = NULL;
+
+   if (Verbose)
+   {
+      printf("by address:  %u indexed symbols (of %u), index built in %.2f ms;  %d lookups took %.2f ms (%.2f ms through SymbolForAddress()), "
+             "looking at every symbol took %.2f ms\n", BigSymbols.nByAddress, BigSymbols.nsyms, Build * 1000, BIG_LOOKUPS,
+             Indexed * 1000, Reverse * 1000, Naive * 1000);
+   }
+}
+
+//
+// v0.23 - klookup.c:  name lookups (external definitions first, then everything else)
+//
+static void *Find(SymbolTableInfo *Symbols, const char *Name)
+{
+   const char  *Found = NULL;
+   void        *Address;
+
+   Address = FindInNameList(Symbols, Name, (uint32_t)strlen(Name), &Found);
+   if (Address != NULL && (Found == NULL || strcmp(Found, Name)))
+   {
+      return (void *)-1;
+   }
+   return Address;
+}
+
+static void CheckNameList(void)
+{
+   const FixtureSymbol Locals[] =
+   {
+      { "_local",    N_SECT,  0x100800 },
+      { "_gamma",    N_SECT,  0x100900 },    // (a local with an external's name:  the external wins)
+   };
+   const FixtureSymbol Externals[] =
+   {
+      { "_alpha",    N_SECT | N_EXT, 0x100100 },
+      { "_beta",     N_SECT | N_EXT, 0x100200 },
+      { "_delta",    N_SECT | N_EXT, 0x100400 },
+      { "_epsilon",  N_SECT | N_EXT, 0x100500 },
+      { "_gamma",    N_SECT | N_EXT, 0x100300 },
+   };
+   const FixtureSymbol Unsorted[] =
+   {
+      { "_beta",     N_SECT | N_EXT, 0x100200 },
+      { "_alpha",    N_SECT | N_EXT, 0x100100 },
+   };
+   MachOIndex        Index;
+   SymbolTableInfo   Symbols;
+   const char        *Name;
+
+   BuildImage(Image, Locals, 2, Externals, 5);
+   memset(&Symbols, 0, sizeof(Symbols));
+   CHECK(ParseMachO((struct mach_header_64 *)Image, &Index) == MACHO_OK && FindSymbolTable(&Index, &Symbols) == 0);
+   CHECK(Symbols.iExtDef == 2 && Symbols.nExtDef == 5 && Symbols.ExtDefSorted);
+   for (Name = "_alpha\0_beta\0_delta\0_epsilon\0"; *Name != '\0'; Name += strlen(Name) + 1)
+   {
+      CHECK(Find(&Symbols, Name) != NULL && Find(&Symbols, Name) != (void *)-1);
+   }
+   CHECK(Find(&Symbols, "_epsilon") == (void *)0x100500);
+   CHECK(Find(&Symbols, "_gamma") == (void *)0x100300);
+   CHECK(Find(&Symbols, "_local") == (void *)0x100800);
+   CHECK(Find(&Symbols, "_alph") == NULL && Find(&Symbols, "_alphabet") == NULL && Find(&Symbols, "_zeta") == NULL);
+   CHECK(Find(&Symbols, "") == NULL);
+
+   // Unsorted external definitions are scanned instead
+   BuildImage(Image, Locals, 2, Unsorted, 2);
+   memset(&Symbols, 0, sizeof(Symbols));
+   CHECK(ParseMachO((struct mach_header_64 *)Image, &Index) == MACHO_OK && FindSymbolTable(&Index, &Symbols) == 0);
+   CHECK(Symbols.nExtDef == 2 && !Symbols.ExtDefSorted);
+   CHECK(Find(&Symbols, "_alpha") == (void *)0x100100 && Find(&Symbols, "_beta") == (void *)0x100200);
+   CHECK(Find(&Symbols, "_gamma") == (void *)0x100900 && Find(&Symbols, "_local") == (void *)0x100800);
+
+   // No LC_DYSYMTAB:  everything is scanned
+   ((FixtureCommands *)Image)->Header.ncmds = 3;
+   memset(&Symbols, 0, sizeof(Symbols));
+   CHECK(ParseMachO((struct mach_header_64 *)Image, &Index) == MACHO_OK && FindSymbolTable(&Index, &Symbols) == 0);
+   CHECK(Symbols.nExtDef == 0);
+   CHECK(Find(&Symbols, "_gamma") == (void *)0x100900 && Find(&Symbols, "_beta") == (void *)0x100200);
+
+   // A name that would run off the end of the string table never matches
+   BuildImage(Image, NULL, 0, Unsorted, 2);
+   memset(&Symbols, 0, sizeof(Symbols));
+   CHECK(ParseMachO((struct mach_header_64 *)Image, &Index) == MACHO_OK && FindSymbolTable(&Index, &Symbols) == 0);
+   Symbols.strsize -= 2;
+   CHECK(Find(&Symbols, "_alpha") == NULL && Find(&Symbols, "_beta") == (void *)0x100200);
+}
+
+//
+// v0.23 - klookup.c:  name lookup in the big symbol table:  the external definitions'
+// binary search, against scanning them (as when they aren't sorted), and against scanning
+// the whole name list (as with no LC_DYSYMTAB, and as every lookup did up through v0.22).
+// Externals are what we look up;  a few locals and missing names go through every mode's
+// fallback scan.
+//
+static void CheckBigNameList(void)
+{
+   static uint32_t   Indexes[BIG_LOOKUPS];
+   SymbolTableInfo   Symbols;
+   const char        *Name;
+   double            Times[3];
+   int               Mode, i, Wrong;
+
+   for (i = 0; i < BIG_LOOKUPS; ++i)
+   {
+      Indexes[i] = BIG_LOCALS + Random() % BIG_EXTERNALS;
+   }
+   for (Mode = 0; Mode < 3; ++Mode)
+   {
+      Symbols = BigSymbols;
+      Symbols.ExtDefSorted = (Mode == 0);
+      if (Mode == 2)
+      {
+         Symbols.nExtDef = 0;
+      }
+      Times[Mode] = Seconds();
+      for (i = 0, Wrong = 0; i < BIG_LOOKUPS; ++i)
+      {
+         Name = BigSymbols.StringTable + BigSymbols.NameList[Indexes[i]].n_un.n_strx;
+         Wrong += (Find(&Symbols, Name) != (void *)BIG_VALUE(Indexes[i]));
+      }
+      Times[Mode] = Seconds() - Times[Mode];
+      CHECK(Wrong == 0);
+
+      // A local (not a debugging one), the first and last externals, and names that aren't there
+      Name = BigSymbols.StringTable + BigSymbols.NameList[2].n_un.n_strx;
+      CHECK(Find(&Symbols, Name) == (void *)BIG_VALUE(2));
+      Name = BigSymbols.StringTable + BigSymbols.NameList[BIG_LOCALS].n_un.n_strx;
+      CHECK(Find(&Symbols, Name) == (void *)BIG_VALUE(BIG_LOCALS));
+      Name = BigSymbols.StringTable + BigSymbols.NameList[BIG_SYMBOLS - 1].n_un.n_strx;
+      CHECK(Find(&Symbols, Name) == (void *)BIG_VALUE(BIG_SYMBOLS - 1));
+      CHECK(Find(&Symbols, "_x") == NULL && Find(&Symbols, "_y00000") == NULL && Find(&Symbols, "_") == NULL);
+   }
+   if (Verbose)
+   {
+      printf("by name:  %d lookups of %u external definitions (of %u symbols) took %.2f ms with the binary search, "
+             "%.2f ms scanning them, and %.2f ms scanning every symbol\n", BIG_LOOKUPS, BigSymbols.nExtDef, BigSymbols.nsyms,
+             Times[0] * 1000, Times[1] * 1000, Times[2] * 1000);
+   }
+}
+
+//
+// v0.23 - klookup.h/klookup.c:  KERNEL_SYMBOL() (hashed by the compiler) vs. SymbolHash(), and the resolved symbol cache
+//
+static void CheckHash(void)
+{
+   static const KernelSymbol Handles[] =
+   {
+      KERNEL_SYMBOL(""),
+      KERNEL_SYMBOL("_"),
+      KERNEL_SYMBOL("_kernel_pmap"),
+      KERNEL_SYMBOL("_abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz"),
+      KERNEL_SYMBOL("_abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz0"),
+      KERNEL_SYMBOL("_abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz01"),
+      KERNEL_SYMBOL("_abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstu"),
+   };
+   static const KernelSymbol PmapSymbol = KERNEL_SYMBOL("_kernel_pmap");
+   static const KernelSymbol FindPhysSymbol = KERNEL_SYMBOL("_pmap_find_phys");
+   SymbolCacheEntry  *Cached;
+   KernelSymbol      Impostor;
+   uint32_t          Length;
+   size_t            i;
+
+   for (i = 0; i < sizeof(Handles) / sizeof(Handles[0]); ++i)
+   {
+      CHECK(SymbolHash(Handles[i].Name, &Length) == Handles[i].Hash);
+      CHECK(Length == Handles[i].Length && Length == strlen(Handles[i].Name));
+   }
+   // Only the first KSYM_HASH_CHARS characters count
+   CHECK(Handles[4].Hash == Handles[5].Hash && Handles[4].Hash == Handles[6].Hash && Handles[3].Hash != Handles[4].Hash);
+
+   // A hit comes from the cache;  so does the same name, hashed at run time
+   CHECK(SymbolLookupRef(&FindPhysSymbol) == (void *)pmap_find_phys_stub);
+   Cached = &SymbolCache[FindPhysSymbol.Hash & (SYMBOL_CACHE_SIZE - 1)];
+   CHECK(Cached->Address == (void *)pmap_find_phys_stub && Cached->Hash == FindPhysSymbol.Hash && !(Cached->Sequence & 1));
+   CHECK(SymbolLookup("_pmap_find_phys") == (void *)pmap_find_phys_stub);
+   CHECK(SymbolLookupRef(&PmapSymbol) == (void *)&KernelPmapStub);
+   CHECK(SymbolLookup("_lbcheck_local") == (void *)0x1234);
+   CHECK(SymbolLookup("_lbcheck_missing") == NULL);
+
+   // A different name with the same hash and length isn't taken from the cache
+   Impostor = FindPhysSymbol;
+   Impostor.Name = "_pmap_find_xxxx";
+   CHECK(SymbolLookupRef(&FindPhysSymbol) == (void *)pmap_find_phys_stub);
+   CHECK(SymbolLookupRef(&Impostor) == NULL);
+   // Nor is an entry that's being written
+   Cached->Sequence |= 1;
+   Cached->Address = (void *)0x1;
+   CHECK(SymbolLookupRef(&FindPhysSymbol) == (void *)pmap_find_phys_stub);
+   CHECK(Cached->Address == (void *)0x1);       // (and it isn't rewritten either)
+   Cached->Sequence += 1;
+   Cached->Address = (void *)pmap_find_phys_stub;
+}
+
+//
+// v0.23 - klookup.c:  one-time initialization, from several threads at once
+//
+static pthread_barrier_t   Start;
+static SymbolTableInfo     SharedSymbols;
+static int                 Wrong = 0;
+
+static void *ByAddressThread(void *Arg)
+{
+   uint64_t    Offset;
+   const char  *Name;
+
+   (void)Arg;
+   pthread_barrier_wait(&Start);
+   Name = FindByAddress(&SharedSymbols, 0x100208, &Offset);
+   if (Name == NULL || strcmp(Name, "_beta") || Offset != 8)
+   {
+      __atomic_add_fetch(&Wrong, 1, __ATOMIC_RELAXED);
+   }
+   return NULL;
+}
+
+static void *KextThread(void *Arg)
+{
+   (void)Arg;
+   pthread_barrier_wait(&Start);
+   if (KextSymbolLookup("com.example.beta", "_beta_start") != (void *)0x100300 ||
+       KextSymbolLookup("com.example.alpha", "_alpha_start") != (void *)0x100100)
+   {
+      __atomic_add_fetch(&Wrong, 1, __ATOMIC_RELAXED);
+   }
+   return NULL;
+}
+
+static void RunThreads(void *(*Body)(void *))
+{
+   pthread_t   Threads[THREADS];
+   int         i;
+
+   pthread_barrier_init(&Start, NULL, THREADS);
+   for (i = 0; i < THREADS; ++i)
+   {
+      pthread_create(&Threads[i], NULL, Body, (void *)(intptr_t)i);
+   }
+   for (i = 0; i < THREADS; ++i)
+   {
+      pthread_join(Threads[i], NULL);
+   }
+   pthread_barrier_destroy(&Start);
+}
+
+static void CheckOnce(void)
+{
+   volatile UInt32   State = ONCE_NEW;
+   MachOIndex        Index;
+   size_t            Before;
+   int               Round;
+
+   CHECK(OnceBegin(&State) == 1 && State == ONCE_BUSY);
+   OnceDone(&State);
+   CHECK(State == ONCE_DONE && OnceBegin(&State) == 0);
+
+   // Each table is built exactly once, however many threads want it first
+   for (Round = 0; Round < 50; ++Round)
+   {
+      BuildFixture();
+      memset(&SharedSymbols, 0, sizeof(SharedSymbols));
+      CHECK(ParseMachO((struct mach_header_64 *)Image, &Index) == MACHO_OK && FindSymbolTable(&Index, &SharedSymbols) == 0);
+      Before = LookupBytes;
+      RunThreads(ByAddressThread);
+      CHECK(Wrong == 0 && SharedSymbols.nByAddress == 5 && LookupBytes - Before == 5 * sizeof(uint32_t));
+      LookupFree(SharedSymbols.ByAddress, SharedSymbols.nByAddress * sizeof(uint32_t));
+
+      KLookupRelease();
+      CHECK(LookupBytes == 0 && KextImages == NULL);
+      RunThreads(KextThread);
+      CHECK(Wrong == 0 && KextCount == 2);
+      CHECK(LookupBytes == 2 * sizeof(KextImage) + 2 * sizeof(MachOIndex));
+   }
+   KLookupRelease();
+   CHECK(LookupBytes == 0);
+}
+
+//
+// v0.23 - lbcore.c:  regions and the sequencer (lb_sequence=), with nested calls, timeouts and ticket wraparound
+//
+static volatile SInt32     Turns;
+static UInt32              Order[THREADS];
+
+static void ResetThreads(void)
+{
+   memset(Slots, 0, sizeof(Slots));
+   memset((void *)&lb_Counters, 0, sizeof(lb_Counters));
+   lb_Threads = Slots;
+   lb_Phase2StartTSC = 0;
+   lb_Phase2StartLoop = 0;
+}
+
+static void *SequenceThread(void *Arg)
+{
+   lb_ThreadInfo  *Info = &lb_Threads[(intptr_t)Arg];
+   lb_RegionInfo  *Region, *Nested;
+
+   pthread_barrier_wait(&Start);
+   Region = lb_PushRegion(Info, 0x2000, 0x1000);
+   lb_SequencerWait(Info, Region);
+   Order[__atomic_fetch_add(&Turns, 1, __ATOMIC_SEQ_CST)] = Region->Ticket;
+   // A call made during our turn goes straight through, and ending it doesn't end the turn
+   Nested = lb_PushRegion(Info, 0x1f00, 0x1800);
+   if (Nested == NULL || Nested->Ticket != Region->Ticket || lb_SequencerWait(Info, Nested) != 0 ||
+       lb_PopRegion(Info) != Nested || lb_Counters.NowServing != Region->Ticket)
+   {
+      __atomic_add_fetch(&Wrong, 1, __ATOMIC_RELAXED);
+   }
+   lb_Sleep(1);
+   if (lb_PopRegion(Info) != Region || Region->ReturnAddress != 0x1000)
+   {
+      __atomic_add_fetch(&Wrong, 1, __ATOMIC_RELAXED);
+   }
+   return NULL;
+}
+
+static void CheckSequencer(void)
+{
+   lb_RegionInfo  *A, *B, *C, *D;
+   UInt32         Base = 0xfffffffd;
+   int            i;
+
+   // Turns are taken in ticket order, across the wrap
+   ResetThreads();
+   lb_Settings.SequenceTimeout = 10000;
+   lb_Counters.NextTicket = lb_Counters.NowServing = Base;
+   Turns = 0;
+   Wrong = 0;
+   RunThreads(SequenceThread);
+   CHECK(Wrong == 0 && Turns == THREADS && lb_Counters.SequenceTimeouts == 0);
+   for (i = 0; i < THREADS; ++i)
+   {
+      CHECK(Order[i] == Base + (UInt32)i);
+   }
+   CHECK(lb_Counters.NowServing == Base + THREADS && lb_Counters.NextTicket == Base + THREADS && lb_Counters.InRegion == 0);
+
+   // A stuck turn holds the next ticket up only until the timeout;  NowServing only moves forward
+   ResetThreads();
+   lb_Settings.SequenceTimeout = 20;
+   A = lb_PushRegion(&lb_Threads[0], 0x2000, 0x1000);
+   B = lb_PushRegion(&lb_Threads[1], 0x2000, 0x1000);
+   CHECK(A->Ticket == 0 && B->Ticket == 1 && lb_Counters.InRegion == 2);
+   CHECK(lb_SequencerWait(&lb_Threads[0], A) == 0);
+   CHECK(lb_SequencerWait(&lb_Threads[1], B) == 20 && lb_Counters.SequenceTimeouts == 1);
+   CHECK(lb_PopRegion(&lb_Threads[1]) == B && lb_Counters.NowServing == 2);
+   CHECK(lb_PopRegion(&lb_Threads[0]) == A && lb_Counters.NowServing == 2);
+   CHECK(lb_PopRegion(&lb_Threads[0]) == NULL && lb_Counters.InRegion == 0);
+
+   // A nested call doesn't wait, even if its caller went ahead by timing out
+   C = lb_PushRegion(&lb_Threads[2], 0x2000, 0x1000);
+   D = lb_PushRegion(&lb_Threads[3], 0x2000, 0x1000);
+   CHECK(lb_SequencerWait(&lb_Threads[3], D) == 20 && lb_Counters.SequenceTimeouts == 2);
+   B = lb_PushRegion(&lb_Threads[3], 0x1f00, 0x1800);
+   CHECK(B != NULL && B->Ticket == D->Ticket && lb_Counters.NextTicket == 4);
+   CHECK(lb_SequencerWait(&lb_Threads[3], B) == 0 && lb_Counters.SequenceTimeouts == 2);
+   CHECK(lb_PopRegion(&lb_Threads[3]) == B && lb_Counters.NowServing == 2);
+   CHECK(lb_PopRegion(&lb_Threads[3]) == D && lb_Counters.NowServing == 4);
+   CHECK(lb_PopRegion(&lb_Threads[2]) == C && lb_Counters.NowServing == 4);
+
+   // Each thread tracks at most LB_MAX_REGIONS at once
+   for (i = 0; i < LB_MAX_REGIONS; ++i)
+   {
+      CHECK(lb_PushRegion(&lb_Threads[0], 0x2000 - 0x100 * i, 0x1000) != NULL);
+   }
+   CHECK(lb_PushRegion(&lb_Threads[0], 0x1000, 0x1000) == NULL && lb_Counters.InRegion == LB_MAX_REGIONS);
+   for (i = 0; i < LB_MAX_REGIONS; ++i)
+   {
+      CHECK(lb_PopRegion(&lb_Threads[0]) != NULL);
+   }
+   CHECK(lb_Counters.InRegion == 0 && lb_Counters.NowServing == 5 && lb_Counters.NextTicket == 5);
+}
+
+//
+// v0.23 - lbcore.c:  the thread table and stagger mode (lb_stagger=).  Each pthread goes
+// through the "hook" STAGGER_LOOPS times, the way latebloom_hook_body() does.
+//
+#define STAGGER_LOOPS      50
+#define STAGGER_STEP       20
+
+static UInt32              Ordinals[THREADS];
+static int                 Delays[THREADS];
+static long                DelayMs[THREADS];
+
+static void *StaggerThread(void *Arg)
+{
+   intptr_t       Index = (intptr_t)Arg;
+   thread_t       Self = (thread_t)(Index + 1);
+   lb_ThreadInfo  *Info;
+   UInt32         Ordinal;
+   long           Delay;
+   int            Loop;
+
+   pthread_barrier_wait(&Start);
+   for (Loop = 0; Loop < STAGGER_LOOPS; ++Loop)
+   {
+      Info = lb_FindThread(Self, 1000 + Loop, &Ordinal);
+      if (Loop == 0)
+      {
+         Ordinals[Index] = Ordinal;
+      }
+      if (Ordinal != Ordinals[Index] || (Info != NULL && (Info->Thread != Self || Info->Ordinal != Ordinal)) ||
+          (Info == NULL && Ordinal != lb_Settings.MaxThreads) || lb_LookupThread(Self) != Info)
+      {
+         __atomic_add_fetch(&Wrong, 1, __ATOMIC_RELAXED);
+      }
+      if (Info != NULL)
+      {
+         Info->Iterations++;
+      }
+      __atomic_add_fetch(&lb_Counters.Loops, 1, __ATOMIC_RELAXED);
+      if ((Delay = lb_StaggerDelay(Info, Ordinal)) != 0)
+      {
+         Delays[Index]++;
+         DelayMs[Index] = Delay;
+      }
+      sched_yield();
+   }
+   return NULL;
+}
+
+static void CheckStagger(void)
+{
+   UInt32   Seen;
+   int      Round, i;
+
+   lb_Settings.StaggerStep = STAGGER_STEP;
+   for (Round = 0; Round < 20; ++Round)
+   {
+      // Every thread fits (THREADS slots), or only half of them do
+      ResetThreads();
+      lb_Settings.MaxThreads = (Round & 1) ? THREADS / 2 : THREADS;
+      memset(Delays, 0, sizeof(Delays));
+      Wrong = 0;
+      RunThreads(StaggerThread);
+      CHECK(Wrong == 0 && lb_Counters.ThreadCount == (SInt32)lb_Settings.MaxThreads);
+      CHECK(lb_Phase2StartTSC >= 1000 && lb_Phase2StartTSC < 1000 + STAGGER_LOOPS);
+      Seen = 0;
+      for (i = 0; i < THREADS; ++i)
+      {
+         if (Ordinals[i] == lb_Settings.MaxThreads)
+         {
+            // (not in the table:  no delay at all)
+            CHECK(Delays[i] == 0);
+            continue;
+         }
+         // Ordinals in the table are distinct, and only Phase 2 threads after the first wait - once
+         CHECK(Ordinals[i] < lb_Settings.MaxThreads && !(Seen & (1U << Ordinals[i])));
+         Seen |= 1U << Ordinals[i];
+         CHECK(Delays[i] == (Ordinals[i] > 1) && (Ordinals[i] <= 1 || DelayMs[i] == (long)(Ordinals[i] - 1) * STAGGER_STEP));
+      }
+      CHECK(Seen == (1U << lb_Settings.MaxThreads) - 1);
+   }
+   CHECK(lb_StaggerDelay(NULL, 3) == 0);
+   lb_Settings.MaxThreads = THREADS;
+}
+
+//
+// v0.23 - lbcore.c:  concurrency delays (lb_conc=), against step * Others^exponent worked out the long way
+//
+static void CheckConcurrency(void)
+{
+   static const long Steps[] = { 0, 1, 7, 100, 9999 };
+   static const long Caps[] = { 0, 1, 50, 500, LB_MAX_DELAY + 1 };
+   unsigned __int128 Expected;
+   long              Limit;
+   SInt32            Others;
+   size_t            Step, Cap;
+   long              Exponent, i;
+   int               Mismatches = 0;
+
+   for (Step = 0; Step < sizeof(Steps) / sizeof(Steps[0]); ++Step)
+   {
+      for (Cap = 0; Cap < sizeof(Caps) / sizeof(Caps[0]); ++Cap)
+      {
+         for (Exponent = 0; Exponent <= 6; ++Exponent)
+         {
+            lb_Settings.ConcurrencyStep = Steps[Step];
+            lb_Settings.ConcurrencyCap = Caps[Cap];
+            lb_Settings.ConcurrencyExponent = Exponent;
+            Limit = (Caps[Cap] != 0 && Caps[Cap] < LB_MAX_DELAY) ? Caps[Cap] : LB_MAX_DELAY;
+            for (Others = 1; Others <= 64; ++Others)
+            {
+               Expected = (unsigned __int128)Steps[Step];
+               for (i = 0; i < Exponent; ++i)
+               {
+                  Expected *= (unsigned)Others;
+               }
+               if (lb_ConcurrencyDelay(Others) != ((Expected < (unsigned __int128)Limit) ? (long)Expected : Limit))
+               {
+                  ++Mismatches;
+               }
+            }
+            // A probe that's alone (or that miscounted) never waits
+            if (lb_ConcurrencyDelay(0) != 0 || lb_ConcurrencyDelay(-1) != 0)
+            {
+               ++Mismatches;
+            }
+         }
+      }
+   }
+   CHECK(Mismatches == 0);
+
+   lb_Settings.ConcurrencyStep = 10;
+   lb_Settings.ConcurrencyCap = 0;
+   lb_Settings.ConcurrencyExponent = 1;
+   CHECK(lb_ConcurrencyDelay(0) == 0 && lb_ConcurrencyDelay(1) == 10 && lb_ConcurrencyDelay(3) == 30);
+   lb_Settings.ConcurrencyExponent = 2;
+   CHECK(lb_ConcurrencyDelay(3) == 90);
+   lb_Settings.ConcurrencyCap = 50;
+   CHECK(lb_ConcurrencyDelay(2) == 40 && lb_ConcurrencyDelay(3) == 50);
+   // The cap applies to a flat delay, too
+   lb_Settings.ConcurrencyStep = 60;
+   lb_Settings.ConcurrencyExponent = 0;
+   CHECK(lb_ConcurrencyDelay(3) == 50);
+
+   // A huge exponent saturates (quickly) instead of overflowing
+   lb_Settings.ConcurrencyStep = 9999;
+   lb_Settings.ConcurrencyCap = 0;
+   lb_Settings.ConcurrencyExponent = 0x7fffffff;
+   CHECK(lb_ConcurrencyDelay(2) == LB_MAX_DELAY && lb_ConcurrencyDelay(1000) == LB_MAX_DELAY);
+   CHECK(lb_ConcurrencyDelay(1) == 9999);
+   lb_Settings.ConcurrencyCap = 2000;
+   CHECK(lb_ConcurrencyDelay(0x7fffffff) == 2000);
+}
+
+//
+// v0.23 - lbcore.c:  backoff (lb_backoff=), on a simulated clock.  The other probe returns
+// (InRegion drops) <OtherMs> into the wait;  each slice lb_BackoffWait() sleeps is recorded.
+//
+static long    Clock;
+static long    OtherMs;
+static long    Slices[32];
+static int     nSlices;
+
+static void SimulatedSleep(unsigned int Ms)
+{
+   if (nSlices < 32)
+   {
+      Slices[nSlices] = (long)Ms;
+   }
+   ++nSlices;
+   if (Clock < OtherMs && Clock + (long)Ms >= OtherMs)
+   {
+      OSDecrementAtomic(&lb_Counters.InRegion);
+   }
+   Clock += (long)Ms;
+}
+
+static long Backoff(long Cap, long Slice, long Other, SInt32 Self)
+{
+   lb_Settings.BackoffCap = Cap;
+   lb_Settings.BackoffSlice = Slice;
+   lb_Counters.InRegion = Self + ((Other > 0) ? 1 : 0);
+   Clock = 0;
+   OtherMs = Other;
+   nSlices = 0;
+   return lb_BackoffWait(Self);
+}
+
+static void CheckBackoff(void)
+{
+   long  Fixed = 0, Total = 0;
+   long  Waited, Other;
+   int   Early = 0, Late = 0;
+
+   Sleeper = SimulatedSleep;
+
+   // Alone:  no waiting at all
+   CHECK(Backoff(100, 1, 0, 0) == 0 && nSlices == 0);
+   CHECK(Backoff(100, 1, 0, 1) == 0 && nSlices == 0);
+
+   // The slices double, and we go ahead after the one in which the other probe returned
+   CHECK(Backoff(100, 1, 10, 1) == 15 && nSlices == 4);
+   CHECK(Slices[0] == 1 && Slices[1] == 2 && Slices[2] == 4 && Slices[3] == 8);
+   CHECK(lb_Counters.InRegion == 1);
+   CHECK(Backoff(100, 1, 1, 0) == 1 && nSlices == 1);
+
+   // The last slice is cut short at the cap, and a probe that never returns waits exactly the cap
+   CHECK(Backoff(100, 1, 1000, 0) == 100 && nSlices == 7 && Slices[5] == 32 && Slices[6] == 37);
+   CHECK(Backoff(12, 5, 1000, 0) == 12 && nSlices == 2 && Slices[0] == 5 && Slices[1] == 7);
+   CHECK(Backoff(3, 5, 1000, 0) == 3 && nSlices == 1 && Slices[0] == 3);
+
+   //
+   // Against a fixed IOSleep():  to keep out of the way of another probe that takes up to
+   // 100 ms, a fixed delay has to be 100 ms every time.  Backoff never goes ahead before
+   // the other probe returns (up to the cap), waits less than twice as long as it had to,
+   // and in total waits far less than the fixed delay.
+   //
+   for (Other = 1; Other <= 100; ++Other)
+   {
+      Waited = Backoff(100, 1, Other, 0);
+      Early += (Waited < Other);
+      Late += (Waited >= 2 * Other);
+      Total += Waited;
+      Fixed += 100;
+   }
+   CHECK(Early == 0 && Late == 0 && Total < Fixed * 3 / 4);
+   if (Verbose)
+   {
+      printf("backoff:  %ld ms in total for other probes of 1-100 ms, vs. %ld ms of fixed 100 ms sleeps\n", Total, Fixed);
+   }
+
+   lb_Counters.InRegion = 0;
+   Sleeper = RealSleep;
+}
+
+//
+// v0.23 - lbcore.c:  the pattern search (lb_scan=, and finding the hook site), against
+// comparing every pattern at every offset.  ScanTables[0] holds cfuncs.c's BytePatterns
+// (one anchor, 0x48);  [1] has short patterns, anchored on 0x00, 0x7f, 0x80 and 0xff
+// (with a 0x48 pattern listed after one that's a prefix of it);  [2] has one anchor more
+// than lb_ScanText() prefilters for, so every offset is compared.
+//
+#define SCAN_SIZE          256
+#define SCAN_BENCH_SIZE    (4 << 20)
+#define SCAN_BENCH_SITES   256
+#define SCAN_MAX_SITES     8
+
+static const unsigned char ScanP113[] = { 0x48, 0xc7, 0x45, 0xd0, 0x00, 0x00, 0x00, 0x00, 0x49, 0x8b, 0x06, 0x4c, 0x89, 0xf7 };
+static const unsigned char ScanP115b2[] = { 0x48, 0xc7, 0x45, 0xd0, 0x00, 0x00, 0x00, 0x00, 0x49, 0x8b, 0x07, 0x4c, 0x89, 0xff };
+static const unsigned char ScanP12b3[] = { 0x48, 0xc7, 0x45, 0xc8, 0x00, 0x00, 0x00, 0x00, 0x49, 0x8b, 0x07, 0x4c, 0x89, 0xff };
+static const unsigned char ScanZero[] = { 0x00, 0x01 };
+static const unsigned char Scan7f[] = { 0x7f, 0x80, 0x7f };
+static const unsigned char Scan80[] = { 0x80 };
+static const unsigned char ScanFF[] = { 0xff, 0x00, 0xff, 0x00 };
+static const unsigned char Scan48[] = { 0x48, 0x49 };
+static const unsigned char Scan4849[] = { 0x48, 0x49, 0x48 };
+static const unsigned char Scan01[] = { 0x01, 0x01 };
+
+static const lb_PatternInfo ScanTables[][7] =
+{
+   {
+      { ScanP113,    sizeof(ScanP113),    8 },
+      { ScanP115b2,  sizeof(ScanP115b2),  8 },
+      { ScanP12b3,   sizeof(ScanP12b3),   8 },
+      { NULL,        0,                   0 },
+   },
+   {
+      { ScanZero,    sizeof(ScanZero),    0 },
+      { Scan7f,      sizeof(Scan7f),      0 },
+      { Scan48,      sizeof(Scan48),      0 },
+      { Scan4849,    sizeof(Scan4849),    0 },
+      { ScanFF,      sizeof(ScanFF),      0 },
+      { NULL,        0,                   0 },
+   },
+   {
+      { ScanZero,    sizeof(ScanZero),    0 },
+      { Scan7f,      sizeof(Scan7f),      0 },
+      { Scan80,      sizeof(Scan80),      0 },
+      { ScanFF,      sizeof(ScanFF),      0 },
+      { Scan01,      sizeof(Scan01),      0 },
+      { Scan48,      sizeof(Scan48),      0 },
+      { NULL,        0,                   0 },
+   },
+};
+#define SCAN_TABLES  (sizeof(ScanTables) / sizeof(ScanTables[0]))
+
+static unsigned char ScanBuffer[SCAN_SIZE + 8];
+
+// The obvious way:  every pattern at every offset
+static UInt32 NaiveScan(const lb_PatternInfo *Table, const unsigned char *Start, unsigned long long Length,
+                        unsigned long long *Sites, unsigned long *Patterns, UInt32 MaxSites)
+{
+   unsigned long long   Position;
+   unsigned long        p;
+   UInt32               Matches = 0;
+
+   for (Position = 0; Position < Length; ++Position)
+   {
+      for (p = 0; Table[p].Pattern != NULL; ++p)
+      {
+         if (Position + Table[p].size <= Length && !memcmp(&Start[Position], Table[p].Pattern, Table[p].size))
+         {
+            if (Matches < MaxSites)
+            {
+               Sites[Matches] = (unsigned long long)&Start[Position];
+               Patterns[Matches] = p;
+            }
+            ++Matches;
+            break;
+         }
+      }
+   }
+   return Matches;
+}
+
+// Does lb_ScanText() find what NaiveScan() does, in <Length> bytes at <Start>?
+static int ScanAgrees(const lb_PatternInfo *Table, const unsigned char *Start, unsigned long long Length, UInt32 MaxSites)
+{
+   unsigned long long   Sites[2][SCAN_MAX_SITES];
+   unsigned long        Patterns[2][SCAN_MAX_SITES];
+   UInt32               Found, Expected, i;
+   UInt32               Candidates = 0;
+
+   Found = lb_ScanText(Table, Start, Length, Sites[0], Patterns[0], MaxSites, &Candidates);
+   Expected = NaiveScan(Table, Start, Length, Sites[1], Patterns[1], MaxSites);
+   if (Found != Expected || Candidates < Found || Candidates > Length)
+   {
+      return 0;
+   }
+   for (i = 0; i < Found && i < MaxSites; ++i)
+   {
+      if (Sites[0][i] != Sites[1][i] || Patterns[0][i] != Patterns[1][i])
+      {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+// Fill the buffer from a few bytes that matter to <Table> (its anchors, the bytes just
+// above them, which the SWAR borrow can flag, and pattern bytes), with patterns planted
+static void ScanFill(const lb_PatternInfo *Table, unsigned char *Buffer, size_t Size)
+{
+   unsigned char  Alphabet[32];
+   size_t         nAlphabet = 0, Position;
+   unsigned long  p, nPatterns;
+
+   for (p = 0; Table[p].Pattern != NULL; ++p)
+   {
+      Alphabet[nAlphabet++] = Table[p].Pattern[0];
+      Alphabet[nAlphabet++] = Table[p].Pattern[0] + 1;
+      Alphabet[nAlphabet++] = Table[p].Pattern[Table[p].size - 1];
+   }
+   nPatterns = p;
+   for (Position = 0; Position < Size; ++Position)
+   {
+      Buffer[Position] = Alphabet[Random() % nAlphabet];
+   }
+   for (p = 0; p < Size / 16; ++p)
+   {
+      const lb_PatternInfo *Pattern = &Table[Random() % nPatterns];
+
+      Position = Random() % (Size - Pattern->size + 1);
+      memcpy(&Buffer[Position], Pattern->Pattern, Pattern->size);
+   }
+}
+
+static void CheckScan(void)
+{
+   static const unsigned char Borrow[16] = { 0x48, 0x49, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                             0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10 };
+   unsigned long long   Sites[SCAN_BENCH_SITES], NaiveSites[SCAN_BENCH_SITES];
+   unsigned long        Patterns[SCAN_BENCH_SITES], NaivePatterns[SCAN_BENCH_SITES];
+   unsigned long long   Length, Site;
+   unsigned char        *Bench;
+   unsigned long        Which;
+   unsigned int         t, Round, Align, MaxSites;
+   UInt32               Candidates, Found, Expected;
+   int                  Disagree;
+   double               Fast, Naive;
+   const lb_PatternInfo *Table = ScanTables[0];
+   const unsigned long  Size = ScanTables[0][2].size;
+
+   //
+   // Every length (so every tail of 0-7 bytes, and every pattern straddling the end), at
+   // every alignment, with room for all the matches, or only some of them
+   //
+   for (t = 0; t < SCAN_TABLES; ++t)
+   {
+      for (Round = 0; Round < 8; ++Round)
+      {
+         Disagree = 0;
+         ScanFill(ScanTables[t], ScanBuffer, sizeof(ScanBuffer));
+         for (Align = 0; Align < 8; ++Align)
+         {
+            for (Length = 0; Length <= SCAN_SIZE; ++Length)
+            {
+               for (MaxSites = 0; MaxSites <= SCAN_MAX_SITES; MaxSites += SCAN_MAX_SITES / 2)
+               {
+                  Disagree += !ScanAgrees(ScanTables[t], &ScanBuffer[Align], Length, MaxSites);
+               }
+            }
+         }
+         CHECK(Disagree == 0);
+      }
+   }
+
+   // The borrow flags the 0x49 after 0x48 as well:  it's compared, but doesn't match
+   Candidates = 0;
+   CHECK(lb_ScanText(Table, Borrow, sizeof(Borrow), &Site, &Which, 1, &Candidates) == 0 && Candidates == 2);
+
+   // A pattern that ends past <Length> isn't a match, even if the bytes past <Length> would match
+   memset(ScanBuffer, 0x90, sizeof(ScanBuffer));
+   memcpy(&ScanBuffer[40], ScanP12b3, Size);
+   for (Length = 40; Length < 40 + Size; ++Length)
+   {
+      CHECK(lb_ScanText(Table, ScanBuffer, Length, &Site, &Which, 1, NULL) == 0);
+   }
+   CHECK(lb_ScanText(Table, ScanBuffer, Length, &Site, &Which, 1, NULL) == 1 && Site == (unsigned long long)&ScanBuffer[40] && Which == 2);
+
+   // A pattern in the last few bytes (past the last whole 8-byte word)
+   memset(ScanBuffer, 0x90, sizeof(ScanBuffer));
+   memcpy(&ScanBuffer[3], Scan4849, sizeof(Scan4849));
+   CHECK(lb_ScanText(ScanTables[1], ScanBuffer, 6, &Site, &Which, 1, NULL) == 1 && Site == (unsigned long long)&ScanBuffer[3] && Which == 2);
+   CHECK(lb_ScanText(ScanTables[1], ScanBuffer, 4, &Site, &Which, 1, NULL) == 0);
+
+   //
+   // Benchmark:  4MB of random bytes (about the size of a kernel's __text), with a match
+   // every 16KB or so
+   //
+   Bench = malloc(SCAN_BENCH_SIZE);
+   for (Length = 0; Length < SCAN_BENCH_SIZE; ++Length)
+   {
+      Bench[Length] = (unsigned char)Random();
+   }
+   for (Round = 0; Round < SCAN_BENCH_SITES; ++Round)
+   {
+      memcpy(&Bench[(SCAN_BENCH_SIZE / SCAN_BENCH_SITES) * Round + Random() % 1024], ScanTables[0][Round % 3].Pattern, Size);
+   }
+   Candidates = 0;
+   Fast = Seconds();
+   Found = lb_ScanText(Table, Bench, SCAN_BENCH_SIZE, Sites, Patterns, SCAN_BENCH_SITES, &Candidates);
+   Fast = Seconds() - Fast;
+   Naive = Seconds();
+   Expected = NaiveScan(Table, Bench, SCAN_BENCH_SIZE, NaiveSites, NaivePatterns, SCAN_BENCH_SITES);
+   Naive = Seconds() - Naive;
+   CHECK(Found == Expected && Found >= SCAN_BENCH_SITES);
+   CHECK(!memcmp(Sites, NaiveSites, sizeof(Sites)) && !memcmp(Patterns, NaivePatterns, sizeof(Patterns)));
+   // (about 1 offset in 256 has the anchor, and the borrow adds a few more)
+   CHECK(Candidates < SCAN_BENCH_SIZE / 128);
+   if (Verbose)
+   {
+      printf("scan:  %u matches in %d bytes;  lb_ScanText() compared %u offsets in %.2f ms, comparing every offset took %.2f ms\n",
+             Found, SCAN_BENCH_SIZE, Candidates, Fast * 1000, Naive * 1000);
+   }
+   free(Bench);
+}
+
+//
+// v0.23 - lbcore.c:  A/B mode (lb_ab=), with its record in a file.  Each simulated boot
+// does what cfuncs.c does:  lb_ABPoll() loads the record, counts a boot that never
+// completed, picks an arm and marks it pending;  latebloom_ab_complete() (if the boot
+// gets that far) clears the mark and counts the outcome.
+//
+#define AB_CONFIG          0x1234abcd
+#define AB_ARMS            4
+#define AB_SAMPLES         20000
+#define AB_BOOTS           400
+
+static const int           ABWinPercent[AB_ARMS] = { 30, 85, 50, 60 };   // How often each arm's boot is fast enough
+static const int           ABHangPercent[AB_ARMS] = { 20, 0, 10, 5 };    // How often it doesn't complete at all
+
+static int SimulateBoot(void)
+{
+   lb_ABRecord Record;
+   int         Arm;
+
+   lb_ABLoad(&Record, AB_CONFIG, AB_ARMS);
+   lb_ABResolvePending(&Record);
+   Arm = lb_ABPick(&Record);
+   Record.Pending = (UInt8)(Arm + 1);
+   lb_StoreWrite(&Record);
+   if ((int)(Random() % 100) >= ABHangPercent[Arm])
+   {
+      lb_ABLoad(&Record, AB_CONFIG, AB_ARMS);
+      if (Record.Pending == Arm + 1)
+      {
+         Record.Pending = 0;
+      }
+      lb_ABCount(&Record.Arm[Arm], (int)(Random() % 100) < ABWinPercent[Arm], 1000 + Random() % 100);
+      lb_StoreWrite(&Record);
+   }
+   return Arm;
+}
+
+static double BetaMean(UInt32 Wins, UInt32 Losses)
+{
+   double   Total = 0;
+   int      i;
+
+   for (i = 0; i < AB_SAMPLES; ++i)
+   {
+      Total += lb_BetaSample(Wins, Losses) / 4294967296.0;
+   }
+   return Total / AB_SAMPLES;
+}
+
+static void CheckAB(void)
+{
+   char           Path[] = "/tmp/lbcheck-ab-XXXXXX";
+   lb_ABRecord    Record, Saved;
+   lb_ArmRecord   Arm;
+   FILE           *File;
+   UInt32         First[4];
+   int            Picks[AB_ARMS] = { 0 };
+   int            Fd, Best, Boot, i;
+
+   if ((Fd = mkstemp(Path)) < 0)
+   {
+      CHECK(!"mkstemp");
+      return;
+   }
+   close(Fd);
+   unlink(Path);
+   StorePath = Path;
+
+   // NVRAM not up:  a new record, which can't be written
+   CHECK(lb_ABLoad(&Record, AB_CONFIG, AB_ARMS) == LB_STORE_DOWN);
+   CHECK(Record.Magic == LB_AB_MAGIC && Record.Config == AB_CONFIG && Record.Arms == AB_ARMS && Record.Pending == 0);
+   CHECK(Record.Arm[0].Wins == 0 && Record.Arm[AB_ARMS - 1].Boots == 0);
+   CHECK(!lb_StoreWrite(&Record));
+
+   // Up, but no record yet;  once written, it reads back as it was
+   StoreUp = 1;
+   CHECK(lb_ABLoad(&Record, AB_CONFIG, AB_ARMS) == LB_STORE_MISSING);
+   Record.Arm[2].Wins = 5;
+   Record.Arm[2].Losses = 3;
+   CHECK(lb_StoreWrite(&Record));
+   Saved = Record;
+   memset(&Record, 0xee, sizeof(Record));
+   CHECK(lb_ABLoad(&Record, AB_CONFIG, AB_ARMS) == LB_STORE_OK && !memcmp(&Record, &Saved, sizeof(Record)));
+
+   // A record for other arms, or one that isn't ours, is as good as none
+   CHECK(lb_ABLoad(&Record, AB_CONFIG + 1, AB_ARMS) == LB_STORE_MISSING && Record.Arm[2].Wins == 0);
+   CHECK(lb_ABLoad(&Record, AB_CONFIG, AB_ARMS - 1) == LB_STORE_MISSING && Record.Arms == AB_ARMS - 1);
+   Record = Saved;
+   Record.Magic ^= 1;
+   CHECK(lb_StoreWrite(&Record) && lb_ABLoad(&Record, AB_CONFIG, AB_ARMS) == LB_STORE_MISSING);
+   Record = Saved;
+   Record.Pending = AB_ARMS + 1;
+   CHECK(lb_StoreWrite(&Record) && lb_ABLoad(&Record, AB_CONFIG, AB_ARMS) == LB_STORE_MISSING && Record.Pending == 0);
+   if ((File = fopen(Path, "wb")) != NULL)
+   {
+      fwrite(&Saved, 1, sizeof(Saved) - 1, File);
+      fclose(File);
+   }
+   CHECK(lb_ABLoad(&Record, AB_CONFIG, AB_ARMS) == LB_STORE_MISSING);
+
+   // NVRAM going down again doesn't lose the record
+   CHECK(lb_StoreWrite(&Saved));
+   StoreUp = 0;
+   CHECK(lb_ABLoad(&Record, AB_CONFIG, AB_ARMS) == LB_STORE_DOWN && Record.Arm[2].Wins == 0);
+   StoreUp = 1;
+   CHECK(lb_ABLoad(&Record, AB_CONFIG, AB_ARMS) == LB_STORE_OK && Record.Arm[2].Wins == 5);
+
+   // A boot left pending counts once, as a loss
+   Record.Pending = 3;
+   CHECK(lb_StoreWrite(&Record) && lb_ABLoad(&Record, AB_CONFIG, AB_ARMS) == LB_STORE_OK);
+   CHECK(lb_ABResolvePending(&Record) == 2 && Record.Pending == 0);
+   CHECK(Record.Arm[2].Wins == 5 && Record.Arm[2].Losses == 4 && Record.Arm[2].Boots == 0);
+   CHECK(lb_ABResolvePending(&Record) == -1 && Record.Arm[2].Losses == 4);
+
+   // Outcomes fade out:  more than LB_AB_HISTORY of them, and they're halved
+   memset(&Arm, 0, sizeof(Arm));
+   for (i = 0; i < LB_AB_HISTORY; ++i)
+   {
+      lb_ABCount(&Arm, i & 1, 100);
+   }
+   CHECK(Arm.Wins == LB_AB_HISTORY / 2 && Arm.Losses == LB_AB_HISTORY / 2);
+   CHECK(Arm.Boots == LB_AB_HISTORY && Arm.TotalMs == LB_AB_HISTORY * 100);
+   lb_ABCount(&Arm, 1, 200);
+   CHECK(Arm.Wins == (LB_AB_HISTORY / 2 + 1) / 2 && Arm.Losses == LB_AB_HISTORY / 4);
+   CHECK(Arm.Boots == LB_AB_HISTORY / 2 + 1 && Arm.TotalMs == LB_AB_HISTORY * 50 + 200);
+   lb_ABCount(&Arm, 0, -1);
+   CHECK(Arm.Boots == LB_AB_HISTORY / 2 + 1 && Arm.Losses == LB_AB_HISTORY / 4 + 1);
+   CHECK(lb_BetaSample(LB_AB_HISTORY, 1) == 0);
+
+   // The same seed gives the same numbers
+   lb_RandomSeed(0x5eed);
+   for (i = 0; i < 4; ++i)
+   {
+      First[i] = lb_Random32();
+   }
+   lb_RandomSeed(0x5eed);
+   for (i = 0; i < 4; ++i)
+   {
+      CHECK(lb_Random32() == First[i]);
+   }
+
+   // Beta(Wins + 1, Losses + 1) has a mean of (Wins + 1) / (Wins + Losses + 2)
+   CHECK(fabs(BetaMean(0, 0) - 0.5) < 0.01);
+   CHECK(fabs(BetaMean(9, 1) - 10.0 / 12) < 0.01);
+   CHECK(fabs(BetaMean(1, 9) - 2.0 / 12) < 0.01);
+   CHECK(fabs(BetaMean(16, 16) - 0.5) < 0.01);
+   CHECK(fabs(BetaMean(LB_AB_HISTORY, 0) - (LB_AB_HISTORY + 1.0) / (LB_AB_HISTORY + 2)) < 0.01);
+
+   // With no history, every arm is as likely as any other
+   memset(&Record, 0, sizeof(Record));
+   Record.Arms = AB_ARMS;
+   for (i = 0; i < AB_SAMPLES; ++i)
+   {
+      Picks[lb_ABPick(&Record)]++;
+   }
+   for (i = 0; i < AB_ARMS; ++i)
+   {
+      CHECK(abs(Picks[i] - AB_SAMPLES / AB_ARMS) < AB_SAMPLES / AB_ARMS / 10);
+   }
+
+   // Boot after boot, the best arm gets picked most
+   unlink(Path);
+   memset(Picks, 0, sizeof(Picks));
+   for (Boot = 0; Boot < AB_BOOTS; ++Boot)
+   {
+      i = SimulateBoot();
+      if (Boot >= AB_BOOTS / 2)
+      {
+         Picks[i]++;
+      }
+   }
+   for (Best = 0, i = 1; i < AB_ARMS; ++i)
+   {
+      Best = (Picks[i] > Picks[Best]) ? i : Best;
+   }
+   CHECK(Best == 1 && Picks[1] > AB_BOOTS / 2 * 3 / 5);
+   CHECK(lb_ABLoad(&Record, AB_CONFIG, AB_ARMS) == LB_STORE_OK);
+   for (i = 0; i < AB_ARMS; ++i)
+   {
+      CHECK(Record.Arm[i].Wins + Record.Arm[i].Losses <= LB_AB_HISTORY && Record.Arm[i].Boots <= LB_AB_HISTORY);
+   }
+   if (Verbose)
+   {
+      printf("A/B:  over the last %d of %d boots, arms picked %d/%d/%d/%d times\n", AB_BOOTS / 2, AB_BOOTS,
+             Picks[0], Picks[1], Picks[2], Picks[3]);
+   }
+
+   unlink(Path);
+   StorePath = NULL;
+   StoreUp = 0;
+}
+
+int main(int argc, char *argv[])
+{
+   if (argc > 1 && !strcmp(argv[1], "-v"))
+   {
+      Verbose = 1;
+   }
+   BuildKernel();
+
+   CheckJournal();
+   CheckParseMachO();
+   CheckFileset();
+   CheckByAddress();
+   BuildBigImage();
+   CheckBigByAddress();
+   CheckNameList();
+   CheckBigNameList();
+   CheckHash();
+   CheckOnce();
+   CheckStagger();
+   CheckSequencer();
+   CheckConcurrency();
+   CheckBackoff();
+   CheckScan();
+   CheckAB();
+
+   printf("lbcheck: %d checks, %d failed\n", Checks, Failures);
+   return Failures != 0;
+}
@@ -0,0 +1,668 @@
+//
+// lbtopo.c
+//
+// v0.23 - Extract the PCI topology latebloom's hook sees from an ioreg dump.
+//
+// Usage:   lbtopo [-o topology.txt] [dump]
+//
+// <dump> (or stdin) is the output of "ioreg -l -w0" (text) or "ioreg -a -l"
+// (plist), from any Mac;  lbtopo itself is plain C, so it builds and runs
+// anywhere (cc -O2 -o lbtopo lbtopo.c).  The input is read once, a line
+// (or an XML tag) at a time, and the tree is built as it goes, so even
+// multi-MB dumps take time (and memory) proportional to their size.
+//
+// IOPCIBridge::probeBus() runs once per bridge, for the bridge's secondary
+// bus, so the output is a list of buses (in the order of the bridge tree),
+// each followed by the devices on it:
+//
+//    latebloom-topology 1
+//    bus <bus> parent <bus>|- depth <n> devices <n> bridge <b:d.f>|host <vendor:device> <name> [tb]
+//      dev <b:d.f> <vendor:device> <name> [bridge] [tb]
+//
+// <depth> counts the bridges above the bus (the host bridge's bus is 0).
+// "tb" marks devices reached through a Thunderbolt tunnel (IOPCITunnelled),
+// and buses behind one.
+//
+////////////////////////////////////////////////////////////////////////////////
+// License: 0BSD                                                              //
+//                                                                            //
+// Copyright (C) 2021 by Syncretic                                            //
+//                                                                            //
+// Permission to use, copy, modify, and/or distribute this software for any   //
+// purpose with or without fee is hereby granted.                             //
+//                                                                            //
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES   //
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF           //
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR    //
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES     //
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN      //
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR //
+// IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.                //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define NAME_SIZE          48
+#define CLASS_SIZE         48
+#define MAX_DEPTH          256      // Deepest IORegistry nesting we keep track of
+
+#define NODE_OTHER         0        // Anything we pass through (but keep, so the tree stays connected)
+#define NODE_DEVICE        1        // IOPCIDevice
+#define NODE_BRIDGE        2        // IOPCIBridge (or subclass):  one probeBus() call, for its secondary bus
+
+typedef struct
+{
+   int            Parent;           // Index of the parent node, -1 for the root
+   int            FirstChild;
+   int            LastChild;
+   int            NextSibling;
+   int            Kind;             // NODE_*
+   char           Name[NAME_SIZE];  // Name (with @location, if any)
+   char           Class[CLASS_SIZE];
+   int            Bus, Dev, Fn;     // -1 if unknown
+   int            Secondary;        // (bridges' IOPCIDevices) secondary bus from "pcidebug", -1 if unknown
+   unsigned int   Vendor, Device;
+   int            Tunnelled;
+} Node;
+
+static Node    *Nodes = NULL;
+static int     NodeCount = 0;
+static int     NodeSpace = 0;
+
+//
+// Add a node as the last child of <Parent>
+//
+static int AddNode(int Parent)
+{
+   Node *New;
+
+   if (NodeCount == NodeSpace)
+   {
+      NodeSpace = NodeSpace ? NodeSpace * 2 : 1024;
+      if ((Nodes = realloc(Nodes, NodeSpace * sizeof(Node))) == NULL)
+      {
+         fprintf(stderr, "lbtopo: out of memory\n");
+         exit(1);
+      }
+   }
+   New = &Nodes[NodeCount];
+   memset(New, 0, sizeof(*New));
+   New->Parent = Parent;
+   New->FirstChild = New->LastChild = New->NextSibling = -1;
+   New->Bus = New->Dev = New->Fn = New->Secondary = -1;
+   if (Parent >= 0)
+   {
+      if (Nodes[Parent].LastChild >= 0)
+      {
+         Nodes[Nodes[Parent].LastChild].NextSibling = NodeCount;
+      }
+      else
+      {
+         Nodes[Parent].FirstChild = NodeCount;
+      }
+      Nodes[Parent].LastChild = NodeCount;
+   }
+   return NodeCount++;
+}
+
+static void CopyString(char *To, size_t Size, const char *From, size_t Length)
+{
+   if (Length >= Size)
+   {
+      Length = Size - 1;
+   }
+   memcpy(To, From, Length);
+   To[Length] = '\0';
+}
+
+static void SetClass(Node *This, const char *Class, size_t Length)
+{
+   CopyString(This->Class, sizeof(This->Class), Class, Length);
+   if (!strcmp(This->Class, "IOPCIDevice"))
+   {
+      This->Kind = NODE_DEVICE;
+   }
+   else if (strstr(This->Class, "PCIBridge") != NULL || !strcmp(This->Class, "AppleACPIPCI"))
+   {
+      This->Kind = NODE_BRIDGE;
+   }
+}
+
+//
+// The first 32 bits of an IORegistry data value (little-endian)
+//
+static unsigned int DataWord(const unsigned char *Bytes, size_t Length)
+{
+   unsigned int   Value = 0;
+   size_t         i;
+
+   for (i = 0; i < 4 && i < Length; ++i)
+   {
+      Value |= (unsigned int)Bytes[i] << (8 * i);
+   }
+   return Value;
+}
+
+//
+// Record the properties we care about.  <Value> is a string (without quotes),
+// or data (<Bytes>, <Length>).
+//
+static void SetProperty(Node *This, const char *Key, const char *Value, const unsigned char *Bytes, size_t Length)
+{
+   int Bus, Dev, Fn, Secondary, Subordinate;
+
+   if (!strcmp(Key, "vendor-id") && Bytes != NULL)
+   {
+      This->Vendor = DataWord(Bytes, Length) & 0xffff;
+   }
+   else if (!strcmp(Key, "device-id") && Bytes != NULL)
+   {
+      This->Device = DataWord(Bytes, Length) & 0xffff;
+   }
+   else if (!strcmp(Key, "reg") && Bytes != NULL && This->Bus < 0)
+   {
+      // Open Firmware "reg":  bus in bits 16-23 of phys.hi, device in 11-15, function in 8-10
+      unsigned int Hi = DataWord(Bytes, Length);
+
+      This->Bus = (Hi >> 16) & 0xff;
+      This->Dev = (Hi >> 11) & 0x1f;
+      This->Fn = (Hi >> 8) & 0x07;
+   }
+   else if (!strcmp(Key, "pcidebug") && Value != NULL)
+   {
+      // "bus:dev:fn", with "(secondary:subordinate)" for bridges
+      switch (sscanf(Value, "%d:%d:%d(%d:%d)", &Bus, &Dev, &Fn, &Secondary, &Subordinate))
+      {
+         case 5:
+            This->Secondary = Secondary;
+            // fall through
+         case 3:
+            This->Bus = Bus;
+            This->Dev = Dev;
+            This->Fn = Fn;
+      }
+   }
+   else if (!strcmp(Key, "IOPCITunnelled") && Value != NULL)
+   {
+      This->Tunnelled = !strcmp(Value, "Yes") || !strcmp(Value, "true");
+   }
+}
+
+static int HexDigit(int c)
+{
+   return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// "ioreg -l -w0" text:
+//
+//    | +-o RP01@1C  <class IOPCIDevice, id 0x100000233, registered, ...>
+//    | | {
+//    | |   "vendor-id" = <86800000>
+//    | |   "pcidebug" = "0:28:0(1:1)"
+//    | | }
+//
+// The column of "+-o" gives the depth;  properties belong to the most recent entry.
+// An entry more than one level deeper than the one before it (a truncated or filtered
+// dump, or one whose first entry is indented) hangs off the deepest entry we know of.
+//
+////////////////////////////////////////////////////////////////////////////////
+static void ParseText(FILE *Input)
+{
+   int            Stack[MAX_DEPTH];
+   int            Top = -1;         // Depth of the most recent entry (Stack[0..Top] are valid)
+   int            Current = -1;
+   char           *Buffer = NULL;
+   size_t         BufferSize = 0;
+   unsigned char  Bytes[8];
+   int            i;
+
+   for (i = 0; i < MAX_DEPTH; ++i)
+   {
+      Stack[i] = -1;
+   }
+   while (getline(&Buffer, &BufferSize, Input) >= 0)
+   {
+      char *Entry = strstr(Buffer, "+-o ");
+      char *p;
+
+      if (Entry != NULL)
+      {
+         int   Depth = (int)(Entry - Buffer) / 2;
+         char  *Name = Entry + 4;
+         char  *Class = strstr(Name, "<class ");
+         char  *End;
+
+         if (Depth > Top + 1)
+         {
+            Depth = Top + 1;
+         }
+         if (Depth >= MAX_DEPTH || Class == NULL)
+         {
+            Current = -1;     // (don't give its properties to somebody else)
+            continue;
+         }
+         Current = AddNode((Depth > 0) ? Stack[Depth - 1] : -1);
+         Stack[Depth] = Current;
+         Top = Depth;
+         for (End = Class; End > Name && End[-1] == ' '; --End)
+            ;
+         CopyString(Nodes[Current].Name, NAME_SIZE, Name, End - Name);
+         Class += 7;
+         SetClass(&Nodes[Current], Class, strcspn(Class, ",>"));
+         continue;
+      }
+      if (Current < 0)
+      {
+         continue;
+      }
+      // A property line?  ("key" = value)
+      for (p = Buffer; *p == ' ' || *p == '|'; ++p)
+         ;
+      if (*p++ == '"')
+      {
+         char     *Key = p;
+         char     *Value;
+         size_t   n;
+
+         if ((p = strchr(p, '"')) == NULL || strncmp(p, "\" = ", 4) != 0)
+         {
+            continue;
+         }
+         *p = '\0';
+         Value = p + 4;
+         Value[strcspn(Value, "\r\n")] = '\0';
+         if (*Value == '<')
+         {
+            for (n = 0, p = Value + 1; n < sizeof(Bytes) && isxdigit(p[0]) && isxdigit(p[1]); ++n, p += 2)
+            {
+               Bytes[n] = (unsigned char)(HexDigit(p[0]) * 16 + HexDigit(p[1]));
+            }
+            SetProperty(&Nodes[Current], Key, NULL, Bytes, n);
+         }
+         else
+         {
+            if (*Value == '"')
+            {
+               ++Value;
+               Value[strcspn(Value, "\"")] = '\0';
+            }
+            SetProperty(&Nodes[Current], Key, Value, NULL, 0);
+         }
+      }
+   }
+   free(Buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// "ioreg -a" plist:  each entry is a <dict>;  its children are the <dict>s in the
+// <array> following its "IORegistryEntryChildren" key.  Any other <dict>/<array>
+// is just a property value, and is skipped over.
+//
+////////////////////////////////////////////////////////////////////////////////
+#define CONTAINER_ENTRY    0        // An entry's <dict>
+#define CONTAINER_CHILDREN 1        // An entry's IORegistryEntryChildren <array>
+#define CONTAINER_OTHER    2        // A property value
+
+static const unsigned char Base64[256] =
+{
+   ['A'] = 1,  ['B'] = 2,  ['C'] = 3,  ['D'] = 4,  ['E'] = 5,  ['F'] = 6,  ['G'] = 7,  ['H'] = 8,
+   ['I'] = 9,  ['J'] = 10, ['K'] = 11, ['L'] = 12, ['M'] = 13, ['N'] = 14, ['O'] = 15, ['P'] = 16,
+   ['Q'] = 17, ['R'] = 18, ['S'] = 19, ['T'] = 20, ['U'] = 21, ['V'] = 22, ['W'] = 23, ['X'] = 24,
+   ['Y'] = 25, ['Z'] = 26, ['a'] = 27, ['b'] = 28, ['c'] = 29, ['d'] = 30, ['e'] = 31, ['f'] = 32,
+   ['g'] = 33, ['h'] = 34, ['i'] = 35, ['j'] = 36, ['k'] = 37, ['l'] = 38, ['m'] = 39, ['n'] = 40,
+   ['o'] = 41, ['p'] = 42, ['q'] = 43, ['r'] = 44, ['s'] = 45, ['t'] = 46, ['u'] = 47, ['v'] = 48,
+   ['w'] = 49, ['x'] = 50, ['y'] = 51, ['z'] = 52, ['0'] = 53, ['1'] = 54, ['2'] = 55, ['3'] = 56,
+   ['4'] = 57, ['5'] = 58, ['6'] = 59, ['7'] = 60, ['8'] = 61, ['9'] = 62, ['+'] = 63, ['/'] = 64,
+};    // (value + 1, so that 0 means "not base64")
+
+//
+// Decode (up to <Size> bytes of) base64 <Text>;  returns the number of bytes
+//
+static size_t DecodeBase64(const char *Text, unsigned char *Bytes, size_t Size)
+{
+   unsigned int   Bits = 0;
+   int            Count = 0;
+   size_t         n = 0;
+
+   for (; *Text != '\0' && n < Size; ++Text)
+   {
+      if (Base64[(unsigned char)*Text] == 0)
+      {
+         continue;         // whitespace, padding
+      }
+      Bits = (Bits << 6) | (Base64[(unsigned char)*Text] - 1);
+      if ((Count += 6) >= 8)
+      {
+         Count -= 8;
+         Bytes[n++] = (unsigned char)(Bits >> Count);
+      }
+   }
+   return n;
+}
+
+//
+// Read the next tag (into <Tag>, without the brackets) and the text before it (into <Text>).
+// Returns 0 at the end of the input.
+//
+static int NextTag(FILE *Input, char **Tag, size_t *TagSize, char **Text, size_t *TextSize)
+{
+   char     **Into = Text;
+   size_t   *IntoSize = TextSize;
+   size_t   n = 0;
+   int      c;
+
+   while ((c = getc(Input)) != EOF)
+   {
+      if (c == '<' && Into == Text)
+      {
+         (*Text)[n] = '\0';
+         Into = Tag;
+         IntoSize = TagSize;
+         n = 0;
+         continue;
+      }
+      if (c == '>' && Into == Tag)
+      {
+         (*Tag)[n] = '\0';
+         return 1;
+      }
+      if (n + 1 >= *IntoSize)
+      {
+         *IntoSize *= 2;
+         if ((*Into = realloc(*Into, *IntoSize)) == NULL)
+         {
+            fprintf(stderr, "lbtopo: out of memory\n");
+            exit(1);
+         }
+      }
+      (*Into)[n++] = (char)c;
+   }
+   return 0;
+}
+
+static void ParsePlist(FILE *Input)
+{
+   unsigned char  Type[MAX_DEPTH];     // CONTAINER_* for each open <dict>/<array>
+   int            Owner[MAX_DEPTH];    // The entry each one belongs to
+   int            Depth = 0;
+   size_t         TagSize = 256, TextSize = 4096;
+   char           *Tag = malloc(TagSize);
+   char           *Text = malloc(TextSize);
+   char           Key[64] = "";
+   unsigned char  Bytes[8];
+   int            Entry;
+
+   if (Tag == NULL || Text == NULL)
+   {
+      fprintf(stderr, "lbtopo: out of memory\n");
+      exit(1);
+   }
+   while (NextTag(Input, &Tag, &TagSize, &Text, &TextSize))
+   {
+      int InEntry = (Depth > 0 && Type[Depth - 1] == CONTAINER_ENTRY);
+
+      Entry = InEntry ? Owner[Depth - 1] : -1;
+      if (!strcmp(Tag, "dict") || !strcmp(Tag, "array"))
+      {
+         if (Depth == MAX_DEPTH)
+         {
+            fprintf(stderr, "lbtopo: plist nested too deeply\n");
+            exit(1);
+         }
+         if (Tag[0] == 'd' && (Depth == 0 || Type[Depth - 1] == CONTAINER_CHILDREN || (Depth == 1 && Type[0] != CONTAINER_ENTRY)))
+         {
+            // A registry entry (the root one, or one of an entry's children)
+            Type[Depth] = CONTAINER_ENTRY;
+            Owner[Depth] = AddNode((Depth > 0) ? Owner[Depth - 1] : -1);
+         }
+         else if (Tag[0] == 'a' && InEntry && !strcmp(Key, "IORegistryEntryChildren"))
+         {
+            Type[Depth] = CONTAINER_CHILDREN;
+            Owner[Depth] = Entry;
+         }
+         else
+         {
+            Type[Depth] = CONTAINER_OTHER;
+            Owner[Depth] = -1;
+         }
+         ++Depth;
+         Key[0] = '\0';
+      }
+      else if (!strcmp(Tag, "/dict") || !strcmp(Tag, "/array"))
+      {
+         if (Depth > 0)
+         {
+            --Depth;
+         }
+         Key[0] = '\0';
+      }
+      else if (!InEntry)
+      {
+         continue;
+      }
+      else if (!strcmp(Tag, "/key"))
+      {
+         CopyString(Key, sizeof(Key), Text, strlen(Text));
+      }
+      else if (!strcmp(Tag, "/string") || !strcmp(Tag, "/data") || !strcmp(Tag, "true/") || !strcmp(Tag, "false/"))
+      {
+         Node *This = &Nodes[Entry];
+
+         if (!strcmp(Key, "IORegistryEntryName"))
+         {
+            char Name[NAME_SIZE];
+
+            // (The location may already be there)
+            snprintf(Name, sizeof(Name), "%s%s", Text, This->Name);
+            CopyString(This->Name, NAME_SIZE, Name, strlen(Name));
+         }
+         else if (!strcmp(Key, "IORegistryEntryLocation"))
+         {
+            size_t n = strlen(This->Name);
+
+            snprintf(&This->Name[n], NAME_SIZE - n, "@%s", Text);
+         }
+         else if (!strcmp(Key, "IOObjectClass"))
+         {
+            SetClass(This, Text, strlen(Text));
+         }
+         else if (Tag[1] == 'd')
+         {
+            SetProperty(This, Key, NULL, Bytes, DecodeBase64(Text, Bytes, sizeof(Bytes)));
+         }
+         else
+         {
+            SetProperty(This, Key, (Tag[0] == 't') ? "true" : (Tag[0] == 'f') ? "false" : Text, NULL, 0);
+         }
+         Key[0] = '\0';
+      }
+   }
+   free(Tag);
+   free(Text);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Output
+//
+////////////////////////////////////////////////////////////////////////////////
+static void PrintBDF(FILE *Output, const Node *This)
+{
+   if (This->Bus >= 0)
+   {
+      fprintf(Output, "%d:%02x.%d", This->Bus, This->Dev, This->Fn);
+   }
+   else
+   {
+      fprintf(Output, "?");
+   }
+}
+
+//
+// The bus a bridge probes:  from its IOPCIDevice's "pcidebug", or else the bus its devices are on
+//
+static int BridgeBus(int Bridge)
+{
+   int Parent = Nodes[Bridge].Parent;
+   int Child;
+
+   if (Parent >= 0 && Nodes[Parent].Kind == NODE_DEVICE && Nodes[Parent].Secondary >= 0)
+   {
+      return Nodes[Parent].Secondary;
+   }
+   for (Child = Nodes[Bridge].FirstChild; Child >= 0; Child = Nodes[Child].NextSibling)
+   {
+      if (Nodes[Child].Kind == NODE_DEVICE && Nodes[Child].Bus >= 0)
+      {
+         return Nodes[Child].Bus;
+      }
+   }
+   return (Parent >= 0 && Nodes[Parent].Kind == NODE_DEVICE) ? -1 : 0;
+}
+
+static void PrintBridges(FILE *Output, int First, int ParentBus, int Depth, int Tunnelled);
+
+//
+// Print the bus <Bridge> probes, its devices, then the buses behind them
+//
+static void PrintBus(FILE *Output, int Bridge, int ParentBus, int Depth, int Tunnelled)
+{
+   Node  *Upstream = (Nodes[Bridge].Parent >= 0 && Nodes[Nodes[Bridge].Parent].Kind == NODE_DEVICE) ? &Nodes[Nodes[Bridge].Parent] : NULL;
+   int   Bus = BridgeBus(Bridge);
+   int   Devices = 0;
+   int   Child;
+
+   for (Child = Nodes[Bridge].FirstChild; Child >= 0; Child = Nodes[Child].NextSibling)
+   {
+      Devices += (Nodes[Child].Kind == NODE_DEVICE);
+   }
+   fprintf(Output, "bus %d parent ", Bus);
+   fprintf(Output, (ParentBus >= 0) ? "%d" : "-", ParentBus);
+   fprintf(Output, " depth %d devices %d ", Depth, Devices);
+   if (Upstream != NULL)
+   {
+      fprintf(Output, "bridge ");
+      PrintBDF(Output, Upstream);
+      fprintf(Output, " %04x:%04x %s%s\n", Upstream->Vendor, Upstream->Device, Upstream->Name, Tunnelled ? " tb" : "");
+   }
+   else
+   {
+      fprintf(Output, "host 0000:0000 %s%s\n", Nodes[Bridge].Name, Tunnelled ? " tb" : "");
+   }
+   for (Child = Nodes[Bridge].FirstChild; Child >= 0; Child = Nodes[Child].NextSibling)
+   {
+      Node  *This = &Nodes[Child];
+      int   Grandchild;
+      int   IsBridge = 0;
+
+      if (This->Kind != NODE_DEVICE)
+      {
+         continue;
+      }
+      for (Grandchild = This->FirstChild; Grandchild >= 0; Grandchild = Nodes[Grandchild].NextSibling)
+      {
+         IsBridge |= (Nodes[Grandchild].Kind == NODE_BRIDGE);
+      }
+      fprintf(Output, "  dev ");
+      PrintBDF(Output, This);
+      fprintf(Output, " %04x:%04x %s%s%s\n", This->Vendor, This->Device, This->Name, IsBridge ? " bridge" : "",
+              (Tunnelled || This->Tunnelled) ? " tb" : "");
+   }
+   for (Child = Nodes[Bridge].FirstChild; Child >= 0; Child = Nodes[Child].NextSibling)
+   {
+      PrintBridges(Output, Nodes[Child].FirstChild, Bus, Depth + 1, Tunnelled || Nodes[Child].Tunnelled);
+   }
+}
+
+//
+// Print the buses of all the bridges in the subtrees starting at <First> (and its siblings)
+//
+static void PrintBridges(FILE *Output, int First, int ParentBus, int Depth, int Tunnelled)
+{
+   int This;
+
+   for (This = First; This >= 0; This = Nodes[This].NextSibling)
+   {
+      if (Nodes[This].Kind == NODE_BRIDGE)
+      {
+         PrintBus(Output, This, ParentBus, Depth, Tunnelled);
+      }
+      else
+      {
+         PrintBridges(Output, Nodes[This].FirstChild, ParentBus, Depth, Tunnelled || Nodes[This].Tunnelled);
+      }
+   }
+}
+
+int main(int argc, char *argv[])
+{
+   FILE     *Input = stdin;
+   FILE     *Output = stdout;
+   int      c;
+   int      i;
+
+   for (i = 1; i < argc; ++i)
+   {
+      if (!strcmp(argv[i], "-o") && i + 1 < argc)
+      {
+         if ((Output = fopen(argv[++i], "w")) == NULL)
+         {
+            perror(argv[i]);
+            return 1;
+         }
+      }
+      else if (argv[i][0] == '-' && argv[i][1] != '\0')
+      {
+         fprintf(stderr, "usage: lbtopo [-o topology.txt] [ioreg-dump]\n");
+         return 2;
+      }
+      else if ((Input = fopen(argv[i], "r")) == NULL)
+      {
+         perror(argv[i]);
+         return 1;
+      }
+   }
+   // Plist or text?  (A plist starts with "<?xml")
+   while ((c = getc(Input)) != EOF && isspace(c))
+      ;
+   if (c == EOF)
+   {
+      fprintf(stderr, "lbtopo: empty input\n");
+      return 1;
+   }
+   ungetc(c, Input);
+   if (c == '<')
+   {
+      ParsePlist(Input);
+   }
+   else
+   {
+      ParseText(Input);
+   }
+   if (NodeCount == 0)
+   {
+      fprintf(stderr, "lbtopo: no IORegistry entries found\n");
+      return 1;
+   }
+   fprintf(Output, "latebloom-topology 1\n");
+   for (i = 0; i < NodeCount; ++i)
+   {
+      if (Nodes[i].Parent < 0)
+      {
+         PrintBridges(Output, i, -1, 0, 0);     // (roots aren't linked as siblings, so this is just the one tree)
+      }
+   }
+   if (Output != stdout)
+   {
+      fclose(Output);
+   }
+   free(Nodes);
+   return 0;
+}